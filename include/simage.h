@@ -306,9 +306,31 @@ extern "C" {
                                   unsigned char * data, int copydata);
 
   SIMAGE_DLL_API s_image * s_image_load(const char * filename, s_image * prealloc /* | NULL */);
+
+  /*! Saves \a image to \a filename. The file format is decided from
+    the filename extension, unless the "file type" \<string\>
+    parameter is set in \a params. All other parameters are passed on
+    to the saver, see simage_save_image_ex() for the supported ones.
+
+    Returns 1 on success, 0 on failure
+  */
   SIMAGE_DLL_API int s_image_save(const char * filename, s_image * image,
                                   s_params * params /* | NULL */);
 
+  /*! Opens the movie file named filename for reading. Multi-page
+    TIFF files and animated GIF files can be read as movies. Each
+    call to s_movie_get_image() decodes only the next page or frame,
+    into the \a prealloc image if one is given. GIF frames are
+    composited onto the logical screen, and returned as RGBA
+    images. YUV4MPEG2 (.y4m) files are converted to RGB frames;
+    the filename "-" reads such a stream from stdin. A filename
+    with a frame number pattern, such as "frame%05d.png", opens the
+    numbered images starting at 0 or 1 as a movie, and the next
+    frames are loaded on background threads while the current one is
+    used. s_movie_get_image() returns NULL after the last frame.
+
+    Returns a pointer to the opened movie on success, NULL on failure
+  */
   SIMAGE_DLL_API s_movie * s_movie_open(const char * filename);
 
   /*! Will create a new move file named filename and attempt to
@@ -319,7 +341,8 @@ extern "C" {
 
     Common parameters:
       - "mime-type" \<string\> : The requested encoder type. There are currently
-        2 encoders available, with mime-types "video/mpeg" and "video/avi".
+        3 encoders available, with mime-types "video/mpeg", "video/avi" and
+        "video/x-yuv4mpeg".
       - width \<int\> : Frame width (all input images must have this width)
       - height \<int\> : Frame height (all input images must have this height)
 
@@ -334,6 +357,29 @@ extern "C" {
         The format of the file is unspecified, and copying such a file between
         different computers probably won't work.
       - width and height must be divisible by 4
+
+    Without Video for Windows, "video/avi" (or a filename ending in ".avi")
+    writes Motion-JPEG AVI files instead, of any size. The frames are
+    compressed on several threads, and files beyond 1 GB use the OpenDML
+    extensions. Its parameters are
+      - fps \<int\> : Frame rate numerator (default 25)
+      - fps denominator \<int\> : Frame rate denominator (default 1)
+      - and the JPEG saver parameters, such as quality and subsampling
+
+    A filename with a frame number pattern, such as "frame%05d.png", and no
+    mime-type saves each frame to its own numbered file, in any format
+    with a saver. The frames are saved on background threads while the
+    caller renders the next ones. Its parameters are
+      - first frame \<int\> : The number of the first frame (default 0)
+      - file type \<string\> : The file format, if not given by the extension
+      - and the parameters of the saver, see simage_save_image_ex()
+
+    Parameters specific for the YUV4MPEG2 encoder. It is also chosen without
+    a mime-type when the filename ends in ".y4m", or is "-" for stdout.
+      - fps \<int\> : Frame rate numerator (default 25)
+      - fps denominator \<int\> : Frame rate denominator (default 1)
+      - chroma \<string\> : "420" (default), "422", "444" or "mono"
+      - color range \<string\> : "limited" (default) or "full"
   */
   SIMAGE_DLL_API s_movie * s_movie_create(const char * filename, s_params * params /* | NULL */);
 
@@ -499,6 +545,223 @@ extern "C" {
                                                      s_dlsym_func *dlsym,
                                                      s_dlclose_func *dlclose);
 
+  /*****************************************************************/
+  /**** NOTE: new methods for simage version 1.9 *******************/
+  /*****************************************************************/
+
+  /*! Same as simage_save_image(), but lets the caller tune the saver
+    through \a params. Parameters not understood by the saver are
+    ignored, and \a params may be NULL.
+
+    Parameters for the JPEG saver
+      - "quality" \<int\> : 0-100, default 90
+      - "subsampling" \<string\> : chroma subsampling, "4:4:4",
+        "4:2:2" or "4:2:0" (default)
+      - "optimize" \<int\> : set to 1 to compute optimal Huffman
+        tables. Gives smaller files, but needs an extra pass over the
+        data. Off by default.
+      - "progressive" \<int\> : set to 1 to write a progressive JPEG
+      - "dct method" \<string\> : "islow" (default), "ifast" or "float"
+      - "restart interval" \<int\> : emit a restart marker every n MCUs
+      - "restart rows" \<int\> : emit a restart marker every n MCU
+        rows. Overrides "restart interval".
+
+    Parameters for the PNG saver
+      - "compression level" \<int\> : zlib level, 0 (none) - 9 (best)
+      - "filters" \<string\> : comma separated list of the row filters
+        libpng may choose from: "none", "sub", "up", "avg", "paeth" or
+        "all". Use "none" or "sub" for fast saving.
+      - "zlib strategy" \<string\> : "default", "filtered", "huffman",
+        "rle" or "fixed"
+      Large images are filtered and compressed in blocks on several
+      threads, see simage_set_num_threads().
+
+    Parameters for the TIFF saver
+      - "compression" \<string\> : "none", "packbits" (default), "lzw",
+        "deflate" or "zstd". Saving fails if libtiff wasn't built
+        with the codec.
+      - "predictor" \<int\> : 2 enables horizontal differencing for
+        lzw, deflate and zstd. Usually gives smaller files for
+        photographic images.
+      - "compression level" \<int\> : for deflate (1-9) and zstd (1-22)
+      - "strip size" \<int\> : approximate size of each strip in
+        bytes, default 256K
+      - "tile size" \<int\> : write square tiles of this size
+        (rounded up to a multiple of 16) instead of strips
+      - "pyramid levels" \<int\> : also write this many reduced
+        resolution levels, each half the size of the previous one, as
+        SubIFDs of the image, stopping early once a level fits in one
+        tile. A negative value writes levels until the image fits in
+        one tile. Pyramids are tiled (256x256 if no tile size is given)
+        and always written as BigTIFF.
+      - "pyramid filter" \<string\> : the filter used to make the
+        levels: "hermite", "box", "triangle", "bell" (default),
+        "b-spline", "lanczos3" or "mitchell"
+      - "bigtiff" \<int\> : 1 writes a BigTIFF file. This is done
+        automatically for images with more than about 3.5 GB of data.
+
+    Parameters for the GIF saver
+      - "quantizer" \<string\> : how the palette is chosen. "median
+        cut" (default) uses giflib, "octree" and "kmeans" use simage's
+        own quantizer, which runs on several threads. "kmeans" refines
+        the octree palette and gives the best quality.
+      - "kmeans iterations" \<int\> : refinement passes, default 4
+      - "dither" \<string\> : "none" (default) or "ordered"
+      - "colors" \<int\> : palette size, 2-256 (default 256)
+
+    Parameters for the TGA saver
+      - "compression" \<string\> : "none" (default) or "rle"
+
+    Parameters for the SGI RGB saver
+      - "compression" \<string\> : "none" (default) or "rle". RLE
+        compressed rows are encoded on several threads
+
+    Parameters for the EPS saver
+      - "encoding" \<string\> : "ascii85" (default) or "binary".
+        Binary files are smaller and faster to write, but can't be sent
+        through channels that only handle text.
+      - "compression" \<string\> : "none" (default), "rle"
+        (PostScript level 2) or "flate" (level 3, needs zlib)
+      - "compression level" \<int\> : zlib level for "flate", 0 - 9
+
+    Parameters for the DDS and KTX2 savers
+      - "format" \<string\> : "bc1" (default for images without
+        alpha), "bc3" (default for images with alpha), "bc4", "bc5",
+        "bc7" or "rgba8" (uncompressed). BC4 stores the first
+        component, BC5 the first two (gray and alpha for two component
+        images). The blocks are compressed on several threads.
+      - "mipmaps" \<int\> : the number of mipmap levels, 0 (default)
+        for a full chain down to 1x1, 1 for no mipmaps
+      - "mipmap filter" \<string\> : the filter used to make the
+        levels: "hermite", "box" (default), "triangle", "bell",
+        "b-spline", "lanczos3" or "mitchell"
+      - "srgb" \<int\> : 1 marks the texture as sRGB encoded. Ignored
+        for BC4 and BC5.
+
+    Returns 1 on success, 0 on failure
+  */
+  SIMAGE_DLL_API int simage_save_image_ex(const char * filename,
+                                          const unsigned char * bytes,
+                                          int w, int h, int numcomponents,
+                                          const char * filenameextension,
+                                          s_params * params /* | NULL */);
+
+  /*! Reads the \a w x \a h pixels with the lower left corner at \a x,
+    \a y from an image opened with s_image_open() (or loaded). Like
+    s_image_read_line(), \a y counts from the bottom of the image.
+    \a buf must have room for w*h*components bytes, and gets the
+    region's lines in the same bottom-up order. For TIFF files, only
+    the strips or tiles covering the region are decoded.
+
+    Returns 1 on success, 0 on failure
+  */
+  SIMAGE_DLL_API int s_image_read_region(s_image * image,
+                                         int x, int y, int w, int h,
+                                         unsigned char * buf);
+
+  /*! Creates an image sharing the \a w x \a h pixels with the lower
+    left corner at \a x, \a y of \a parent, without copying any
+    pixels. \a parent is loaded first if it was opened with
+    s_image_open(). The lines of the view are s_image_stride() bytes
+    apart in s_image_data(). The view keeps \a parent alive until both
+    are destroyed, but \a parent's data must not be replaced with
+    s_image_set() while the view is in use. Views can be passed to
+    s_image_read_line(), s_image_read_region(), s_image_save(),
+    s_image_resize() and s_movie_put_image().
+
+    Returns NULL if the region is outside \a parent
+  */
+  SIMAGE_DLL_API s_image * s_image_create_view(s_image * parent,
+                                               int x, int y, int w, int h);
+
+  /*! Returns the number of bytes between the start of two lines in
+    s_image_data(), which is width*components except for views. */
+  SIMAGE_DLL_API int s_image_stride(s_image * image);
+
+  /*! Like simage_resize(), but takes an s_image, which may be a view,
+    and returns a new image to be destroyed with s_image_destroy().
+
+    Returns NULL on failure
+  */
+  SIMAGE_DLL_API s_image * s_image_resize(s_image * image,
+                                          int newwidth, int newheight);
+
+  /*! Sets the number of threads simage may use when loading and
+    saving large images. The default, 0, uses one thread per
+    processor. Set to 1 to do all the work on the calling thread. */
+  SIMAGE_DLL_API void simage_set_num_threads(int num);
+
+  /*! Returns the number of threads simage will use for loading and
+    saving large images. */
+  SIMAGE_DLL_API int simage_get_num_threads(void);
+
+  enum {
+    SIMAGE_PALETTE_EXPAND_RGBA = 0,
+    SIMAGE_PALETTE_EXPAND,
+    SIMAGE_PALETTE_INDEXED
+  };
+
+  /*! Sets how images with a color palette (GIF files) are loaded.
+    SIMAGE_PALETTE_EXPAND_RGBA, the default, gives RGBA images.
+    SIMAGE_PALETTE_EXPAND gives RGB images when the file has no
+    transparent color, and RGBA images otherwise.
+    SIMAGE_PALETTE_INDEXED gives single component images of palette
+    indices, and the colors are read with s_image_get_palette(). Only
+    the first image of a file is loaded in indexed mode. */
+  SIMAGE_DLL_API void simage_set_palette_mode(int mode);
+
+  /*! Returns the current palette mode. */
+  SIMAGE_DLL_API int simage_get_palette_mode(void);
+
+  /*! Copies the palette of an image loaded or opened in the
+    SIMAGE_PALETTE_INDEXED mode to \a palette, which needs room for
+    256 RGBA colors. The transparent color, if any, has alpha 0.
+
+    Returns the number of colors, or 0 if the image has no palette
+  */
+  SIMAGE_DLL_API int s_image_get_palette(s_image * image,
+                                         unsigned char * palette);
+
+  enum {
+    SIMAGE_TEXTURE_RGBA8 = 0,
+    SIMAGE_TEXTURE_BC1,
+    SIMAGE_TEXTURE_BC3,
+    SIMAGE_TEXTURE_BC4,
+    SIMAGE_TEXTURE_BC5,
+    SIMAGE_TEXTURE_BC7
+  };
+
+  typedef struct simage_texture_s s_texture;
+
+  /*! Loads a DDS or KTX2 file, as written by the DDS and KTX2 savers,
+    without decoding the compressed blocks. Only 2D textures in the
+    SIMAGE_TEXTURE_* formats are supported.
+
+    Returns NULL on failure, see simage_get_last_error()
+  */
+  SIMAGE_DLL_API s_texture * s_texture_load(const char * filename);
+  SIMAGE_DLL_API void s_texture_destroy(s_texture * texture);
+
+  /*! Returns the SIMAGE_TEXTURE_* format of the texture. */
+  SIMAGE_DLL_API int s_texture_get_format(s_texture * texture);
+
+  /*! Returns 1 if the texture's colors are sRGB encoded. */
+  SIMAGE_DLL_API int s_texture_is_srgb(s_texture * texture);
+
+  /*! Returns the number of mipmap levels, at least 1. */
+  SIMAGE_DLL_API int s_texture_get_num_levels(s_texture * texture);
+
+  /*! Returns the data of a mipmap level, 0 being the largest, and its
+    size in pixels and bytes. The data is stored from the top row as
+    OpenGL and other APIs expect for compressed textures, and RGBA8
+    textures have 4 bytes per pixel. Returns NULL for levels that
+    don't exist. */
+  SIMAGE_DLL_API const unsigned char * s_texture_get_level(s_texture * texture,
+                                                           int level,
+                                                           int * width,
+                                                           int * height,
+                                                           int * size);
+
 
 
 #ifdef __cplusplus
@@ -25,6 +25,8 @@
 #error "This file should not be used under the current configuration!"
 #endif /* !SIMAGE_EPS_SUPPORT */
 
+#include <simage.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -33,7 +35,8 @@ extern "C" {
 		      const unsigned char * bytes,
 		      int width,
 		      int height,
-		      int numcomponents);
+		      int numcomponents,
+		      s_params * params);
   int simage_eps_error(char * buffer, int bufferlen);
 
 #ifdef __cplusplus
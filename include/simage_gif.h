@@ -25,6 +25,8 @@
 #error "This file should not be used under the current configuration!"
 #endif /* !HAVE_GIFLIB */
 
+#include <simage.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -38,7 +40,8 @@ extern "C" {
                       const unsigned char * bytes,
                       int width,
                       int height,
-                      int numcomponents);
+                      int numcomponents,
+                      s_params * params);
 
   int simage_gif_identify(const char *filename,
                           const unsigned char *header,
@@ -46,6 +49,20 @@ extern "C" {
 
   int simage_gif_error(char *buffer, int bufferlen);
 
+  void * simage_gif_open(const char * filename,
+                         int * width,
+                         int * height,
+                         int * numcomponents);
+  int simage_gif_read_line(void * opendata, int y, unsigned char * buf);
+  void simage_gif_close(void * opendata);
+  int simage_gif_palette(const char * filename, unsigned char * palette);
+
+  /* animated files as movies */
+  int simage_gif_movie_open(const char * filename, s_movie * movie);
+  s_image * simage_gif_movie_get(s_movie * movie, s_image * prealloc,
+                                 s_params * params);
+  void simage_gif_movie_close(s_movie * movie);
+
 #ifdef __cplusplus
 }
 #endif
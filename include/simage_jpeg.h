@@ -25,6 +25,8 @@
 #error "This file should not be used under the current configuration!"
 #endif /* !HAVE_JPEGLIB */
 
+#include <simage.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -37,7 +39,17 @@ extern "C" {
                        const unsigned char * bytes,
                        int width,
                        int height,
-                       int numcomponents);
+                       int numcomponents,
+                       s_params * params);
+
+  int simage_jpeg_encode(const unsigned char * bytes,
+                         int width,
+                         int height,
+                         int numcomponents,
+                         int bgr,
+                         s_params * params,
+                         unsigned char ** buffer,
+                         int * bufsize);
 
   int simage_jpeg_identify(const char * filename,
                            const unsigned char * header,
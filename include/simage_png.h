@@ -25,6 +25,8 @@
 #error "This file should not be used under the current configuration!"
 #endif /* !HAVE_PNGLIB */
 
+#include <simage.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -37,13 +39,21 @@ extern "C" {
                       const unsigned char * bytes,
                       int width,
                       int height,
-                      int numcomponents);
+                      int numcomponents,
+                      s_params * params);
   int simage_png_identify(const char * filename,
                           const unsigned char * header,
                           int headerlen);
 
   int simage_png_error(char * buffer, int bufferlen);
 
+  void * simage_png_open(const char * filename,
+                         int * width,
+                         int * height,
+                         int * numcomponents);
+  void simage_png_close(void * opendata);
+  int simage_png_read_line(void * opendata, int y, unsigned char * buf);
+
 #ifdef __cplusplus
 }
 #endif
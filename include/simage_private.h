@@ -29,6 +29,12 @@ extern "C" {
     int (*read_line_func)(void * opendata, int y, unsigned char * buf);
     int (*next_line_func)(void * opendata, unsigned char * buf);
     void (*close_func)(void * opendata);
+    /* added for simage 1.9 */
+    int (*read_region_func)(void * opendata, int x, int y, int w, int h,
+                            unsigned char * buf);
+    /* copies the RGBA palette of a file loaded in indexed mode,
+       returns the number of colors */
+    int (*palette_func)(const char * filename, unsigned char * palette);
   };
 
   struct simage_image_s {
@@ -43,13 +49,92 @@ extern "C" {
     int oktoreadall;
     char * openfilename;
     struct simage_open_funcs openfuncs;
+    /* added for simage 1.9: bytes between lines, and the image a
+       view shares its data with (NULL for ordinary images) */
+    int stride;
+    s_image * parent;
+    int refcount;
   };
 
   s_params * s_movie_params(s_movie * movie);
 
+  /* returns image (or a new image if image is NULL) with room for w x
+     h x components bytes of data, reallocating if the size differs.
+     Used by the movie importers to decode into a preallocated
+     image. Returns NULL if out of memory */
+  s_image * s_image_prepare(s_image * image, int w, int h, int components);
+
+  /* returns image if its lines are tightly packed, or else a packed
+     copy of it, which the caller must destroy. NULL if out of memory */
+  s_image * s_image_packed(s_image * image);
+
+
   void * s_stream_context_get(s_stream *stream);
   void s_stream_context_set(s_stream *stream, void *context);
 
+  /* runs func(closure, i) for i in [0, count) on the worker
+     threads. Returns when all jobs are done. Called from a job, the
+     jobs run on the calling thread. */
+  typedef void s_parallel_func(void * closure, int idx);
+  void s_parallel_for(int count, s_parallel_func * func, void * closure);
+
+  /* like s_parallel_for(), but the jobs run on background threads
+     while the caller goes on. s_parallel_wait() waits for them and
+     frees the task. With a single thread the jobs are run before
+     s_parallel_start() returns, and NULL is returned. */
+  typedef struct s_parallel_task s_parallel_task;
+  s_parallel_task * s_parallel_start(int count, s_parallel_func * func,
+                                     void * closure);
+  void s_parallel_wait(s_parallel_task * task /* | NULL */);
+
+  /* makes a palette of at most maxcolors (<= 256) colors for the
+     image, refined with the given number of k-means iterations, and
+     maps each pixel to a palette index, with ordered dithering if
+     dither is nonzero. palette gets 3 bytes per color and indices
+     width*height bytes. Returns the number of colors, 0 on failure */
+  int s_quantize_image(const unsigned char * bytes, int width, int height,
+                       int numcomponents, int maxcolors, int iterations,
+                       int dither, unsigned char * palette,
+                       unsigned char * indices);
+
+  /* like simage_resize(), but with a choice of filter: "hermite",
+     "box", "triangle", "bell" (the default if NULL), "b-spline",
+     "lanczos3" or "mitchell". Returns NULL for unknown filters */
+  unsigned char * s_resize_filtered(const unsigned char * src, int width,
+                                    int height, int num_comp,
+                                    int newwidth, int newheight,
+                                    const char * filtername);
+  /* like s_resize_filtered(), for source lines \a stride bytes apart */
+  unsigned char * s_resize_strided(const unsigned char * src, int width,
+                                   int height, int num_comp, int stride,
+                                   int newwidth, int newheight,
+                                   const char * filtername);
+
+  /* compresses the image, as rows of 4x4 blocks from the top, into
+     one of the SIMAGE_TEXTURE_BC* formats. dst needs 8 (BC1 and BC4)
+     or 16 bytes per block */
+  void s_bcn_compress(const unsigned char * bytes, int width, int height,
+                      int numcomponents, int format, unsigned char * dst);
+
+  /* the DDS and KTX2 savers, see texture.c */
+  int s_texture_save_dds(const char * filename, const unsigned char * bytes,
+                         int width, int height, int numcomponents,
+                         s_params * params);
+  int s_texture_save_ktx2(const char * filename, const unsigned char * bytes,
+                          int width, int height, int numcomponents,
+                          s_params * params);
+  int s_texture_error(char * buffer, int bufferlen);
+
+  /* movies stored as numbered image files, see simage_sequence.c */
+  int simage_sequence_movie_open(const char * filename, s_movie * movie);
+  s_image * simage_sequence_movie_get(s_movie * movie, s_image * prealloc,
+                                      s_params * params);
+  int simage_sequence_movie_create(const char * filename, s_movie * movie,
+                                   s_params * params);
+  int simage_sequence_movie_put(s_movie * movie, s_image * image,
+                                s_params * params);
+  void simage_sequence_movie_close(s_movie * movie);
+
 #ifdef __cplusplus
 }
 #endif
@@ -25,6 +25,8 @@
 #error "This file should not be used under the current configuration!"
 #endif /* !SIMAGE_RGB_SUPPORT */
 
+#include <simage.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -37,7 +39,8 @@ extern "C" {
                       const unsigned char * bytes,
                       int width,
                       int height,
-                      int numcomponents);
+                      int numcomponents,
+                      s_params * params);
   int simage_rgb_identify(const char * filename,
                           const unsigned char * header,
                           int headerlen);
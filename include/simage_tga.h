@@ -25,6 +25,8 @@
 #error "This file should not be used under the current configuration!"
 #endif /* !SIMAGE_TGA_SUPPORT */
 
+#include <simage.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -39,6 +41,20 @@ extern "C" {
 
   int simage_tga_error(char *buffer, int bufferlen);
 
+  void * simage_tga_open(const char * filename,
+                         int * width,
+                         int * height,
+                         int * numcomponents);
+  int simage_tga_read_line(void * opendata, int y, unsigned char * buf);
+  void simage_tga_close(void * opendata);
+
+  int simage_tga_save(const char * filename,
+                      const unsigned char * bytes,
+                      int width,
+                      int height,
+                      int numcomponents,
+                      s_params * params);
+
 #ifdef __cplusplus
 }
 #endif
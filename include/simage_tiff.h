@@ -25,6 +25,8 @@
 #error "This file should not be used under the current configuration!"
 #endif /* !HAVE_TIFFLIB */
 
+#include <simage.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -37,7 +39,8 @@ extern "C" {
                        const unsigned char * bytes,
                        int width,
                        int height,
-                       int numcomponents);
+                       int numcomponents,
+                       s_params * params);
   int simage_tiff_identify(const char * filename,
                            const unsigned char * header,
                            int headerlen);
@@ -52,6 +55,16 @@ extern "C" {
   void simage_tiff_close(void * opendata);
   int simage_tiff_read_line(void * opendata, int y, unsigned char * buf);
 
+  /* new for simage 1.9 */
+  int simage_tiff_read_region(void * opendata, int x, int y, int w, int h,
+                              unsigned char * buf);
+
+  /* multi-page files as movies */
+  int simage_tiff_movie_open(const char * filename, s_movie * movie);
+  s_image * simage_tiff_movie_get(s_movie * movie, s_image * prealloc,
+                                  s_params * params);
+  void simage_tiff_movie_close(s_movie * movie);
+
 #ifdef __cplusplus
 }
 #endif
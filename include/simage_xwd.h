@@ -44,6 +44,13 @@ extern "C" {
 
   int simage_xwd_error(char * buffer, int bufferlen);
 
+  void * simage_xwd_open(const char * filename,
+                         int * width,
+                         int * height,
+                         int * numcomponents);
+  void simage_xwd_close(void * opendata);
+  int simage_xwd_read_line(void * opendata, int y, unsigned char * buf);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,629 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Block compression into the BC1 (DXT1), BC3 (DXT5), BC4, BC5 and BC7
+ * texture formats.
+ *
+ * Every 4x4 block is coded on its own, so the block rows are split
+ * between the worker threads. The color endpoints are first placed at
+ * the ends of the block's principal axis, each pixel gets the nearest
+ * color of the resulting palette, and the endpoints are then refitted
+ * to the chosen indices by least squares. The refit is kept if it
+ * lowers the error. BC7 blocks are always written in mode 6, a single
+ * RGBA line with 4 bit indices, which suits both opaque and
+ * transparent blocks.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <simage.h>
+#include <simage_private.h>
+
+/* smaller images are compressed on the calling thread */
+#define PARALLEL_MIN_BLOCKS 4096
+
+/* about the number of blocks each job compresses */
+#define BLOCKS_PER_JOB 1024
+
+/* BC7 interpolation weights for 4 bit indices */
+static const int bc7_weights[16] = {
+  0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64
+};
+
+/* copies the 4x4 block at block column bx and row by, counting from
+   the top, to block as RGBA. Pixels outside the image repeat the
+   edge */
+static void
+fetch_block(const unsigned char * bytes, int width, int height, int nc,
+            int bx, int by, unsigned char * block)
+{
+  int i, j;
+
+  for (j = 0; j < 4; j++) {
+    const unsigned char * row;
+    int y = by * 4 + j;
+    if (y >= height) y = height - 1;
+    /* the image is stored from the bottom row */
+    row = bytes + (size_t) (height - 1 - y) * width * nc;
+    for (i = 0; i < 4; i++) {
+      unsigned char * q = block + (j * 4 + i) * 4;
+      const unsigned char * p;
+      int x = bx * 4 + i;
+      if (x >= width) x = width - 1;
+      p = row + (size_t) x * nc;
+      switch (nc) {
+      case 1:
+        q[0] = q[1] = q[2] = p[0];
+        q[3] = 255;
+        break;
+      case 2:
+        q[0] = q[1] = q[2] = p[0];
+        q[3] = p[1];
+        break;
+      case 3:
+        q[0] = p[0];
+        q[1] = p[1];
+        q[2] = p[2];
+        q[3] = 255;
+        break;
+      default:
+        memcpy(q, p, 4);
+        break;
+      }
+    }
+  }
+}
+
+/* finds the ends of the principal axis of the first n channels of the
+   block's pixels that have use[i] set, and stores them in e0 and
+   e1 */
+static void
+fit_axis(const unsigned char * block, int n, const int * use,
+         float * e0, float * e1)
+{
+  float mean[4], cov[4][4], axis[4], tmp[4];
+  float len, t, tmin, tmax;
+  int i, j, k, count, best;
+
+  count = 0;
+  for (k = 0; k < n; k++) mean[k] = 0.0f;
+  for (i = 0; i < 16; i++) {
+    if (!use[i]) continue;
+    for (k = 0; k < n; k++) mean[k] += block[i*4+k];
+    count++;
+  }
+  for (k = 0; k < n; k++) mean[k] /= (float) count;
+
+  for (j = 0; j < n; j++) {
+    for (k = 0; k < n; k++) cov[j][k] = 0.0f;
+  }
+  for (i = 0; i < 16; i++) {
+    if (!use[i]) continue;
+    for (k = 0; k < n; k++) tmp[k] = block[i*4+k] - mean[k];
+    for (j = 0; j < n; j++) {
+      for (k = 0; k < n; k++) cov[j][k] += tmp[j] * tmp[k];
+    }
+  }
+
+  /* power iteration, starting from the row with the largest
+     variance */
+  best = 0;
+  for (k = 1; k < n; k++) {
+    if (cov[k][k] > cov[best][best]) best = k;
+  }
+  for (k = 0; k < n; k++) axis[k] = cov[best][k];
+  for (i = 0; i < 8; i++) {
+    len = 0.0f;
+    for (j = 0; j < n; j++) {
+      tmp[j] = 0.0f;
+      for (k = 0; k < n; k++) tmp[j] += cov[j][k] * axis[k];
+      if (fabs(tmp[j]) > len) len = (float) fabs(tmp[j]);
+    }
+    if (len == 0.0f) break;
+    for (k = 0; k < n; k++) axis[k] = tmp[k] / len;
+  }
+
+  len = 0.0f;
+  for (k = 0; k < n; k++) len += axis[k] * axis[k];
+  if (len == 0.0f) {
+    /* all the pixels have the same color */
+    for (k = 0; k < n; k++) e0[k] = e1[k] = mean[k];
+    return;
+  }
+  len = (float) sqrt(len);
+  for (k = 0; k < n; k++) axis[k] /= len;
+
+  tmin = tmax = 0.0f;
+  for (i = 0; i < 16; i++) {
+    if (!use[i]) continue;
+    t = 0.0f;
+    for (k = 0; k < n; k++) t += (block[i*4+k] - mean[k]) * axis[k];
+    if (t < tmin) tmin = t;
+    if (t > tmax) tmax = t;
+  }
+  for (k = 0; k < n; k++) {
+    e0[k] = mean[k] + tmin * axis[k];
+    e1[k] = mean[k] + tmax * axis[k];
+  }
+}
+
+/* refits the endpoints of a line through the first n channels of the
+   used pixels, where pixel i lies weight[i] of the way from e0 to e1.
+   Returns 0 if the weights don't determine the line */
+static int
+refit_line(const unsigned char * block, int n, const int * use,
+           const float * weight, float * e0, float * e1)
+{
+  float a, b, c, det, x[4], y[4];
+  int i, k;
+
+  a = b = c = 0.0f;
+  for (k = 0; k < n; k++) x[k] = y[k] = 0.0f;
+  for (i = 0; i < 16; i++) {
+    float w = weight[i];
+    if (!use[i]) continue;
+    a += (1.0f - w) * (1.0f - w);
+    b += (1.0f - w) * w;
+    c += w * w;
+    for (k = 0; k < n; k++) {
+      x[k] += (1.0f - w) * block[i*4+k];
+      y[k] += w * block[i*4+k];
+    }
+  }
+  det = a * c - b * b;
+  if (fabs(det) < 1e-6f) return 0;
+  for (k = 0; k < n; k++) {
+    e0[k] = (c * x[k] - b * y[k]) / det;
+    e1[k] = (a * y[k] - b * x[k]) / det;
+  }
+  return 1;
+}
+
+static int
+quantize(float val, int max)
+{
+  int q = (int) floor(val * max / 255.0f + 0.5f);
+  return q < 0 ? 0 : (q > max ? max : q);
+}
+
+/*
+ * BC1 and the color part of BC3
+ */
+
+static unsigned int
+pack_565(const float * rgb)
+{
+  return (quantize(rgb[0], 31) << 11) | (quantize(rgb[1], 63) << 5) |
+    quantize(rgb[2], 31);
+}
+
+static void
+unpack_565(unsigned int c, int * rgb)
+{
+  int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+  rgb[0] = (r << 3) | (r >> 2);
+  rgb[1] = (g << 2) | (g >> 4);
+  rgb[2] = (b << 3) | (b >> 2);
+}
+
+/* picks the indices for the endpoints c0 and c1, ordering them for the
+   four color mode, or the three color mode with transparent pixels if
+   threecolor is set. Returns the squared error */
+static int
+bc1_indices(const unsigned char * block, const int * use, int threecolor,
+            unsigned int * c0, unsigned int * c1, unsigned int * indices)
+{
+  int pal[4][3];
+  int i, j, k, err, best, d, e, numcolors;
+  unsigned int tmp;
+
+  if (threecolor ? *c0 > *c1 : *c0 < *c1) {
+    tmp = *c0;
+    *c0 = *c1;
+    *c1 = tmp;
+  }
+  unpack_565(*c0, pal[0]);
+  unpack_565(*c1, pal[1]);
+  if (*c0 > *c1) {
+    for (k = 0; k < 3; k++) {
+      pal[2][k] = (2 * pal[0][k] + pal[1][k]) / 3;
+      pal[3][k] = (pal[0][k] + 2 * pal[1][k]) / 3;
+    }
+    numcolors = 4;
+  }
+  else {
+    /* in the three color mode, or both endpoints are the same */
+    for (k = 0; k < 3; k++) pal[2][k] = (pal[0][k] + pal[1][k]) / 2;
+    numcolors = 3;
+  }
+
+  err = 0;
+  *indices = 0;
+  for (i = 0; i < 16; i++) {
+    const unsigned char * p = block + i * 4;
+    if (!use[i]) {
+      *indices |= 3u << (i * 2);
+      continue;
+    }
+    best = 0;
+    e = 0x7fffffff;
+    for (j = 0; j < numcolors; j++) {
+      d = (p[0] - pal[j][0]) * (p[0] - pal[j][0]) +
+        (p[1] - pal[j][1]) * (p[1] - pal[j][1]) +
+        (p[2] - pal[j][2]) * (p[2] - pal[j][2]);
+      if (d < e) {
+        e = d;
+        best = j;
+      }
+    }
+    *indices |= (unsigned int) best << (i * 2);
+    err += e;
+  }
+  return err;
+}
+
+static void
+encode_bc1(const unsigned char * block, int alpha, unsigned char * dst)
+{
+  static const float weights4[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+  static const float weights3[4] = { 0.0f, 1.0f, 0.5f, 0.0f };
+  float e0[3], e1[3], weight[16];
+  unsigned int c0, c1, indices, r0, r1, rindices;
+  int use[16], i, numused, threecolor, err;
+
+  numused = 0;
+  for (i = 0; i < 16; i++) {
+    /* pixels with alpha below 128 are transparent in BC1 */
+    use[i] = !alpha || block[i*4+3] >= 128;
+    numused += use[i];
+  }
+  threecolor = numused < 16;
+
+  if (numused == 0) {
+    c0 = c1 = 0;
+    indices = 0xffffffff;
+  }
+  else {
+    fit_axis(block, 3, use, e0, e1);
+    c0 = pack_565(e0);
+    c1 = pack_565(e1);
+    err = bc1_indices(block, use, threecolor, &c0, &c1, &indices);
+
+    if (err > 0 && c0 != c1) {
+      const float * w = (c0 > c1) ? weights4 : weights3;
+      for (i = 0; i < 16; i++) weight[i] = w[(indices >> (i * 2)) & 3];
+      if (refit_line(block, 3, use, weight, e0, e1)) {
+        r0 = pack_565(e0);
+        r1 = pack_565(e1);
+        if (bc1_indices(block, use, threecolor, &r0, &r1, &rindices) < err) {
+          c0 = r0;
+          c1 = r1;
+          indices = rindices;
+        }
+      }
+    }
+  }
+
+  dst[0] = (unsigned char) (c0 & 0xff);
+  dst[1] = (unsigned char) (c0 >> 8);
+  dst[2] = (unsigned char) (c1 & 0xff);
+  dst[3] = (unsigned char) (c1 >> 8);
+  dst[4] = (unsigned char) (indices & 0xff);
+  dst[5] = (unsigned char) ((indices >> 8) & 0xff);
+  dst[6] = (unsigned char) ((indices >> 16) & 0xff);
+  dst[7] = (unsigned char) (indices >> 24);
+}
+
+/*
+ * BC4, also used for the alpha of BC3 and the two channels of BC5
+ */
+
+/* picks the indices for the endpoints e0 and e1. Returns the squared
+   error */
+static int
+bc4_indices(const int * val, int e0, int e1, unsigned long long * indices)
+{
+  int pal[8];
+  int i, j, k, err, best, d, e;
+
+  pal[0] = e0;
+  pal[1] = e1;
+  if (e0 > e1) {
+    for (k = 2; k < 8; k++) pal[k] = ((8 - k) * e0 + (k - 1) * e1 + 3) / 7;
+  }
+  else {
+    for (k = 2; k < 6; k++) pal[k] = ((6 - k) * e0 + (k - 1) * e1 + 2) / 5;
+    pal[6] = 0;
+    pal[7] = 255;
+  }
+
+  err = 0;
+  *indices = 0;
+  for (i = 0; i < 16; i++) {
+    best = 0;
+    e = 0x7fffffff;
+    for (j = 0; j < 8; j++) {
+      d = (val[i] - pal[j]) * (val[i] - pal[j]);
+      if (d < e) {
+        e = d;
+        best = j;
+      }
+    }
+    *indices |= (unsigned long long) best << (i * 3);
+    err += e;
+  }
+  return err;
+}
+
+/* encodes channel c of the block */
+static void
+encode_bc4(const unsigned char * block, int c, unsigned char * dst)
+{
+  unsigned long long indices, indices6;
+  int val[16], i, lo, hi, lo6, hi6, e0, e1, err;
+
+  lo = lo6 = 255;
+  hi = hi6 = 0;
+  for (i = 0; i < 16; i++) {
+    val[i] = block[i*4+c];
+    if (val[i] < lo) lo = val[i];
+    if (val[i] > hi) hi = val[i];
+    /* the six value mode has exact 0 and 255 */
+    if (val[i] > 0 && val[i] < lo6) lo6 = val[i];
+    if (val[i] < 255 && val[i] > hi6) hi6 = val[i];
+  }
+
+  e0 = hi;
+  e1 = lo;
+  err = bc4_indices(val, e0, e1, &indices);
+  if (err > 0 && (lo == 0 || hi == 255)) {
+    if (lo6 > hi6) lo6 = hi6 = (lo == 0) ? 0 : 255;
+    if (bc4_indices(val, lo6, hi6, &indices6) < err) {
+      e0 = lo6;
+      e1 = hi6;
+      indices = indices6;
+    }
+  }
+
+  dst[0] = (unsigned char) e0;
+  dst[1] = (unsigned char) e1;
+  for (i = 0; i < 6; i++) dst[2 + i] = (unsigned char) (indices >> (i * 8));
+}
+
+/*
+ * BC7 mode 6
+ */
+
+/* quantizes an endpoint to 7 bits per channel and a shared lowest bit,
+   which is chosen to give the smallest error */
+static void
+bc7_quantize(const float * e, int * q, int * pbit)
+{
+  int p, k, v, qp[4], best;
+  float d, err[2];
+
+  best = 0;
+  for (p = 0; p < 2; p++) {
+    err[p] = 0.0f;
+    for (k = 0; k < 4; k++) {
+      v = (int) floor((e[k] - p) / 2.0f + 0.5f);
+      v = v < 0 ? 0 : (v > 127 ? 127 : v);
+      d = (float) (v * 2 + p) - e[k];
+      err[p] += d * d;
+      if (p == 0) q[k] = v;
+      else qp[k] = v;
+    }
+  }
+  if (err[1] < err[0]) {
+    for (k = 0; k < 4; k++) q[k] = qp[k];
+    best = 1;
+  }
+  *pbit = best;
+}
+
+/* picks the indices for the quantized endpoints. Returns the squared
+   error */
+static int
+bc7_indices(const unsigned char * block, const int * q0, int p0,
+            const int * q1, int p1, unsigned char * indices)
+{
+  int pal[16][4];
+  int i, j, k, err, best, d, e, v0, v1;
+
+  for (k = 0; k < 4; k++) {
+    v0 = q0[k] * 2 + p0;
+    v1 = q1[k] * 2 + p1;
+    for (j = 0; j < 16; j++) {
+      pal[j][k] = ((64 - bc7_weights[j]) * v0 + bc7_weights[j] * v1 + 32) >> 6;
+    }
+  }
+
+  err = 0;
+  for (i = 0; i < 16; i++) {
+    const unsigned char * p = block + i * 4;
+    best = 0;
+    e = 0x7fffffff;
+    for (j = 0; j < 16; j++) {
+      d = 0;
+      for (k = 0; k < 4; k++) d += (p[k] - pal[j][k]) * (p[k] - pal[j][k]);
+      if (d < e) {
+        e = d;
+        best = j;
+      }
+    }
+    indices[i] = (unsigned char) best;
+    err += e;
+  }
+  return err;
+}
+
+static void
+put_bits(unsigned char * dst, int * pos, unsigned int val, int n)
+{
+  int i;
+  for (i = 0; i < n; i++, (*pos)++) {
+    if (val & (1u << i)) dst[*pos >> 3] |= (unsigned char) (1 << (*pos & 7));
+  }
+}
+
+static void
+encode_bc7(const unsigned char * block, unsigned char * dst)
+{
+  static const int use[16] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
+  };
+  float e0[4], e1[4], weight[16];
+  unsigned char indices[16], rindices[16];
+  int q0[4], q1[4], r0[4], r1[4], p0, p1, rp0, rp1, i, k, err, pos, tmp;
+
+  fit_axis(block, 4, use, e0, e1);
+  bc7_quantize(e0, q0, &p0);
+  bc7_quantize(e1, q1, &p1);
+  err = bc7_indices(block, q0, p0, q1, p1, indices);
+
+  if (err > 0) {
+    for (i = 0; i < 16; i++) weight[i] = bc7_weights[indices[i]] / 64.0f;
+    if (refit_line(block, 4, use, weight, e0, e1)) {
+      for (k = 0; k < 4; k++) {
+        e0[k] = e0[k] < 0.0f ? 0.0f : (e0[k] > 255.0f ? 255.0f : e0[k]);
+        e1[k] = e1[k] < 0.0f ? 0.0f : (e1[k] > 255.0f ? 255.0f : e1[k]);
+      }
+      bc7_quantize(e0, r0, &rp0);
+      bc7_quantize(e1, r1, &rp1);
+      if (bc7_indices(block, r0, rp0, r1, rp1, rindices) < err) {
+        memcpy(q0, r0, sizeof(q0));
+        memcpy(q1, r1, sizeof(q1));
+        p0 = rp0;
+        p1 = rp1;
+        memcpy(indices, rindices, sizeof(indices));
+      }
+    }
+  }
+
+  /* the highest bit of the first index is implied to be 0 */
+  if (indices[0] & 8) {
+    for (k = 0; k < 4; k++) {
+      tmp = q0[k];
+      q0[k] = q1[k];
+      q1[k] = tmp;
+    }
+    tmp = p0;
+    p0 = p1;
+    p1 = tmp;
+    for (i = 0; i < 16; i++) indices[i] = (unsigned char) (15 - indices[i]);
+  }
+
+  memset(dst, 0, 16);
+  pos = 0;
+  put_bits(dst, &pos, 1 << 6, 7); /* mode 6 */
+  for (k = 0; k < 4; k++) {
+    put_bits(dst, &pos, q0[k], 7);
+    put_bits(dst, &pos, q1[k], 7);
+  }
+  put_bits(dst, &pos, p0, 1);
+  put_bits(dst, &pos, p1, 1);
+  put_bits(dst, &pos, indices[0], 3);
+  for (i = 1; i < 16; i++) put_bits(dst, &pos, indices[i], 4);
+}
+
+/*
+ * The jobs
+ */
+
+typedef struct {
+  const unsigned char * bytes;
+  int width, height, nc;
+  int format;
+  int blocksx, blocksy;
+  int rowsperjob;
+  int blocksize;
+  unsigned char * dst;
+} bcn_job;
+
+static void
+encode_block_rows(void * closure, int idx)
+{
+  bcn_job * job = (bcn_job *) closure;
+  unsigned char block[64];
+  unsigned char * dst;
+  int bx, by, start, stop;
+
+  start = idx * job->rowsperjob;
+  stop = start + job->rowsperjob;
+  if (stop > job->blocksy) stop = job->blocksy;
+
+  for (by = start; by < stop; by++) {
+    dst = job->dst + (size_t) by * job->blocksx * job->blocksize;
+    for (bx = 0; bx < job->blocksx; bx++) {
+      fetch_block(job->bytes, job->width, job->height, job->nc, bx, by, block);
+      switch (job->format) {
+      case SIMAGE_TEXTURE_BC1:
+        encode_bc1(block, job->nc == 2 || job->nc == 4, dst);
+        break;
+      case SIMAGE_TEXTURE_BC3:
+        encode_bc4(block, 3, dst);
+        encode_bc1(block, 0, dst + 8);
+        break;
+      case SIMAGE_TEXTURE_BC4:
+        encode_bc4(block, 0, dst);
+        break;
+      case SIMAGE_TEXTURE_BC5:
+        /* gray images with alpha keep the alpha in the second channel */
+        encode_bc4(block, 0, dst);
+        encode_bc4(block, job->nc == 2 ? 3 : 1, dst + 8);
+        break;
+      default:
+        encode_bc7(block, dst);
+        break;
+      }
+      dst += job->blocksize;
+    }
+  }
+}
+
+void
+s_bcn_compress(const unsigned char * bytes, int width, int height,
+               int numcomponents, int format, unsigned char * dst)
+{
+  bcn_job job;
+  int numjobs;
+
+  job.bytes = bytes;
+  job.width = width;
+  job.height = height;
+  job.nc = numcomponents;
+  job.format = format;
+  job.blocksx = (width + 3) / 4;
+  job.blocksy = (height + 3) / 4;
+  job.blocksize = (format == SIMAGE_TEXTURE_BC1 || format == SIMAGE_TEXTURE_BC4) ? 8 : 16;
+  job.dst = dst;
+
+  if (job.blocksx * job.blocksy < PARALLEL_MIN_BLOCKS) {
+    job.rowsperjob = job.blocksy;
+  }
+  else {
+    job.rowsperjob = (BLOCKS_PER_JOB + job.blocksx - 1) / job.blocksx;
+  }
+  numjobs = (job.blocksy + job.rowsperjob - 1) / job.rowsperjob;
+  s_parallel_for(numjobs, encode_block_rows, &job);
+}
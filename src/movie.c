@@ -40,6 +40,22 @@
 #include "simage_avi.h"
 #endif /* SIMAGE_AVIENC_SUPPORT */
 
+#ifdef HAVE_TIFFLIB
+#include "simage_tiff.h"
+#endif /* HAVE_TIFFLIB */
+
+#ifdef HAVE_GIFLIB
+#include "simage_gif.h"
+#endif /* HAVE_GIFLIB */
+
+#ifdef SIMAGE_Y4M_SUPPORT
+#include "simage_y4m.h"
+#endif /* SIMAGE_Y4M_SUPPORT */
+
+#ifdef SIMAGE_MJPEG_SUPPORT
+#include "simage_mjpeg.h"
+#endif /* SIMAGE_MJPEG_SUPPORT */
+
 struct simage_movie_s {
   char * filename;
 
@@ -78,7 +94,24 @@ add_internal_importers(void)
 {
   static int first = 1;
   if (first) {
-    /* none yet */
+#ifdef HAVE_TIFFLIB
+    s_movie_importer_add(simage_tiff_movie_open,
+                         simage_tiff_movie_get,
+                         simage_tiff_movie_close);
+#endif
+#ifdef HAVE_GIFLIB
+    s_movie_importer_add(simage_gif_movie_open,
+                         simage_gif_movie_get,
+                         simage_gif_movie_close);
+#endif
+#ifdef SIMAGE_Y4M_SUPPORT
+    s_movie_importer_add(simage_y4m_movie_open,
+                         simage_y4m_movie_get,
+                         simage_y4m_movie_close);
+#endif
+    s_movie_importer_add(simage_sequence_movie_open,
+                         simage_sequence_movie_get,
+                         simage_sequence_movie_close);
     first = 0;
   }
 }
@@ -97,7 +130,20 @@ add_internal_exporters(void)
     s_movie_exporter_add(avienc_movie_create,
                          avienc_movie_put,
                          avienc_movie_close);
+#elif defined(SIMAGE_MJPEG_SUPPORT)
+    /* "video/avi" without Video for Windows */
+    s_movie_exporter_add(simage_mjpeg_movie_create,
+                         simage_mjpeg_movie_put,
+                         simage_mjpeg_movie_close);
 #endif
+#ifdef SIMAGE_Y4M_SUPPORT
+    s_movie_exporter_add(simage_y4m_movie_create,
+                         simage_y4m_movie_put,
+                         simage_y4m_movie_close);
+#endif
+    s_movie_exporter_add(simage_sequence_movie_create,
+                         simage_sequence_movie_put,
+                         simage_sequence_movie_close);
     first = 0;
   }
 }
@@ -135,17 +181,22 @@ s_movie *
 s_movie_create(const char * filename, s_params * params /* | NULL */)
 {
   struct simage_movie_exporter * exp;
+  s_params * noparams = NULL;
   s_movie * movie = (s_movie*) malloc(sizeof(s_movie));
   movie->params = NULL;
   movie->filename = NULL;
 
   add_internal_exporters();
 
+  /* the exporters expect a parameter set, even an empty one */
+  if (params == NULL) params = noparams = s_params_create();
+
   exp = exporters;
   while (exp) {
     if (exp->create(filename, movie, params)) break;
     exp = exp->next;
   }
+  if (noparams) s_params_destroy(noparams);
   if (exp == NULL) {
     free((void*) movie);
     return NULL;
@@ -169,7 +220,14 @@ int
 s_movie_put_image(s_movie * movie, s_image * image,
                   s_params * params)
 {
-  return movie->put(movie, image, params);
+  /* the exporters expect tightly packed lines */
+  s_image * packed = s_image_packed(image);
+  int ret;
+
+  if (packed == NULL) return 0;
+  ret = movie->put(movie, packed, params);
+  if (packed != image) s_image_destroy(packed);
+  return ret;
 }
 
 void
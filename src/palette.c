@@ -0,0 +1,536 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Color quantization for the savers of paletted formats.
+ *
+ * The colors are counted in a 15-bit (5 bits per channel) histogram,
+ * built on several threads for large images. The palette is made by
+ * reducing an octree over the histogram, and can be refined with a
+ * few k-means iterations over the histogram cells. Finally every
+ * histogram cell is mapped to its nearest palette entry, and the
+ * pixels are looked up in that table, optionally with ordered
+ * dithering.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <simage.h>
+#include <simage_private.h>
+
+#define HIST_BITS 5
+#define HIST_SIZE (1 << (3 * HIST_BITS))
+#define HIST_SHIFT (8 - HIST_BITS)
+
+#define HIST_INDEX(r, g, b) \
+  ((((r) >> HIST_SHIFT) << (2 * HIST_BITS)) | \
+   (((g) >> HIST_SHIFT) << HIST_BITS) | \
+   ((b) >> HIST_SHIFT))
+
+/* don't bother with threads for images smaller than this */
+#define PARALLEL_MIN_PIXELS (1024 * 1024)
+
+/* the number of cells each job handles when working on the histogram */
+#define CELLS_PER_JOB 4096
+
+typedef struct {
+  double count;
+  double sum[3];
+} hist_cell;
+
+/* get the red, green and blue value of pixel x in a row */
+#define GET_RGB(row, x, nc, r, g, b)                    \
+  do {                                                  \
+    const unsigned char * p_ = (row) + (size_t) (x) * (nc); \
+    if ((nc) < 3) (r) = (g) = (b) = p_[0];              \
+    else { (r) = p_[0]; (g) = p_[1]; (b) = p_[2]; }     \
+  } while (0)
+
+/*
+ * Histogram
+ */
+
+typedef struct {
+  const unsigned char * bytes;
+  int width, height, numcomponents;
+  int numjobs;
+  hist_cell ** hists; /* one per job */
+} hist_job;
+
+static void
+build_hist(void * closure, int idx)
+{
+  hist_job * job = (hist_job *) closure;
+  hist_cell * hist = job->hists[idx];
+  int y0 = (int) ((double) job->height * idx / job->numjobs);
+  int y1 = (int) ((double) job->height * (idx + 1) / job->numjobs);
+  int x, y, r, g, b;
+
+  for (y = y0; y < y1; y++) {
+    const unsigned char * row =
+      job->bytes + (size_t) y * job->width * job->numcomponents;
+    for (x = 0; x < job->width; x++) {
+      hist_cell * cell;
+      GET_RGB(row, x, job->numcomponents, r, g, b);
+      cell = &hist[HIST_INDEX(r, g, b)];
+      cell->count += 1.0;
+      cell->sum[0] += r;
+      cell->sum[1] += g;
+      cell->sum[2] += b;
+    }
+  }
+}
+
+/* returns the histogram, or NULL if out of memory */
+static hist_cell *
+make_histogram(const unsigned char * bytes, int width, int height,
+               int numcomponents, int numjobs)
+{
+  hist_job job;
+  int i, j;
+
+  job.bytes = bytes;
+  job.width = width;
+  job.height = height;
+  job.numcomponents = numcomponents;
+  job.numjobs = numjobs;
+  job.hists = (hist_cell **) calloc(numjobs, sizeof(hist_cell *));
+  if (job.hists == NULL) return NULL;
+  for (i = 0; i < numjobs; i++) {
+    job.hists[i] = (hist_cell *) calloc(HIST_SIZE, sizeof(hist_cell));
+    if (job.hists[i] == NULL) {
+      for (j = 0; j < i; j++) free(job.hists[j]);
+      free(job.hists);
+      return NULL;
+    }
+  }
+
+  s_parallel_for(numjobs, build_hist, &job);
+
+  /* merge into the first one */
+  for (i = 1; i < numjobs; i++) {
+    hist_cell * src = job.hists[i];
+    hist_cell * dst = job.hists[0];
+    for (j = 0; j < HIST_SIZE; j++) {
+      if (src[j].count > 0.0) {
+        dst[j].count += src[j].count;
+        dst[j].sum[0] += src[j].sum[0];
+        dst[j].sum[1] += src[j].sum[1];
+        dst[j].sum[2] += src[j].sum[2];
+      }
+    }
+    free(src);
+  }
+  {
+    hist_cell * hist = job.hists[0];
+    free(job.hists);
+    return hist;
+  }
+}
+
+/*
+ * Octree reduction
+ */
+
+typedef struct {
+  int children[8]; /* -1 if no child */
+  int numchildren;
+  int leaf;
+  hist_cell total;
+} octree_node;
+
+typedef struct {
+  octree_node * nodes;
+  int numnodes;
+  int * levels[HIST_BITS]; /* the inner nodes of each level */
+  int numlevel[HIST_BITS];
+} octree;
+
+static int
+new_node(octree * tree, int level)
+{
+  octree_node * node = &tree->nodes[tree->numnodes];
+  int i;
+  memset(node, 0, sizeof(octree_node));
+  for (i = 0; i < 8; i++) node->children[i] = -1;
+  node->leaf = level == HIST_BITS;
+  if (!node->leaf) tree->levels[level][tree->numlevel[level]++] = tree->numnodes;
+  return tree->numnodes++;
+}
+
+/* a node and its pixel count, for sorting the nodes of a level */
+typedef struct {
+  double count;
+  int index;
+} node_count;
+
+static int
+compare_nodes(const void * a, const void * b)
+{
+  const node_count * na = (const node_count *) a;
+  const node_count * nb = (const node_count *) b;
+  if (na->count != nb->count) return na->count < nb->count ? -1 : 1;
+  return na->index - nb->index;
+}
+
+static void
+add_cell(hist_cell * dst, const hist_cell * src)
+{
+  dst->count += src->count;
+  dst->sum[0] += src->sum[0];
+  dst->sum[1] += src->sum[1];
+  dst->sum[2] += src->sum[2];
+}
+
+/* fills in palette (as doubles) with at most maxcolors colors.
+   Returns the number of colors, or 0 if out of memory */
+static int
+octree_palette(const hist_cell * hist, int maxcolors, double * palette)
+{
+  octree tree;
+  node_count * order;
+  int maxnodes, numleaves, i, level, n;
+
+  /* at most one inner node per cell of each coarser level */
+  maxnodes = HIST_SIZE;
+  for (i = 0; i < HIST_BITS; i++) maxnodes += 1 << (3 * i);
+  tree.nodes = (octree_node *) malloc(maxnodes * sizeof(octree_node));
+  if (tree.nodes == NULL) return 0;
+  for (i = 0; i < HIST_BITS; i++) {
+    tree.levels[i] = (int *) malloc((1 << (3 * i)) * sizeof(int));
+    tree.numlevel[i] = 0;
+  }
+  tree.numnodes = 0;
+  (void) new_node(&tree, 0);
+
+  /* insert the histogram cells */
+  numleaves = 0;
+  for (i = 0; i < HIST_SIZE; i++) {
+    int r, g, b, node = 0;
+    if (hist[i].count <= 0.0) continue;
+    r = i >> (2 * HIST_BITS);
+    g = (i >> HIST_BITS) & ((1 << HIST_BITS) - 1);
+    b = i & ((1 << HIST_BITS) - 1);
+    for (level = 0; level < HIST_BITS; level++) {
+      int shift = HIST_BITS - 1 - level;
+      int child = (((r >> shift) & 1) << 2) | (((g >> shift) & 1) << 1) | ((b >> shift) & 1);
+      add_cell(&tree.nodes[node].total, &hist[i]);
+      if (tree.nodes[node].children[child] < 0) {
+        int c = new_node(&tree, level + 1);
+        tree.nodes[node].children[child] = c;
+        tree.nodes[node].numchildren++;
+      }
+      node = tree.nodes[node].children[child];
+    }
+    add_cell(&tree.nodes[node].total, &hist[i]);
+    numleaves++;
+  }
+
+  /* merge the least used nodes, deepest level first, until there are
+     few enough leaves. When a level is done, all the nodes on it are
+     leaves, so the children of the next level are always leaves */
+  order = (node_count *) malloc((1 << (3 * (HIST_BITS - 1))) * sizeof(node_count));
+  if (order == NULL) {
+    for (i = 0; i < HIST_BITS; i++) free(tree.levels[i]);
+    free(tree.nodes);
+    return 0;
+  }
+  for (level = HIST_BITS - 1; level >= 0 && numleaves > maxcolors; level--) {
+    for (i = 0; i < tree.numlevel[level]; i++) {
+      order[i].index = tree.levels[level][i];
+      order[i].count = tree.nodes[order[i].index].total.count;
+    }
+    qsort(order, tree.numlevel[level], sizeof(node_count), compare_nodes);
+    for (i = 0; i < tree.numlevel[level] && numleaves > maxcolors; i++) {
+      octree_node * node = &tree.nodes[order[i].index];
+      numleaves -= node->numchildren - 1;
+      node->leaf = 1;
+    }
+  }
+  free(order);
+
+  /* collect the leaves, walking from the root */
+  n = 0;
+  {
+    int stack[HIST_BITS * 8 + 1];
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp > 0) {
+      octree_node * node = &tree.nodes[stack[--sp]];
+      if (node->leaf) {
+        if (node->total.count > 0.0 && n < maxcolors) {
+          palette[n*3+0] = node->total.sum[0] / node->total.count;
+          palette[n*3+1] = node->total.sum[1] / node->total.count;
+          palette[n*3+2] = node->total.sum[2] / node->total.count;
+          n++;
+        }
+        continue;
+      }
+      for (i = 0; i < 8; i++) {
+        if (node->children[i] >= 0) stack[sp++] = node->children[i];
+      }
+    }
+  }
+
+  for (i = 0; i < HIST_BITS; i++) free(tree.levels[i]);
+  free(tree.nodes);
+  return n;
+}
+
+/*
+ * Nearest palette entry search
+ */
+
+typedef struct {
+  int numcolors;
+  /* the palette as separate arrays, so the distance loop vectorizes */
+  int r[256], g[256], b[256];
+} search_palette;
+
+static int
+nearest_color(const search_palette * pal, int r, int g, int b)
+{
+  int dist[256];
+  int i, best, bestdist;
+
+  for (i = 0; i < pal->numcolors; i++) {
+    int dr = pal->r[i] - r;
+    int dg = pal->g[i] - g;
+    int db = pal->b[i] - b;
+    dist[i] = dr * dr + dg * dg + db * db;
+  }
+  best = 0;
+  bestdist = dist[0];
+  for (i = 1; i < pal->numcolors; i++) {
+    if (dist[i] < bestdist) {
+      bestdist = dist[i];
+      best = i;
+    }
+  }
+  return best;
+}
+
+static void
+set_search_palette(search_palette * pal, const double * palette, int numcolors)
+{
+  int i;
+  pal->numcolors = numcolors;
+  for (i = 0; i < numcolors; i++) {
+    pal->r[i] = (int) (palette[i*3+0] + 0.5);
+    pal->g[i] = (int) (palette[i*3+1] + 0.5);
+    pal->b[i] = (int) (palette[i*3+2] + 0.5);
+  }
+}
+
+/*
+ * k-means refinement
+ */
+
+typedef struct {
+  const hist_cell * hist;
+  const search_palette * pal;
+  hist_cell (*sums)[256]; /* one set per job */
+} kmeans_job;
+
+static void
+kmeans_assign(void * closure, int idx)
+{
+  kmeans_job * job = (kmeans_job *) closure;
+  hist_cell * sums = job->sums[idx];
+  int i;
+
+  for (i = idx * CELLS_PER_JOB; i < (idx + 1) * CELLS_PER_JOB; i++) {
+    const hist_cell * cell = &job->hist[i];
+    int c;
+    if (cell->count <= 0.0) continue;
+    c = nearest_color(job->pal,
+                      (int) (cell->sum[0] / cell->count),
+                      (int) (cell->sum[1] / cell->count),
+                      (int) (cell->sum[2] / cell->count));
+    add_cell(&sums[c], cell);
+  }
+}
+
+static void
+kmeans_refine(const hist_cell * hist, double * palette, int numcolors,
+              int iterations)
+{
+  search_palette pal;
+  kmeans_job job;
+  int numjobs = HIST_SIZE / CELLS_PER_JOB;
+  int it, i, j;
+
+  job.sums = (hist_cell (*)[256]) malloc(numjobs * sizeof(hist_cell[256]));
+  if (job.sums == NULL) return;
+  job.hist = hist;
+  job.pal = &pal;
+
+  for (it = 0; it < iterations; it++) {
+    set_search_palette(&pal, palette, numcolors);
+    memset(job.sums, 0, numjobs * sizeof(hist_cell[256]));
+    s_parallel_for(numjobs, kmeans_assign, &job);
+    for (i = 0; i < numcolors; i++) {
+      hist_cell total;
+      memset(&total, 0, sizeof(hist_cell));
+      for (j = 0; j < numjobs; j++) add_cell(&total, &job.sums[j][i]);
+      /* colors that lost all their pixels keep their old value */
+      if (total.count > 0.0) {
+        palette[i*3+0] = total.sum[0] / total.count;
+        palette[i*3+1] = total.sum[1] / total.count;
+        palette[i*3+2] = total.sum[2] / total.count;
+      }
+    }
+  }
+  free(job.sums);
+}
+
+/*
+ * Mapping the pixels
+ */
+
+static const unsigned char bayer8[8][8] = {
+  {  0, 32,  8, 40,  2, 34, 10, 42 },
+  { 48, 16, 56, 24, 50, 18, 58, 26 },
+  { 12, 44,  4, 36, 14, 46,  6, 38 },
+  { 60, 28, 52, 20, 62, 30, 54, 22 },
+  {  3, 35, 11, 43,  1, 33,  9, 41 },
+  { 51, 19, 59, 27, 49, 17, 57, 25 },
+  { 15, 47,  7, 39, 13, 45,  5, 37 },
+  { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+typedef struct {
+  const search_palette * pal;
+  unsigned char * lut; /* histogram cell -> palette index */
+  const unsigned char * bytes;
+  int width, height, numcomponents;
+  int numjobs;
+  int dither;  /* the dither amplitude, 0 for no dithering */
+  unsigned char * indices;
+} map_job;
+
+static void
+build_lut(void * closure, int idx)
+{
+  map_job * job = (map_job *) closure;
+  int half = 1 << (HIST_SHIFT - 1);
+  int i;
+
+  /* use the center of each cell */
+  for (i = idx * CELLS_PER_JOB; i < (idx + 1) * CELLS_PER_JOB; i++) {
+    int r = ((i >> (2 * HIST_BITS)) << HIST_SHIFT) + half;
+    int g = (((i >> HIST_BITS) & ((1 << HIST_BITS) - 1)) << HIST_SHIFT) + half;
+    int b = ((i & ((1 << HIST_BITS) - 1)) << HIST_SHIFT) + half;
+    job->lut[i] = (unsigned char) nearest_color(job->pal, r, g, b);
+  }
+}
+
+#define CLAMP255(v) ((v) < 0 ? 0 : ((v) > 255 ? 255 : (v)))
+
+static void
+map_rows(void * closure, int idx)
+{
+  map_job * job = (map_job *) closure;
+  int y0 = (int) ((double) job->height * idx / job->numjobs);
+  int y1 = (int) ((double) job->height * (idx + 1) / job->numjobs);
+  int x, y, r, g, b;
+
+  for (y = y0; y < y1; y++) {
+    const unsigned char * row =
+      job->bytes + (size_t) y * job->width * job->numcomponents;
+    unsigned char * dst = job->indices + (size_t) y * job->width;
+    if (job->dither == 0) {
+      for (x = 0; x < job->width; x++) {
+        GET_RGB(row, x, job->numcomponents, r, g, b);
+        dst[x] = job->lut[HIST_INDEX(r, g, b)];
+      }
+    }
+    else {
+      for (x = 0; x < job->width; x++) {
+        int d = ((int) bayer8[y & 7][x & 7] * 2 - 63) * job->dither / 128;
+        GET_RGB(row, x, job->numcomponents, r, g, b);
+        r = CLAMP255(r + d);
+        g = CLAMP255(g + d);
+        b = CLAMP255(b + d);
+        dst[x] = job->lut[HIST_INDEX(r, g, b)];
+      }
+    }
+  }
+}
+
+#undef CLAMP255
+
+int
+s_quantize_image(const unsigned char * bytes, int width, int height,
+                 int numcomponents, int maxcolors, int iterations,
+                 int dither, unsigned char * palette, unsigned char * indices)
+{
+  double colors[256 * 3];
+  search_palette pal;
+  hist_cell * hist;
+  map_job job;
+  int numcolors, numjobs, i;
+
+  if (maxcolors < 2) maxcolors = 2;
+  if (maxcolors > 256) maxcolors = 256;
+
+  numjobs = 1;
+  if ((double) width * height >= PARALLEL_MIN_PIXELS) {
+    numjobs = simage_get_num_threads();
+    if (numjobs > height) numjobs = height;
+  }
+
+  hist = make_histogram(bytes, width, height, numcomponents, numjobs);
+  if (hist == NULL) return 0;
+  numcolors = octree_palette(hist, maxcolors, colors);
+  if (numcolors == 0) {
+    free(hist);
+    return 0;
+  }
+  if (iterations > 0) kmeans_refine(hist, colors, numcolors, iterations);
+  free(hist);
+
+  set_search_palette(&pal, colors, numcolors);
+  for (i = 0; i < numcolors; i++) {
+    palette[i*3+0] = (unsigned char) pal.r[i];
+    palette[i*3+1] = (unsigned char) pal.g[i];
+    palette[i*3+2] = (unsigned char) pal.b[i];
+  }
+
+  job.lut = (unsigned char *) malloc(HIST_SIZE);
+  if (job.lut == NULL) return 0;
+  job.pal = &pal;
+  job.bytes = bytes;
+  job.width = width;
+  job.height = height;
+  job.numcomponents = numcomponents;
+  job.numjobs = numjobs;
+  job.indices = indices;
+  /* spread the dither over about one palette step */
+  job.dither = dither ? (int) (255.0 / pow((double) numcolors, 1.0 / 3.0)) : 0;
+
+  s_parallel_for(HIST_SIZE / CELLS_PER_JOB, build_lut, &job);
+  s_parallel_for(numjobs, map_rows, &job);
+
+  free(job.lut);
+  return numcolors;
+}
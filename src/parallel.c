@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Runs independent jobs for the loaders and savers that can split
+ * their work. Each call starts its own worker threads and joins them
+ * when the jobs are done; there is no pool kept between calls. Jobs
+ * that start jobs of their own, like an image saved by a movie
+ * exporter's worker, run them on their own thread instead of
+ * multiplying the number of threads. Falls back to running the jobs
+ * one after another on the calling thread when no thread API is
+ * available.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+
+#include <simage.h>
+#include <simage_private.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#define SIMAGE_WIN32_THREADS
+#elif defined(HAVE_PTHREAD)
+#include <pthread.h>
+#include <unistd.h>
+#define SIMAGE_POSIX_THREADS
+#endif
+
+/* upper limit for the number of worker threads we'll ever start */
+#define MAX_THREADS 64
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define THREAD_LOCAL _Thread_local
+#endif
+
+static int numthreads = 0; /* 0 means "not decided yet" */
+
+static int
+num_cpus(void)
+{
+#if defined(SIMAGE_WIN32_THREADS)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int) info.dwNumberOfProcessors;
+#elif defined(SIMAGE_POSIX_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int) n : 1;
+#else
+  return 1;
+#endif
+}
+
+void
+simage_set_num_threads(int num)
+{
+  if (num > MAX_THREADS) num = MAX_THREADS;
+  numthreads = num > 0 ? num : 0;
+}
+
+int
+simage_get_num_threads(void)
+{
+#if defined(SIMAGE_WIN32_THREADS) || defined(SIMAGE_POSIX_THREADS)
+  int n = numthreads;
+  if (n == 0) n = num_cpus();
+  if (n > MAX_THREADS) n = MAX_THREADS;
+  return n < 1 ? 1 : n;
+#else
+  return 1;
+#endif
+}
+
+#if defined(SIMAGE_WIN32_THREADS) || defined(SIMAGE_POSIX_THREADS)
+
+typedef struct {
+  s_parallel_func * func;
+  void * closure;
+  int count;
+  int next;
+#ifdef SIMAGE_WIN32_THREADS
+  CRITICAL_SECTION mutex;
+#else
+  pthread_mutex_t mutex;
+#endif
+} parallel_job;
+
+static int
+fetch_index(parallel_job * job)
+{
+  int idx;
+#ifdef SIMAGE_WIN32_THREADS
+  EnterCriticalSection(&job->mutex);
+#else
+  pthread_mutex_lock(&job->mutex);
+#endif
+  idx = job->next < job->count ? job->next++ : -1;
+#ifdef SIMAGE_WIN32_THREADS
+  LeaveCriticalSection(&job->mutex);
+#else
+  pthread_mutex_unlock(&job->mutex);
+#endif
+  return idx;
+}
+
+#ifdef THREAD_LOCAL
+/* set while a thread runs jobs, so that nested calls run inline */
+static THREAD_LOCAL int inside_job = 0;
+#define INSIDE_JOB inside_job
+#else
+#define INSIDE_JOB 0
+#endif
+
+static void
+run_jobs(parallel_job * job)
+{
+  int idx;
+#ifdef THREAD_LOCAL
+  int nested = inside_job;
+  inside_job = 1;
+#endif
+  while ((idx = fetch_index(job)) >= 0) {
+    job->func(job->closure, idx);
+  }
+#ifdef THREAD_LOCAL
+  inside_job = nested;
+#endif
+}
+
+#ifdef SIMAGE_WIN32_THREADS
+static DWORD WINAPI
+worker_main(LPVOID arg)
+{
+  run_jobs((parallel_job *) arg);
+  return 0;
+}
+#else
+static void *
+worker_main(void * arg)
+{
+  run_jobs((parallel_job *) arg);
+  return NULL;
+}
+#endif
+
+struct s_parallel_task {
+  parallel_job job;
+  int started;
+#ifdef SIMAGE_WIN32_THREADS
+  HANDLE workers[MAX_THREADS];
+#else
+  pthread_t workers[MAX_THREADS];
+#endif
+};
+
+static void
+init_task(s_parallel_task * task, int count, s_parallel_func * func, void * closure)
+{
+  task->job.func = func;
+  task->job.closure = closure;
+  task->job.count = count;
+  task->job.next = 0;
+  task->started = 0;
+#ifdef SIMAGE_WIN32_THREADS
+  InitializeCriticalSection(&task->job.mutex);
+#else
+  pthread_mutex_init(&task->job.mutex, NULL);
+#endif
+}
+
+/* if we fail to start a thread, we just go on with fewer workers */
+static void
+start_workers(s_parallel_task * task, int nworkers)
+{
+  int i;
+  for (i = 0; i < nworkers; i++) {
+#ifdef SIMAGE_WIN32_THREADS
+    task->workers[task->started] = CreateThread(NULL, 0, worker_main, &task->job, 0, NULL);
+    if (task->workers[task->started] != NULL) task->started++;
+#else
+    if (pthread_create(&task->workers[task->started], NULL, worker_main, &task->job) == 0) task->started++;
+#endif
+  }
+}
+
+static void
+finish_task(s_parallel_task * task)
+{
+  int i;
+  for (i = 0; i < task->started; i++) {
+#ifdef SIMAGE_WIN32_THREADS
+    WaitForSingleObject(task->workers[i], INFINITE);
+    CloseHandle(task->workers[i]);
+#else
+    pthread_join(task->workers[i], NULL);
+#endif
+  }
+
+#ifdef SIMAGE_WIN32_THREADS
+  DeleteCriticalSection(&task->job.mutex);
+#else
+  pthread_mutex_destroy(&task->job.mutex);
+#endif
+}
+
+#endif /* SIMAGE_WIN32_THREADS || SIMAGE_POSIX_THREADS */
+
+void
+s_parallel_for(int count, s_parallel_func * func, void * closure)
+{
+#if defined(SIMAGE_WIN32_THREADS) || defined(SIMAGE_POSIX_THREADS)
+  s_parallel_task task;
+  int i, nworkers;
+
+  nworkers = simage_get_num_threads();
+  if (nworkers > count) nworkers = count;
+  nworkers--; /* the calling thread does its share of the work */
+
+  if (nworkers <= 0 || INSIDE_JOB) {
+    for (i = 0; i < count; i++) func(closure, i);
+    return;
+  }
+
+  init_task(&task, count, func, closure);
+  start_workers(&task, nworkers);
+  run_jobs(&task.job);
+  finish_task(&task);
+
+#else /* no thread support */
+  int i;
+  for (i = 0; i < count; i++) func(closure, i);
+#endif
+}
+
+s_parallel_task *
+s_parallel_start(int count, s_parallel_func * func, void * closure)
+{
+#if defined(SIMAGE_WIN32_THREADS) || defined(SIMAGE_POSIX_THREADS)
+  s_parallel_task * task;
+  int nworkers;
+
+  /* even a single job gets a thread, as the caller has other work */
+  nworkers = simage_get_num_threads();
+  task = NULL;
+  if (nworkers > 1 && count > 0 && !INSIDE_JOB) {
+    if (nworkers > count) nworkers = count;
+    task = (s_parallel_task *) malloc(sizeof(s_parallel_task));
+  }
+  if (task) {
+    init_task(task, count, func, closure);
+    start_workers(task, nworkers);
+    if (task->started > 0) return task;
+    finish_task(task);
+    free(task);
+  }
+#endif
+  /* no threads to spare, do the work right away */
+  s_parallel_for(count, func, closure);
+  return NULL;
+}
+
+void
+s_parallel_wait(s_parallel_task * task)
+{
+#if defined(SIMAGE_WIN32_THREADS) || defined(SIMAGE_POSIX_THREADS)
+  if (task) {
+    finish_task(task);
+    free(task);
+  }
+#endif
+}
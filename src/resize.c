@@ -37,6 +37,7 @@
    method should be defined with __declspec(dllexport) under
    MSWindows. */
 #include <simage.h>
+#include <simage_private.h>
 
 
 #ifndef M_PI
@@ -58,7 +59,7 @@ get_row(unsigned char * row, Image * image, int y)
   assert(y < image->ysize);
 
   memcpy(row,
-         image->data + (y * image->span),
+         image->data + (size_t) y * image->span,
          (image->bpp * image->xsize));
 }
 
@@ -94,7 +95,7 @@ put_pixel(Image * image, int x, int y, float * data)
   assert(y < image->ysize);
 
   bpp = image->bpp;
-  p = image->data + image->span * y + x * bpp;
+  p = image->data + (size_t) image->span * y + x * bpp;
   for (i = 0; i < bpp; i++) {
     val = data[i];
     if (val < 0.0f) val = 0.0f;
@@ -239,7 +240,7 @@ new_image(int xsize, int ysize, int bpp, unsigned char * data)
   img->bpp = bpp;
   img->span = xsize * bpp;
   img->data = data;
-  if (data == NULL) img->data = (unsigned char*) malloc(img->span*img->ysize);
+  if (data == NULL) img->data = (unsigned char*) malloc((size_t) img->span*img->ysize);
   return img;
 }
 
@@ -444,7 +445,7 @@ zoom(Image * dst,               /* destination image structure */
         dstptr[b] = (unsigned char) val;
       }
 #endif /* new, faster code */
-      dstptr += bpp * dstxsize;
+      dstptr += (size_t) bpp * dstxsize;
     }
   }
 
@@ -532,3 +533,61 @@ simage_resize(unsigned char * src, int width,
   free(dstimg);
   return dstdata;
 }
+
+static const struct {
+  const char * name;
+  float (*filterf)(float);
+  float support;
+} resize_filters[] = {
+  { "hermite", filter, filter_support },
+  { "box", box_filter, box_support },
+  { "triangle", triangle_filter, triangle_support },
+  { "bell", bell_filter, bell_support },
+  { "b-spline", B_spline_filter, B_spline_support },
+  { "lanczos3", Lanczos3_filter, Lanczos3_support },
+  { "mitchell", Mitchell_filter, (float) Mitchell_support },
+  { NULL, NULL, 0.0f }
+};
+
+unsigned char *
+s_resize_filtered(const unsigned char * src, int width,
+                  int height, int num_comp,
+                  int newwidth, int newheight,
+                  const char * filtername)
+{
+  return s_resize_strided(src, width, height, num_comp, width * num_comp,
+                          newwidth, newheight, filtername);
+}
+
+unsigned char *
+s_resize_strided(const unsigned char * src, int width,
+                 int height, int num_comp, int stride,
+                 int newwidth, int newheight,
+                 const char * filtername)
+{
+  unsigned char * dstdata;
+  Image * srcimg, * dstimg;
+  int i;
+
+  if (filtername == NULL) filtername = "bell";
+  for (i = 0; resize_filters[i].name; i++) {
+    if (strcmp(resize_filters[i].name, filtername) == 0) break;
+  }
+  if (resize_filters[i].name == NULL) return NULL;
+
+  srcimg = new_image(width, height, num_comp, (unsigned char *) src);
+  srcimg->span = stride;
+  dstimg = new_image(newwidth, newheight, num_comp, NULL);
+  if (dstimg->data == NULL) {
+    free(srcimg);
+    free(dstimg);
+    return NULL;
+  }
+
+  zoom(dstimg, srcimg, resize_filters[i].filterf, resize_filters[i].support);
+
+  dstdata = dstimg->data;
+  free(srcimg);
+  free(dstimg);
+  return dstdata;
+}
@@ -82,6 +82,14 @@ static loader_data gif_loader;
 #include <simage_xwd.h>
 static loader_data xwd_loader;
 #endif /* SIMAGE_XWD_SUPPORT */
+#ifdef SIMAGE_PNM_SUPPORT
+#include <simage_pnm.h>
+static loader_data pnm_loader;
+#endif /* SIMAGE_PNM_SUPPORT */
+#ifdef SIMAGE_QOI_SUPPORT
+#include <simage_qoi.h>
+static loader_data qoi_loader;
+#endif /* SIMAGE_QOI_SUPPORT */
 #ifdef SIMAGE_QIMAGE_SUPPORT
 #include <simage_qimage.h>
 static loader_data qimage_loader;
@@ -197,6 +205,9 @@ add_internal_loaders(void)
                simage_png_identify,
                simage_png_error,
                1, 0);
+    png_loader.openfuncs.open_func = simage_png_open;
+    png_loader.openfuncs.close_func = simage_png_close;
+    png_loader.openfuncs.read_line_func = simage_png_read_line;
 #endif /* HAVE_PNGLIB */
 #ifdef SIMAGE_TGA_SUPPORT
     add_loader(&targa_loader,
@@ -204,6 +215,9 @@ add_internal_loaders(void)
                simage_tga_identify,
                simage_tga_error,
                1, 0);
+    targa_loader.openfuncs.open_func = simage_tga_open;
+    targa_loader.openfuncs.close_func = simage_tga_close;
+    targa_loader.openfuncs.read_line_func = simage_tga_read_line;
 #endif /* SIMAGE_TGA_SUPPORT */
 #ifdef HAVE_TIFFLIB
     add_loader(&tiff_loader,
@@ -214,6 +228,7 @@ add_internal_loaders(void)
     tiff_loader.openfuncs.open_func = simage_tiff_open;
     tiff_loader.openfuncs.close_func = simage_tiff_close;
     tiff_loader.openfuncs.read_line_func = simage_tiff_read_line;
+    tiff_loader.openfuncs.read_region_func = simage_tiff_read_region;
 #endif /* HAVE_TIFFLIB */
 #ifdef HAVE_JASPER
     add_loader(&jasper_loader,
@@ -249,6 +264,10 @@ add_internal_loaders(void)
                simage_gif_identify,
                simage_gif_error,
                1, 0);
+    gif_loader.openfuncs.open_func = simage_gif_open;
+    gif_loader.openfuncs.close_func = simage_gif_close;
+    gif_loader.openfuncs.read_line_func = simage_gif_read_line;
+    gif_loader.openfuncs.palette_func = simage_gif_palette;
 #endif /* HAVE_GIFLIB */
 #ifdef SIMAGE_XWD_SUPPORT
     add_loader(&xwd_loader,
@@ -256,7 +275,30 @@ add_internal_loaders(void)
                simage_xwd_identify,
                simage_xwd_error,
                1, 0);
+    xwd_loader.openfuncs.open_func = simage_xwd_open;
+    xwd_loader.openfuncs.close_func = simage_xwd_close;
+    xwd_loader.openfuncs.read_line_func = simage_xwd_read_line;
 #endif /* SIMAGE_XWD_SUPPORT */
+#ifdef SIMAGE_PNM_SUPPORT
+    add_loader(&pnm_loader,
+               simage_pnm_load,
+               simage_pnm_identify,
+               simage_pnm_error,
+               1, 0);
+    pnm_loader.openfuncs.open_func = simage_pnm_open;
+    pnm_loader.openfuncs.close_func = simage_pnm_close;
+    pnm_loader.openfuncs.read_line_func = simage_pnm_read_line;
+#endif /* SIMAGE_PNM_SUPPORT */
+#ifdef SIMAGE_QOI_SUPPORT
+    add_loader(&qoi_loader,
+               simage_qoi_load,
+               simage_qoi_identify,
+               simage_qoi_error,
+               1, 0);
+    qoi_loader.openfuncs.open_func = simage_qoi_open;
+    qoi_loader.openfuncs.close_func = simage_qoi_close;
+    qoi_loader.openfuncs.read_line_func = simage_qoi_read_line;
+#endif /* SIMAGE_QOI_SUPPORT */
 #ifdef SIMAGE_QIMAGE_SUPPORT
     add_loader(&qimage_loader,
                simage_qimage_load,
@@ -436,6 +478,9 @@ s_image_open(const char * filename, int oktoreadall)
       image->openfilename = (char*) malloc(strlen(filename)+1);
       strcpy(image->openfilename, filename);
       memcpy(&image->openfuncs, &loader->openfuncs, sizeof(struct simage_open_funcs));
+      image->stride = w * nc;
+      image->parent = NULL;
+      image->refcount = 1;
       return image;
     }
   }
@@ -454,7 +499,7 @@ s_image_read_line(s_image * image,
 {
   if (image->data) {
     int bpr = image->width*image->components;
-    memcpy(buf, image->data + bpr*line, bpr);
+    memcpy(buf, image->data + (size_t) image->stride*line, bpr);
     return 1;
   }
   else if (image->opendata && image->openfuncs.read_line_func) {
@@ -475,6 +520,8 @@ s_image_read_line(s_image * image,
                                       &image->components);
 
       if (image->data) {
+        image->didalloc = 1;
+        image->stride = image->width*image->components;
         return s_image_read_line(image, line, buf);
       }
     }
@@ -483,6 +530,75 @@ s_image_read_line(s_image * image,
   return 0;
 }
 
+int
+s_image_read_region(s_image * image,
+                    int x, int y, int w, int h,
+                    unsigned char * buf)
+{
+  int i, nc, bpr;
+  unsigned char * line;
+
+  if (x < 0 || y < 0 || w <= 0 || h <= 0 ||
+      x + w > image->width || y + h > image->height) return 0;
+
+  nc = image->components;
+  bpr = w * nc;
+
+  if (image->data) {
+    for (i = 0; i < h; i++) {
+      memcpy(buf + i*bpr, image->data + (size_t) (y+i)*image->stride + x*nc, bpr);
+    }
+    return 1;
+  }
+  if (image->opendata && image->openfuncs.read_region_func &&
+      image->openfuncs.read_region_func(image->opendata, x, y, w, h, buf)) {
+    return 1;
+  }
+
+  /* read the region line by line */
+  line = (unsigned char *) malloc(image->width * nc);
+  if (line == NULL) return 0;
+  for (i = 0; i < h; i++) {
+    if (!s_image_read_line(image, y+i, line)) {
+      free(line);
+      return 0;
+    }
+    memcpy(buf + i*bpr, line + x*nc, bpr);
+  }
+  free(line);
+  return 1;
+}
+
+static int palettemode = SIMAGE_PALETTE_EXPAND_RGBA;
+
+void
+simage_set_palette_mode(int mode)
+{
+  palettemode = mode;
+}
+
+int
+simage_get_palette_mode(void)
+{
+  return palettemode;
+}
+
+int
+s_image_get_palette(s_image * image, unsigned char * palette)
+{
+  loader_data * loader;
+
+  if (image == NULL || image->components != 1 || image->openfilename == NULL) {
+    return 0;
+  }
+  add_internal_loaders();
+  loader = find_loader(image->openfilename);
+  if (loader && loader->openfuncs.palette_func) {
+    return loader->openfuncs.palette_func(image->openfilename, palette);
+  }
+  return 0;
+}
+
 /* new simage 1.7 methods */
 
 static s_dlopen_func *dlopen = NULL;
@@ -48,6 +48,11 @@ s_image_create(int w, int h, int components,
   image->openfilename = NULL;
   memset(&image->openfuncs, 0, sizeof(struct simage_open_funcs));
 
+  /* needed for simage 1.9 */
+  image->stride = w*components;
+  image->parent = NULL;
+  image->refcount = 1;
+
   /* return image struct */
   return (s_image*) image;
 }
@@ -56,6 +61,11 @@ void
 s_image_destroy(s_image * image)
 {
   if (image) {
+    s_image * parent = image->parent;
+
+    /* views keep their parent's data alive */
+    if (--image->refcount > 0) return;
+
     if (image->didalloc) free((void*)image->data);
 
     if (image->opendata) {
@@ -65,9 +75,40 @@ s_image_destroy(s_image * image)
       free((void*) image->openfilename);
     }
     free((void*)image);
+
+    /* release the view's reference to its parent */
+    s_image_destroy(parent);
   }
 }
 
+s_image *
+s_image_create_view(s_image * parent, int x, int y, int w, int h)
+{
+  s_image * view;
+  unsigned char * data;
+
+  if (parent == NULL || x < 0 || y < 0 || w <= 0 || h <= 0 ||
+      x + w > parent->width || y + h > parent->height) return NULL;
+
+  data = s_image_data(parent);
+  if (data == NULL) return NULL;
+
+  view = s_image_create(w, h, parent->components,
+                        data + (size_t) y*parent->stride + x*parent->components);
+  view->stride = parent->stride;
+  view->order = parent->order;
+  view->parent = parent;
+  parent->refcount++;
+  return view;
+}
+
+int
+s_image_stride(s_image * image)
+{
+  if (image) return image->stride;
+  return 0;
+}
+
 int
 s_image_width(s_image * image)
 {
@@ -110,11 +151,21 @@ s_image_data(s_image * image)
   if (image) {
     if (image->opendata && image->data == NULL) {
       int i;
-      image->data = (unsigned char *) malloc(image->width*image->height*image->components);
-      image->didalloc = 1;
+      /* read into a separate buffer, or s_image_read_line() would
+         copy from it */
+      unsigned char * data = (unsigned char *)
+        malloc((size_t) image->width*image->height*image->components);
+      if (data == NULL) return NULL;
       for (i = 0; i < image->height; i++) {
-        (void) s_image_read_line(image, i,
-                                 image->data+image->width*image->components);
+        (void) s_image_read_line(image, i, data + (size_t) i*image->stride);
+      }
+      if (image->data) {
+        /* s_image_read_line() fell back to loading the whole image */
+        free(data);
+      }
+      else {
+        image->data = data;
+        image->didalloc = 1;
       }
     }
     return image->data;
@@ -156,14 +207,40 @@ s_image_set(s_image * image, int w, int h, int components,
       image->didalloc = 0;
     }
   }
+  image->stride = w*components;
+  image->order = SIMAGE_ORDER_RGB;
+}
+
+s_image *
+s_image_prepare(s_image * image, int w, int h, int components)
+{
+  unsigned char * data;
+
+  if (image == NULL) {
+    image = s_image_create(w, h, components, NULL);
+    if (image->data == NULL) {
+      s_image_destroy(image);
+      return NULL;
+    }
+    return image;
+  }
+  if (image->width != w || image->height != h ||
+      image->components != components || image->data == NULL ||
+      image->stride != w*components) {
+    data = (unsigned char *) malloc((size_t) w*h*components);
+    if (data == NULL) return NULL;
+    s_image_set(image, w, h, components, data, 0);
+    image->didalloc = 1;
+  }
   image->order = SIMAGE_ORDER_RGB;
+  return image;
 }
 
 s_image *
 s_image_load(const char * filename, s_image * prealloc /* | NULL */)
 {
   unsigned char * data;
-  int w,h,nc;
+  int w,h,nc,i;
 
   data = simage_read_image(filename, &w, &h, &nc);
   if (data == NULL) return NULL;
@@ -175,8 +252,11 @@ s_image_load(const char * filename, s_image * prealloc /* | NULL */)
     prealloc->didalloc = 1; /* we did alloc this data */
   }
   else {
-    /* copy into preallocated buffer */
-    memcpy(prealloc->data, data, w*h*nc);
+    /* copy into preallocated buffer, which may be a view */
+    for (i = 0; i < h; i++) {
+      memcpy(prealloc->data + (size_t) i*prealloc->stride,
+             data + (size_t) i*w*nc, w*nc);
+    }
 
     /* we don't need this copy any more */
     simage_free_image(data);
@@ -192,9 +272,12 @@ s_image_save(const char * filename, s_image * image,
              s_params * params /* | NULL */)
 {
   char * ext = NULL;
+  s_image * packed;
+  int ret;
+
   if (params != NULL) {
-    s_params_get(params, S_STRING_PARAM_TYPE,
-                 "file type", &ext,
+    s_params_get(params,
+                 "file type", S_STRING_PARAM_TYPE, &ext,
                  NULL);
   }
   if (ext == NULL) {
@@ -205,10 +288,60 @@ s_image_save(const char * filename, s_image * image,
     ext++;
   }
 
-  return simage_save_image(filename,
-                           s_image_data(image),
-                           image->width,
-                           image->height,
-                           image->components,
-                           ext);
+  /* the savers expect tightly packed lines */
+  packed = s_image_packed(image);
+  if (packed == NULL) return 0;
+
+  ret = simage_save_image_ex(filename,
+                             s_image_data(packed),
+                             packed->width,
+                             packed->height,
+                             packed->components,
+                             ext,
+                             params);
+  if (packed != image) s_image_destroy(packed);
+  return ret;
+}
+
+s_image *
+s_image_packed(s_image * image)
+{
+  s_image * packed;
+  unsigned char * src;
+  int i, bpr;
+
+  src = s_image_data(image);
+  bpr = image->width*image->components;
+  if (src == NULL || image->stride == bpr) return image;
+
+  packed = s_image_create(image->width, image->height, image->components, NULL);
+  if (packed->data == NULL) {
+    s_image_destroy(packed);
+    return NULL;
+  }
+  for (i = 0; i < image->height; i++) {
+    memcpy(packed->data + (size_t) i*bpr, src + (size_t) i*image->stride, bpr);
+  }
+  packed->order = image->order;
+  return packed;
+}
+
+s_image *
+s_image_resize(s_image * image, int newwidth, int newheight)
+{
+  s_image * resized;
+  unsigned char * src, * data;
+
+  src = s_image_data(image);
+  if (src == NULL || newwidth <= 0 || newheight <= 0) return NULL;
+
+  data = s_resize_strided(src, image->width, image->height,
+                          image->components, image->stride,
+                          newwidth, newheight, NULL);
+  if (data == NULL) return NULL;
+
+  resized = s_image_create(newwidth, newheight, image->components, data);
+  resized->didalloc = 1; /* we did alloc this data */
+  resized->order = image->order;
+  return resized;
 }
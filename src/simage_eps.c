@@ -23,10 +23,18 @@
 #include <simage_eps.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <math.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
+
 #define ERR_NO_ERROR          0
 #define ERR_OPEN_WRITE        1
+#define ERR_MEM               2
+#define ERR_WRITE             3
 
 static int epserror = ERR_NO_ERROR;
 
@@ -37,90 +45,242 @@ simage_eps_error(char * buffer, int buflen)
     case ERR_OPEN_WRITE:
       strncpy(buffer, "EPS loader: Error opening file for writing", buflen);
       break;
+    case ERR_MEM:
+      strncpy(buffer, "EPS saver: Out of memory", buflen);
+      break;
+    case ERR_WRITE:
+      strncpy(buffer, "EPS saver: Error writing file", buflen);
+      break;
   }
   return epserror;
 }
 
+/*
+ * The whole file is built in memory and written with a single
+ * fwrite().
+ */
+
+typedef struct {
+  unsigned char * data;
+  size_t len;
+  size_t size;
+  int failed;
+} eps_buffer;
+
+/* makes room for n more bytes */
 static int
-encode_ascii85(const unsigned char * in, unsigned char * out)
+buffer_reserve(eps_buffer * buf, size_t n)
 {
-  unsigned int data =
-    ((unsigned int)(in[0])<<24) |
-    ((unsigned int)(in[1])<<16) |
-    ((unsigned int)(in[2])<< 8) |
-    ((unsigned int)(in[3]));
-
-  if (data == 0) {
-    out[0] = 'z';
-    return 1;
+  unsigned char * data;
+  size_t size;
+
+  if (buf->failed) return 0;
+  if (buf->len + n <= buf->size) return 1;
+  size = buf->size ? buf->size : 4096;
+  while (size < buf->len + n) size *= 2;
+  data = (unsigned char *) realloc(buf->data, size);
+  if (data == NULL) {
+    buf->failed = 1;
+    return 0;
   }
-  out[4] = (unsigned char) (data%85 + '!');
-  data /= 85;
-  out[3] = (unsigned char) (data%85 + '!');
-  data /= 85;
-  out[2] = (unsigned char) (data%85 + '!');
-  data /= 85;
-  out[1] = (unsigned char) (data%85 + '!');
-  data /= 85;
-  out[0] = (unsigned char) (data%85 + '!');
-  return 5;
+  buf->data = data;
+  buf->size = size;
+  return 1;
+}
+
+static void
+buffer_append(eps_buffer * buf, const void * data, size_t n)
+{
+  if (!buffer_reserve(buf, n)) return;
+  memcpy(buf->data + buf->len, data, n);
+  buf->len += n;
 }
 
 static void
-output_ascii85(FILE * fp,
-               const unsigned char val,
-               unsigned char * tuple,
-               unsigned char * linebuf,
-               int  * tuplecnt, int * linecnt,
-               int rowlen,
-               int flush)
+buffer_printf(eps_buffer * buf, const char * format, ...)
 {
-  int i;
-  if (flush) {
-    /* fill up tuple */
-    for (i = *tuplecnt; i < 4; i++) tuple[i] = 0;
+  char line[256];
+  va_list args;
+  int n;
+
+  va_start(args, format);
+  n = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (n > 0) buffer_append(buf, line, n < (int) sizeof(line) ? (size_t) n : (size_t) (sizeof(line) - 1));
+}
+
+/*
+ * ASCII85. The groups of a block are first converted to five digits
+ * each in a loop the compiler can vectorize, then packed, with 'z' for
+ * all zero groups, and split into lines.
+ */
+
+#define ROWLEN 72
+
+/* input bytes encoded at a time, a multiple of 4 */
+#define ASCII85_BLOCK (16 * 1024)
+
+static void
+encode_ascii85_groups(const unsigned char * in, size_t numgroups,
+                      unsigned char * out)
+{
+  size_t i;
+  for (i = 0; i < numgroups; i++) {
+    unsigned int data =
+      ((unsigned int)(in[i*4])<<24) |
+      ((unsigned int)(in[i*4+1])<<16) |
+      ((unsigned int)(in[i*4+2])<< 8) |
+      ((unsigned int)(in[i*4+3]));
+    out[i*5+4] = (unsigned char) (data%85 + '!');
+    data /= 85;
+    out[i*5+3] = (unsigned char) (data%85 + '!');
+    data /= 85;
+    out[i*5+2] = (unsigned char) (data%85 + '!');
+    data /= 85;
+    out[i*5+1] = (unsigned char) (data%85 + '!');
+    data /= 85;
+    out[i*5] = (unsigned char) (data + '!');
   }
-  else {
-    tuple[*tuplecnt] = val;
-    (*tuplecnt)++;
+}
+
+/* appends text to buf, starting a new line every ROWLEN characters */
+static void
+append_lines(eps_buffer * buf, const unsigned char * text, size_t n,
+             int * linecnt)
+{
+  size_t len;
+
+  /* room for the text and the newlines */
+  if (!buffer_reserve(buf, n + n / ROWLEN + 1)) return;
+  while (n > 0) {
+    len = ROWLEN - *linecnt;
+    if (len > n) len = n;
+    memcpy(buf->data + buf->len, text, len);
+    buf->len += len;
+    text += len;
+    n -= len;
+    *linecnt += (int) len;
+    if (*linecnt == ROWLEN) {
+      buf->data[buf->len++] = '\n';
+      *linecnt = 0;
+    }
   }
-  if (flush || *tuplecnt == 4) {
-    if (*tuplecnt) {
-      int add = encode_ascii85(tuple, linebuf + *linecnt);
-      if (flush) {
-        if (add == 1) {
-          for (i = 0; i < 5; i++) linebuf[*linecnt+i] = '!';
-        }
-        *linecnt += *tuplecnt + 1;
+}
+
+static int
+write_ascii85(eps_buffer * buf, const unsigned char * data, size_t n)
+{
+  unsigned char * digits, * packed;
+  unsigned char tuple[4];
+  size_t done, len, numgroups, i, j;
+  int linecnt = 0;
+
+  digits = (unsigned char *) malloc(ASCII85_BLOCK / 4 * 5 * 2);
+  if (digits == NULL) return 0;
+  packed = digits + ASCII85_BLOCK / 4 * 5;
+
+  for (done = 0; done < n; done += len) {
+    len = n - done < ASCII85_BLOCK ? n - done : ASCII85_BLOCK;
+    numgroups = len / 4;
+    encode_ascii85_groups(data + done, numgroups, digits);
+    for (i = 0, j = 0; i < numgroups; i++) {
+      if (data[done + i*4] == 0 && data[done + i*4+1] == 0 &&
+          data[done + i*4+2] == 0 && data[done + i*4+3] == 0) {
+        packed[j++] = 'z';
       }
-      else *linecnt += add;
-      *tuplecnt = 0;
-    }
-    if (*linecnt >= rowlen) {
-      unsigned char store = linebuf[rowlen];
-      linebuf[rowlen] = 0;
-      fprintf(fp, "%s\n", linebuf);
-      linebuf[rowlen] = store;
-      for (i = rowlen; i < *linecnt; i++) {
-        linebuf[i-rowlen] = linebuf[i];
+      else {
+        memcpy(packed + j, digits + i*5, 5);
+        j += 5;
       }
-      *linecnt -= rowlen;
     }
-    if (flush && *linecnt) {
-      linebuf[*linecnt] = 0;
-      fprintf(fp, "%s\n", linebuf);
+    /* the last group is padded with zeros, and never written as 'z' */
+    if (len & 3) {
+      memset(tuple, 0, 4);
+      memcpy(tuple, data + done + numgroups * 4, len & 3);
+      encode_ascii85_groups(tuple, 1, digits);
+      memcpy(packed + j, digits, (len & 3) + 1);
+      j += (len & 3) + 1;
     }
+    append_lines(buf, packed, j, &linecnt);
   }
+  free(digits);
+  if (linecnt) buffer_append(buf, "\n", 1);
+  return 1;
 }
 
-static void
-flush_ascii85(FILE * fp,
-              unsigned char * tuple,
-              unsigned char * linebuf,
-              int * tuplecnt, int * linecnt,
-              int rowlen)
+/*
+ * RunLengthDecode data. A length byte of 0-127 is followed by that
+ * many plus one bytes to copy, and 129-255 by a byte to repeat 257
+ * minus length times. 128 ends the data.
+ */
+
+static size_t
+encode_runlength(const unsigned char * src, size_t n, unsigned char * dst)
+{
+  unsigned char * start = dst;
+  size_t x, len;
+
+  x = 0;
+  while (x < n) {
+    len = 1;
+    while (x + len < n && len < 128 && src[x + len] == src[x]) len++;
+    if (len > 2) {
+      *dst++ = (unsigned char) (257 - len);
+      *dst++ = src[x];
+    }
+    else {
+      /* copy bytes up to where the next run starts */
+      len = 1;
+      while (x + len < n && len < 128 &&
+             !(x + len + 2 < n && src[x + len] == src[x + len + 1] &&
+               src[x + len] == src[x + len + 2])) len++;
+      *dst++ = (unsigned char) (len - 1);
+      memcpy(dst, src + x, len);
+      dst += len;
+    }
+    x += len;
+  }
+  *dst++ = 128;
+  return dst - start;
+}
+
+#define COMPRESS_NONE 0
+#define COMPRESS_RLE  1
+#define COMPRESS_FLATE 2
+
+/* returns the (possibly compressed) image data in *out. *out is set to
+   data when it's passed through unchanged */
+static int
+compress_data(const unsigned char * data, size_t n, int compression,
+              int level, unsigned char ** out, size_t * outlen)
 {
-  output_ascii85(fp, 0, tuple, linebuf, tuplecnt, linecnt, rowlen, 1);
+#ifdef HAVE_ZLIB
+  uLongf len;
+
+  if (compression == COMPRESS_FLATE) {
+    len = compressBound((uLong) n);
+    *out = (unsigned char *) malloc(len);
+    if (*out == NULL) return 0;
+    if (compress2(*out, &len, data, (uLong) n, level) != Z_OK) {
+      free(*out);
+      return 0;
+    }
+    *outlen = len;
+    return 1;
+  }
+#else /* !HAVE_ZLIB */
+  (void) level;
+#endif /* !HAVE_ZLIB */
+  if (compression == COMPRESS_RLE) {
+    /* one length byte for each 128 bytes at worst, and the end marker */
+    *out = (unsigned char *) malloc(n + n / 128 + 2);
+    if (*out == NULL) return 0;
+    *outlen = encode_runlength(data, n, *out);
+    return 1;
+  }
+  *out = (unsigned char *) data;
+  *outlen = n;
+  return 1;
 }
 
 int
@@ -128,7 +288,8 @@ simage_eps_save(const char *filename,
                 const unsigned char * src,
                 int width,
                 int height,
-                int nc)
+                int nc,
+                s_params * params)
 
 {
   /*
@@ -136,27 +297,46 @@ simage_eps_save(const char *filename,
     If you find a bug here, remember to correct it in Coin also.
   */
 
-#define ROWLEN 72
-
   int size[2];
   float inchsize[2];
   int pixelsize[2];
   int scaledsize[2];
   float defaultdpi;
   float dpi;
-  int num;
+  size_t num, i;
   int chan;
-  unsigned char tuple[4];
-  unsigned char linebuf[ROWLEN+5];
-  int tuplecnt;
-  int linecnt;
-  int cnt;
-  FILE * fp = fopen(filename, "wb");
+  int binary, compression, level;
+  char * str;
+  unsigned char * samples;
+  unsigned char * data;
+  size_t datalen;
+  char operators[256];
+  eps_buffer buf;
+  FILE * fp;
 
-  if (fp == NULL) {
-    epserror = ERR_OPEN_WRITE;
-    return 0;
+  epserror = ERR_NO_ERROR;
+
+  binary = 0;
+  compression = COMPRESS_NONE;
+  level = 6;
+  if (params) {
+    if (s_params_get(params, "encoding", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+      if (strcmp(str, "binary") == 0) binary = 1;
+      else if (strcmp(str, "ascii85") == 0) binary = 0;
+    }
+    if (s_params_get(params, "compression", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+      if (strcmp(str, "none") == 0) compression = COMPRESS_NONE;
+      else if (strcmp(str, "rle") == 0) compression = COMPRESS_RLE;
+      else if (strcmp(str, "flate") == 0) compression = COMPRESS_FLATE;
+    }
+    if (s_params_get(params, "compression level", S_INTEGER_PARAM_TYPE, &level, NULL)) {
+      if (level < 0) level = 0;
+      if (level > 9) level = 9;
+    }
   }
+#ifndef HAVE_ZLIB
+  if (compression == COMPRESS_FLATE) compression = COMPRESS_RLE;
+#endif /* !HAVE_ZLIB */
 
   size[0] = width;
   size[1] = height;
@@ -171,92 +351,122 @@ simage_eps_save(const char *filename,
   scaledsize[0] = (int) ceil(((double)size[0])*defaultdpi/dpi);
   scaledsize[1] = (int) ceil(((double)size[1])*defaultdpi/dpi);
 
-  fprintf(fp, "%%!PS-Adobe-2.0 EPSF-1.2\n");
-  fprintf(fp, "%%%%Pages: 1\n");
-  fprintf(fp, "%%%%PageOrder: Ascend\n");
-  fprintf(fp, "%%%%BoundingBox: 0 %d %d %d\n",
-          pixelsize[1]-scaledsize[1],
-          scaledsize[0],
-          pixelsize[1]);
-  fprintf(fp, "%%%%Creator: simage <https://coin3d.github.io>\n");
-  fprintf(fp, "%%%%EndComments\n");
-
-  fprintf(fp, "\n");
-  fprintf(fp, "/origstate save def\n");
-  fprintf(fp, "\n");
-  fprintf(fp, "%% workaround for bug in some PS interpreters\n");
-  fprintf(fp, "%% which doesn't skip the ASCII85 EOD marker.\n");
-  fprintf(fp, "/~ {currentfile read pop pop} def\n\n");
-  fprintf(fp, "/image_wd %d def\n", size[0]);
-  fprintf(fp, "/image_ht %d def\n", size[1]);
-  fprintf(fp, "/pos_wd %d def\n", size[0]);
-  fprintf(fp, "/pos_ht %d def\n", size[1]);
-  fprintf(fp, "/image_dpi %g def\n", dpi);
-  fprintf(fp, "/image_scale %g image_dpi div def\n", defaultdpi);
-  fprintf(fp, "/image_chan %d def\n", chan);
-  fprintf(fp, "/xpos_offset 0 image_scale mul def\n");
-  fprintf(fp, "/ypos_offset 0 image_scale mul def\n");
-  fprintf(fp, "/pix_buf_size %d def\n\n", size[0]*chan);
-  fprintf(fp, "/page_ht %g %g mul def\n", inchsize[1], defaultdpi);
-  fprintf(fp, "/page_wd %g %g mul def\n", inchsize[0], defaultdpi);
-  fprintf(fp, "/image_xpos 0 def\n");
-  fprintf(fp, "/image_ypos page_ht pos_ht image_scale mul sub def\n");
-  fprintf(fp, "image_xpos xpos_offset add image_ypos ypos_offset add translate\n");
-  fprintf(fp, "\n");
-  fprintf(fp, "/pix pix_buf_size string def\n");
-  fprintf(fp, "image_wd image_scale mul image_ht image_scale mul scale\n");
-  fprintf(fp, "\n");
-  fprintf(fp, "image_wd image_ht 8\n");
-  fprintf(fp, "[image_wd 0 0 image_ht 0 0]\n");
-  fprintf(fp, "currentfile\n");
-  fprintf(fp, "/ASCII85Decode filter\n");
-  /* fprintf(fp, "/RunLengthDecode filter\n"); FIXME: add later */
-  if (chan == 3) fprintf(fp, "false 3\ncolorimage\n");
-  else fprintf(fp,"image\n");
-
-  num = size[0] * size[1];
-  tuplecnt = 0;
-  linecnt = 0;
-  cnt = 0;
-
-  while (cnt < num) {
-    switch (nc) {
-      default: /* avoid warning */
-      case 1:
-        output_ascii85(fp, src[cnt], tuple, linebuf, &tuplecnt, &linecnt, ROWLEN, 0);
-        break;
-      case 2:
-        output_ascii85(fp, src[cnt*2], tuple, linebuf, &tuplecnt, &linecnt, ROWLEN, 0);
-        break;
-      case 3:
-        output_ascii85(fp, src[cnt*3], tuple, linebuf, &tuplecnt, &linecnt, ROWLEN, 0);
-        output_ascii85(fp, src[cnt*3+1], tuple, linebuf, &tuplecnt, &linecnt, ROWLEN, 0);
-        output_ascii85(fp, src[cnt*3+2], tuple, linebuf, &tuplecnt, &linecnt, ROWLEN, 0);
-        break;
-      case 4:
-        output_ascii85(fp, src[cnt*4], tuple, linebuf, &tuplecnt, &linecnt, ROWLEN, 0);
-        output_ascii85(fp, src[cnt*4+1], tuple, linebuf, &tuplecnt, &linecnt, ROWLEN, 0);
-        output_ascii85(fp, src[cnt*4+2], tuple, linebuf, &tuplecnt, &linecnt, ROWLEN, 0);
-        break;
+  /* the samples, without alpha */
+  num = (size_t) size[0] * size[1];
+  samples = (unsigned char *) src;
+  if (nc == 2 || nc == 4) {
+    samples = (unsigned char *) malloc(num * chan);
+    if (samples == NULL) {
+      epserror = ERR_MEM;
+      return 0;
+    }
+    if (nc == 2) {
+      for (i = 0; i < num; i++) samples[i] = src[i*2];
+    }
+    else {
+      for (i = 0; i < num; i++) {
+        samples[i*3] = src[i*4];
+        samples[i*3+1] = src[i*4+1];
+        samples[i*3+2] = src[i*4+2];
+      }
     }
-    cnt++;
   }
 
-  /* flush data in ascii85 encoder */
-  flush_ascii85(fp, tuple, linebuf, &tuplecnt, &linecnt, ROWLEN);
+  if (!compress_data(samples, num * chan, compression, level, &data, &datalen)) {
+    if (samples != src) free(samples);
+    epserror = ERR_MEM;
+    return 0;
+  }
+
+  memset(&buf, 0, sizeof(buf));
+  buffer_printf(&buf, "%%!PS-Adobe-2.0 EPSF-1.2\n");
+  buffer_printf(&buf, "%%%%Pages: 1\n");
+  buffer_printf(&buf, "%%%%PageOrder: Ascend\n");
+  buffer_printf(&buf, "%%%%BoundingBox: 0 %d %d %d\n",
+                pixelsize[1]-scaledsize[1],
+                scaledsize[0],
+                pixelsize[1]);
+  /* the default output is left as it has always been */
+  if (compression != COMPRESS_NONE) {
+    buffer_printf(&buf, "%%%%LanguageLevel: %d\n",
+                  compression == COMPRESS_FLATE ? 3 : 2);
+  }
+  buffer_printf(&buf, "%%%%Creator: simage <https://coin3d.github.io>\n");
+  buffer_printf(&buf, "%%%%EndComments\n");
 
-  fprintf(fp, "~>\n\n"); /* ASCII85 EOD marker */
-  fprintf(fp, "origstate restore\n");
-  fprintf(fp, "\n");
-  fprintf(fp, "%%%%Trailer\n");
-  fprintf(fp, "\n");
-  fprintf(fp, "%%%%EOF\n");
+  buffer_printf(&buf, "\n");
+  buffer_printf(&buf, "/origstate save def\n");
+  buffer_printf(&buf, "\n");
+  buffer_printf(&buf, "%% workaround for bug in some PS interpreters\n");
+  buffer_printf(&buf, "%% which doesn't skip the ASCII85 EOD marker.\n");
+  buffer_printf(&buf, "/~ {currentfile read pop pop} def\n\n");
+  buffer_printf(&buf, "/image_wd %d def\n", size[0]);
+  buffer_printf(&buf, "/image_ht %d def\n", size[1]);
+  buffer_printf(&buf, "/pos_wd %d def\n", size[0]);
+  buffer_printf(&buf, "/pos_ht %d def\n", size[1]);
+  buffer_printf(&buf, "/image_dpi %g def\n", dpi);
+  buffer_printf(&buf, "/image_scale %g image_dpi div def\n", defaultdpi);
+  buffer_printf(&buf, "/image_chan %d def\n", chan);
+  buffer_printf(&buf, "/xpos_offset 0 image_scale mul def\n");
+  buffer_printf(&buf, "/ypos_offset 0 image_scale mul def\n");
+  buffer_printf(&buf, "/pix_buf_size %d def\n\n", size[0]*chan);
+  buffer_printf(&buf, "/page_ht %g %g mul def\n", inchsize[1], defaultdpi);
+  buffer_printf(&buf, "/page_wd %g %g mul def\n", inchsize[0], defaultdpi);
+  buffer_printf(&buf, "/image_xpos 0 def\n");
+  buffer_printf(&buf, "/image_ypos page_ht pos_ht image_scale mul sub def\n");
+  buffer_printf(&buf, "image_xpos xpos_offset add image_ypos ypos_offset add translate\n");
+  buffer_printf(&buf, "\n");
+  buffer_printf(&buf, "/pix pix_buf_size string def\n");
+  buffer_printf(&buf, "image_wd image_scale mul image_ht image_scale mul scale\n");
+  buffer_printf(&buf, "\n");
 
-  fclose(fp);
-  return 1;
+  /* the operators reading the data are counted as part of it by
+     %%BeginData */
+  sprintf(operators, "image_wd image_ht 8\n[image_wd 0 0 image_ht 0 0]\ncurrentfile\n%s%s%s",
+          binary ? "" : "/ASCII85Decode filter\n",
+          compression == COMPRESS_RLE ? "/RunLengthDecode filter\n" :
+          compression == COMPRESS_FLATE ? "/FlateDecode filter\n" : "",
+          chan == 3 ? "false 3\ncolorimage\n" : "image\n");
 
-#undef ROWLEN
+  if (binary) {
+    buffer_printf(&buf, "%%%%BeginData: %lu Binary Bytes\n",
+                  (unsigned long) (strlen(operators) + datalen));
+    buffer_append(&buf, operators, strlen(operators));
+    buffer_append(&buf, data, datalen);
+    buffer_printf(&buf, "\n%%%%EndData\n\n");
+  }
+  else {
+    buffer_append(&buf, operators, strlen(operators));
+    if (!write_ascii85(&buf, data, datalen)) buf.failed = 1;
+    buffer_printf(&buf, "~>\n\n"); /* ASCII85 EOD marker */
+  }
+  buffer_printf(&buf, "origstate restore\n");
+  buffer_printf(&buf, "\n");
+  buffer_printf(&buf, "%%%%Trailer\n");
+  buffer_printf(&buf, "\n");
+  buffer_printf(&buf, "%%%%EOF\n");
+
+  if (data != samples) free(data);
+  if (samples != src) free(samples);
+
+  if (buf.failed) {
+    free(buf.data);
+    epserror = ERR_MEM;
+    return 0;
+  }
+
+  fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    free(buf.data);
+    epserror = ERR_OPEN_WRITE;
+    return 0;
+  }
+  if (fwrite(buf.data, 1, buf.len, fp) != buf.len) epserror = ERR_WRITE;
+  if (fclose(fp) != 0) epserror = ERR_WRITE;
+  free(buf.data);
+  return epserror == ERR_NO_ERROR;
 }
 
+#undef ROWLEN
 
 #endif /* SIMAGE_EPS_SUPPORT */
@@ -26,6 +26,7 @@
 #ifdef HAVE_GIFLIB
 
 #include <simage_gif.h>
+#include <simage_private.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -93,219 +94,563 @@ simage_gif_identify(const char *filename,
     && header[2] == 'F';
 }
 
+/*
+ * Loading. The screen is filled with the background color, and the
+ * images in the file are drawn on top of it. Rows are decoded to
+ * palette indices and expanded through a lookup table into the
+ * format asked for with simage_set_palette_mode(): RGBA, RGB when no
+ * color is transparent, or the palette indices themselves.
+ */
+
+/* the color map of the current image */
+typedef struct {
+  unsigned char rgba[256 * 4]; /* palette index -> RGBA */
+  unsigned char index[256];    /* palette index, clamped to the color map */
+  int numcolors;
+} gif_palette;
+
 static void
-decode_row(GifFileType * giffile,
-           unsigned char * buffer,
-           unsigned char * rowdata,
-           int x, int y, int len,
-           int transparent)
+make_palette(GifFileType * giffile, int transparent, gif_palette * pal)
 {
-  GifColorType * cmentry;
   ColorMapObject * colormap;
-  int colormapsize;
-  unsigned char col;
   unsigned char * ptr;
-
-  y = giffile->SHeight - (y+1);
-  ptr = buffer + (giffile->SWidth * y + x) * 4;
+  int i, col;
 
   colormap = (giffile->Image.ColorMap
               ? giffile->Image.ColorMap
               : giffile->SColorMap);
-  colormapsize = colormap ? colormap->ColorCount : 255;
+  pal->numcolors = colormap ? colormap->ColorCount : 255;
+  if (pal->numcolors > 256) pal->numcolors = 256;
 
-  while (len--) {
-    col = *rowdata++;
-    if (col >= colormapsize) col = 0; /* just in case */
-    cmentry = colormap ? &colormap->Colors[col] : NULL;
-    if (cmentry) {
-      *ptr++ = cmentry->Red;
-      *ptr++ = cmentry->Green;
-      *ptr++ = cmentry->Blue;
+  ptr = pal->rgba;
+  for (i = 0; i < 256; i++) {
+    col = i < pal->numcolors ? i : 0; /* just in case */
+    pal->index[i] = (unsigned char) col;
+    if (colormap) {
+      *ptr++ = colormap->Colors[col].Red;
+      *ptr++ = colormap->Colors[col].Green;
+      *ptr++ = colormap->Colors[col].Blue;
     }
     else {
-      *ptr++ = col;
-      *ptr++ = col;
-      *ptr++ = col;
+      *ptr++ = (unsigned char) col;
+      *ptr++ = (unsigned char) col;
+      *ptr++ = (unsigned char) col;
     }
     *ptr++ = (col == transparent ? 0x00 : 0xff);
   }
 }
 
+/* the screen background in the output format */
+static void
+background_pixel(GifFileType * giffile, int nc, unsigned char * pixel)
+{
+  ColorMapObject * colormap = giffile->SColorMap;
+  int bg = giffile->SBackGroundColor;
+
+  if (nc == 1) {
+    pixel[0] = (unsigned char) ((colormap && bg < colormap->ColorCount) ? bg : 0);
+  }
+  else if (colormap && bg < colormap->ColorCount) {
+    pixel[0] = colormap->Colors[bg].Red;
+    pixel[1] = colormap->Colors[bg].Green;
+    pixel[2] = colormap->Colors[bg].Blue;
+    pixel[3] = 0xff;
+  }
+  else {
+    pixel[0] = pixel[1] = pixel[2] = 0x00;
+    pixel[3] = 0xff;
+  }
+}
+
+static void
+fill_pixels(unsigned char * dst, int len, int nc, const unsigned char * pixel)
+{
+  if (nc == 1) {
+    memset(dst, pixel[0], len);
+    return;
+  }
+  while (len--) {
+    memcpy(dst, pixel, nc);
+    dst += nc;
+  }
+}
+
+static void
+expand_row(const unsigned char * rowdata, int len, const gif_palette * pal,
+           int nc, unsigned char * dst)
+{
+  int i;
+
+  switch (nc) {
+  case 1:
+    for (i = 0; i < len; i++) dst[i] = pal->index[rowdata[i]];
+    break;
+  case 3:
+    for (i = 0; i < len; i++) {
+      const unsigned char * src = pal->rgba + rowdata[i] * 4;
+      dst[0] = src[0];
+      dst[1] = src[1];
+      dst[2] = src[2];
+      dst += 3;
+    }
+    break;
+  default:
+    for (i = 0; i < len; i++) {
+      memcpy(dst, pal->rgba + rowdata[i] * 4, 4);
+      dst += 4;
+    }
+    break;
+  }
+}
+
+/* the number of components for an image, given the transparent
+   color index of the first image */
+static int
+output_components(int transparent)
+{
+  switch (simage_get_palette_mode()) {
+  case SIMAGE_PALETTE_INDEXED:
+    return 1;
+  case SIMAGE_PALETTE_EXPAND:
+    return transparent >= 0 ? 4 : 3;
+  default:
+    return 4;
+  }
+}
+
+/* reads an extension block, and updates the transparent color index
+   and the disposal method (if disposal isn't NULL) if it's a graphic
+   control extension */
+static int
+read_extension(GifFileType * giffile, int * transparent, int * disposal)
+{
+  GifByteType * extension;
+  int extcode;
+
+  if (DGifGetExtension(giffile, &extcode, &extension) == GIF_ERROR) {
+    return 0;
+  }
+  /* transparent test from the gimp gif-plugin. Open Source rulez! */
+  if (extcode == 0xf9 && extension) {
+    if (extension[0] >= 4 && extension[1] & 0x1) *transparent = extension[4];
+    else *transparent = -1;
+    if (disposal && extension[0] >= 4) *disposal = (extension[1] >> 2) & 0x7;
+  }
+  while (extension != NULL) {
+    if (DGifGetExtensionNext(giffile, &extension) == GIF_ERROR) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* reads records until the next image descriptor. Returns 1 at an
+   image, 0 at the end of the file and -1 on errors */
+static int
+next_image(GifFileType * giffile, int * transparent, int * disposal)
+{
+  GifRecordType recordtype;
+
+  do {
+    if (DGifGetRecordType(giffile, &recordtype) == GIF_ERROR) return -1;
+    switch (recordtype) {
+    case IMAGE_DESC_RECORD_TYPE:
+      if (DGifGetImageDesc(giffile) == GIF_ERROR) return -1;
+      /* image must be confined to screen dimension */
+      if (giffile->Image.Left + giffile->Image.Width > giffile->SWidth ||
+          giffile->Image.Top + giffile->Image.Height > giffile->SHeight) {
+        return -1;
+      }
+      return 1;
+    case EXTENSION_RECORD_TYPE:
+      if (!read_extension(giffile, transparent, disposal)) return -1;
+      break;
+    default:
+      break;
+    }
+  } while (recordtype != TERMINATE_RECORD_TYPE);
+  return 0;
+}
+
+/* expands an RGB canvas to RGBA in place, when a later image in the
+   file turns out to have transparent pixels */
+static unsigned char *
+grow_to_rgba(unsigned char * buffer, size_t n)
+{
+  unsigned char * rgba = (unsigned char *) realloc(buffer, n * 4);
+  size_t i;
+
+  if (rgba == NULL) return NULL;
+  for (i = n; i-- > 0; ) {
+    rgba[i*4+3] = 0xff;
+    rgba[i*4+2] = rgba[i*3+2];
+    rgba[i*4+1] = rgba[i*3+1];
+    rgba[i*4] = rgba[i*3];
+  }
+  return rgba;
+}
+
+/* draws a row onto an RGBA canvas, leaving it as it is under
+   transparent pixels */
+static void
+composite_row(const unsigned char * rowdata, int len, const gif_palette * pal,
+              int transparent, unsigned char * dst)
+{
+  int i;
+
+  for (i = 0; i < len; i++) {
+    if (rowdata[i] != transparent) memcpy(dst, pal->rgba + rowdata[i] * 4, 4);
+    dst += 4;
+  }
+}
+
+/* draws the image just read from the file. The interlaced rows are
+   stored in 4 passes. If composite is set, buffer is RGBA and the
+   transparent pixels aren't drawn */
+static int
+draw_image(GifFileType * giffile, unsigned char * buffer, int nc,
+           unsigned char * rowdata, int transparent, int composite)
+{
+  /* The way an interlaced image should be read - offsets and jumps */
+  static const int interlacedoffset[] = { 0, 4, 2, 1 };
+  static const int interlacedjumps[] = { 8, 8, 4, 2 };
+  int row, col, width, height, pass, j;
+  gif_palette pal;
+
+  row = giffile->Image.Top; /* subimage position in composite image */
+  col = giffile->Image.Left;
+  width = giffile->Image.Width;
+  height = giffile->Image.Height;
+  make_palette(giffile, transparent, &pal);
+
+  for (pass = 0; pass < 4; pass++) {
+    int start = giffile->Image.Interlace ? interlacedoffset[pass] : 0;
+    int step = giffile->Image.Interlace ? interlacedjumps[pass] : 1;
+    for (j = row + start; j < row + height; j += step) {
+      size_t y = giffile->SHeight - (j+1);
+      unsigned char * dst = buffer + ((size_t) giffile->SWidth * y + col) * nc;
+      if (DGifGetLine(giffile, rowdata, width) == GIF_ERROR) return 0;
+      if (composite) composite_row(rowdata, width, &pal, transparent, dst);
+      else expand_row(rowdata, width, &pal, nc, dst);
+    }
+    if (!giffile->Image.Interlace) break;
+  }
+  return 1;
+}
+
+/* decodes the whole file. In indexed mode, only the first image is
+   read, since the images may have different color maps */
+static unsigned char *
+gif_read(GifFileType * giffile, int * nc_ret)
+{
+  unsigned char * buffer, * rowdata, * tmp;
+  unsigned char bgpixel[4];
+  size_t n;
+  int nc, transparent, ret;
+
+  transparent = -1; /* no transparent color by default */
+  n = (size_t) giffile->SHeight * giffile->SWidth;
+  rowdata = (unsigned char*) malloc(giffile->SWidth);
+  if (!rowdata) {
+    giferror = ERR_MEM;
+    return NULL;
+  }
+
+  /* the output format is decided by the first image */
+  ret = next_image(giffile, &transparent, NULL);
+  if (ret < 0) {
+    giferror = ERR_READ;
+    free(rowdata);
+    return NULL;
+  }
+  nc = output_components(transparent);
+  buffer = (unsigned char*) malloc(n * nc);
+  if (!buffer) {
+    giferror = ERR_MEM;
+    free(rowdata);
+    return NULL;
+  }
+  background_pixel(giffile, nc, bgpixel);
+  fill_pixels(buffer, (int) n, nc, bgpixel);
+
+  while (ret > 0) {
+    if (nc == 3 && transparent >= 0) {
+      tmp = grow_to_rgba(buffer, n);
+      if (!tmp) {
+        giferror = ERR_MEM;
+        free(buffer);
+        free(rowdata);
+        return NULL;
+      }
+      buffer = tmp;
+      nc = 4;
+    }
+    if (!draw_image(giffile, buffer, nc, rowdata, transparent, 0)) {
+      giferror = ERR_READ;
+      free(buffer);
+      free(rowdata);
+      return NULL;
+    }
+    if (nc == 1) break;
+    ret = next_image(giffile, &transparent, NULL);
+    if (ret < 0) {
+      giferror = ERR_READ;
+      free(buffer);
+      free(rowdata);
+      return NULL;
+    }
+  }
+
+  free(rowdata);
+  *nc_ret = nc;
+  return buffer;
+}
+
 unsigned char *
 simage_gif_load(const char *filename,
                 int *width_ret,
                 int *height_ret,
                 int *numComponents_ret)
 {
-  int i, j, n, row, col, width, height, extcode;
-  unsigned char * rowdata;
-  unsigned char * buffer, * ptr;
-  unsigned char bg;
-  int transparent;
-  GifRecordType recordtype;
-  GifByteType * extension;
   GifFileType * giffile;
-  GifColorType * bgcol;
-
-  /* The way an interlaced image should be read - offsets and jumps */
-  int interlacedoffset[] = { 0, 4, 2, 1 };
-  int interlacedjumps[] = { 8, 8, 4, 2 };
+  unsigned char * buffer;
+  int nc;
 
   giffile = DGifOpenFileName(filename);
   if (!giffile) {
     giferror = ERR_OPEN;
     return NULL;
   }
+  buffer = gif_read(giffile, &nc);
+  if (buffer) {
+    *width_ret = giffile->SWidth;
+    *height_ret = giffile->SHeight;
+    *numComponents_ret = nc;
+  }
+  DGifCloseFile(giffile);
+  return buffer;
+}
 
-  transparent = -1; /* no transparent color by default */
+/* for s_image_open(). A file with a single, non-interlaced image is
+   decoded one row at a time, keeping only that row in memory. Other
+   files are decoded in full when opened. */
 
-  n = giffile->SHeight * giffile->SWidth;
-  buffer = (unsigned char*) malloc(n * 4);
-  if (!buffer) {
-    giferror = ERR_MEM;
+typedef struct {
+  GifFileType * giffile;
+  int width;
+  int height;
+  int numcomponents;
+  int nextrow;             /* next screen row (from the top) to decode */
+  int failed;
+  unsigned char * rowdata; /* the image part of the row before nextrow */
+  unsigned char * image;   /* the whole image, when not streaming */
+  gif_palette palette;
+  unsigned char bgpixel[4];
+} simage_gif_opendata;
+
+/* finds the number of images in the file, whether any of them has
+   transparent pixels, and whether the first one is interlaced. The
+   image data is skipped without being decompressed. */
+static int
+scan_file(const char * filename, int * numimages, int * hastransparency,
+          int * interlaced)
+{
+  GifFileType * giffile;
+  GifByteType * code;
+  int transparent, codesize, ret;
+
+  giffile = DGifOpenFileName(filename);
+  if (!giffile) return 0;
+
+  *numimages = 0;
+  *hastransparency = 0;
+  *interlaced = 0;
+  transparent = -1;
+  while ((ret = next_image(giffile, &transparent, NULL)) > 0) {
+    if (*numimages == 0) *interlaced = giffile->Image.Interlace;
+    if (transparent >= 0) *hastransparency = 1;
+    (*numimages)++;
+    if (DGifGetCode(giffile, &codesize, &code) == GIF_ERROR) {
+      ret = -1;
+      break;
+    }
+    while (code != NULL) {
+      if (DGifGetCodeNext(giffile, &code) == GIF_ERROR) break;
+    }
+  }
+  DGifCloseFile(giffile);
+  return ret == 0;
+}
+
+void *
+simage_gif_open(const char * filename,
+                int * width,
+                int * height,
+                int * numcomponents)
+{
+  simage_gif_opendata * od;
+  GifFileType * giffile;
+  int numimages, hastransparency, interlaced, transparent, nc;
+
+  nc = simage_get_palette_mode() == SIMAGE_PALETTE_INDEXED ? 1 : 0;
+  if (!scan_file(filename, &numimages, &hastransparency, &interlaced)) {
+    giferror = ERR_READ;
     return NULL;
   }
-  rowdata = (unsigned char*) malloc(giffile->SWidth);
-  if (!rowdata) {
+  giffile = DGifOpenFileName(filename);
+  if (!giffile) {
+    giferror = ERR_OPEN;
+    return NULL;
+  }
+  od = (simage_gif_opendata *) malloc(sizeof(simage_gif_opendata));
+  if (od == NULL) {
     giferror = ERR_MEM;
-    free(buffer);
+    DGifCloseFile(giffile);
     return NULL;
   }
+  memset(od, 0, sizeof(simage_gif_opendata));
+  od->width = giffile->SWidth;
+  od->height = giffile->SHeight;
 
-  bg = giffile->SBackGroundColor;
-  if (giffile->SColorMap && bg < giffile->SColorMap->ColorCount) {
-    bgcol = &giffile->SColorMap->Colors[bg];
-  }
-  else bgcol = NULL;
-  ptr = buffer;
-  for (i = 0; i < n; i++) {
-    if (bgcol) {
-      *ptr++ = bgcol->Red;
-      *ptr++ = bgcol->Green;
-      *ptr++ = bgcol->Blue;
-      *ptr++ = 0xff;
-    }
-    else {
-      *ptr++ = 0x00;
-      *ptr++ = 0x00;
-      *ptr++ = 0x00;
-      *ptr++ = 0xff;
+  if (interlaced || numimages == 0 || (numimages > 1 && nc != 1)) {
+    od->image = gif_read(giffile, &od->numcomponents);
+    DGifCloseFile(giffile);
+    if (od->image == NULL) {
+      free(od);
+      return NULL;
     }
   }
-
-  /* Scan the content of the GIF file and load the image(s) in: */
-  do {
-    if (DGifGetRecordType(giffile, &recordtype) == GIF_ERROR) {
+  else {
+    od->giffile = giffile;
+    transparent = -1;
+    if (next_image(giffile, &transparent, NULL) <= 0) {
       giferror = ERR_READ;
-      free(buffer);
-      free(rowdata);
+      simage_gif_close(od);
       return NULL;
     }
-    switch (recordtype) {
-      case IMAGE_DESC_RECORD_TYPE:
-        if (DGifGetImageDesc(giffile) == GIF_ERROR) {
-          giferror = ERR_READ;
-          free(buffer);
-          free(rowdata);
-          return NULL;
-        }
-        row = giffile->Image.Top; /* subimage position in composite image */
-        col = giffile->Image.Left;
-        width = giffile->Image.Width;
-        height = giffile->Image.Height;
-        if (giffile->Image.Left + giffile->Image.Width > giffile->SWidth ||
-            giffile->Image.Top + giffile->Image.Height > giffile->SHeight) {
-          /* image is not confined to screen dimension */
-          giferror = ERR_READ;
-          free(buffer);
-          free(rowdata);
-          return NULL;
-        }
-        if (giffile->Image.Interlace) {
-          /* Need to perform 4 passes on the images: */
-          for (i = 0; i < 4; i++) {
-            for (j = row + interlacedoffset[i]; j < row + height;
-                 j += interlacedjumps[i]) {
-              if (DGifGetLine(giffile, rowdata, width) == GIF_ERROR) {
-                giferror = ERR_READ;
-                free(buffer);
-                free(rowdata);
-                return NULL;
-              }
-              else decode_row(giffile, buffer, rowdata, col, j, width, transparent);
-            }
-          }
-        }
-        else {
-          for (i = 0; i < height; i++, row++) {
-            if (DGifGetLine(giffile, rowdata, width) == GIF_ERROR) {
-              giferror = ERR_READ;
-              free(buffer);
-              free(rowdata);
-              return NULL;
-            }
-            else decode_row(giffile, buffer, rowdata, col, row, width, transparent);
-          }
-        }
-        break;
-      case EXTENSION_RECORD_TYPE:
-        /* Skip any extension blocks in file: */
-        if (DGifGetExtension(giffile, &extcode, &extension) == GIF_ERROR) {
-          giferror = ERR_READ;
-          free(buffer);
-          free(rowdata);
-          return NULL;
-        }
-        /* transparent test from the gimp gif-plugin. Open Source rulez! */
-        else if (extcode == 0xf9) {
-          if (extension[0] >= 4 && extension[1] & 0x1) transparent = extension[4];
-          else transparent = -1;
-        }
-        while (extension != NULL) {
-          if (DGifGetExtensionNext(giffile, &extension) == GIF_ERROR) {
-            giferror = ERR_READ;
-            free(buffer);
-            free(rowdata);
-            return NULL;
-          }
-        }
-        break;
-      case TERMINATE_RECORD_TYPE:
-        break;
-      default:              /* Should be trapped by DGifGetRecordType. */
-        break;
+    od->numcomponents = nc ? nc : output_components(hastransparency ? 0 : -1);
+    make_palette(giffile, transparent, &od->palette);
+    background_pixel(giffile, od->numcomponents, od->bgpixel);
+    od->rowdata = (unsigned char *) malloc(giffile->Image.Width);
+    if (od->rowdata == NULL) {
+      giferror = ERR_MEM;
+      simage_gif_close(od);
+      return NULL;
     }
   }
-  while (recordtype != TERMINATE_RECORD_TYPE);
 
-  free(rowdata);
-  *width_ret = giffile->SWidth;
-  *height_ret = giffile->SHeight;
-  *numComponents_ret = 4;
-  DGifCloseFile(giffile);
-  return buffer;
+  *width = od->width;
+  *height = od->height;
+  *numcomponents = od->numcomponents;
+  giferror = ERR_NO_ERROR;
+  return (void *) od;
+}
+
+void
+simage_gif_close(void * opendata)
+{
+  simage_gif_opendata * od = (simage_gif_opendata *) opendata;
+
+  if (od->giffile) DGifCloseFile(od->giffile);
+  if (od->rowdata) free(od->rowdata);
+  if (od->image) free(od->image);
+  free(od);
 }
 
 int
-simage_gif_save(const char * filename,
-                const unsigned char * bytes,
-                int width,
-                int height,
-                int numcomponents)
+simage_gif_read_line(void * opendata, int y, unsigned char * buf)
+{
+  simage_gif_opendata * od = (simage_gif_opendata *) opendata;
+  GifFileType * giffile = od->giffile;
+  int nc = od->numcomponents;
+  int row, top, left, width;
+
+  if (od->image) {
+    memcpy(buf, od->image + (size_t) y * od->width * nc, (size_t) od->width * nc);
+    return 1;
+  }
+
+  /* the rows are stored from the top in the file */
+  row = od->height - 1 - y;
+  top = giffile->Image.Top;
+  left = giffile->Image.Left;
+  width = giffile->Image.Width;
+
+  if (row < top || row >= top + giffile->Image.Height) {
+    fill_pixels(buf, od->width, nc, od->bgpixel);
+    return 1;
+  }
+
+  /* we can't seek backwards in the compressed stream. Returning
+     failure makes s_image_read_line() load the whole image instead,
+     if the caller allowed that */
+  if (od->failed || row < od->nextrow - 1) return 0;
+
+  while (od->nextrow <= row) {
+    if (od->nextrow >= top && od->nextrow < top + giffile->Image.Height) {
+      if (DGifGetLine(giffile, od->rowdata, width) == GIF_ERROR) {
+        giferror = ERR_READ;
+        od->failed = 1;
+        return 0;
+      }
+    }
+    od->nextrow++;
+  }
+
+  fill_pixels(buf, left, nc, od->bgpixel);
+  expand_row(od->rowdata, width, &od->palette, nc, buf + left * nc);
+  fill_pixels(buf + (left + width) * nc, od->width - left - width,
+              nc, od->bgpixel);
+  return 1;
+}
+
+int
+simage_gif_palette(const char * filename, unsigned char * palette)
+{
+  GifFileType * giffile;
+  gif_palette pal;
+  int transparent;
+
+  giffile = DGifOpenFileName(filename);
+  if (!giffile) {
+    giferror = ERR_OPEN;
+    return 0;
+  }
+  transparent = -1;
+  if (next_image(giffile, &transparent, NULL) <= 0) {
+    giferror = ERR_READ;
+    DGifCloseFile(giffile);
+    return 0;
+  }
+  make_palette(giffile, transparent, &pal);
+  memcpy(palette, pal.rgba, pal.numcolors * 4);
+  DGifCloseFile(giffile);
+  return pal.numcolors;
+}
+
+/* the quantizers the saver can use */
+enum {
+  QUANTIZE_MEDIAN_CUT,
+  QUANTIZE_OCTREE,
+  QUANTIZE_KMEANS
+};
+
+/* k-means iterations used if the "kmeans iterations" parameter isn't set */
+#define DEFAULT_KMEANS_ITERATIONS 4
+
+/* makes the palette with giflib's median cut quantizer */
+static int
+median_cut(const unsigned char * bytes, int width, int height,
+           int numcomponents, ColorMapObject * cmapobj, GifByteType * outbuf)
 {
   const unsigned char * bytes_ptr = bytes;
-  int i, colormapsize = 256;
+  int i, colormapsize = cmapobj->ColorCount;
   int bufsize = width * height;
-  ColorMapObject * cmapobj;
-  GifByteType * outbuf = NULL, * outbuf_ptr = NULL;
   GifByteType * rgbbuf = NULL, * rgbbuf_ptr = NULL;
-  GifFileType * giffile = NULL;
 
   /* allocate memory for the channels of the rgb buffer */
   if (!(rgbbuf = (GifByteType*)malloc(bufsize*3))) {
-    giferror = ERR_MEM;
-    return 0;
+    return ERR_MEM;
   }
 
   rgbbuf_ptr = rgbbuf;
@@ -334,31 +679,113 @@ simage_gif_save(const char * filename,
         if (numcomponents == 2) { bytes_ptr++; }
       }
       break;
+  }
 
-    default:
-      giferror = ERR_WRITE;
-      free(rgbbuf);
-      return 0;
+  if (QuantizeBuffer(width, height, &colormapsize,
+                     rgbbuf, &rgbbuf[bufsize], &rgbbuf[bufsize*2],
+                     outbuf, cmapobj->Colors) == GIF_ERROR) {
+    free(rgbbuf);
+    return ERR_MEM;
   }
+  free(rgbbuf);
+  return ERR_NO_ERROR;
+}
+
+/* makes the palette with s_quantize_image(), which is faster and
+   can dither */
+static int
+quantize_image(const unsigned char * bytes, int width, int height,
+               int numcomponents, int maxcolors, int iterations, int dither,
+               ColorMapObject * cmapobj, GifByteType * outbuf)
+{
+  unsigned char palette[256 * 3];
+  int i, numcolors;
+
+  numcolors = s_quantize_image(bytes, width, height, numcomponents,
+                               maxcolors, iterations, dither,
+                               palette, outbuf);
+  if (numcolors == 0) return ERR_MEM;
+  for (i = 0; i < cmapobj->ColorCount; i++) {
+    if (i < numcolors) {
+      cmapobj->Colors[i].Red = palette[i*3+0];
+      cmapobj->Colors[i].Green = palette[i*3+1];
+      cmapobj->Colors[i].Blue = palette[i*3+2];
+    }
+    else {
+      cmapobj->Colors[i].Red = cmapobj->Colors[i].Green = cmapobj->Colors[i].Blue = 0;
+    }
+  }
+  return ERR_NO_ERROR;
+}
+
+int
+simage_gif_save(const char * filename,
+                const unsigned char * bytes,
+                int width,
+                int height,
+                int numcomponents,
+                s_params * params)
+{
+  int i, colormapsize = 256;
+  int bufsize = width * height;
+  ColorMapObject * cmapobj;
+  GifByteType * outbuf = NULL, * outbuf_ptr = NULL;
+  GifFileType * giffile = NULL;
+  int quantizer = QUANTIZE_MEDIAN_CUT;
+  int iterations = DEFAULT_KMEANS_ITERATIONS;
+  int maxcolors = 256;
+  int dither = 0;
+  int err;
+  char * str;
+
+  if (numcomponents < 1 || numcomponents > 4) {
+    giferror = ERR_WRITE;
+    return 0;
+  }
+
+  if (params) {
+    if (s_params_get(params, "quantizer", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+      if (strcmp(str, "median cut") == 0) quantizer = QUANTIZE_MEDIAN_CUT;
+      else if (strcmp(str, "octree") == 0) quantizer = QUANTIZE_OCTREE;
+      else if (strcmp(str, "kmeans") == 0) quantizer = QUANTIZE_KMEANS;
+    }
+    if (s_params_get(params, "dither", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+      dither = strcmp(str, "ordered") == 0;
+    }
+    (void) s_params_get(params, "kmeans iterations", S_INTEGER_PARAM_TYPE, &iterations, NULL);
+    (void) s_params_get(params, "colors", S_INTEGER_PARAM_TYPE, &maxcolors, NULL);
+    if (maxcolors < 2) maxcolors = 2;
+    if (maxcolors > 256) maxcolors = 256;
+  }
+  /* the median cut quantizer doesn't dither, and always makes 256
+     colors */
+  if ((dither || maxcolors < 256) && quantizer == QUANTIZE_MEDIAN_CUT)
+    quantizer = QUANTIZE_OCTREE;
+
+  /* the palette size must be a power of two */
+  for (colormapsize = 2; colormapsize < maxcolors; colormapsize <<= 1);
 
   if (!(outbuf = (GifByteType*)malloc(bufsize))) {
     giferror = ERR_MEM;
-    free(rgbbuf);
     return 0;
   }
 
   if (!(cmapobj = MakeMapObject(colormapsize, NULL))) {
     giferror = ERR_MEM;
-    free(rgbbuf);
     free(outbuf);
     return 0;
   }
 
-  if (QuantizeBuffer(width, height, &colormapsize,
-                     rgbbuf, &rgbbuf[bufsize], &rgbbuf[bufsize*2],
-                     outbuf, cmapobj->Colors) == GIF_ERROR) {
-    giferror = ERR_MEM;
-    free(rgbbuf);
+  if (quantizer == QUANTIZE_MEDIAN_CUT) {
+    err = median_cut(bytes, width, height, numcomponents, cmapobj, outbuf);
+  }
+  else {
+    err = quantize_image(bytes, width, height, numcomponents, maxcolors,
+                         quantizer == QUANTIZE_KMEANS ? iterations : 0,
+                         dither, cmapobj, outbuf);
+  }
+  if (err != ERR_NO_ERROR) {
+    giferror = err;
     free(outbuf);
     FreeMapObject(cmapobj);
     return 0;
@@ -367,7 +794,6 @@ simage_gif_save(const char * filename,
   /* open gif file and overwrite any existing file */
   if (!(giffile = EGifOpenFileName(filename, FALSE))) {
     giferror = ERR_OPEN;
-    free(rgbbuf);
     free(outbuf);
     FreeMapObject(cmapobj);
     return 0;
@@ -378,7 +804,6 @@ simage_gif_save(const char * filename,
       EGifPutImageDesc(giffile, 0, 0, width, height,
                        FALSE, NULL) == GIF_ERROR) {
     giferror = ERR_WRITE;
-    free(rgbbuf);
     free(outbuf);
     EGifCloseFile(giffile);
     FreeMapObject(cmapobj);
@@ -390,7 +815,6 @@ simage_gif_save(const char * filename,
     outbuf_ptr -= width;
     if (EGifPutLine(giffile, outbuf_ptr, width) == GIF_ERROR) {
       giferror = ERR_WRITE;
-      free(rgbbuf);
       free(outbuf);
       EGifCloseFile(giffile);
       FreeMapObject(cmapobj);
@@ -401,18 +825,201 @@ simage_gif_save(const char * filename,
   if (EGifPutComment(giffile, "Image saved using simage.") == GIF_ERROR ||
       EGifCloseFile(giffile) == GIF_ERROR) {
     giferror = ERR_WRITE;
-    free(rgbbuf);
     free(outbuf);
     EGifCloseFile(giffile);
     FreeMapObject(cmapobj);
     return 0;
   }
 
-  free(rgbbuf);
   free(outbuf);
   FreeMapObject(cmapobj);
 
   return 1;
 }
 
+/*
+ * Animated GIF files as movies. Each s_movie_get_image() decodes the
+ * next frame onto the logical screen, and returns it as an RGBA
+ * image. Only the screen is kept in memory, plus a copy of it when a
+ * frame asks to be restored to the previous contents afterwards.
+ */
+
+/* frame disposal methods from the graphic control extension */
+#define GIF_DISPOSE_BACKGROUND 2
+#define GIF_DISPOSE_PREVIOUS 3
+
+typedef struct {
+  GifFileType * giffile;
+  unsigned char * canvas; /* RGBA, bottom-up */
+  unsigned char * saved;  /* canvas before the last frame was drawn */
+  unsigned char * rowdata;
+  unsigned char bgcol[4];
+  int transparent;        /* for the next frame */
+  int disposal;           /* for the next frame */
+  /* the last frame, disposed of before drawing the next one */
+  int lastdisposal, lastleft, lasttop, lastwidth, lastheight;
+} simage_gif_movie;
+
+/* sets (or restores) a rectangle of the canvas. The rectangle is
+   given in GIF coordinates, with y = 0 at the top */
+static void
+fill_rect(simage_gif_movie * gm, int left, int top, int width, int height,
+          const unsigned char * src)
+{
+  int swidth = gm->giffile->SWidth;
+  int y, x;
+
+  for (y = top; y < top + height; y++) {
+    size_t offset = ((size_t) swidth * (gm->giffile->SHeight - (y+1)) + left) * 4;
+    if (src) {
+      memcpy(gm->canvas + offset, src + offset, (size_t) width * 4);
+    }
+    else {
+      unsigned char * ptr = gm->canvas + offset;
+      for (x = 0; x < width; x++) {
+        memcpy(ptr, gm->bgcol, 4);
+        ptr += 4;
+      }
+    }
+  }
+}
+
+int
+simage_gif_movie_open(const char * filename, s_movie * movie)
+{
+  simage_gif_movie * gm;
+  GifFileType * giffile;
+  unsigned char header[3];
+  FILE * fp;
+  size_t n;
+  int ok;
+
+  fp = fopen(filename, "rb");
+  if (fp == NULL) return 0;
+  ok = fread(header, 1, 3, fp) == 3 && simage_gif_identify(filename, header, 3);
+  fclose(fp);
+  if (!ok) return 0;
+
+  giffile = DGifOpenFileName(filename);
+  if (!giffile) {
+    giferror = ERR_OPEN;
+    return 0;
+  }
+
+  gm = (simage_gif_movie *) malloc(sizeof(simage_gif_movie));
+  if (gm == NULL) {
+    giferror = ERR_MEM;
+    DGifCloseFile(giffile);
+    return 0;
+  }
+  n = (size_t) giffile->SWidth * giffile->SHeight;
+  gm->giffile = giffile;
+  gm->canvas = (unsigned char *) malloc(n * 4);
+  gm->rowdata = (unsigned char *) malloc(giffile->SWidth);
+  gm->saved = NULL;
+  if (gm->canvas == NULL || gm->rowdata == NULL) {
+    giferror = ERR_MEM;
+    if (gm->canvas) free(gm->canvas);
+    if (gm->rowdata) free(gm->rowdata);
+    free(gm);
+    DGifCloseFile(giffile);
+    return 0;
+  }
+
+  /* the screen starts out as transparent background */
+  background_pixel(giffile, 4, gm->bgcol);
+  gm->bgcol[3] = 0x00;
+  fill_rect(gm, 0, 0, giffile->SWidth, giffile->SHeight, NULL);
+
+  gm->transparent = -1;
+  gm->disposal = 0;
+  gm->lastdisposal = 0;
+
+  s_params_set(s_movie_params(movie), "gif movie handle",
+               S_POINTER_PARAM_TYPE, gm, NULL);
+  return 1;
+}
+
+/* decodes the next frame onto the canvas. Returns 0 at the end of
+   the file or on errors */
+static int
+gif_movie_next_frame(simage_gif_movie * gm)
+{
+  GifFileType * giffile = gm->giffile;
+  int ret;
+
+  ret = next_image(giffile, &gm->transparent, &gm->disposal);
+  if (ret <= 0) {
+    if (ret < 0) giferror = ERR_READ;
+    return 0;
+  }
+
+  /* get rid of the previous frame */
+  if (gm->lastdisposal == GIF_DISPOSE_BACKGROUND) {
+    fill_rect(gm, gm->lastleft, gm->lasttop, gm->lastwidth, gm->lastheight, NULL);
+  }
+  else if (gm->lastdisposal == GIF_DISPOSE_PREVIOUS && gm->saved) {
+    fill_rect(gm, gm->lastleft, gm->lasttop, gm->lastwidth, gm->lastheight,
+              gm->saved);
+  }
+  if (gm->disposal == GIF_DISPOSE_PREVIOUS) {
+    size_t n = (size_t) giffile->SWidth * giffile->SHeight * 4;
+    if (gm->saved == NULL) gm->saved = (unsigned char *) malloc(n);
+    if (gm->saved == NULL) {
+      giferror = ERR_MEM;
+      return 0;
+    }
+    memcpy(gm->saved, gm->canvas, n);
+  }
+  gm->lastdisposal = gm->disposal;
+  gm->lastleft = giffile->Image.Left;
+  gm->lasttop = giffile->Image.Top;
+  gm->lastwidth = giffile->Image.Width;
+  gm->lastheight = giffile->Image.Height;
+
+  if (!draw_image(giffile, gm->canvas, 4, gm->rowdata, gm->transparent, 1)) {
+    giferror = ERR_READ;
+    return 0;
+  }
+  /* the graphic control extension only applies to one frame */
+  gm->transparent = -1;
+  gm->disposal = 0;
+  return 1;
+}
+
+s_image *
+simage_gif_movie_get(s_movie * movie, s_image * prealloc, s_params * params)
+{
+  simage_gif_movie * gm;
+  s_image * image;
+
+  if (!s_params_get(s_movie_params(movie), "gif movie handle",
+                    S_POINTER_PARAM_TYPE, &gm, NULL)) return NULL;
+
+  if (!gif_movie_next_frame(gm)) return NULL;
+
+  image = s_image_prepare(prealloc, gm->giffile->SWidth, gm->giffile->SHeight, 4);
+  if (image == NULL) {
+    giferror = ERR_MEM;
+    return NULL;
+  }
+  memcpy(s_image_data(image), gm->canvas,
+         (size_t) gm->giffile->SWidth * gm->giffile->SHeight * 4);
+  return image;
+}
+
+void
+simage_gif_movie_close(s_movie * movie)
+{
+  simage_gif_movie * gm;
+  if (s_params_get(s_movie_params(movie), "gif movie handle",
+                   S_POINTER_PARAM_TYPE, &gm, NULL)) {
+    DGifCloseFile(gm->giffile);
+    free(gm->canvas);
+    free(gm->rowdata);
+    if (gm->saved) free(gm->saved);
+    free(gm);
+  }
+}
+
 #endif /* HAVE_GIFLIB */
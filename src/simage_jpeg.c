@@ -25,6 +25,8 @@
 
 #ifdef HAVE_JPEGLIB
 
+#include <simage_jpeg.h>
+#include <simage_private.h>
 #include <stdio.h>
 #include <setjmp.h>
 #include <string.h>
@@ -129,6 +131,292 @@ copyScanline(unsigned char *currPtr, unsigned char *from, int cnt)
   return currPtr;
 }
 
+/*
+ * Parallel decoding of baseline JPEG files with restart markers.
+ *
+ * When the encoder has inserted a restart marker at the start of
+ * every N MCU rows, the entropy coded data can be split at those
+ * markers into independent segments. We cut the image into a few
+ * horizontal bands, each built into a small, valid JPEG stream of
+ * its own (the original headers with a patched height, the band's
+ * segments with renumbered restart markers and an EOI), and decode
+ * the bands on the worker threads straight into the output buffer.
+ *
+ * When the chroma components are vertically subsampled, the
+ * upsampler needs the rows just outside a band, so each band also
+ * decodes one extra segment above and below and throws those rows
+ * away. The result is identical to what the serial loader returns.
+ */
+
+/* don't bother with threads for images smaller than this */
+#define PARALLEL_MIN_PIXELS (1024 * 1024)
+
+typedef struct {
+  const JOCTET * start;
+  const JOCTET * end;
+} jpeg_segment;
+
+typedef struct {
+  const JOCTET * data;    /* the whole file */
+  size_t sof_pos;         /* offset of the SOF marker */
+  size_t header_len;      /* everything up to the entropy coded data */
+  jpeg_segment * segments;
+  int numsegments;
+  int segrows;            /* image rows per segment */
+  int overlap;            /* extra segments to decode around each band */
+  int segsperband;
+  int width;
+  int height;
+  int format;
+  unsigned char * buffer; /* the output image */
+  int failed;
+} jpeg_parallel_job;
+
+static void
+decode_band(void * closure, int band)
+{
+  jpeg_parallel_job * job = (jpeg_parallel_job *) closure;
+  struct jpeg_decompress_struct cinfo;
+  struct my_error_mgr jerr;
+  JOCTET * data;
+  JOCTET * ptr;
+  JSAMPARRAY scratch;
+  JSAMPROW row;
+  size_t size;
+  int i, first, last, keepfirst, keepend, bandheight;
+  int row_stride = job->width * job->format;
+
+  first = band * job->segsperband;
+  last = first + job->segsperband;
+  if (last > job->numsegments) last = job->numsegments;
+  keepfirst = first * job->segrows;
+  keepend = last * job->segrows;
+  if (keepend > job->height) keepend = job->height;
+
+  first -= job->overlap;
+  if (first < 0) first = 0;
+  last += job->overlap;
+  if (last > job->numsegments) last = job->numsegments;
+  bandheight = last * job->segrows;
+  if (bandheight > job->height) bandheight = job->height;
+  bandheight -= first * job->segrows;
+
+  /* build the JPEG stream for this band */
+  size = job->header_len + 2;
+  for (i = first; i < last; i++) {
+    size += (job->segments[i].end - job->segments[i].start) + 2;
+  }
+  data = (JOCTET *) malloc(size);
+  if (data == NULL) {
+    job->failed = 1;
+    return;
+  }
+  memcpy(data, job->data, job->header_len);
+  data[job->sof_pos + 5] = (JOCTET) (bandheight >> 8);
+  data[job->sof_pos + 6] = (JOCTET) (bandheight & 0xff);
+  ptr = data + job->header_len;
+  for (i = first; i < last; i++) {
+    size_t len = job->segments[i].end - job->segments[i].start;
+    memcpy(ptr, job->segments[i].start, len);
+    ptr += len;
+    *ptr++ = 0xFF;
+    *ptr++ = (i == last - 1) ? JPEG_EOI : (JOCTET) (JPEG_RST0 + ((i - first) & 7));
+  }
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = my_error_exit;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    free(data);
+    job->failed = 1;
+    return;
+  }
+  jpeg_create_decompress(&cinfo);
+  simage_jpeg_memory_src_init(&cinfo, data, ptr - data);
+  (void) jpeg_read_header(&cinfo, TRUE);
+  cinfo.out_color_space = job->format == 1 ? JCS_GRAYSCALE : JCS_RGB;
+  (void) jpeg_start_decompress(&cinfo);
+
+  if ((int) cinfo.output_width != job->width ||
+      (int) cinfo.output_components != job->format) {
+    jpeg_destroy_decompress(&cinfo);
+    free(data);
+    job->failed = 1;
+    return;
+  }
+
+  scratch = (*cinfo.mem->alloc_sarray)
+    ((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
+
+  /* decode straight into the (flipped) output image, skipping the
+     overlap rows */
+  while (!job->failed) {
+    int y = first * job->segrows + (int) cinfo.output_scanline;
+    if (y >= keepend) break;
+    if (y >= keepfirst) {
+      row = job->buffer + (size_t) row_stride * (job->height - 1 - y);
+      (void) jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    else {
+      (void) jpeg_read_scanlines(&cinfo, scratch, 1);
+    }
+  }
+  jpeg_destroy_decompress(&cinfo);
+  free(data);
+}
+
+/*
+ * Try to decode the file in parallel. cinfo must have read the file
+ * header. Returns NULL if the file isn't suitable for this, or if
+ * something went wrong. The caller should then decode the file the
+ * normal way.
+ */
+static unsigned char *
+jpeg_load_parallel(FILE * infile, j_decompress_ptr cinfo, int format)
+{
+  jpeg_parallel_job job;
+  JOCTET * data;
+  const JOCTET * ptr;
+  const JOCTET * end;
+  long filesize;
+  size_t pos;
+  int i, hmax, vmax, mcuw, mcuh, mcusperrow, numthreads, numbands;
+  int expected, maxsegments;
+
+  numthreads = simage_get_num_threads();
+  if (numthreads < 2 || cinfo->restart_interval == 0 ||
+      cinfo->progressive_mode || cinfo->arith_code ||
+      cinfo->data_precision != 8 ||
+      cinfo->comps_in_scan != cinfo->num_components ||
+      (double) cinfo->image_width * cinfo->image_height < PARALLEL_MIN_PIXELS) {
+    return NULL;
+  }
+
+  /* the restart interval must cover a whole number of MCU rows */
+  hmax = vmax = 1;
+  for (i = 0; i < cinfo->num_components; i++) {
+    if (cinfo->comp_info[i].h_samp_factor > hmax) hmax = cinfo->comp_info[i].h_samp_factor;
+    if (cinfo->comp_info[i].v_samp_factor > vmax) vmax = cinfo->comp_info[i].v_samp_factor;
+  }
+  if (cinfo->num_components == 1) hmax = vmax = 1; /* non-interleaved */
+  mcuw = DCTSIZE * hmax;
+  mcuh = DCTSIZE * vmax;
+  mcusperrow = (cinfo->image_width + mcuw - 1) / mcuw;
+  if (cinfo->restart_interval % mcusperrow) return NULL;
+
+  job.width = cinfo->image_width;
+  job.height = cinfo->image_height;
+  job.format = format;
+  job.segrows = (cinfo->restart_interval / mcusperrow) * mcuh;
+  job.overlap = 0;
+  if (format > 1) {
+    for (i = 0; i < cinfo->num_components; i++) {
+      if (cinfo->comp_info[i].v_samp_factor != vmax) job.overlap = 1;
+    }
+  }
+  expected = (job.height + job.segrows - 1) / job.segrows;
+  if (expected < 2) return NULL;
+
+  /* read the whole file */
+  if (fseek(infile, 0, SEEK_END) != 0) return NULL;
+  filesize = ftell(infile);
+  if (filesize <= 4 || fseek(infile, 0, SEEK_SET) != 0) return NULL;
+  data = (JOCTET *) malloc(filesize);
+  if (data == NULL) return NULL;
+  if (fread(data, 1, filesize, infile) != (size_t) filesize) {
+    free(data);
+    return NULL;
+  }
+  end = data + filesize;
+
+  /* find the SOF and SOS markers */
+  job.sof_pos = 0;
+  job.header_len = 0;
+  pos = 2; /* skip SOI */
+  while (pos + 4 <= (size_t) filesize && job.header_len == 0) {
+    int marker, len;
+    if (data[pos] != 0xFF) break;
+    marker = data[pos + 1];
+    if (marker == 0xFF) { pos++; continue; } /* fill byte */
+    len = (data[pos + 2] << 8) | data[pos + 3];
+    if (marker == 0xC0 || marker == 0xC1) job.sof_pos = pos;
+    else if (marker == JPEG_EOI) break;
+    else if (marker == 0xDA) job.header_len = pos + 2 + len;
+    pos += 2 + len;
+  }
+  if (job.sof_pos == 0 || job.header_len == 0 ||
+      job.header_len >= (size_t) filesize) {
+    free(data);
+    return NULL;
+  }
+
+  /* split the entropy coded data at the restart markers */
+  maxsegments = expected;
+  job.segments = (jpeg_segment *) malloc(maxsegments * sizeof(jpeg_segment));
+  if (job.segments == NULL) {
+    free(data);
+    return NULL;
+  }
+  job.numsegments = 0;
+  ptr = data + job.header_len;
+  job.segments[0].start = ptr;
+  while (job.numsegments >= 0) {
+    const JOCTET * ff = (const JOCTET *) memchr(ptr, 0xFF, end - ptr);
+    int marker;
+    if (ff == NULL || ff + 1 >= end) {
+      job.numsegments = -1; /* no EOI */
+      break;
+    }
+    marker = ff[1];
+    if (marker == 0x00 || marker == 0xFF) {
+      /* stuffed zero or fill byte */
+      ptr = ff + 1;
+      continue;
+    }
+    if ((marker >= JPEG_RST0 && marker <= JPEG_RST0 + 7) || marker == JPEG_EOI) {
+      job.segments[job.numsegments++].end = ff;
+      if (marker == JPEG_EOI) break;
+      if (job.numsegments == maxsegments) {
+        job.numsegments = -1;
+        break;
+      }
+      ptr = ff + 2;
+      job.segments[job.numsegments].start = ptr;
+      continue;
+    }
+    job.numsegments = -1; /* DNL, another scan or garbage */
+  }
+  if (job.numsegments != expected) {
+    free(job.segments);
+    free(data);
+    return NULL;
+  }
+
+  numbands = job.numsegments / (job.overlap ? 4 : 1);
+  if (numbands > numthreads) numbands = numthreads;
+  if (numbands < 2) {
+    free(job.segments);
+    free(data);
+    return NULL;
+  }
+  job.segsperband = (job.numsegments + numbands - 1) / numbands;
+  numbands = (job.numsegments + job.segsperband - 1) / job.segsperband;
+
+  job.data = data;
+  job.failed = 0;
+  job.buffer = (unsigned char *) malloc((size_t) job.width * job.height * format);
+  if (job.buffer) {
+    s_parallel_for(numbands, decode_band, &job);
+    if (job.failed) {
+      free(job.buffer);
+      job.buffer = NULL;
+    }
+  }
+  free(job.segments);
+  free(data);
+  return job.buffer;
+}
+
 unsigned char *
 simage_jpeg_load(const char *filename,
                  int *width_ret,
@@ -153,6 +441,7 @@ simage_jpeg_load(const char *filename,
   FILE * infile;                /* source file */
   JSAMPARRAY rowbuffer;            /* Output row buffer */
   int row_stride;               /* physical row width in output buffer */
+  long filepos;
 
   jpegerror = ERR_NO_ERROR;
 
@@ -215,7 +504,27 @@ simage_jpeg_load(const char *filename,
     format = 3;
     cinfo.out_color_space = JCS_RGB;
   }
-  
+
+  /* large images with restart markers can be decoded in parallel */
+  filepos = ftell(infile);
+  buffer = jpeg_load_parallel(infile, &cinfo, format);
+  if (buffer) {
+    *width_ret = cinfo.image_width;
+    *height_ret = cinfo.image_height;
+    *numComponents_ret = format;
+    jpeg_destroy_decompress(&cinfo);
+    fclose(infile);
+    return buffer;
+  }
+  /* the data source keeps its own buffer, so we can just continue
+     where it left the file */
+  if (filepos < 0 || fseek(infile, filepos, SEEK_SET) != 0) {
+    jpegerror = ERR_JPEGLIB;
+    jpeg_destroy_decompress(&cinfo);
+    fclose(infile);
+    return NULL;
+  }
+
   (void) jpeg_start_decompress(&cinfo);
   /* We can ignore the return value since suspension is not possible
    * with the stdio data source.
@@ -293,12 +602,139 @@ simage_jpeg_load(const char *filename,
   return buffer;
 }
 
+/*
+ * set the compression parameters the caller asked for. Must be
+ * called after jpeg_set_defaults().
+ */
+static void
+set_save_params(j_compress_ptr cinfo, s_params * params)
+{
+  int quality, optimize, progressive, restart;
+  char * str;
+
+  quality = 90;
+  if (params) {
+    (void) s_params_get(params, "quality", S_INTEGER_PARAM_TYPE, &quality, NULL);
+    if (quality < 0) quality = 0;
+    if (quality > 100) quality = 100;
+  }
+  jpeg_set_quality(cinfo, quality, TRUE /* limit to baseline-JPEG values */);
+
+  if (params == NULL) return;
+
+  if (s_params_get(params, "subsampling", S_STRING_PARAM_TYPE, &str, NULL) &&
+      str && cinfo->in_color_space == JCS_RGB) {
+    /* the chroma components are subsampled relative to luminance,
+       which stays at full resolution, so only the luminance sampling
+       factors are set */
+    if (strcmp(str, "4:4:4") == 0) {
+      cinfo->comp_info[0].h_samp_factor = 1;
+      cinfo->comp_info[0].v_samp_factor = 1;
+    }
+    else if (strcmp(str, "4:2:2") == 0) {
+      cinfo->comp_info[0].h_samp_factor = 2;
+      cinfo->comp_info[0].v_samp_factor = 1;
+    }
+    else if (strcmp(str, "4:2:0") == 0) {
+      cinfo->comp_info[0].h_samp_factor = 2;
+      cinfo->comp_info[0].v_samp_factor = 2;
+    }
+  }
+  if (s_params_get(params, "dct method", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+    if (strcmp(str, "islow") == 0) cinfo->dct_method = JDCT_ISLOW;
+    else if (strcmp(str, "ifast") == 0) cinfo->dct_method = JDCT_IFAST;
+    else if (strcmp(str, "float") == 0) cinfo->dct_method = JDCT_FLOAT;
+  }
+  if (s_params_get(params, "optimize", S_INTEGER_PARAM_TYPE, &optimize, NULL)) {
+    cinfo->optimize_coding = optimize ? TRUE : FALSE;
+  }
+  if (s_params_get(params, "restart interval", S_INTEGER_PARAM_TYPE, &restart, NULL) &&
+      restart >= 0 && restart <= 65535) {
+    cinfo->restart_interval = (unsigned int) restart;
+  }
+  if (s_params_get(params, "restart rows", S_INTEGER_PARAM_TYPE, &restart, NULL) &&
+      restart >= 0 && restart <= 65535) {
+    cinfo->restart_in_rows = restart;
+  }
+  if (s_params_get(params, "progressive", S_INTEGER_PARAM_TYPE, &progressive, NULL) &&
+      progressive) {
+    jpeg_simple_progression(cinfo);
+  }
+}
+
+/*
+ * describe the image to the compressor and set the compression
+ * parameters. Alpha channels are not supported by JPEG, and are
+ * stripped by write_rows().
+ */
+static void
+setup_compress(j_compress_ptr cinfo, int width, int height,
+               int numcomponents, s_params * params)
+{
+  cinfo->image_width = width;         /* image width and height, in pixels */
+  cinfo->image_height = height;
+  /* # of color components per pixel, and colorspace of input image */
+  cinfo->input_components = numcomponents >= 3 ? 3 : 1;
+  cinfo->in_color_space = numcomponents >= 3 ? JCS_RGB : JCS_GRAYSCALE;
+  /* Now use the library's routine to set default compression parameters.
+   * (You must set at least cinfo.in_color_space before calling this,
+   * since the defaults depend on the source color space.)
+   */
+  jpeg_set_defaults(cinfo);
+  /* Now you can set any non-default parameters you wish to. */
+  set_save_params(cinfo, params);
+}
+
+/*
+ * feed the (bottom-up) image to the compressor, top row first. Rows
+ * with alpha or in BGR order are converted through a row buffer.
+ */
+static void
+write_rows(j_compress_ptr cinfo, const unsigned char * bytes,
+           int numcomponents, int bgr)
+{
+  JSAMPROW row_pointer[1];      /* pointer to JSAMPLE row[s] */
+  JSAMPROW row = NULL;
+  const unsigned char * src;
+  int x, width, height, bytesperrow;
+
+  width = cinfo->image_width;
+  height = cinfo->image_height;
+  bytesperrow = width * numcomponents;
+  if (numcomponents != cinfo->input_components || bgr) {
+    row = (JSAMPROW) (*cinfo->mem->alloc_small)
+      ((j_common_ptr) cinfo, JPOOL_IMAGE, width * cinfo->input_components);
+  }
+
+  while (cinfo->next_scanline < cinfo->image_height) {
+    src = bytes + bytesperrow * (height - cinfo->next_scanline - 1);
+    if (row == NULL) {
+      row_pointer[0] = (JSAMPROW) src;
+    }
+    else if (cinfo->input_components == 3) {
+      for (x = 0; x < width; x++) {
+        row[x*3] = src[bgr ? 2 : 0];
+        row[x*3+1] = src[1];
+        row[x*3+2] = src[bgr ? 0 : 2];
+        src += numcomponents;
+      }
+      row_pointer[0] = row;
+    }
+    else {
+      for (x = 0; x < width; x++) row[x] = src[x*numcomponents];
+      row_pointer[0] = row;
+    }
+    (void) jpeg_write_scanlines(cinfo, row_pointer, 1);
+  }
+}
+
 int 
 simage_jpeg_save(const char * filename,
                  const unsigned char * bytes,
                  int width,
                  int height,
-                 int numcomponents)
+                 int numcomponents,
+                 s_params * params)
 {
   /* This struct contains the JPEG compression parameters and pointers to
    * working space (which is allocated as needed by the JPEG library).
@@ -316,14 +752,6 @@ simage_jpeg_save(const char * filename,
 
   /* More stuff */
   FILE * outfile;               /* target file */
-  JSAMPROW row_pointer[1];      /* pointer to JSAMPLE row[s] */
-
-  int quality;
-  unsigned char * tmpbytes;
-  int bytesperrow;
-  
-  quality = 90;
-  tmpbytes = NULL;
 
   /* Step 1: allocate and initialize JPEG compression object */
 
@@ -364,7 +792,6 @@ simage_jpeg_save(const char * filename,
      */
     jpeg_destroy_compress(&cinfo);
     fclose(outfile);
-    if (tmpbytes) free(tmpbytes);
     jpegerror = ERR_JPEGLIB_WRITE;
     return 0;
   }
@@ -372,56 +799,9 @@ simage_jpeg_save(const char * filename,
   simage_jpeg_dest_init(&cinfo, outfile);
 
 
-  /*
-   * alpha channel is not supported for jpeg. strip it.
-   */
-  
-  if (numcomponents == 4) {
-    unsigned char * dst;
-    const unsigned char * src;
-    int i, n = width * height;
-    dst = tmpbytes = (unsigned char *) malloc(n*3);
-    src = bytes;
-    for (i = 0; i < n; i++) {
-      *dst++ = *src++; 
-      *dst++ = *src++; 
-      *dst++ = *src++;
-      src++;
-    }
-    numcomponents = 3;
-  }
-  else if (numcomponents == 2) {
-    unsigned char * dst;
-    const unsigned char * src;
-    int i, n = width * height;
-    dst = tmpbytes = (unsigned char *) malloc(n*3);
-    src = bytes;
-    for (i = 0; i < n; i++) {
-      *dst++ = *src++; 
-      src++;
-    }
-    numcomponents = 1;
-  }
-
   /* Step 3: set parameters for compression */
 
-  /* First we supply a description of the input image.
-   * Four fields of the cinfo struct must be filled in:
-   */
-   
-  cinfo.image_width = width;         /* image width and height, in pixels */
-  cinfo.image_height = height;
-  cinfo.input_components = numcomponents;  /* # of color components per pixel */
-  cinfo.in_color_space = numcomponents == 3 ? JCS_RGB : JCS_GRAYSCALE;  /* colorspace of input image */
-  /* Now use the library's routine to set default compression parameters.
-   * (You must set at least cinfo.in_color_space before calling this,
-   * since the defaults depend on the source color space.)
-   */
-  jpeg_set_defaults(&cinfo);
-  /* Now you can set any non-default parameters you wish to.
-   * Here we just illustrate the use of quality (quantization table) scaling:
-   */
-  jpeg_set_quality(&cinfo, quality, TRUE /* limit to baseline-JPEG values */);
+  setup_compress(&cinfo, width, height, numcomponents, params);
 
   /* Step 4: Start compressor */
 
@@ -439,18 +819,7 @@ simage_jpeg_save(const char * filename,
    * more if you wish, though.
    */
 
-  bytesperrow = width * numcomponents;
-  if (tmpbytes) bytes = tmpbytes; /* more convenient */
-
-  while (cinfo.next_scanline < cinfo.image_height) {
-    /* jpeg_write_scanlines expects an array of pointers to scanlines.
-     * Here the array is only one element long, but you could pass
-     * more than one scanline at a time if that's more convenient.
-     */
-    row_pointer[0] = (JSAMPROW) bytes + bytesperrow * (height-cinfo.next_scanline-1);
-    (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
-  }
-  if (tmpbytes) free(tmpbytes);
+  write_rows(&cinfo, bytes, numcomponents, 0);
 
   /* Step 6: Finish compression */
 
@@ -468,4 +837,62 @@ simage_jpeg_save(const char * filename,
   return 1;
 }
 
+/*
+ * compresses the image to a JFIF stream in memory, for the movie
+ * exporters. *buffer and *bufsize hold a malloc'ed buffer (or NULL
+ * and 0), which is grown as needed and can be reused for the next
+ * frame. Returns the size of the stream, or 0 on failure. Safe to
+ * call from several threads at once.
+ */
+int
+simage_jpeg_encode(const unsigned char * bytes,
+                   int width,
+                   int height,
+                   int numcomponents,
+                   int bgr,
+                   s_params * params,
+                   unsigned char ** buffer,
+                   int * bufsize)
+{
+  struct jpeg_compress_struct cinfo;
+  struct my_error_mgr jerr;
+  memory_dest_mgr dest;
+
+  if (*buffer == NULL || *bufsize <= 0) {
+    /* plenty for most frames at the default quality */
+    *bufsize = width * height / 2 + 4096;
+    *buffer = (unsigned char *) malloc(*bufsize);
+    if (*buffer == NULL) {
+      *bufsize = 0;
+      jpegerror = ERR_MEM;
+      return 0;
+    }
+  }
+  dest.buffer = *buffer;
+  dest.size = *bufsize;
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = my_error_exit;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_compress(&cinfo);
+    /* the buffer may have been moved by a failed realloc */
+    *buffer = dest.buffer;
+    *bufsize = (int) dest.size;
+    jpegerror = ERR_JPEGLIB_WRITE;
+    return 0;
+  }
+  jpeg_create_compress(&cinfo);
+  simage_jpeg_memory_dest_init(&cinfo, &dest);
+
+  setup_compress(&cinfo, width, height, numcomponents, params);
+  jpeg_start_compress(&cinfo, TRUE);
+  write_rows(&cinfo, bytes, numcomponents, bgr);
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  *buffer = dest.buffer;
+  *bufsize = (int) dest.size;
+  return (int) dest.datacount;
+}
+
 #endif /* HAVE_JPEGLIB */
@@ -0,0 +1,551 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Motion-JPEG AVI movies, written without Video for Windows.
+ *
+ * Every frame is a complete JPEG image, compressed with libjpeg, so
+ * the movie can be cut at any frame. Frames are collected in batches
+ * of one per thread, compressed in parallel and written in order.
+ *
+ * The file follows the OpenDML (AVI 2.0) extensions: the frames are
+ * split over RIFF lists of at most 1 GB each, and every RIFF gets a
+ * standard index, listed in a super index in the stream header. The
+ * first RIFF also gets an old style idx1 index, for players that only
+ * understand AVI 1.0 files.
+ */
+
+/* the files can grow beyond 2 GB */
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifdef SIMAGE_MJPEG_SUPPORT
+
+#include <simage_mjpeg.h>
+#include <simage_jpeg.h>
+#include <simage_private.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define seek_file(fp, offset) _fseeki64(fp, (__int64) (offset), SEEK_SET)
+#else
+#define seek_file(fp, offset) fseeko(fp, (off_t) (offset), SEEK_SET)
+#endif
+
+/* start a new RIFF list before one grows beyond this */
+#define RIFF_LIMIT (1000 * 1000 * 1000)
+
+/* room for this many RIFF lists in the super index, 256 GB */
+#define MAX_SEGMENTS 256
+
+#define MAX_BATCH 64
+
+#define AVIF_HASINDEX 0x10
+#define AVIF_ISINTERLEAVED 0x100
+#define AVIIF_KEYFRAME 0x10
+#define AVI_INDEX_OF_INDEXES 0
+#define AVI_INDEX_OF_CHUNKS 1
+
+#define AVIH_SIZE 56
+#define STRH_SIZE 56
+#define STRF_SIZE 40
+#define INDX_SIZE (24 + 16 * MAX_SEGMENTS)
+#define DMLH_SIZE 248
+#define STRL_SIZE (4 + 8 + STRH_SIZE + 8 + STRF_SIZE + 8 + INDX_SIZE)
+#define ODML_SIZE (4 + 8 + DMLH_SIZE)
+#define HDRL_SIZE (4 + 8 + AVIH_SIZE + 8 + STRL_SIZE + 8 + ODML_SIZE)
+/* RIFF and hdrl up to the movi list header */
+#define HEADER_SIZE (12 + 8 + HDRL_SIZE + 12)
+
+typedef struct {
+  unsigned long long offset; /* where the standard index chunk is */
+  unsigned int size;
+  unsigned int frames;
+} mjpeg_segment;
+
+typedef struct {
+  const unsigned char * src;
+  unsigned char * copy;      /* a copy of the image, when batching */
+  int copysize;
+  int nc;
+  int bgr;
+  unsigned char * jpeg;      /* the compressed frame */
+  int jpegalloc;
+  int size;
+} mjpeg_frame;
+
+typedef struct {
+  FILE * fp;
+  int width;
+  int height;
+  int fpsnum, fpsden;
+  s_params * jpegparams;
+  int started;               /* the header has been written */
+  unsigned long long pos;    /* the file position */
+
+  /* the RIFF list being written, and the frames in it */
+  unsigned long long riffstart;
+  unsigned long long movistart;
+  unsigned int * index;      /* offset from riffstart and size */
+  int numindex, maxindex;
+
+  unsigned int riffsize0, movisize0;
+  mjpeg_segment segments[MAX_SEGMENTS];
+  int numsegments;
+  int totalframes;
+  int firstframes;           /* the frames in the first RIFF */
+  unsigned int maxchunk;
+
+  /* the frames waiting to be compressed */
+  mjpeg_frame frames[MAX_BATCH];
+  int numframes;
+  int batchsize;
+} simage_mjpeg_movie;
+
+static unsigned char *
+put_uint16le(unsigned char * ptr, unsigned int val)
+{
+  ptr[0] = (unsigned char) (val & 0xff);
+  ptr[1] = (unsigned char) ((val >> 8) & 0xff);
+  return ptr + 2;
+}
+
+static unsigned char *
+put_uint32le(unsigned char * ptr, unsigned int val)
+{
+  ptr[0] = (unsigned char) (val & 0xff);
+  ptr[1] = (unsigned char) ((val >> 8) & 0xff);
+  ptr[2] = (unsigned char) ((val >> 16) & 0xff);
+  ptr[3] = (unsigned char) ((val >> 24) & 0xff);
+  return ptr + 4;
+}
+
+static unsigned char *
+put_uint64le(unsigned char * ptr, unsigned long long val)
+{
+  put_uint32le(ptr, (unsigned int) (val & 0xffffffff));
+  return put_uint32le(ptr + 4, (unsigned int) (val >> 32));
+}
+
+static unsigned char *
+put_tag(unsigned char * ptr, const char * fourcc, unsigned int size)
+{
+  memcpy(ptr, fourcc, 4);
+  return put_uint32le(ptr + 4, size);
+}
+
+static unsigned char *
+put_list(unsigned char * ptr, unsigned int size, const char * type)
+{
+  ptr = put_tag(ptr, "LIST", size);
+  memcpy(ptr, type, 4);
+  return ptr + 4;
+}
+
+static int
+write_bytes(simage_mjpeg_movie * mv, const void * data, size_t size)
+{
+  if (fwrite(data, 1, size, mv->fp) != size) return 0;
+  mv->pos += size;
+  return 1;
+}
+
+/* writes a size field earlier in the file */
+static int
+patch_size(simage_mjpeg_movie * mv, unsigned long long offset, unsigned int size)
+{
+  unsigned char buf[4];
+  put_uint32le(buf, size);
+  return
+    seek_file(mv->fp, offset) == 0 &&
+    fwrite(buf, 1, 4, mv->fp) == 4 &&
+    seek_file(mv->fp, mv->pos) == 0;
+}
+
+/* the headers of the first RIFF, up to the movi list header */
+static void
+build_header(simage_mjpeg_movie * mv, unsigned char * hdr)
+{
+  unsigned char * p = hdr;
+  unsigned int usecs, bufsize;
+  int i;
+
+  usecs = (unsigned int) (1000000.0 * mv->fpsden / mv->fpsnum + 0.5);
+  bufsize = mv->maxchunk ? mv->maxchunk + 8 : 0;
+  memset(hdr, 0, HEADER_SIZE);
+
+  p = put_tag(p, "RIFF", mv->riffsize0);
+  memcpy(p, "AVI ", 4); p += 4;
+  p = put_list(p, HDRL_SIZE, "hdrl");
+
+  p = put_tag(p, "avih", AVIH_SIZE);
+  p = put_uint32le(p, usecs);
+  p = put_uint32le(p, (unsigned int) ((double) bufsize * mv->fpsnum / mv->fpsden));
+  p = put_uint32le(p, 0); /* padding granularity */
+  p = put_uint32le(p, AVIF_HASINDEX | AVIF_ISINTERLEAVED);
+  p = put_uint32le(p, mv->firstframes);
+  p = put_uint32le(p, 0); /* initial frames */
+  p = put_uint32le(p, 1); /* streams */
+  p = put_uint32le(p, bufsize);
+  p = put_uint32le(p, mv->width);
+  p = put_uint32le(p, mv->height);
+  p += 16; /* reserved */
+
+  p = put_list(p, STRL_SIZE, "strl");
+  p = put_tag(p, "strh", STRH_SIZE);
+  memcpy(p, "vidsMJPG", 8); p += 8;
+  p = put_uint32le(p, 0); /* flags */
+  p = put_uint16le(p, 0); /* priority */
+  p = put_uint16le(p, 0); /* language */
+  p = put_uint32le(p, 0); /* initial frames */
+  p = put_uint32le(p, mv->fpsden);
+  p = put_uint32le(p, mv->fpsnum);
+  p = put_uint32le(p, 0); /* start */
+  p = put_uint32le(p, mv->totalframes);
+  p = put_uint32le(p, bufsize);
+  p = put_uint32le(p, 0xffffffff); /* quality */
+  p = put_uint32le(p, 0); /* sample size */
+  p = put_uint16le(p, 0);
+  p = put_uint16le(p, 0);
+  p = put_uint16le(p, mv->width);
+  p = put_uint16le(p, mv->height);
+
+  /* BITMAPINFOHEADER */
+  p = put_tag(p, "strf", STRF_SIZE);
+  p = put_uint32le(p, STRF_SIZE);
+  p = put_uint32le(p, mv->width);
+  p = put_uint32le(p, mv->height);
+  p = put_uint16le(p, 1);  /* planes */
+  p = put_uint16le(p, 24); /* bits per pixel */
+  memcpy(p, "MJPG", 4); p += 4;
+  p = put_uint32le(p, mv->width * mv->height * 3);
+  p += 16; /* resolution and palette */
+
+  /* the super index, pointing at the index of each RIFF */
+  p = put_tag(p, "indx", INDX_SIZE);
+  p = put_uint16le(p, 4); /* longs per entry */
+  *p++ = 0;
+  *p++ = AVI_INDEX_OF_INDEXES;
+  p = put_uint32le(p, mv->numsegments);
+  memcpy(p, "00dc", 4); p += 4;
+  p += 12; /* reserved */
+  for (i = 0; i < MAX_SEGMENTS; i++) {
+    if (i < mv->numsegments) {
+      put_uint64le(p, mv->segments[i].offset);
+      put_uint32le(p + 8, mv->segments[i].size);
+      put_uint32le(p + 12, mv->segments[i].frames);
+    }
+    p += 16;
+  }
+
+  p = put_list(p, ODML_SIZE, "odml");
+  p = put_tag(p, "dmlh", DMLH_SIZE);
+  put_uint32le(p, mv->totalframes);
+  p += DMLH_SIZE;
+
+  (void) put_list(p, mv->movisize0, "movi");
+}
+
+static int
+begin_riff(simage_mjpeg_movie * mv)
+{
+  unsigned char buf[HEADER_SIZE];
+
+  mv->riffstart = mv->pos;
+  if (mv->numsegments == 0) {
+    build_header(mv, buf);
+    mv->movistart = mv->pos + HEADER_SIZE - 12;
+    return write_bytes(mv, buf, HEADER_SIZE);
+  }
+  put_tag(buf, "RIFF", 0);
+  memcpy(buf + 8, "AVIX", 4);
+  put_list(buf + 12, 0, "movi");
+  mv->movistart = mv->pos + 12;
+  return write_bytes(mv, buf, 24);
+}
+
+/* writes the indices of the RIFF, and fills in its sizes */
+static int
+end_riff(simage_mjpeg_movie * mv)
+{
+  unsigned char * buf, * p;
+  unsigned int movioffset;
+  int i, n, ok;
+
+  if (mv->numsegments >= MAX_SEGMENTS) return 0;
+  n = mv->numindex;
+  buf = (unsigned char *) malloc(32 + 16 * n);
+  if (buf == NULL) return 0;
+
+  /* the standard index, the last chunk in the movi list */
+  p = put_tag(buf, "ix00", 24 + 8 * n);
+  p = put_uint16le(p, 2); /* longs per entry */
+  *p++ = 0;
+  *p++ = AVI_INDEX_OF_CHUNKS;
+  p = put_uint32le(p, n);
+  memcpy(p, "00dc", 4); p += 4;
+  p = put_uint64le(p, mv->riffstart);
+  p = put_uint32le(p, 0);
+  for (i = 0; i < n; i++) {
+    p = put_uint32le(p, mv->index[i*2]);
+    p = put_uint32le(p, mv->index[i*2+1]);
+  }
+  mv->segments[mv->numsegments].offset = mv->pos;
+  mv->segments[mv->numsegments].size = 32 + 8 * n;
+  mv->segments[mv->numsegments].frames = n;
+  ok = write_bytes(mv, buf, 32 + 8 * n);
+  if (ok) {
+    unsigned int size = (unsigned int) (mv->pos - mv->movistart - 8);
+    if (mv->numsegments == 0) mv->movisize0 = size;
+    ok = patch_size(mv, mv->movistart + 4, size);
+  }
+
+  if (ok && mv->numsegments == 0) {
+    /* the AVI 1.0 index, offsets from the movi tag */
+    movioffset = (unsigned int) (mv->movistart + 8 - mv->riffstart);
+    p = put_tag(buf, "idx1", 16 * n);
+    ok = write_bytes(mv, buf, 8);
+    p = buf;
+    for (i = 0; i < n; i++) {
+      memcpy(p, "00dc", 4);
+      put_uint32le(p + 4, AVIIF_KEYFRAME);
+      put_uint32le(p + 8, mv->index[i*2] - 8 - movioffset);
+      put_uint32le(p + 12, mv->index[i*2+1]);
+      p += 16;
+    }
+    if (ok) ok = write_bytes(mv, buf, 16 * n);
+  }
+  free(buf);
+
+  if (ok) {
+    unsigned int size = (unsigned int) (mv->pos - mv->riffstart - 8);
+    if (mv->numsegments == 0) mv->riffsize0 = size;
+    ok = patch_size(mv, mv->riffstart + 4, size);
+  }
+  mv->numsegments++;
+  mv->numindex = 0;
+  return ok;
+}
+
+static int
+write_frame(simage_mjpeg_movie * mv, const unsigned char * data, int size)
+{
+  unsigned char buf[8];
+  unsigned int chunk = 8 + size + (size & 1);
+  unsigned long long indexsize;
+
+  /* leave room for the indices at the end of the RIFF */
+  indexsize = 32 + 8 * (mv->numindex + 1);
+  if (mv->numsegments == 0) indexsize += 8 + 16 * (mv->numindex + 1);
+  if (mv->numindex > 0 &&
+      mv->pos - mv->riffstart + chunk + indexsize > RIFF_LIMIT) {
+    if (!end_riff(mv) || !begin_riff(mv)) return 0;
+  }
+
+  if (mv->numindex == mv->maxindex) {
+    int newmax = mv->maxindex ? mv->maxindex * 2 : 1024;
+    unsigned int * index = (unsigned int *)
+      realloc(mv->index, newmax * 2 * sizeof(unsigned int));
+    if (index == NULL) return 0;
+    mv->index = index;
+    mv->maxindex = newmax;
+  }
+  mv->index[mv->numindex*2] = (unsigned int) (mv->pos + 8 - mv->riffstart);
+  mv->index[mv->numindex*2+1] = size;
+
+  put_tag(buf, "00dc", size);
+  if (!write_bytes(mv, buf, 8) || !write_bytes(mv, data, size)) return 0;
+  if ((size & 1) && !write_bytes(mv, "", 1)) return 0;
+
+  mv->numindex++;
+  mv->totalframes++;
+  if (mv->numsegments == 0) mv->firstframes++;
+  if (chunk > mv->maxchunk) mv->maxchunk = chunk;
+  return 1;
+}
+
+static void
+encode_frame(void * closure, int idx)
+{
+  simage_mjpeg_movie * mv = (simage_mjpeg_movie *) closure;
+  mjpeg_frame * frame = &mv->frames[idx];
+
+  frame->size = simage_jpeg_encode(frame->src, mv->width, mv->height,
+                                   frame->nc, frame->bgr, mv->jpegparams,
+                                   &frame->jpeg, &frame->jpegalloc);
+}
+
+/* compresses the waiting frames, one per thread, and writes them in order */
+static int
+flush_frames(simage_mjpeg_movie * mv)
+{
+  int i, ok = 1;
+
+  if (mv->numframes == 0) return 1;
+  s_parallel_for(mv->numframes, encode_frame, mv);
+  for (i = 0; i < mv->numframes; i++) {
+    mjpeg_frame * frame = &mv->frames[i];
+    if (ok && (frame->size <= 0 || !write_frame(mv, frame->jpeg, frame->size))) {
+      ok = 0;
+    }
+  }
+  mv->numframes = 0;
+  return ok;
+}
+
+static void
+free_movie(simage_mjpeg_movie * mv)
+{
+  int i;
+  for (i = 0; i < MAX_BATCH; i++) {
+    if (mv->frames[i].copy) free(mv->frames[i].copy);
+    if (mv->frames[i].jpeg) free(mv->frames[i].jpeg);
+  }
+  if (mv->index) free(mv->index);
+  if (mv->jpegparams) s_params_destroy(mv->jpegparams);
+  if (mv->fp) fclose(mv->fp);
+  free(mv);
+}
+
+int
+simage_mjpeg_movie_create(const char * filename, s_movie * movie,
+                          s_params * params)
+{
+  simage_mjpeg_movie * mv;
+  const char * mime_type = NULL;
+  size_t len;
+  int fps, fpsden;
+
+  if (params) s_params_get(params, "mime-type", S_STRING_PARAM_TYPE, &mime_type, NULL);
+  if (mime_type) {
+    if (strcmp(mime_type, "video/avi") != 0 &&
+        strcmp(mime_type, "video/x-msvideo") != 0 &&
+        strcmp(mime_type, "video/msvideo") != 0) return 0;
+  }
+  else {
+    /* without a mime type, go by the filename */
+    len = strlen(filename);
+    if (len < 4 || strcmp(filename + len - 4, ".avi") != 0) return 0;
+  }
+
+  mv = (simage_mjpeg_movie *) malloc(sizeof(simage_mjpeg_movie));
+  if (mv == NULL) return 0;
+  memset(mv, 0, sizeof(simage_mjpeg_movie));
+
+  fps = 25;
+  fpsden = 1;
+  if (params) {
+    s_params_get(params, "width", S_INTEGER_PARAM_TYPE, &mv->width, NULL);
+    s_params_get(params, "height", S_INTEGER_PARAM_TYPE, &mv->height, NULL);
+    s_params_get(params, "fps", S_INTEGER_PARAM_TYPE, &fps, NULL);
+    s_params_get(params, "fps denominator", S_INTEGER_PARAM_TYPE, &fpsden, NULL);
+    /* quality, subsampling etc. are passed on to the JPEG encoder */
+    mv->jpegparams = s_params_copy(params);
+  }
+  mv->fpsnum = fps > 0 ? fps : 25;
+  mv->fpsden = fpsden > 0 ? fpsden : 1;
+
+  mv->batchsize = simage_get_num_threads();
+  if (mv->batchsize < 1) mv->batchsize = 1;
+  if (mv->batchsize > MAX_BATCH) mv->batchsize = MAX_BATCH;
+
+  mv->fp = fopen(filename, "wb");
+  if (mv->fp == NULL) {
+    free_movie(mv);
+    return 0;
+  }
+
+  s_params_set(s_movie_params(movie), "mjpeg movie handle",
+               S_POINTER_PARAM_TYPE, mv, NULL);
+  return 1;
+}
+
+int
+simage_mjpeg_movie_put(s_movie * movie, s_image * image, s_params * params)
+{
+  simage_mjpeg_movie * mv;
+  mjpeg_frame * frame;
+  int size;
+
+  if (!s_params_get(s_movie_params(movie), "mjpeg movie handle",
+                    S_POINTER_PARAM_TYPE, &mv, NULL)) return 0;
+
+  if (!mv->started) {
+    /* the size is taken from the first frame unless it was given */
+    if (mv->width <= 0) mv->width = s_image_width(image);
+    if (mv->height <= 0) mv->height = s_image_height(image);
+    if (!begin_riff(mv)) return 0;
+    mv->started = 1;
+  }
+  if (s_image_width(image) != mv->width || s_image_height(image) != mv->height ||
+      s_image_data(image) == NULL) {
+    return 0;
+  }
+
+  frame = &mv->frames[mv->numframes];
+  frame->nc = s_image_components(image);
+  frame->bgr = s_image_get_component_order(image) == SIMAGE_ORDER_BGR;
+  frame->src = s_image_data(image);
+  if (mv->batchsize > 1) {
+    /* the caller may reuse the image before the batch is compressed */
+    size = mv->width * mv->height * frame->nc;
+    if (size > frame->copysize) {
+      if (frame->copy) free(frame->copy);
+      frame->copy = (unsigned char *) malloc(size);
+      frame->copysize = frame->copy ? size : 0;
+      if (frame->copy == NULL) return 0;
+    }
+    memcpy(frame->copy, frame->src, size);
+    frame->src = frame->copy;
+  }
+  mv->numframes++;
+
+  if (mv->numframes == mv->batchsize) return flush_frames(mv);
+  return 1;
+}
+
+void
+simage_mjpeg_movie_close(s_movie * movie)
+{
+  simage_mjpeg_movie * mv;
+  unsigned char buf[HEADER_SIZE];
+
+  if (!s_params_get(s_movie_params(movie), "mjpeg movie handle",
+                    S_POINTER_PARAM_TYPE, &mv, NULL)) return;
+
+  if (!mv->started && mv->width > 0 && mv->height > 0) {
+    /* no frames, but the size is known: write an empty movie */
+    mv->started = begin_riff(mv);
+  }
+  if (mv->started) {
+    (void) flush_frames(mv);
+    if (end_riff(mv)) {
+      /* the header, now with the frame counts and the super index */
+      build_header(mv, buf);
+      if (seek_file(mv->fp, 0) == 0) (void) fwrite(buf, 1, HEADER_SIZE, mv->fp);
+    }
+  }
+  free_movie(mv);
+}
+
+#endif /* SIMAGE_MJPEG_SUPPORT */
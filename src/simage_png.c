@@ -25,11 +25,13 @@
 #ifdef HAVE_PNGLIB
 
 #include <simage_png.h>
+#include <simage_private.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include <png.h>
+#include <zlib.h>
 
 #define ERR_NO_ERROR     0
 #define ERR_OPEN         1
@@ -41,8 +43,11 @@
 
 static int pngerror = ERR_NO_ERROR;
 
-/* my setjmp buffer */
-static jmp_buf setjmp_buffer;
+#if PNG_LIBPNG_VER < 10400
+#define PNG_JMPBUF(png_ptr) ((png_ptr)->jmpbuf)
+#else
+#define PNG_JMPBUF(png_ptr) png_jmpbuf(png_ptr)
+#endif /* PNG_LIBPNG_VER < 10400 */
 
 /* called my libpng */
 static void
@@ -58,7 +63,10 @@ err_callback(png_structp ps, png_const_charp pc)
 /*   fprintf(stderr,"PNG error: %s\n", pc); */
 
   /* FIXME: store error message? */
-  longjmp(setjmp_buffer, 1);
+
+  /* each png_struct has its own setjmp buffer, since several files
+     may be read at the same time, on different threads */
+  longjmp(PNG_JMPBUF(ps), 1);
 }
 
 int
@@ -131,6 +139,67 @@ user_flush_cb(png_structp png_ptr)
   }
 }
 
+/* reads the file header and sets up the transformations we want
+   for the image data */
+static void
+setup_transformations(png_structp png_ptr, png_infop info_ptr)
+{
+  png_uint_32 width, height;
+  int bit_depth, color_type, interlace_type;
+
+  /* The call to png_read_info() gives us all of the information from the
+   * PNG file before the first IDAT (image data chunk).  REQUIRED
+   */
+  png_read_info(png_ptr, info_ptr);
+
+  png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
+               &interlace_type, NULL, NULL);
+
+  /* let libpng deinterlace the image for us */
+  if (interlace_type != PNG_INTERLACE_NONE)
+    (void) png_set_interlace_handling(png_ptr);
+
+  /**** Set up the data transformations you want.  Note that these are all
+   **** optional.  Only call them if you want/need them.  Many of the
+   **** transformations only work on specific types of images, and many
+   **** are mutually exclusive.
+   ****/
+
+  /* tell libpng to strip 16 bit/color files down to 8 bits/color */
+  png_set_strip_16(png_ptr);
+
+  /* strip alpha bytes from the input data without combining with th
+   * background (not recommended) */
+  /* png_set_strip_alpha(png_ptr); */
+
+  /* extract multiple pixels with bit depths of 1, 2, and 4 from a single
+   * byte into separate bytes (useful for paletted and grayscale images).
+   */
+  /* png_set_packing(png_ptr); */
+
+  /* change the order of packed pixels to least significant bit first
+   * (not useful if you are using png_set_packing). */
+  /* png_set_packswap(png_ptr); */
+
+  /* expand paletted colors into true RGB triplets */
+  if (color_type == PNG_COLOR_TYPE_PALETTE)
+    png_set_expand(png_ptr);
+
+  /* expand grayscale images to the full 8 bits from 1, 2, or 4 bits/pixel */
+  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+    png_set_expand(png_ptr);
+
+  /* expand paletted or RGB images with transparency to full alpha channels
+   * so the data will be available as RGBA quartets */
+  if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+    png_set_expand(png_ptr);
+
+  /* Add filler (or alpha) byte (before/after each RGB triplet) */
+  /* png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER); */
+
+  png_read_update_info(png_ptr, info_ptr);
+}
+
 unsigned char *
 simage_png_load(const char *filename,
                 int *width_ret,
@@ -141,13 +210,12 @@ simage_png_load(const char *filename,
   png_infop info_ptr;
   png_uint_32 width, height;
 
-  int bit_depth, color_type, interlace_type;
   FILE *fp;
-  unsigned char *buffer;
+  unsigned char * volatile buffer; /* used after setjmp() returns */
   int y, bytes_per_row;
   int channels;
   int format;
-  png_bytepp row_pointers;
+  png_bytep * volatile row_pointers;
 
   if ((fp = fopen(filename, "rb")) == NULL) {
     pngerror = ERR_OPEN;
@@ -187,8 +255,9 @@ simage_png_load(const char *filename,
    */
 
   buffer = NULL;
+  row_pointers = NULL;
 
-  if (setjmp(setjmp_buffer)) {
+  if (setjmp(PNG_JMPBUF(png_ptr))) {
     pngerror = ERR_PNGLIB;
     /* Free all of the memory associated with the png_ptr and info_ptr */
     png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
@@ -196,6 +265,7 @@ simage_png_load(const char *filename,
     /* If we get here, we had a problem reading the file */
 
     if (buffer) free(buffer);
+    if (row_pointers) free(row_pointers);
     return NULL;
   }
 
@@ -204,54 +274,10 @@ simage_png_load(const char *filename,
       (C run-time library) */
   png_set_read_fn(png_ptr, (void *)fp, (png_rw_ptr)user_read_cb);
 
-  /* The call to png_read_info() gives us all of the information from the
-   * PNG file before the first IDAT (image data chunk).  REQUIRED
-   */
-  png_read_info(png_ptr, info_ptr);
-
-  png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
-               &interlace_type, NULL, NULL);
-
-  /**** Set up the data transformations you want.  Note that these are all
-   **** optional.  Only call them if you want/need them.  Many of the
-   **** transformations only work on specific types of images, and many
-   **** are mutually exclusive.
-   ****/
-
-  /* tell libpng to strip 16 bit/color files down to 8 bits/color */
-  png_set_strip_16(png_ptr);
-
-  /* strip alpha bytes from the input data without combining with th
-   * background (not recommended) */
-  /* png_set_strip_alpha(png_ptr); */
-
-  /* extract multiple pixels with bit depths of 1, 2, and 4 from a single
-   * byte into separate bytes (useful for paletted and grayscale images).
-   */
-  /* png_set_packing(png_ptr); */
-
-  /* change the order of packed pixels to least significant bit first
-   * (not useful if you are using png_set_packing). */
-  /* png_set_packswap(png_ptr); */
-
-  /* expand paletted colors into true RGB triplets */
-  if (color_type == PNG_COLOR_TYPE_PALETTE)
-    png_set_expand(png_ptr);
-
-  /* expand grayscale images to the full 8 bits from 1, 2, or 4 bits/pixel */
-  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-    png_set_expand(png_ptr);
-
-  /* expand paletted or RGB images with transparency to full alpha channels
-   * so the data will be available as RGBA quartets */
-  if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
-    png_set_expand(png_ptr);
-
-  /* Add filler (or alpha) byte (before/after each RGB triplet) */
-  /* png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER); */
-
-  png_read_update_info(png_ptr, info_ptr);
+  setup_transformations(png_ptr, info_ptr);
 
+  width = png_get_image_width(png_ptr, info_ptr);
+  height = png_get_image_height(png_ptr, info_ptr);
   channels = png_get_channels(png_ptr, info_ptr);
 
   /* allocate the memory to hold the image using the fields of info_ptr. */
@@ -292,18 +318,547 @@ simage_png_load(const char *filename,
   return buffer;
 }
 
+/* for s_image_open(). Non-interlaced images are decoded one row at
+   a time, so only a single row is kept in memory. Interlaced images
+   can't be read like that, and are decoded in full when opened. */
+
+typedef struct {
+  FILE * fp;
+  png_structp png_ptr;
+  png_infop info_ptr;
+  int width;
+  int height;
+  int numcomponents;
+  int rowbytes;
+  int nextrow;           /* next row (from the top) libpng will return */
+  int failed;
+  unsigned char * rowbuf;  /* the row just before nextrow */
+  unsigned char * image;   /* the whole image, for interlaced files */
+} simage_png_opendata;
+
+void *
+simage_png_open(const char * filename,
+                int * width,
+                int * height,
+                int * numcomponents)
+{
+  simage_png_opendata * od;
+  int y;
+  png_bytep * volatile row_pointers; /* used after setjmp() returns */
+
+  od = (simage_png_opendata *) malloc(sizeof(simage_png_opendata));
+  if (od == NULL) {
+    pngerror = ERR_MEM;
+    return NULL;
+  }
+  memset(od, 0, sizeof(simage_png_opendata));
+
+  if ((od->fp = fopen(filename, "rb")) == NULL) {
+    pngerror = ERR_OPEN;
+    free(od);
+    return NULL;
+  }
+  od->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                       NULL, err_callback, warn_callback);
+  if (od->png_ptr) od->info_ptr = png_create_info_struct(od->png_ptr);
+  if (od->info_ptr == NULL) {
+    pngerror = ERR_MEM;
+    simage_png_close(od);
+    return NULL;
+  }
+
+  row_pointers = NULL;
+  if (setjmp(PNG_JMPBUF(od->png_ptr))) {
+    pngerror = ERR_PNGLIB;
+    if (row_pointers) free(row_pointers);
+    simage_png_close(od);
+    return NULL;
+  }
+
+  png_set_read_fn(od->png_ptr, (void *)od->fp, (png_rw_ptr)user_read_cb);
+  setup_transformations(od->png_ptr, od->info_ptr);
+
+  od->width = png_get_image_width(od->png_ptr, od->info_ptr);
+  od->height = png_get_image_height(od->png_ptr, od->info_ptr);
+  od->numcomponents = png_get_channels(od->png_ptr, od->info_ptr);
+  od->rowbytes = png_get_rowbytes(od->png_ptr, od->info_ptr);
+
+  if (png_get_interlace_type(od->png_ptr, od->info_ptr) != PNG_INTERLACE_NONE) {
+    od->image = (unsigned char *) malloc(od->rowbytes * od->height);
+    row_pointers = (png_bytepp) malloc(od->height * sizeof(png_bytep));
+    if (od->image == NULL || row_pointers == NULL) {
+      pngerror = ERR_MEM;
+      if (row_pointers) free(row_pointers);
+      simage_png_close(od);
+      return NULL;
+    }
+    for (y = 0; y < od->height; y++) {
+      row_pointers[od->height-y-1] = od->image + y*od->rowbytes;
+    }
+    png_read_image(od->png_ptr, row_pointers);
+    free(row_pointers);
+    row_pointers = NULL;
+  }
+  else {
+    od->rowbuf = (unsigned char *) malloc(od->rowbytes);
+    if (od->rowbuf == NULL) {
+      pngerror = ERR_MEM;
+      simage_png_close(od);
+      return NULL;
+    }
+  }
+
+  *width = od->width;
+  *height = od->height;
+  *numcomponents = od->numcomponents;
+  pngerror = ERR_NO_ERROR;
+  return (void *) od;
+}
+
+void
+simage_png_close(void * opendata)
+{
+  simage_png_opendata * od = (simage_png_opendata *) opendata;
+
+  if (od->png_ptr) {
+    png_destroy_read_struct(&od->png_ptr,
+                            od->info_ptr ? &od->info_ptr : (png_infopp)NULL,
+                            (png_infopp)NULL);
+  }
+  if (od->fp) fclose(od->fp);
+  if (od->rowbuf) free(od->rowbuf);
+  if (od->image) free(od->image);
+  free(od);
+}
+
+int
+simage_png_read_line(void * opendata, int y, unsigned char * buf)
+{
+  simage_png_opendata * od = (simage_png_opendata *) opendata;
+  int row;
+
+  if (od->image) {
+    memcpy(buf, od->image + y * od->rowbytes, od->rowbytes);
+    return 1;
+  }
+
+  /* the rows are stored from the top in the file */
+  row = od->height - 1 - y;
+
+  /* we can't seek backwards in the compressed stream. Returning
+     failure makes s_image_read_line() load the whole image instead,
+     if the caller allowed that */
+  if (od->failed || row < od->nextrow - 1) return 0;
+
+  if (setjmp(PNG_JMPBUF(od->png_ptr))) {
+    pngerror = ERR_PNGLIB;
+    od->failed = 1;
+    return 0;
+  }
+  while (od->nextrow <= row) {
+    png_read_row(od->png_ptr, od->rowbuf, NULL);
+    od->nextrow++;
+  }
+  memcpy(buf, od->rowbuf, od->rowbytes);
+  return 1;
+}
+
+/* the compression settings for the PNG saver. -1 means "not set" */
+typedef struct {
+  int level;
+  int filters;
+  int strategy;
+} png_save_settings;
+
+static void
+get_save_params(s_params * params, png_save_settings * settings)
+{
+  int level;
+  char * str;
+
+  settings->level = -1;
+  settings->filters = -1;
+  settings->strategy = -1;
+
+  if (params == NULL) return;
+
+  if (s_params_get(params, "compression level", S_INTEGER_PARAM_TYPE, &level, NULL)) {
+    if (level < Z_NO_COMPRESSION) level = Z_NO_COMPRESSION;
+    if (level > Z_BEST_COMPRESSION) level = Z_BEST_COMPRESSION;
+    settings->level = level;
+  }
+  if (s_params_get(params, "filters", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+    /* a comma separated list of filters libpng may choose from */
+    int filters = 0;
+    while (*str) {
+      size_t len = strcspn(str, ",");
+      if (len == 4 && strncmp(str, "none", len) == 0) filters |= PNG_FILTER_NONE;
+      else if (len == 3 && strncmp(str, "sub", len) == 0) filters |= PNG_FILTER_SUB;
+      else if (len == 2 && strncmp(str, "up", len) == 0) filters |= PNG_FILTER_UP;
+      else if (len == 3 && strncmp(str, "avg", len) == 0) filters |= PNG_FILTER_AVG;
+      else if (len == 5 && strncmp(str, "paeth", len) == 0) filters |= PNG_FILTER_PAETH;
+      else if (len == 3 && strncmp(str, "all", len) == 0) filters |= PNG_ALL_FILTERS;
+      str += len;
+      if (*str == ',') str++;
+    }
+    if (filters) settings->filters = filters;
+  }
+  if (s_params_get(params, "zlib strategy", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+    if (strcmp(str, "default") == 0) settings->strategy = Z_DEFAULT_STRATEGY;
+    else if (strcmp(str, "filtered") == 0) settings->strategy = Z_FILTERED;
+    else if (strcmp(str, "huffman") == 0) settings->strategy = Z_HUFFMAN_ONLY;
+    else if (strcmp(str, "rle") == 0) settings->strategy = Z_RLE;
+    else if (strcmp(str, "fixed") == 0) settings->strategy = Z_FIXED;
+  }
+}
+
+/*
+ * set the compression parameters the caller asked for. Must be
+ * called before png_write_info().
+ */
+static void
+set_save_params(png_structp png_ptr, const png_save_settings * settings)
+{
+  if (settings->level >= 0)
+    png_set_compression_level(png_ptr, settings->level);
+  if (settings->filters >= 0)
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, settings->filters);
+  if (settings->strategy >= 0)
+    png_set_compression_strategy(png_ptr, settings->strategy);
+}
+
+/*
+ * Parallel compression of the image data, the same way pigz does it.
+ *
+ * The rows are split into blocks which are filtered and deflated on
+ * the worker threads. Each block is a raw deflate stream primed with
+ * the last 32K of (filtered) data from the block before it, and
+ * ended with a sync flush so it stops on a byte boundary. The
+ * concatenated blocks then form a single deflate stream. Every block
+ * is written as an IDAT chunk of its own, with its CRC computed by
+ * the worker. The Adler-32 checksums of the blocks are combined on
+ * the calling thread and written in a final IDAT chunk after the
+ * last block.
+ */
+
+/* don't bother with threads for images smaller than this */
+#define PARALLEL_MIN_PIXELS (1024 * 1024)
+/* the amount of raw image data in each block */
+#define PARALLEL_BLOCK_SIZE (256 * 1024)
+#define DEFLATE_WINDOW_SIZE 32768
+
+typedef struct {
+  unsigned char * chunk;  /* the complete IDAT chunk */
+  size_t chunklen;
+  uLong adler;            /* of the uncompressed block data */
+  uLong datalen;
+} png_block;
+
+typedef struct {
+  const unsigned char * bytes;
+  int height;
+  int bpp;
+  int rowbytes;
+  int filters;
+  int level;
+  int strategy;
+  int rowsperblock;
+  int numblocks;
+  int firstblock;         /* of the current batch */
+  png_block * blocks;
+  const unsigned char * zerorow;
+  int failed;
+} png_parallel_job;
+
+static const unsigned char *
+image_row(png_parallel_job * job, int row)
+{
+  if (row < 0) return job->zerorow;
+  /* the image is stored bottom-up */
+  return job->bytes + (size_t) job->rowbytes * (job->height - 1 - row);
+}
+
+static int
+paeth_predictor(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) return a;
+  if (pb <= pc) return b;
+  return c;
+}
+
+static void
+filter_row(int type, const unsigned char * row, const unsigned char * prev,
+           int bpp, int rowbytes, unsigned char * out)
+{
+  int i;
+
+  *out++ = (unsigned char) type;
+  switch (type) {
+  case 0: /* none */
+    memcpy(out, row, rowbytes);
+    break;
+  case 1: /* sub */
+    memcpy(out, row, bpp);
+    for (i = bpp; i < rowbytes; i++) out[i] = row[i] - row[i-bpp];
+    break;
+  case 2: /* up */
+    for (i = 0; i < rowbytes; i++) out[i] = row[i] - prev[i];
+    break;
+  case 3: /* average */
+    for (i = 0; i < bpp; i++) out[i] = row[i] - (prev[i] >> 1);
+    for (; i < rowbytes; i++) out[i] = row[i] - ((row[i-bpp] + prev[i]) >> 1);
+    break;
+  case 4: /* paeth */
+    for (i = 0; i < bpp; i++) out[i] = row[i] - prev[i];
+    for (; i < rowbytes; i++) {
+      out[i] = row[i] - paeth_predictor(row[i-bpp], prev[i], prev[i-bpp]);
+    }
+    break;
+  }
+}
+
+/* filters a row with the allowed filter that gives the smallest sum
+   of absolute differences, the same heuristic libpng uses. tmp must
+   have room for one filtered row. */
+static void
+filter_best(png_parallel_job * job, int row, unsigned char * out, unsigned char * tmp)
+{
+  static const int masks[5] = {
+    PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH
+  };
+  const unsigned char * cur = image_row(job, row);
+  const unsigned char * prev = image_row(job, row-1);
+  unsigned long best = 0;
+  int type, i, found = 0;
+
+  for (type = 0; type < 5; type++) {
+    unsigned long sum = 0;
+    unsigned char * dst = found ? tmp : out;
+    if (!(job->filters & masks[type])) continue;
+    filter_row(type, cur, prev, job->bpp, job->rowbytes, dst);
+    if (job->filters == masks[type]) return; /* the only choice */
+    for (i = 1; i <= job->rowbytes; i++) {
+      sum += dst[i] < 128 ? dst[i] : 256 - dst[i];
+    }
+    if (!found || sum < best) {
+      if (found) memcpy(out, tmp, job->rowbytes + 1);
+      best = sum;
+      found = 1;
+    }
+  }
+}
+
+static void
+filter_rows(png_parallel_job * job, int first, int last, unsigned char * out,
+            unsigned char * tmp)
+{
+  int row;
+  for (row = first; row < last; row++) {
+    filter_best(job, row, out, tmp);
+    out += job->rowbytes + 1;
+  }
+}
+
+static void
+put_uint32(unsigned char * ptr, uLong val)
+{
+  ptr[0] = (unsigned char) (val >> 24);
+  ptr[1] = (unsigned char) (val >> 16);
+  ptr[2] = (unsigned char) (val >> 8);
+  ptr[3] = (unsigned char) val;
+}
+
+static void
+encode_block(void * closure, int idx)
+{
+  png_parallel_job * job = (png_parallel_job *) closure;
+  png_block * block = &job->blocks[idx];
+  int b = job->firstblock + idx;
+  int first = b * job->rowsperblock;
+  int last = first + job->rowsperblock;
+  int filteredbytes = job->rowbytes + 1;
+  unsigned char * data, * tmp, * out;
+  size_t bound;
+  uLong datalen;
+  z_stream z;
+  int ret;
+
+  if (last > job->height) last = job->height;
+  datalen = (uLong) (last - first) * filteredbytes;
+
+  data = (unsigned char *) malloc(datalen);
+  tmp = (unsigned char *) malloc(filteredbytes);
+  if (data == NULL || tmp == NULL) {
+    if (data) free(data);
+    if (tmp) free(tmp);
+    job->failed = 1;
+    return;
+  }
+
+  memset(&z, 0, sizeof(z_stream));
+  if (deflateInit2(&z, job->level, Z_DEFLATED, -15, 8, job->strategy) != Z_OK) {
+    free(data);
+    free(tmp);
+    job->failed = 1;
+    return;
+  }
+
+  if (first > 0) {
+    /* filter the end of the previous block again to use as the
+       dictionary */
+    int dictrows = (DEFLATE_WINDOW_SIZE + filteredbytes - 1) / filteredbytes;
+    int dictfirst = first - dictrows;
+    size_t dictlen;
+    unsigned char * dict;
+    if (dictfirst < 0) dictfirst = 0;
+    dictlen = (size_t) (first - dictfirst) * filteredbytes;
+    dict = (unsigned char *) malloc(dictlen);
+    if (dict == NULL) {
+      deflateEnd(&z);
+      free(data);
+      free(tmp);
+      job->failed = 1;
+      return;
+    }
+    filter_rows(job, dictfirst, first, dict, tmp);
+    if (dictlen > DEFLATE_WINDOW_SIZE) {
+      (void) deflateSetDictionary(&z, dict + dictlen - DEFLATE_WINDOW_SIZE,
+                                  DEFLATE_WINDOW_SIZE);
+    }
+    else {
+      (void) deflateSetDictionary(&z, dict, (uInt) dictlen);
+    }
+    free(dict);
+  }
+
+  filter_rows(job, first, last, data, tmp);
+  free(tmp);
+
+  /* room for the chunk header, the zlib header, the deflate data,
+     the sync flush marker and the CRC */
+  bound = deflateBound(&z, datalen) + 32;
+  out = (unsigned char *) malloc(bound);
+  if (out == NULL) {
+    deflateEnd(&z);
+    free(data);
+    job->failed = 1;
+    return;
+  }
+  z.next_out = out + 8;
+  z.avail_out = (uInt) (bound - 12);
+  if (b == 0) {
+    /* the zlib header goes in front of the first block */
+    int flevel = job->level == Z_DEFAULT_COMPRESSION ? 2 :
+      job->level < 2 ? 0 : job->level < 6 ? 1 : job->level == 6 ? 2 : 3;
+    int header = (0x78 << 8) | (flevel << 6);
+    header += 31 - (header % 31);
+    z.next_out[0] = (unsigned char) (header >> 8);
+    z.next_out[1] = (unsigned char) (header & 0xff);
+    z.next_out += 2;
+    z.avail_out -= 2;
+  }
+  z.next_in = data;
+  z.avail_in = (uInt) datalen;
+  ret = deflate(&z, b == job->numblocks - 1 ? Z_FINISH : Z_SYNC_FLUSH);
+  if ((ret != Z_OK && ret != Z_STREAM_END) || z.avail_in != 0 || z.avail_out == 0) {
+    job->failed = 1;
+  }
+  deflateEnd(&z);
+
+  block->adler = adler32(adler32(0L, Z_NULL, 0), data, (uInt) datalen);
+  block->datalen = datalen;
+  free(data);
+
+  block->chunklen = (z.next_out - out) + 4;
+  put_uint32(out, (uLong) (block->chunklen - 12));
+  memcpy(out + 4, "IDAT", 4);
+  put_uint32(out + block->chunklen - 4,
+             crc32(crc32(0L, Z_NULL, 0), out + 4, (uInt) (block->chunklen - 8)));
+  block->chunk = out;
+}
+
+/* writes the IDAT chunks for the image. Returns 0 on failure */
+static int
+write_image_parallel(FILE * fp, const unsigned char * bytes,
+                     int width, int height, int numcomponents,
+                     const png_save_settings * settings)
+{
+  png_parallel_job job;
+  unsigned char trailer[16];
+  uLong adler;
+  int i, batch;
+
+  job.bytes = bytes;
+  job.height = height;
+  job.bpp = numcomponents;
+  job.rowbytes = width * numcomponents;
+  /* use the same defaults as libpng */
+  job.filters = settings->filters >= 0 ? settings->filters : PNG_ALL_FILTERS;
+  job.level = settings->level >= 0 ? settings->level : Z_DEFAULT_COMPRESSION;
+  job.strategy = settings->strategy >= 0 ? settings->strategy :
+    (job.filters == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED);
+  job.rowsperblock = PARALLEL_BLOCK_SIZE / (job.rowbytes + 1);
+  if (job.rowsperblock < 1) job.rowsperblock = 1;
+  job.numblocks = (height + job.rowsperblock - 1) / job.rowsperblock;
+  job.failed = 0;
+
+  /* keep only a few blocks in memory at a time */
+  batch = simage_get_num_threads() * 2;
+  job.blocks = (png_block *) malloc(batch * sizeof(png_block));
+  job.zerorow = (const unsigned char *) calloc(job.rowbytes, 1);
+  if (job.blocks == NULL || job.zerorow == NULL) {
+    if (job.blocks) free(job.blocks);
+    if (job.zerorow) free((void *) job.zerorow);
+    return 0;
+  }
+
+  adler = adler32(0L, Z_NULL, 0);
+  for (job.firstblock = 0; job.firstblock < job.numblocks && !job.failed;
+       job.firstblock += batch) {
+    int count = job.numblocks - job.firstblock;
+    if (count > batch) count = batch;
+    memset(job.blocks, 0, count * sizeof(png_block));
+    s_parallel_for(count, encode_block, &job);
+    for (i = 0; i < count; i++) {
+      png_block * block = &job.blocks[i];
+      if (!job.failed &&
+          fwrite(block->chunk, 1, block->chunklen, fp) != block->chunklen) {
+        job.failed = 1;
+      }
+      adler = adler32_combine(adler, block->adler, (z_off_t) block->datalen);
+      if (block->chunk) free(block->chunk);
+    }
+  }
+  free(job.blocks);
+  free((void *) job.zerorow);
+  if (job.failed) return 0;
+
+  /* the Adler-32 checksum ends the zlib stream */
+  put_uint32(trailer, 4);
+  memcpy(trailer + 4, "IDAT", 4);
+  put_uint32(trailer + 8, adler);
+  put_uint32(trailer + 12, crc32(crc32(0L, Z_NULL, 0), trailer + 4, 8));
+  return fwrite(trailer, 1, 16, fp) == 16;
+}
+
 int
 simage_png_save(const char *filename,
                 const unsigned char * bytes,
                 int width,
                 int height,
-                int numcomponents)
+                int numcomponents,
+                s_params * params)
 {
   FILE * fp;
   png_structp png_ptr;
   png_infop info_ptr;
   int colortype;
   int y, bytesperrow;
+  png_save_settings settings;
 #ifdef PNG_TEXT_SUPPORTED
   png_text text_ptr[3];
 #endif
@@ -408,6 +963,9 @@ simage_png_save(const char *filename,
 
   /* other optional chunks like cHRM, bKGD, tRNS, tIME, oFFs, pHYs, */
 
+  get_save_params(params, &settings);
+  set_save_params(png_ptr, &settings);
+
   /* Write the file header information.  REQUIRED */
   png_write_info(png_ptr, info_ptr);
 
@@ -454,6 +1012,23 @@ simage_png_save(const char *filename,
 
   /* If you are only writing one row at a time, this works */
 
+  /* large images are compressed on several threads */
+  if (simage_get_num_threads() > 1 && numcomponents >= 1 && numcomponents <= 4 &&
+      (double) width * height >= PARALLEL_MIN_PIXELS) {
+    if (!write_image_parallel(fp, bytes, width, height, numcomponents, &settings)) {
+      fclose(fp);
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      pngerror = ERR_PNGLIB_WRITE;
+      return 0;
+    }
+    /* libpng doesn't know about the IDAT chunks we wrote, so we end
+       the file ourselves instead of calling png_write_end() */
+    png_write_chunk(png_ptr, (png_bytep) "IEND", NULL, 0);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    fclose(fp);
+    return 1;
+  }
+
   bytesperrow = width * numcomponents;
 
   for (y = 0; y < height; y++) {
@@ -0,0 +1,554 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A NetPBM loader and saver: PBM, PGM and PPM (P1-P6) and PAM (P7).
+ * See the netpbm documentation for the format descriptions.
+ *
+ * The file is mapped into memory where possible. Binary files with 8
+ * bit samples are copied straight from the mapping, other files are
+ * converted one row at a time. The plain (ASCII) formats are decoded
+ * when the file is opened.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifdef SIMAGE_PNM_SUPPORT
+
+#include <simage_pnm.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif /* HAVE_UNISTD_H */
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif /* HAVE_SYS_MMAN_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ERR_NO_ERROR          0
+#define ERR_OPEN              1
+#define ERR_READ              2
+#define ERR_MEM               3
+#define ERR_UNSUPPORTED       4
+#define ERR_OPEN_WRITE        5
+#define ERR_WRITE             6
+
+static int pnmerror = ERR_NO_ERROR;
+
+int
+simage_pnm_error(char * buffer, int buflen)
+{
+  switch (pnmerror) {
+  case ERR_OPEN:
+    strncpy(buffer, "PNM loader: Error opening file", buflen);
+    break;
+  case ERR_READ:
+    strncpy(buffer, "PNM loader: Error reading file", buflen);
+    break;
+  case ERR_MEM:
+    strncpy(buffer, "PNM loader: Out of memory error", buflen);
+    break;
+  case ERR_UNSUPPORTED:
+    strncpy(buffer, "PNM loader: Unsupported or invalid file", buflen);
+    break;
+  case ERR_OPEN_WRITE:
+    strncpy(buffer, "PNM saver: Error opening file for writing", buflen);
+    break;
+  case ERR_WRITE:
+    strncpy(buffer, "PNM saver: Error writing file", buflen);
+    break;
+  }
+  return pnmerror;
+}
+
+int
+simage_pnm_identify(const char * filename,
+                    const unsigned char * header,
+                    int headerlen)
+{
+  if (headerlen < 3) return 0;
+  return header[0] == 'P' && header[1] >= '1' && header[1] <= '7' &&
+    (header[2] == ' ' || header[2] == '\t' || header[2] == '\n' ||
+     header[2] == '\r');
+}
+
+typedef struct {
+  FILE * fp;
+  const unsigned char * map;  /* the mapped file, or NULL */
+  size_t mapsize;
+  size_t pos;                 /* read position in the map */
+  int format;                 /* 1 - 7, from the magic number */
+  int width;
+  int height;
+  int nc;
+  unsigned int maxval;
+  int samplebytes;            /* 1 or 2 */
+  size_t rowbytes;            /* bytes per row in the file */
+  size_t dataoffset;
+  int nextrow;                /* the file row fp is at */
+  unsigned char * row;        /* file row, when the file isn't mapped */
+  unsigned char * image;      /* plain formats, decoded at open, top row first */
+  unsigned char scale[256];   /* 8 bit samples when maxval isn't 255 */
+} simage_pnm_opendata;
+
+static int
+next_char(simage_pnm_opendata * od)
+{
+  if (od->map) return od->pos < od->mapsize ? od->map[od->pos++] : -1;
+  return getc(od->fp);
+}
+
+static int
+is_space(int c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+    c == '\v' || c == '\f';
+}
+
+/* reads a decimal number, skipping whitespace and comments before
+   it. The character following the number is consumed */
+static int
+read_number(simage_pnm_opendata * od, unsigned int * value)
+{
+  int c = next_char(od);
+  unsigned int v;
+
+  for (;;) {
+    if (c == '#') {
+      while (c != '\n' && c != '\r' && c != -1) c = next_char(od);
+    }
+    else if (is_space(c)) c = next_char(od);
+    else break;
+  }
+  if (c < '0' || c > '9') return 0;
+  v = 0;
+  while (c >= '0' && c <= '9') {
+    if (v > 0x0fffffff) return 0;
+    v = v * 10 + (c - '0');
+    c = next_char(od);
+  }
+  *value = v;
+  return 1;
+}
+
+/* reads the PAM header, up to and including ENDHDR */
+static int
+read_pam_header(simage_pnm_opendata * od)
+{
+  char line[256];
+  unsigned int width, height, depth, maxval;
+  int c, n;
+
+  width = height = depth = maxval = 0;
+  for (;;) {
+    n = 0;
+    while ((c = next_char(od)) != '\n' && c != -1) {
+      if (n < (int) sizeof(line) - 1) line[n++] = (char) c;
+    }
+    line[n] = 0;
+    if (c == -1) return 0;
+    if (line[0] == '#') continue;
+    if (strncmp(line, "ENDHDR", 6) == 0) break;
+    if (strncmp(line, "WIDTH", 5) == 0) width = (unsigned int) atoi(line + 5);
+    else if (strncmp(line, "HEIGHT", 6) == 0) height = (unsigned int) atoi(line + 6);
+    else if (strncmp(line, "DEPTH", 5) == 0) depth = (unsigned int) atoi(line + 5);
+    else if (strncmp(line, "MAXVAL", 6) == 0) maxval = (unsigned int) atoi(line + 6);
+    /* TUPLTYPE follows from the depth */
+  }
+  if (depth < 1 || depth > 4) return 0;
+  od->width = (int) width;
+  od->height = (int) height;
+  od->nc = (int) depth;
+  od->maxval = maxval;
+  return width > 0 && height > 0;
+}
+
+static int
+read_header(simage_pnm_opendata * od)
+{
+  unsigned int width, height, maxval;
+
+  if (next_char(od) != 'P') return 0;
+  od->format = next_char(od) - '0';
+  if (od->format < 1 || od->format > 7) return 0;
+
+  if (od->format == 7) {
+    if (!is_space(next_char(od))) return 0;
+    if (!read_pam_header(od)) return 0;
+  }
+  else {
+    if (!read_number(od, &width) || !read_number(od, &height)) return 0;
+    maxval = 1;
+    if (od->format != 1 && od->format != 4 && !read_number(od, &maxval)) return 0;
+    od->width = (int) width;
+    od->height = (int) height;
+    od->nc = (od->format == 3 || od->format == 6) ? 3 : 1;
+    od->maxval = maxval;
+  }
+  if (od->width <= 0 || od->height <= 0 ||
+      od->maxval < 1 || od->maxval > 65535 ||
+      od->width > 0x7fffffff / 4 / od->height) return 0;
+
+  od->samplebytes = od->maxval > 255 ? 2 : 1;
+  if (od->format == 4) od->rowbytes = (od->width + 7) / 8;
+  else od->rowbytes = (size_t) od->width * od->nc * od->samplebytes;
+  return 1;
+}
+
+/*
+ * The row converters. Samples are scaled to 0-255, and bitmaps, where
+ * 1 is black, are expanded to 0 and 255.
+ */
+
+static void
+convert_bits(const unsigned char * src, int width, unsigned char * dst)
+{
+  int x;
+  for (x = 0; x < width; x++) {
+    dst[x] = (src[x >> 3] & (0x80 >> (x & 7))) ? 0 : 255;
+  }
+}
+
+static void
+convert_8(const unsigned char * src, size_t n, const unsigned char * scale,
+          unsigned char * dst)
+{
+  size_t i;
+  for (i = 0; i < n; i++) dst[i] = scale[src[i]];
+}
+
+static void
+convert_16(const unsigned char * src, size_t n, unsigned int maxval,
+           unsigned char * dst)
+{
+  size_t i;
+  for (i = 0; i < n; i++) {
+    unsigned int v = (src[i*2] << 8) | src[i*2+1];
+    if (v > maxval) v = maxval;
+    dst[i] = (unsigned char) ((v * 255 + maxval / 2) / maxval);
+  }
+}
+
+static void
+convert_row(simage_pnm_opendata * od, const unsigned char * src,
+            unsigned char * dst)
+{
+  size_t n = (size_t) od->width * od->nc;
+
+  if (od->format == 4) convert_bits(src, od->width, dst);
+  else if (od->samplebytes == 2) convert_16(src, n, od->maxval, dst);
+  else if (od->maxval == 255) memcpy(dst, src, n);
+  else convert_8(src, n, od->scale, dst);
+}
+
+/* decodes the plain formats P1, P2 and P3 */
+static int
+read_plain(simage_pnm_opendata * od)
+{
+  size_t n, i;
+  unsigned int v;
+  int c;
+
+  n = (size_t) od->width * od->height * od->nc;
+  od->image = (unsigned char *) malloc(n);
+  if (od->image == NULL) {
+    pnmerror = ERR_MEM;
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    if (od->format == 1) {
+      /* the digits need not be separated */
+      do {
+        c = next_char(od);
+        if (c == '#') {
+          while (c != '\n' && c != -1) c = next_char(od);
+        }
+      } while (c != -1 && c != '0' && c != '1');
+      if (c == -1) break;
+      od->image[i] = c == '1' ? 0 : 255;
+    }
+    else {
+      if (!read_number(od, &v)) break;
+      if (v > od->maxval) v = od->maxval;
+      od->image[i] = (unsigned char) ((v * 255 + od->maxval / 2) / od->maxval);
+    }
+  }
+  if (i < n) {
+    pnmerror = ERR_READ;
+    return 0;
+  }
+  return 1;
+}
+
+/* maps the file into memory, if the platform supports it */
+static void
+map_file(simage_pnm_opendata * od, const char * filename)
+{
+#ifdef HAVE_SYS_MMAN_H
+  struct stat statdata;
+  void * map;
+  int fd;
+
+  if ((fd = open(filename, O_RDONLY)) == -1) return;
+  if (fstat(fd, &statdata) == 0 && statdata.st_size > 0) {
+    map = mmap(NULL, (size_t) statdata.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      od->map = (const unsigned char *) map;
+      od->mapsize = (size_t) statdata.st_size;
+    }
+  }
+  close(fd);
+#endif /* HAVE_SYS_MMAN_H */
+}
+
+void *
+simage_pnm_open(const char * filename,
+                int * width,
+                int * height,
+                int * numcomponents)
+{
+  simage_pnm_opendata * od;
+  unsigned int i;
+
+  pnmerror = ERR_NO_ERROR;
+  od = (simage_pnm_opendata *) malloc(sizeof(simage_pnm_opendata));
+  if (od == NULL) {
+    pnmerror = ERR_MEM;
+    return NULL;
+  }
+  memset(od, 0, sizeof(simage_pnm_opendata));
+
+  map_file(od, filename);
+  if (od->map == NULL && (od->fp = fopen(filename, "rb")) == NULL) {
+    free(od);
+    pnmerror = ERR_OPEN;
+    return NULL;
+  }
+  if (!read_header(od)) {
+    simage_pnm_close(od);
+    pnmerror = ERR_UNSUPPORTED;
+    return NULL;
+  }
+
+  if (od->maxval < 256) {
+    for (i = 0; i < 256; i++) {
+      unsigned int v = i < od->maxval ? i : od->maxval;
+      od->scale[i] = (unsigned char) ((v * 255 + od->maxval / 2) / od->maxval);
+    }
+  }
+
+  if (od->format <= 3) {
+    if (!read_plain(od)) {
+      simage_pnm_close(od);
+      return NULL;
+    }
+  }
+  else if (od->map) {
+    od->dataoffset = od->pos;
+    if (od->dataoffset > od->mapsize ||
+        od->rowbytes * od->height > od->mapsize - od->dataoffset) {
+      simage_pnm_close(od);
+      pnmerror = ERR_READ;
+      return NULL;
+    }
+  }
+  else {
+    od->dataoffset = (size_t) ftell(od->fp);
+    od->row = (unsigned char *) malloc(od->rowbytes);
+    if (od->row == NULL) {
+      simage_pnm_close(od);
+      pnmerror = ERR_MEM;
+      return NULL;
+    }
+  }
+
+  *width = od->width;
+  *height = od->height;
+  *numcomponents = od->nc;
+  return od;
+}
+
+void
+simage_pnm_close(void * opendata)
+{
+  simage_pnm_opendata * od = (simage_pnm_opendata *) opendata;
+
+#ifdef HAVE_SYS_MMAN_H
+  if (od->map) munmap((void *) od->map, od->mapsize);
+#endif /* HAVE_SYS_MMAN_H */
+  if (od->fp) fclose(od->fp);
+  if (od->row) free(od->row);
+  if (od->image) free(od->image);
+  free(od);
+}
+
+int
+simage_pnm_read_line(void * opendata, int y, unsigned char * buf)
+{
+  simage_pnm_opendata * od = (simage_pnm_opendata *) opendata;
+  size_t rowsize = (size_t) od->width * od->nc;
+  int row = od->height - 1 - y; /* the rows are stored from the top */
+  unsigned char * dst;
+
+  if (od->image) {
+    memcpy(buf, od->image + row * rowsize, rowsize);
+    return 1;
+  }
+  if (od->map) {
+    convert_row(od, od->map + od->dataoffset + row * od->rowbytes, buf);
+    return 1;
+  }
+
+  if (row != od->nextrow &&
+      fseek(od->fp, (long) (od->dataoffset + row * od->rowbytes), SEEK_SET) != 0) {
+    pnmerror = ERR_READ;
+    return 0;
+  }
+  od->nextrow = row + 1;
+  /* 8 bit samples are read straight into buf */
+  dst = (od->format != 4 && od->samplebytes == 1) ? buf : od->row;
+  if (fread(dst, 1, od->rowbytes, od->fp) != od->rowbytes) {
+    pnmerror = ERR_READ;
+    return 0;
+  }
+  if (dst != buf || od->maxval != 255) convert_row(od, dst, buf);
+  return 1;
+}
+
+unsigned char *
+simage_pnm_load(const char * filename,
+                int * width_ret,
+                int * height_ret,
+                int * numcomponents_ret)
+{
+  simage_pnm_opendata * od;
+  unsigned char * buffer;
+  size_t rowsize;
+  int width, height, nc, y;
+
+  od = (simage_pnm_opendata *) simage_pnm_open(filename, &width, &height, &nc);
+  if (od == NULL) return NULL;
+
+  rowsize = (size_t) width * nc;
+  buffer = (unsigned char *) malloc(rowsize * height);
+  if (buffer == NULL) {
+    pnmerror = ERR_MEM;
+    simage_pnm_close(od);
+    return NULL;
+  }
+  /* read the rows in file order */
+  for (y = height - 1; y >= 0; y--) {
+    if (!simage_pnm_read_line(od, y, buffer + y * rowsize)) {
+      free(buffer);
+      simage_pnm_close(od);
+      return NULL;
+    }
+  }
+  simage_pnm_close(od);
+
+  *width_ret = width;
+  *height_ret = height;
+  *numcomponents_ret = nc;
+  return buffer;
+}
+
+/*
+ * The saver writes PGM (P5) for grayscale images, PPM (P6) for RGB
+ * images and PAM (P7) for images with alpha. The rows are flipped
+ * into a block buffer that is written when it's full.
+ */
+
+/* the output is collected in blocks of about this size before being
+   written */
+#define WRITE_BLOCK_SIZE (1024 * 1024)
+
+int
+simage_pnm_save(const char * filename,
+                const unsigned char * bytes,
+                int width,
+                int height,
+                int numcomponents)
+{
+  static const char * tupltypes[] = {
+    "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"
+  };
+  char header[256];
+  unsigned char * buf;
+  size_t rowsize, headerlen, bufsize, used;
+  int y, ok;
+  FILE * fp;
+
+  pnmerror = ERR_NO_ERROR;
+  if (numcomponents < 1 || numcomponents > 4 || width <= 0 || height <= 0) {
+    pnmerror = ERR_UNSUPPORTED;
+    return 0;
+  }
+
+  if (numcomponents == 1 || numcomponents == 3) {
+    sprintf(header, "P%d\n%d %d\n255\n", numcomponents == 1 ? 5 : 6,
+            width, height);
+  }
+  else {
+    sprintf(header, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\n"
+            "TUPLTYPE %s\nENDHDR\n", width, height, numcomponents,
+            tupltypes[numcomponents - 1]);
+  }
+  headerlen = strlen(header);
+  rowsize = (size_t) width * numcomponents;
+
+  /* room for at least one row, and no more than the image */
+  bufsize = (WRITE_BLOCK_SIZE / rowsize) * rowsize;
+  if (bufsize < rowsize) bufsize = rowsize;
+  if (bufsize > rowsize * height) bufsize = rowsize * height;
+  buf = (unsigned char *) malloc(bufsize);
+  if (buf == NULL) {
+    pnmerror = ERR_MEM;
+    return 0;
+  }
+
+  fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    free(buf);
+    pnmerror = ERR_OPEN_WRITE;
+    return 0;
+  }
+  ok = fwrite(header, 1, headerlen, fp) == headerlen;
+
+  /* the rows are stored from the top */
+  used = 0;
+  for (y = height - 1; y >= 0 && ok; y--) {
+    memcpy(buf + used, bytes + (size_t) y * rowsize, rowsize);
+    used += rowsize;
+    if (used == bufsize || y == 0) {
+      ok = fwrite(buf, 1, used, fp) == used;
+      used = 0;
+    }
+  }
+  if (fclose(fp) != 0) ok = 0;
+  free(buf);
+  if (!ok) pnmerror = ERR_WRITE;
+  return ok;
+}
+
+#endif /* SIMAGE_PNM_SUPPORT */
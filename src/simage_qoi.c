@@ -0,0 +1,542 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A loader and saver for the Quite OK Image format, see
+ * https://qoiformat.org/qoi-specification.pdf
+ *
+ * The pixels are stored from the top row, and each one is coded
+ * relative to the previous pixel or a 64 entry hash of recently seen
+ * colors. Rows can't be decoded without decoding the ones before them,
+ * so the decoder state is saved at the start of each row to let
+ * read_line go back.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifdef SIMAGE_QOI_SUPPORT
+
+#include <simage_qoi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ERR_NO_ERROR          0
+#define ERR_OPEN              1
+#define ERR_READ              2
+#define ERR_MEM               3
+#define ERR_UNSUPPORTED       4
+#define ERR_OPEN_WRITE        5
+#define ERR_WRITE             6
+
+static int qoierror = ERR_NO_ERROR;
+
+int
+simage_qoi_error(char * buffer, int buflen)
+{
+  switch (qoierror) {
+  case ERR_OPEN:
+    strncpy(buffer, "QOI loader: Error opening file", buflen);
+    break;
+  case ERR_READ:
+    strncpy(buffer, "QOI loader: Error reading file", buflen);
+    break;
+  case ERR_MEM:
+    strncpy(buffer, "QOI loader: Out of memory error", buflen);
+    break;
+  case ERR_UNSUPPORTED:
+    strncpy(buffer, "QOI loader: Unsupported or invalid file", buflen);
+    break;
+  case ERR_OPEN_WRITE:
+    strncpy(buffer, "QOI saver: Error opening file for writing", buflen);
+    break;
+  case ERR_WRITE:
+    strncpy(buffer, "QOI saver: Error writing file", buflen);
+    break;
+  }
+  return qoierror;
+}
+
+#define QOI_HEADER_SIZE 14
+
+#define QOI_OP_INDEX  0x00 /* 00xxxxxx */
+#define QOI_OP_DIFF   0x40 /* 01xxxxxx */
+#define QOI_OP_LUMA   0x80 /* 10xxxxxx */
+#define QOI_OP_RUN    0xc0 /* 11xxxxxx */
+#define QOI_OP_RGB    0xfe /* 11111110 */
+#define QOI_OP_RGBA   0xff /* 11111111 */
+#define QOI_MASK_2    0xc0
+
+#define QOI_HASH(p) (((p)[0] * 3 + (p)[1] * 5 + (p)[2] * 7 + (p)[3] * 11) & 63)
+
+static const unsigned char qoi_padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+static unsigned int
+get_uint32be(const unsigned char * ptr)
+{
+  return ((unsigned int) ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+}
+
+static void
+put_uint32be(unsigned char * ptr, unsigned int val)
+{
+  ptr[0] = (unsigned char) (val >> 24);
+  ptr[1] = (unsigned char) (val >> 16);
+  ptr[2] = (unsigned char) (val >> 8);
+  ptr[3] = (unsigned char) val;
+}
+
+int
+simage_qoi_identify(const char * filename,
+                    const unsigned char * header,
+                    int headerlen)
+{
+  if (headerlen < 4) return 0;
+  return memcmp(header, "qoif", 4) == 0;
+}
+
+/* the size of the input buffer */
+#define READ_BLOCK_SIZE (64 * 1024)
+
+/* the decoder state at the start of a row */
+typedef struct {
+  long offset;                  /* file offset of the next op */
+  int run;                      /* pixels left of the current run */
+  unsigned char px[4];
+  unsigned char index[64][4];
+} qoi_state;
+
+typedef struct {
+  FILE * fp;
+  int width;
+  int height;
+  int channels;
+  int nextrow;                  /* the next row the decoder is at */
+  unsigned char * inbuf;
+  long inoffset;                /* file offset of inbuf[0] */
+  int inpos;
+  int inlen;
+  int eof;
+  qoi_state state;
+  qoi_state * rowstates;        /* the state at the start of each row */
+} simage_qoi_opendata;
+
+/* makes sure at least 5 bytes, the largest op, are buffered unless
+   the file ends */
+static void
+fill_input(simage_qoi_opendata * od)
+{
+  int left = od->inlen - od->inpos;
+
+  if (left >= 5 || od->eof) return;
+  memmove(od->inbuf, od->inbuf + od->inpos, left);
+  od->inoffset += od->inpos;
+  od->inpos = 0;
+  od->inlen = left + (int) fread(od->inbuf + left, 1, READ_BLOCK_SIZE - left, od->fp);
+  if (od->inlen < READ_BLOCK_SIZE) od->eof = 1;
+}
+
+/* decodes the next row into dst, with the file's number of channels */
+static int
+decode_row(simage_qoi_opendata * od, unsigned char * dst)
+{
+  qoi_state * s = &od->state;
+  const unsigned char * in;
+  unsigned char * px = s->px;
+  int channels = od->channels;
+  int x, pos, end, b1, b2, vg;
+
+  x = 0;
+  while (x < od->width) {
+    if (s->run > 0) {
+      /* repeat the previous pixel */
+      int n = od->width - x < s->run ? od->width - x : s->run;
+      s->run -= n;
+      if (channels == 4) {
+        for (; n > 0; n--, x++, dst += 4) memcpy(dst, px, 4);
+      }
+      else {
+        for (; n > 0; n--, x++, dst += 3) memcpy(dst, px, 3);
+      }
+      continue;
+    }
+
+    fill_input(od);
+    in = od->inbuf;
+    pos = od->inpos;
+    /* decode ops until the buffer runs low or the row is done, with
+       no end-of-buffer checks in the loop */
+    end = od->inlen - 5;
+    if (pos > end) {
+      /* the last few bytes of the file */
+      if (pos >= od->inlen) return 0;
+      end = pos;
+    }
+    while (x < od->width && pos <= end) {
+      b1 = in[pos++];
+      if (b1 == QOI_OP_RGB) {
+        px[0] = in[pos];
+        px[1] = in[pos + 1];
+        px[2] = in[pos + 2];
+        pos += 3;
+      }
+      else if (b1 == QOI_OP_RGBA) {
+        px[0] = in[pos];
+        px[1] = in[pos + 1];
+        px[2] = in[pos + 2];
+        px[3] = in[pos + 3];
+        pos += 4;
+      }
+      else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+        memcpy(px, s->index[b1], 4);
+      }
+      else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+        px[0] += ((b1 >> 4) & 0x03) - 2;
+        px[1] += ((b1 >> 2) & 0x03) - 2;
+        px[2] += (b1 & 0x03) - 2;
+      }
+      else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+        b2 = in[pos++];
+        vg = (b1 & 0x3f) - 32;
+        px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+        px[1] += vg;
+        px[2] += vg - 8 + (b2 & 0x0f);
+      }
+      else {
+        /* a run of the previous pixel */
+        s->run = b1 & 0x3f;
+      }
+      memcpy(s->index[QOI_HASH(px)], px, 4);
+      memcpy(dst, px, channels);
+      dst += channels;
+      x++;
+      if (s->run) break;
+    }
+    od->inpos = pos;
+  }
+  return 1;
+}
+
+/* decodes file row into dst */
+static int
+read_file_row(simage_qoi_opendata * od, int row, unsigned char * dst)
+{
+  /* rows can only be decoded from the start of a row we've already
+     been to */
+  if (row < od->nextrow) {
+    od->state = od->rowstates[row];
+    if (fseek(od->fp, od->state.offset, SEEK_SET) != 0) return 0;
+    od->inoffset = od->state.offset;
+    od->inpos = od->inlen = 0;
+    od->eof = 0;
+    od->nextrow = row;
+  }
+  while (od->nextrow <= row) {
+    od->state.offset = od->inoffset + od->inpos;
+    od->rowstates[od->nextrow] = od->state;
+    if (!decode_row(od, dst)) return 0;
+    od->nextrow++;
+  }
+  return 1;
+}
+
+void *
+simage_qoi_open(const char * filename,
+                int * width,
+                int * height,
+                int * numcomponents)
+{
+  simage_qoi_opendata * od;
+  unsigned char header[QOI_HEADER_SIZE];
+  unsigned int w, h;
+  FILE * fp;
+
+  qoierror = ERR_NO_ERROR;
+
+  fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    qoierror = ERR_OPEN;
+    return NULL;
+  }
+  if (fread(header, 1, QOI_HEADER_SIZE, fp) != QOI_HEADER_SIZE) {
+    qoierror = ERR_READ;
+    fclose(fp);
+    return NULL;
+  }
+  w = get_uint32be(header + 4);
+  h = get_uint32be(header + 8);
+  if (memcmp(header, "qoif", 4) != 0 || w == 0 || h == 0 ||
+      (header[12] != 3 && header[12] != 4) ||
+      w > 0x7fffffff / 4 / h) {
+    qoierror = ERR_UNSUPPORTED;
+    fclose(fp);
+    return NULL;
+  }
+
+  od = (simage_qoi_opendata *) malloc(sizeof(simage_qoi_opendata));
+  if (od == NULL) {
+    qoierror = ERR_MEM;
+    fclose(fp);
+    return NULL;
+  }
+  memset(od, 0, sizeof(simage_qoi_opendata));
+  od->fp = fp;
+  od->width = (int) w;
+  od->height = (int) h;
+  od->channels = header[12];
+  od->inoffset = QOI_HEADER_SIZE;
+  od->state.px[3] = 255;
+  /* a few bytes of slack for a truncated last op */
+  od->inbuf = (unsigned char *) malloc(READ_BLOCK_SIZE + 8);
+  od->rowstates = (qoi_state *) malloc(od->height * sizeof(qoi_state));
+  if (od->inbuf == NULL || od->rowstates == NULL) {
+    qoierror = ERR_MEM;
+    simage_qoi_close(od);
+    return NULL;
+  }
+
+  *width = od->width;
+  *height = od->height;
+  *numcomponents = od->channels;
+  return od;
+}
+
+void
+simage_qoi_close(void * opendata)
+{
+  simage_qoi_opendata * od = (simage_qoi_opendata *) opendata;
+
+  fclose(od->fp);
+  if (od->inbuf) free(od->inbuf);
+  if (od->rowstates) free(od->rowstates);
+  free(od);
+}
+
+int
+simage_qoi_read_line(void * opendata, int y, unsigned char * buf)
+{
+  simage_qoi_opendata * od = (simage_qoi_opendata *) opendata;
+
+  /* the rows are stored from the top */
+  if (!read_file_row(od, od->height - 1 - y, buf)) {
+    qoierror = ERR_READ;
+    return 0;
+  }
+  return 1;
+}
+
+unsigned char *
+simage_qoi_load(const char * filename,
+                int * width_ret,
+                int * height_ret,
+                int * numcomponents_ret)
+{
+  simage_qoi_opendata * od;
+  unsigned char * buffer;
+  size_t bpr;
+  int width, height, nc, y;
+
+  od = (simage_qoi_opendata *) simage_qoi_open(filename, &width, &height, &nc);
+  if (od == NULL) return NULL;
+
+  bpr = (size_t) width * nc;
+  buffer = (unsigned char *) malloc(bpr * height);
+  if (buffer == NULL) {
+    qoierror = ERR_MEM;
+    simage_qoi_close(od);
+    return NULL;
+  }
+  /* decode the rows in file order */
+  for (y = height - 1; y >= 0; y--) {
+    if (!decode_row(od, buffer + y * bpr)) {
+      qoierror = ERR_READ;
+      free(buffer);
+      simage_qoi_close(od);
+      return NULL;
+    }
+  }
+  simage_qoi_close(od);
+
+  *width_ret = width;
+  *height_ret = height;
+  *numcomponents_ret = nc;
+  return buffer;
+}
+
+/*
+ * The saver. Gray images are written as RGB, since QOI only has 3 and
+ * 4 channel images.
+ */
+
+/* the output is collected in blocks of about this size before being
+   written */
+#define WRITE_BLOCK_SIZE (1024 * 1024)
+
+typedef struct {
+  unsigned char px[4];
+  unsigned char index[64][4];
+  int run;
+} qoi_encoder;
+
+/* encodes n pixels of one row. Each pixel takes at most 5 bytes */
+static unsigned char *
+encode_pixels(qoi_encoder * e, const unsigned char * src, int n, int nc,
+              unsigned char * out)
+{
+  unsigned char * prev = e->px;
+  unsigned char px[4];
+  int x, h;
+
+  for (x = 0; x < n; x++, src += nc) {
+    switch (nc) {
+    case 1:
+      px[0] = px[1] = px[2] = src[0];
+      px[3] = 255;
+      break;
+    case 2:
+      px[0] = px[1] = px[2] = src[0];
+      px[3] = src[1];
+      break;
+    case 3:
+      px[0] = src[0];
+      px[1] = src[1];
+      px[2] = src[2];
+      px[3] = 255;
+      break;
+    default:
+      memcpy(px, src, 4);
+      break;
+    }
+
+    if (memcmp(px, prev, 4) == 0) {
+      if (++e->run == 62) {
+        *out++ = (unsigned char) (QOI_OP_RUN | (e->run - 1));
+        e->run = 0;
+      }
+      continue;
+    }
+    if (e->run > 0) {
+      *out++ = (unsigned char) (QOI_OP_RUN | (e->run - 1));
+      e->run = 0;
+    }
+
+    h = QOI_HASH(px);
+    if (memcmp(e->index[h], px, 4) == 0) {
+      *out++ = (unsigned char) (QOI_OP_INDEX | h);
+    }
+    else {
+      memcpy(e->index[h], px, 4);
+      if (px[3] == prev[3]) {
+        signed char vr = (signed char) (px[0] - prev[0]);
+        signed char vg = (signed char) (px[1] - prev[1]);
+        signed char vb = (signed char) (px[2] - prev[2]);
+        signed char vg_r = (signed char) (vr - vg);
+        signed char vg_b = (signed char) (vb - vg);
+
+        if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+          *out++ = (unsigned char) (QOI_OP_DIFF | ((vr + 2) << 4) |
+                                    ((vg + 2) << 2) | (vb + 2));
+        }
+        else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+                 vg_b > -9 && vg_b < 8) {
+          *out++ = (unsigned char) (QOI_OP_LUMA | (vg + 32));
+          *out++ = (unsigned char) (((vg_r + 8) << 4) | (vg_b + 8));
+        }
+        else {
+          *out++ = QOI_OP_RGB;
+          *out++ = px[0];
+          *out++ = px[1];
+          *out++ = px[2];
+        }
+      }
+      else {
+        *out++ = QOI_OP_RGBA;
+        memcpy(out, px, 4);
+        out += 4;
+      }
+    }
+    memcpy(prev, px, 4);
+  }
+  return out;
+}
+
+int
+simage_qoi_save(const char * filename,
+                const unsigned char * bytes,
+                int width,
+                int height,
+                int numcomponents)
+{
+  qoi_encoder encoder;
+  unsigned char * buf, * out;
+  size_t bpr, blocksize, maxrow;
+  int y, ok;
+  FILE * fp;
+
+  qoierror = ERR_NO_ERROR;
+  if (numcomponents < 1 || numcomponents > 4 || width <= 0 || height <= 0) {
+    qoierror = ERR_UNSUPPORTED;
+    return 0;
+  }
+
+  bpr = (size_t) width * numcomponents;
+  maxrow = (size_t) width * 5;
+  blocksize = maxrow > WRITE_BLOCK_SIZE ? maxrow : WRITE_BLOCK_SIZE;
+  buf = (unsigned char *) malloc(blocksize + maxrow + 8);
+  if (buf == NULL) {
+    qoierror = ERR_MEM;
+    return 0;
+  }
+
+  fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    free(buf);
+    qoierror = ERR_OPEN_WRITE;
+    return 0;
+  }
+
+  memcpy(buf, "qoif", 4);
+  put_uint32be(buf + 4, (unsigned int) width);
+  put_uint32be(buf + 8, (unsigned int) height);
+  buf[12] = (numcomponents == 2 || numcomponents == 4) ? 4 : 3;
+  buf[13] = 0; /* sRGB with linear alpha */
+  out = buf + QOI_HEADER_SIZE;
+
+  memset(&encoder, 0, sizeof(encoder));
+  encoder.px[3] = 255;
+
+  ok = 1;
+  /* the rows are stored from the top */
+  for (y = height - 1; y >= 0 && ok; y--) {
+    out = encode_pixels(&encoder, bytes + y * bpr, width, numcomponents, out);
+    if ((size_t) (out - buf) >= blocksize) {
+      ok = fwrite(buf, 1, out - buf, fp) == (size_t) (out - buf);
+      out = buf;
+    }
+  }
+  if (encoder.run > 0) *out++ = (unsigned char) (QOI_OP_RUN | (encoder.run - 1));
+  memcpy(out, qoi_padding, 8);
+  out += 8;
+  if (ok) ok = fwrite(buf, 1, out - buf, fp) == (size_t) (out - buf);
+  if (fclose(fp) != 0) ok = 0;
+  free(buf);
+  if (!ok) qoierror = ERR_WRITE;
+  return ok;
+}
+
+#endif /* SIMAGE_QOI_SUPPORT */
@@ -15,7 +15,7 @@
  */
 
 /*
- * An SGI RGB loader. By pederb@sim.no.
+ * An SGI RGB loader and saver. By pederb@sim.no.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -36,6 +36,7 @@
 #define ERR_MEM               3
 #define ERR_SIZEZ             4
 #define ERR_OPEN_WRITE        5
+#define ERR_WRITE             6
 
 static int rgberror = ERR_NO_ERROR;
 
@@ -52,6 +53,8 @@ typedef struct {
   unsigned char * tmpbuf[4];
 } simage_rgb_opendata;
 
+static int rgb_load_parallel(simage_rgb_opendata * od, unsigned char * buffer);
+
 unsigned char *
 simage_rgb_load(const char * filename,
                 int * width,
@@ -64,10 +67,19 @@ simage_rgb_load(const char * filename,
   if (od) {
     int i;
     int bpr = *width * *numcomponents;
-    unsigned char * buf = (unsigned char *) malloc(bpr * *height);
+    unsigned char * buf = (unsigned char *) malloc((size_t) bpr * *height);
 
+    if (buf == NULL) {
+      rgberror = ERR_MEM;
+      simage_rgb_close(od);
+      return NULL;
+    }
+    if (rgb_load_parallel(od, buf)) {
+      simage_rgb_close(od);
+      return buf;
+    }
     for (i = 0; i < *height; i++) {
-      if (simage_rgb_read_line(od, i, buf+bpr*i) == 0) {
+      if (simage_rgb_read_line(od, i, buf+(size_t)bpr*i) == 0) {
         /* rgberror will be set by simage_rgb_read_line() */
         free(buf);
         simage_rgb_close(od);
@@ -80,64 +92,6 @@ simage_rgb_load(const char * filename,
   return NULL;
 }
 
-static int
-write_short(FILE * fp, unsigned short val)
-{
-  unsigned char tmp[2];
-  tmp[0] = (unsigned char)(val >> 8);
-  tmp[1] = (unsigned char)(val & 0xff);
-  return (int)fwrite(&tmp, 2, 1, fp);
-}
-
-int
-simage_rgb_save(const char * filename,
-                const unsigned char * bytes,
-                int width,
-                int height,
-                int comp)
-{
-  int x, y, c;
-  unsigned char * tmpbuf;
-  unsigned char buf[500];
-
-  FILE * fp = fopen(filename, "wb");
-  if (!fp) {
-    rgberror = ERR_OPEN_WRITE;
-    return 0;
-  }
-
-  write_short(fp, 0x01da); /* imagic */
-  write_short(fp, 0x0001); /* raw (no rle yet) */
-
-  if (comp == 1)
-    write_short(fp, 0x0002); /* 2 dimensions (heightmap) */
-  else
-    write_short(fp, 0x0003); /* 3 dimensions */
-
-  write_short(fp, (unsigned short) width);
-  write_short(fp, (unsigned short) height);
-  write_short(fp, (unsigned short) comp);
-
-  memset(buf, 0, 500);
-  buf[7] = 255; /* set maximum pixel value to 255 */
-  strcpy((char *)buf+8, "https://coin3d.github.io");
-  fwrite(buf, 1, 500, fp);
-
-  tmpbuf = (unsigned char *) malloc(width);
-
-  for (c = 0; c < comp; c++) {
-    for (y = 0; y < height; y++) {
-      for (x = 0; x < width; x++) {
-        tmpbuf[x] = bytes[x * comp + y * comp * width + c];
-      }
-      fwrite(tmpbuf, 1, width, fp);
-    }
-  }
-  free(tmpbuf);
-  fclose(fp);
-  return 1;
-}
-
 int
 simage_rgb_identify(const char * filename,
                     const unsigned char * header,
@@ -168,6 +122,9 @@ simage_rgb_error(char * buffer, int buflen)
       break;
     case ERR_OPEN_WRITE:
       strncpy(buffer, "RGB loader: Error opening file for writing", buflen);
+      break;
+    case ERR_WRITE:
+      strncpy(buffer, "RGB saver: Error writing file", buflen);
   }
   return rgberror;
 }
@@ -267,6 +224,12 @@ simage_rgb_open(const char * filename,
     return NULL;
   }
 
+  if (size[2] < 1 || size[2] > 4) {
+    rgberror = ERR_SIZEZ;
+    fclose(in);
+    return NULL;
+  }
+
   od = (simage_rgb_opendata*) malloc(sizeof(simage_rgb_opendata));
   memset(od, 0, sizeof(simage_rgb_opendata));
   od->in = in;
@@ -317,14 +280,79 @@ simage_rgb_close(void * opendata)
   free(od);
 }
 
+/* decodes an RLE compressed row of one channel. Returns 0 if the
+   data is corrupt */
+static int
+decode_rle_row(const unsigned char * src, int srclen,
+               unsigned char * dst, int width)
+{
+  const unsigned char * srcstop = src + srclen;
+  unsigned char * dststop = dst + width;
+  unsigned char pixel;
+  int count;
+
+  while (src < srcstop) {
+    pixel = *src++;
+    count = (int)(pixel & 0x7F);
+    if (count == 0) break;
+    if (dst + count > dststop) return 0;
+    if (pixel & 0x80) {
+      if (src + count > srcstop) return 0;
+      memcpy(dst, src, count);
+      src += count;
+    }
+    else {
+      if (src >= srcstop) return 0;
+      memset(dst, *src++, count);
+    }
+    dst += count;
+  }
+  return 1;
+}
+
+/* merges the channels of a row into pixels */
+static void
+interleave_row(unsigned char * const * planes, int nc, int width,
+               unsigned char * dst)
+{
+  const unsigned char * p0 = planes[0];
+  const unsigned char * p1 = planes[1];
+  const unsigned char * p2 = planes[2];
+  const unsigned char * p3 = planes[3];
+  int i;
+
+  switch (nc) {
+  case 1:
+    memcpy(dst, p0, width);
+    break;
+  case 2:
+    for (i = 0; i < width; i++) {
+      dst[i*2] = p0[i];
+      dst[i*2+1] = p1[i];
+    }
+    break;
+  case 3:
+    for (i = 0; i < width; i++) {
+      dst[i*3] = p0[i];
+      dst[i*3+1] = p1[i];
+      dst[i*3+2] = p2[i];
+    }
+    break;
+  default:
+    for (i = 0; i < width; i++) {
+      dst[i*4] = p0[i];
+      dst[i*4+1] = p1[i];
+      dst[i*4+2] = p2[i];
+      dst[i*4+3] = p3[i];
+    }
+    break;
+  }
+}
+
 static int
 read_rgb_row_component(simage_rgb_opendata * od, int y, int c)
 {
   if (od->compressed) {
-    unsigned char * src, * dst;
-    unsigned char * srcstop, * dststop;
-    unsigned char pixel;
-    int count;
     int rowlen;
 
     if (fseek(od->in, od->rowseek[y+c*od->h], SEEK_SET) != 0) {
@@ -342,31 +370,9 @@ read_rgb_row_component(simage_rgb_opendata * od, int y, int c)
       return 0;
     }
 
-    src = od->rlebuf;
-    dst = od->tmpbuf[c];
-    srcstop = src + rowlen;
-    dststop = dst + od->w;
-
-    pixel = *src++;
-    count = (int)(pixel & 0x7F);
-
-    while (count) {
-      if (dst + count > dststop) { rgberror = ERR_READ; return 0; }
-      if (pixel & 0x80) {
-        if (src + count > srcstop) { rgberror = ERR_READ; return 0; }
-        while (count--) {
-          *dst++ = *src++;
-        }
-      }
-      else {
-        if (src >= srcstop) { rgberror = ERR_READ; return 0; }
-        pixel = *src++;
-        while (count--) {
-          *dst++ = pixel;
-        }
-      }
-      pixel = *src++;
-      count = (int)(pixel & 0x7F);
+    if (!decode_rle_row(od->rlebuf, rowlen, od->tmpbuf[c], od->w)) {
+      rgberror = ERR_READ;
+      return 0;
     }
   }
   else {
@@ -385,8 +391,7 @@ read_rgb_row_component(simage_rgb_opendata * od, int y, int c)
 int
 simage_rgb_read_line(void * opendata, int y, unsigned char * buf)
 {
-  int i, c;
-  unsigned char * ptr;
+  int c;
 
   simage_rgb_opendata * od =
     (simage_rgb_opendata*) opendata;
@@ -399,14 +404,511 @@ simage_rgb_read_line(void * opendata, int y, unsigned char * buf)
     }
   }
 
-  ptr = buf;
-  /* merge components into pixels */
-  for (i = 0; i < od->w; i++) {
+  interleave_row(od->tmpbuf, od->nc, od->w, buf);
+  return 1;
+}
+
+/*
+ * Parallel loading. Every row of every channel can be read on its
+ * own, compressed or not. The calling thread reads a batch of rows,
+ * in file order so that adjacent rows are read with a single call,
+ * and the worker threads decompress and interleave them.
+ */
+
+/* don't bother with threads for images smaller than this */
+#define PARALLEL_MIN_PIXELS (1024 * 1024)
+/* approximate number of pixels each job decodes */
+#define PIXELS_PER_JOB (64 * 1024)
+
+typedef struct {
+  long offset;
+  int len;
+  int idx;                    /* row * nc + channel within the batch */
+} rgb_raw_row;
+
+typedef struct {
+  simage_rgb_opendata * od;
+  int first;                  /* the first row in the current batch */
+  int count;                  /* rows in the current batch */
+  int rowsperjob;
+  unsigned char ** raw;       /* batch rows x channels */
+  int * rawlen;
+  unsigned char * buffer;
+  int failed;
+} rgb_parallel_job;
+
+static int
+compare_offset(const void * a, const void * b)
+{
+  long oa = ((const rgb_raw_row *) a)->offset;
+  long ob = ((const rgb_raw_row *) b)->offset;
+  return oa < ob ? -1 : (oa > ob ? 1 : 0);
+}
+
+static void
+decode_rows(void * closure, int idx)
+{
+  rgb_parallel_job * job = (rgb_parallel_job *) closure;
+  simage_rgb_opendata * od = job->od;
+  unsigned char * planes[4] = { NULL, NULL, NULL, NULL };
+  unsigned char * tmp = NULL;
+  int start, stop, y, c;
+
+  start = idx * job->rowsperjob;
+  stop = start + job->rowsperjob;
+  if (stop > job->count) stop = job->count;
+
+  if (od->compressed) {
+    tmp = (unsigned char *) malloc((size_t) od->w * od->nc);
+    if (tmp == NULL) {
+      job->failed = 1;
+      return;
+    }
+  }
+  for (y = start; y < stop; y++) {
     for (c = 0; c < od->nc; c++) {
-      *ptr++ = od->tmpbuf[c][i];
+      int i = y * od->nc + c;
+      if (od->compressed) {
+        planes[c] = tmp + c * od->w;
+        if (!decode_rle_row(job->raw[i], job->rawlen[i], planes[c], od->w)) {
+          job->failed = 1;
+          free(tmp);
+          return;
+        }
+      }
+      else planes[c] = job->raw[i];
+    }
+    interleave_row(planes, od->nc, od->w,
+                   job->buffer + (size_t) (job->first + y) * od->w * od->nc);
+  }
+  if (tmp) free(tmp);
+}
+
+/* reads the rows of the current batch. Rows that follow each other in
+   the file are read with one call */
+static int
+read_batch(rgb_parallel_job * job, rgb_raw_row * rows, unsigned char * data)
+{
+  simage_rgb_opendata * od = job->od;
+  int n = job->count * od->nc;
+  int i, j, y, c;
+  long end;
+  size_t total;
+
+  for (y = 0; y < job->count; y++) {
+    for (c = 0; c < od->nc; c++) {
+      rgb_raw_row * row = &rows[y * od->nc + c];
+      int tab = job->first + y + c * od->h;
+      row->idx = y * od->nc + c;
+      if (od->compressed) {
+        row->offset = (long) od->rowseek[tab];
+        row->len = od->rowlen[tab];
+      }
+      else {
+        row->offset = 512 + (long) tab * od->w;
+        row->len = od->w;
+      }
     }
   }
+  qsort(rows, n, sizeof(rgb_raw_row), compare_offset);
+
+  for (i = 0; i < n; i = j) {
+    total = rows[i].len;
+    end = rows[i].offset + rows[i].len;
+    job->raw[rows[i].idx] = data;
+    job->rawlen[rows[i].idx] = rows[i].len;
+    for (j = i + 1; j < n && rows[j].offset == end; j++) {
+      job->raw[rows[j].idx] = data + total;
+      job->rawlen[rows[j].idx] = rows[j].len;
+      total += rows[j].len;
+      end += rows[j].len;
+    }
+    if (fseek(od->in, rows[i].offset, SEEK_SET) != 0 ||
+        fread(data, 1, total, od->in) != total) return 0;
+    data += total;
+  }
   return 1;
 }
 
+static int
+rgb_load_parallel(simage_rgb_opendata * od, unsigned char * buffer)
+{
+  rgb_parallel_job job;
+  rgb_raw_row * rows;
+  unsigned char * data;
+  size_t datasize, size;
+  int numthreads, batch, numjobs, y, c;
+
+  numthreads = simage_get_num_threads();
+  if (numthreads < 2 || (double) od->w * od->h < PARALLEL_MIN_PIXELS) return 0;
+
+  job.od = od;
+  job.buffer = buffer;
+  job.failed = 0;
+  job.rowsperjob = (PIXELS_PER_JOB + od->w - 1) / od->w;
+  batch = job.rowsperjob * numthreads * 4;
+  if (batch > od->h) batch = od->h;
+
+  /* find the largest batch of data we'll need to read */
+  datasize = 0;
+  for (job.first = 0; job.first < od->h; job.first += batch) {
+    size = 0;
+    for (y = job.first; y < job.first + batch && y < od->h; y++) {
+      for (c = 0; c < od->nc; c++) {
+        int len = od->compressed ? od->rowlen[y + c * od->h] : od->w;
+        /* a row can't compress to more than twice its size */
+        if (len < 0 || len > od->w * 2 + 2) return 0;
+        size += len;
+      }
+    }
+    if (size > datasize) datasize = size;
+  }
+
+  job.raw = (unsigned char **) malloc(batch * od->nc * sizeof(unsigned char *));
+  job.rawlen = (int *) malloc(batch * od->nc * sizeof(int));
+  rows = (rgb_raw_row *) malloc(batch * od->nc * sizeof(rgb_raw_row));
+  data = (unsigned char *) malloc(datasize);
+  if (job.raw == NULL || job.rawlen == NULL || rows == NULL || data == NULL) {
+    job.failed = 1;
+  }
+
+  for (job.first = 0; job.first < od->h && !job.failed; job.first += batch) {
+    job.count = od->h - job.first < batch ? od->h - job.first : batch;
+    if (!read_batch(&job, rows, data)) {
+      job.failed = 1;
+      break;
+    }
+    numjobs = (job.count + job.rowsperjob - 1) / job.rowsperjob;
+    s_parallel_for(numjobs, decode_rows, &job);
+  }
+
+  if (job.raw) free(job.raw);
+  if (job.rawlen) free(job.rawlen);
+  if (rows) free(rows);
+  if (data) free(data);
+  return !job.failed;
+}
+
+/*
+ * The saver. Uncompressed files store each channel as a plane. RLE
+ * compressed files store each row of each channel on its own, with
+ * tables of row offsets and lengths after the header. The rows are
+ * compressed on the worker threads, a batch at a time, and written in
+ * order by the calling thread. The tables are filled in at the end.
+ */
+
+/* the output is collected in blocks of about this size before being
+   written */
+#define WRITE_BLOCK_SIZE (1024 * 1024)
+
+/* worst case size of an RLE compressed row, including the end
+   marker. Only copies of 127 bytes and the copy at the end of a row
+   add to the size */
+#define RLE_MAX_ROW(w) ((w) + ((w) + 126) / 127 + 1)
+
+static int
+write_short(FILE * fp, unsigned short val)
+{
+  unsigned char tmp[2];
+  tmp[0] = (unsigned char)(val >> 8);
+  tmp[1] = (unsigned char)(val & 0xff);
+  return (int)fwrite(&tmp, 2, 1, fp);
+}
+
+static void
+put_int(unsigned char * ptr, unsigned int val)
+{
+  ptr[0] = (unsigned char) (val >> 24);
+  ptr[1] = (unsigned char) (val >> 16);
+  ptr[2] = (unsigned char) (val >> 8);
+  ptr[3] = (unsigned char) val;
+}
+
+/* copies channel c of n pixels into dst */
+static void
+extract_channel(const unsigned char * src, int nc, int c, size_t n,
+                unsigned char * dst)
+{
+  size_t i;
+
+  src += c;
+  switch (nc) {
+  case 1:
+    memcpy(dst, src, n);
+    break;
+  case 2:
+    for (i = 0; i < n; i++) dst[i] = src[i*2];
+    break;
+  case 3:
+    for (i = 0; i < n; i++) dst[i] = src[i*3];
+    break;
+  default:
+    for (i = 0; i < n; i++) dst[i] = src[i*4];
+    break;
+  }
+}
+
+/* compresses a row of one channel. Returns the number of bytes
+   written to dst, at most RLE_MAX_ROW(width) */
+static int
+encode_rle_row(const unsigned char * src, int width, unsigned char * dst)
+{
+  unsigned char * start = dst;
+  int x, n;
+
+  x = 0;
+  while (x < width) {
+    n = 1;
+    while (x + n < width && n < 127 && src[x + n] == src[x]) n++;
+    /* runs shorter than 3 bytes are cheaper to store as copies */
+    if (n > 2) {
+      *dst++ = (unsigned char) n;
+      *dst++ = src[x];
+    }
+    else {
+      /* copy bytes up to where the next run starts */
+      n = 1;
+      while (x + n < width && n < 127 &&
+             !(x + n + 2 < width && src[x + n] == src[x + n + 1] &&
+               src[x + n] == src[x + n + 2])) n++;
+      *dst++ = (unsigned char) (0x80 | n);
+      memcpy(dst, src + x, n);
+      dst += n;
+    }
+    x += n;
+  }
+  *dst++ = 0;
+  return (int) (dst - start);
+}
+
+typedef struct {
+  const unsigned char * bytes;
+  int width;
+  int nc;
+  int first;                /* the first row in the current batch */
+  int count;                /* rows in the current batch */
+  int rowsperjob;
+  unsigned char * data;     /* room for RLE_MAX_ROW for each row and channel */
+  int * rowlen;             /* batch rows x channels */
+  int failed;
+} rgb_save_job;
+
+static void
+encode_rows(void * closure, int idx)
+{
+  rgb_save_job * job = (rgb_save_job *) closure;
+  size_t maxrow = RLE_MAX_ROW(job->width);
+  unsigned char * plane;
+  int start, stop, y, c;
+
+  start = idx * job->rowsperjob;
+  stop = start + job->rowsperjob;
+  if (stop > job->count) stop = job->count;
+
+  plane = (unsigned char *) malloc(job->width);
+  if (plane == NULL) {
+    job->failed = 1;
+    return;
+  }
+  for (y = start; y < stop; y++) {
+    const unsigned char * src =
+      job->bytes + (size_t) (job->first + y) * job->width * job->nc;
+    for (c = 0; c < job->nc; c++) {
+      int i = y * job->nc + c;
+      extract_channel(src, job->nc, c, job->width, plane);
+      job->rowlen[i] = encode_rle_row(plane, job->width, job->data + i * maxrow);
+    }
+  }
+  free(plane);
+}
+
+static int
+write_rle_data(FILE * fp, const unsigned char * bytes, int width, int height,
+               int nc, unsigned int * rowstart, int * rowsize)
+{
+  rgb_save_job job;
+  size_t maxrow = RLE_MAX_ROW(width);
+  unsigned int offset;
+  int batch, numjobs, numthreads, y, c, ok;
+
+  job.bytes = bytes;
+  job.width = width;
+  job.nc = nc;
+  job.rowsperjob = (PIXELS_PER_JOB + width - 1) / width;
+  numthreads = simage_get_num_threads();
+  if ((double) width * height < PARALLEL_MIN_PIXELS) numthreads = 1;
+  batch = job.rowsperjob * numthreads * 4;
+  if (batch > height) batch = height;
+
+  job.data = (unsigned char *) malloc(batch * nc * maxrow);
+  job.rowlen = (int *) malloc(batch * nc * sizeof(int));
+  if (job.data == NULL || job.rowlen == NULL) {
+    if (job.data) free(job.data);
+    if (job.rowlen) free(job.rowlen);
+    rgberror = ERR_MEM;
+    return 0;
+  }
+
+  ok = 1;
+  offset = 512 + height * nc * 8;
+  for (job.first = 0; job.first < height && ok; job.first += batch) {
+    job.count = height - job.first < batch ? height - job.first : batch;
+    numjobs = (job.count + job.rowsperjob - 1) / job.rowsperjob;
+    job.failed = 0;
+    s_parallel_for(numjobs, encode_rows, &job);
+    if (job.failed) {
+      rgberror = ERR_MEM;
+      ok = 0;
+      break;
+    }
+
+    for (y = 0; y < job.count && ok; y++) {
+      for (c = 0; c < nc; c++) {
+        int i = y * nc + c;
+        int tab = job.first + y + c * height;
+        rowstart[tab] = offset;
+        rowsize[tab] = job.rowlen[i];
+        offset += job.rowlen[i];
+        if (fwrite(job.data + i * maxrow, 1, job.rowlen[i], fp) != (size_t) job.rowlen[i]) {
+          ok = 0;
+          break;
+        }
+      }
+    }
+  }
+  free(job.data);
+  free(job.rowlen);
+  if (!ok && rgberror == ERR_NO_ERROR) rgberror = ERR_WRITE;
+  return ok;
+}
+
+static int
+write_planes(FILE * fp, const unsigned char * bytes, int width, int height,
+             int nc)
+{
+  unsigned char * buf;
+  size_t n, done, len, blocksize;
+  int c, ok;
+
+  n = (size_t) width * height;
+  blocksize = n < WRITE_BLOCK_SIZE ? n : WRITE_BLOCK_SIZE;
+  buf = (unsigned char *) malloc(blocksize);
+  if (buf == NULL) {
+    rgberror = ERR_MEM;
+    return 0;
+  }
+  ok = 1;
+  for (c = 0; c < nc && ok; c++) {
+    for (done = 0; done < n; done += len) {
+      len = n - done < blocksize ? n - done : blocksize;
+      extract_channel(bytes + done * nc, nc, c, len, buf);
+      if (fwrite(buf, 1, len, fp) != len) {
+        rgberror = ERR_WRITE;
+        ok = 0;
+        break;
+      }
+    }
+  }
+  free(buf);
+  return ok;
+}
+
+int
+simage_rgb_save(const char * filename,
+                const unsigned char * bytes,
+                int width,
+                int height,
+                int comp,
+                s_params * params)
+{
+  unsigned int * rowstart = NULL;
+  int * rowsize = NULL;
+  unsigned char buf[500];
+  unsigned char * tables;
+  char * str;
+  int rle, i, n, ok;
+  FILE * fp;
+
+  rgberror = ERR_NO_ERROR;
+  if (comp < 1 || comp > 4 || width <= 0 || height <= 0 ||
+      width > 65535 || height > 65535) {
+    rgberror = ERR_SIZEZ;
+    return 0;
+  }
+
+  rle = 0;
+  if (params && s_params_get(params, "compression", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+    if (strcmp(str, "rle") == 0) rle = 1;
+    else if (strcmp(str, "none") == 0) rle = 0;
+  }
+
+  n = height * comp;
+  if (rle) {
+    rowstart = (unsigned int *) malloc(n * sizeof(unsigned int));
+    rowsize = (int *) malloc(n * sizeof(int));
+    if (rowstart == NULL || rowsize == NULL) {
+      if (rowstart) free(rowstart);
+      if (rowsize) free(rowsize);
+      rgberror = ERR_MEM;
+      return 0;
+    }
+  }
+
+  fp = fopen(filename, "wb");
+  if (!fp) {
+    rgberror = ERR_OPEN_WRITE;
+    if (rowstart) free(rowstart);
+    if (rowsize) free(rowsize);
+    return 0;
+  }
+
+  write_short(fp, 0x01da); /* imagic */
+  write_short(fp, rle ? 0x0101 : 0x0001); /* storage and bytes per channel */
+
+  if (comp == 1)
+    write_short(fp, 0x0002); /* 2 dimensions (heightmap) */
+  else
+    write_short(fp, 0x0003); /* 3 dimensions */
+
+  write_short(fp, (unsigned short) width);
+  write_short(fp, (unsigned short) height);
+  write_short(fp, (unsigned short) comp);
+
+  memset(buf, 0, 500);
+  buf[7] = 255; /* set maximum pixel value to 255 */
+  strcpy((char *)buf+8, "https://coin3d.github.io");
+  ok = fwrite(buf, 1, 500, fp) == 500;
+
+  if (rle) {
+    /* the tables are written once we know the row sizes */
+    ok = ok && fseek(fp, 512 + n * 8, SEEK_SET) == 0;
+    ok = ok && write_rle_data(fp, bytes, width, height, comp, rowstart, rowsize);
+    if (ok) {
+      tables = (unsigned char *) malloc(n * 8);
+      if (tables == NULL) {
+        rgberror = ERR_MEM;
+        ok = 0;
+      }
+      else {
+        for (i = 0; i < n; i++) {
+          put_int(tables + i * 4, rowstart[i]);
+          put_int(tables + (n + i) * 4, (unsigned int) rowsize[i]);
+        }
+        ok = fseek(fp, 512, SEEK_SET) == 0 &&
+          fwrite(tables, 1, n * 8, fp) == (size_t) n * 8;
+        free(tables);
+      }
+    }
+    free(rowstart);
+    free(rowsize);
+  }
+  else {
+    ok = ok && write_planes(fp, bytes, width, height, comp);
+  }
+
+  if (fclose(fp) != 0) ok = 0;
+  if (!ok && rgberror == ERR_NO_ERROR) rgberror = ERR_WRITE;
+  return ok;
+}
+
 #endif /* SIMAGE_RGB_SUPPORT */
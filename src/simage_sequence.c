@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Movies stored as numbered image files, named by a printf pattern
+ * such as "frame%05d.png". Any format with a loader or saver can be
+ * used.
+ *
+ * Frames are handled in batches of one per thread. The importer loads
+ * the next batch on a background thread while the caller works on the
+ * current one, and the exporter saves a full batch in the background
+ * while the caller renders the next. Each frame goes to the file with
+ * its own number, so the order is kept no matter which thread saves
+ * it.
+ *
+ * The loaders keep their error state in globals, so the frames of a
+ * batch are loaded one after the other rather than in parallel.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <simage.h>
+#include <simage_private.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_BATCH 64
+
+/* the widest frame number field accepted in a pattern */
+#define MAX_FIELD_WIDTH 16
+
+typedef struct {
+  unsigned char * data;    /* NULL if the frame could not be loaded */
+  int width, height, nc;
+  s_image * image;         /* a frame waiting to be saved */
+  int ok;
+} sequence_frame;
+
+typedef struct {
+  int start;               /* the number of the first frame */
+  int count;
+  sequence_frame frames[MAX_BATCH];
+} sequence_batch;
+
+typedef struct {
+  char * pattern;
+  size_t namelen;
+  int batchsize;
+  int next;                /* the number of the next frame */
+  int exporting;
+  s_params * params;       /* passed on to the saver */
+
+  /* one batch is used by the caller while the other is loaded or
+     saved on the background threads */
+  sequence_batch batches[2];
+  int current;
+  int pending;
+  s_parallel_task * task;
+  int failed;              /* a frame could not be saved */
+} simage_sequence_movie;
+
+/* checks that pattern has exactly one %d conversion (with an optional
+   zero flag and width), and no other conversions than %% */
+static int
+check_pattern(const char * pattern)
+{
+  const char * p = pattern;
+  int width, conversions = 0;
+
+  while ((p = strchr(p, '%')) != NULL) {
+    p++;
+    if (*p == '%') {
+      p++;
+      continue;
+    }
+    if (*p == '0') p++;
+    width = 0;
+    while (*p >= '0' && *p <= '9') {
+      width = width * 10 + (*p - '0');
+      if (width > MAX_FIELD_WIDTH) return 0;
+      p++;
+    }
+    if (*p != 'd') return 0;
+    p++;
+    conversions++;
+  }
+  return conversions == 1;
+}
+
+static char *
+frame_name(simage_sequence_movie * sm, int number)
+{
+  char * name = (char *) malloc(sm->namelen);
+  if (name) sprintf(name, sm->pattern, number);
+  return name;
+}
+
+static simage_sequence_movie *
+new_movie(const char * pattern)
+{
+  simage_sequence_movie * sm;
+
+  sm = (simage_sequence_movie *) malloc(sizeof(simage_sequence_movie));
+  if (sm == NULL) return NULL;
+  memset(sm, 0, sizeof(simage_sequence_movie));
+  sm->namelen = strlen(pattern) + MAX_FIELD_WIDTH + 16;
+  sm->pattern = (char *) malloc(strlen(pattern) + 1);
+  if (sm->pattern == NULL) {
+    free(sm);
+    return NULL;
+  }
+  strcpy(sm->pattern, pattern);
+
+  sm->batchsize = simage_get_num_threads();
+  if (sm->batchsize < 1) sm->batchsize = 1;
+  if (sm->batchsize > MAX_BATCH) sm->batchsize = MAX_BATCH;
+  return sm;
+}
+
+static void
+free_movie(simage_sequence_movie * sm)
+{
+  int i, j;
+
+  s_parallel_wait(sm->task);
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < MAX_BATCH; j++) {
+      sequence_frame * frame = &sm->batches[i].frames[j];
+      if (frame->data) simage_free_image(frame->data);
+      if (frame->image) s_image_destroy(frame->image);
+    }
+  }
+  if (sm->params) s_params_destroy(sm->params);
+  free(sm->pattern);
+  free(sm);
+}
+
+/*
+ * The importer
+ */
+
+static void
+load_batch(void * closure, int idx)
+{
+  simage_sequence_movie * sm = (simage_sequence_movie *) closure;
+  sequence_batch * batch = &sm->batches[!sm->current];
+  int i;
+
+  for (i = 0; i < batch->count; i++) {
+    sequence_frame * frame = &batch->frames[i];
+    char * name;
+
+    if (frame->data) simage_free_image(frame->data);
+    frame->data = NULL;
+    name = frame_name(sm, batch->start + i);
+    if (name) {
+      frame->data = simage_read_image(name, &frame->width, &frame->height,
+                                      &frame->nc);
+      free(name);
+    }
+  }
+}
+
+/* starts loading the batch of frames from start on a background thread */
+static void
+prefetch(simage_sequence_movie * sm, int start)
+{
+  sequence_batch * batch = &sm->batches[!sm->current];
+  batch->start = start;
+  batch->count = sm->batchsize;
+  sm->pending = 1;
+  sm->task = s_parallel_start(1, load_batch, sm);
+}
+
+int
+simage_sequence_movie_open(const char * filename, s_movie * movie)
+{
+  simage_sequence_movie * sm;
+  char * name;
+  int supported;
+
+  if (!check_pattern(filename)) return 0;
+
+  sm = new_movie(filename);
+  if (sm == NULL) return 0;
+
+  /* the sequence starts at frame 0 or 1. Checking the first file also
+     sets up the loaders before any other thread uses them */
+  supported = 0;
+  for (sm->next = 0; sm->next < 2; sm->next++) {
+    name = frame_name(sm, sm->next);
+    if (name) {
+      supported = simage_check_supported(name);
+      free(name);
+    }
+    if (supported) break;
+  }
+  if (!supported) {
+    free_movie(sm);
+    return 0;
+  }
+  prefetch(sm, sm->next);
+
+  s_params_set(s_movie_params(movie), "sequence movie handle",
+               S_POINTER_PARAM_TYPE, sm, NULL);
+  return 1;
+}
+
+s_image *
+simage_sequence_movie_get(s_movie * movie, s_image * prealloc, s_params * params)
+{
+  simage_sequence_movie * sm;
+  sequence_batch * batch;
+  sequence_frame * frame;
+  s_image * image;
+
+  if (!s_params_get(s_movie_params(movie), "sequence movie handle",
+                    S_POINTER_PARAM_TYPE, &sm, NULL)) return NULL;
+
+  batch = &sm->batches[sm->current];
+  if (sm->next >= batch->start + batch->count) {
+    if (!sm->pending) return NULL;
+    s_parallel_wait(sm->task);
+    sm->task = NULL;
+    sm->pending = 0;
+    sm->current = !sm->current;
+    batch = &sm->batches[sm->current];
+    /* read ahead, unless the end is within this batch */
+    if (batch->frames[batch->count - 1].data) {
+      prefetch(sm, batch->start + batch->count);
+    }
+  }
+
+  frame = &batch->frames[sm->next - batch->start];
+  if (frame->data == NULL) return NULL;
+  sm->next++;
+
+  if (prealloc == NULL) {
+    /* hand the loaded data over to a new image */
+    image = s_image_create(frame->width, frame->height, frame->nc, frame->data);
+    image->didalloc = 1;
+    frame->data = NULL;
+    return image;
+  }
+  image = s_image_prepare(prealloc, frame->width, frame->height, frame->nc);
+  if (image) {
+    memcpy(s_image_data(image), frame->data,
+           (size_t) frame->width * frame->height * frame->nc);
+  }
+  return image;
+}
+
+/*
+ * The exporter
+ */
+
+static void
+save_frame(void * closure, int idx)
+{
+  simage_sequence_movie * sm = (simage_sequence_movie *) closure;
+  sequence_batch * batch = &sm->batches[!sm->current];
+  sequence_frame * frame = &batch->frames[idx];
+  char * name;
+
+  frame->ok = 0;
+  name = frame_name(sm, batch->start + idx);
+  if (name) {
+    frame->ok = s_image_save(name, frame->image, sm->params);
+    free(name);
+  }
+}
+
+/* waits for the batch being saved, and checks that all went well */
+static void
+finish_saving(simage_sequence_movie * sm)
+{
+  sequence_batch * batch = &sm->batches[!sm->current];
+  int i;
+
+  if (!sm->pending) return;
+  s_parallel_wait(sm->task);
+  sm->task = NULL;
+  sm->pending = 0;
+  for (i = 0; i < batch->count; i++) {
+    if (!batch->frames[i].ok) sm->failed = 1;
+  }
+}
+
+/* starts saving the current batch on the background threads, and
+   makes the other one current */
+static void
+save_batch(simage_sequence_movie * sm)
+{
+  sequence_batch * batch = &sm->batches[sm->current];
+
+  finish_saving(sm);
+  if (batch->count == 0) return;
+  sm->current = !sm->current;
+  sm->pending = 1;
+  sm->task = s_parallel_start(batch->count, save_frame, sm);
+  sm->batches[sm->current].start = batch->start + batch->count;
+  sm->batches[sm->current].count = 0;
+}
+
+int
+simage_sequence_movie_create(const char * filename, s_movie * movie,
+                             s_params * params)
+{
+  simage_sequence_movie * sm;
+  const char * mime_type = NULL;
+  const char * ext = NULL;
+  int first = 0;
+
+  /* other exporters are asked for by mime type */
+  if (params) {
+    s_params_get(params, "mime-type", S_STRING_PARAM_TYPE, &mime_type, NULL);
+    s_params_get(params, "file type", S_STRING_PARAM_TYPE, &ext, NULL);
+    s_params_get(params, "first frame", S_INTEGER_PARAM_TYPE, &first, NULL);
+  }
+  if (mime_type || !check_pattern(filename)) return 0;
+
+  /* this also sets up the savers before any other thread uses them */
+  if (ext == NULL) {
+    ext = strrchr(filename, '.');
+    if (ext) ext++;
+  }
+  if (ext == NULL || !simage_check_save_supported(ext)) return 0;
+
+  sm = new_movie(filename);
+  if (sm == NULL) return 0;
+  if (params) sm->params = s_params_copy(params);
+  sm->exporting = 1;
+  sm->batches[0].start = first;
+
+  s_params_set(s_movie_params(movie), "sequence movie handle",
+               S_POINTER_PARAM_TYPE, sm, NULL);
+  return 1;
+}
+
+int
+simage_sequence_movie_put(s_movie * movie, s_image * image, s_params * params)
+{
+  simage_sequence_movie * sm;
+  sequence_batch * batch;
+  sequence_frame * frame;
+  const unsigned char * src;
+  unsigned char * dst;
+  int i, n, w, h, nc;
+
+  if (!s_params_get(s_movie_params(movie), "sequence movie handle",
+                    S_POINTER_PARAM_TYPE, &sm, NULL)) return 0;
+
+  src = s_image_data(image);
+  if (src == NULL) return 0;
+  w = s_image_width(image);
+  h = s_image_height(image);
+  nc = s_image_components(image);
+
+  /* the caller may reuse the image while the frame is being saved */
+  batch = &sm->batches[sm->current];
+  frame = &batch->frames[batch->count];
+  frame->image = s_image_prepare(frame->image, w, h, nc);
+  if (frame->image == NULL) return 0;
+  dst = s_image_data(frame->image);
+  n = w * h;
+  if (nc >= 3 && s_image_get_component_order(image) == SIMAGE_ORDER_BGR) {
+    for (i = 0; i < n; i++) {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+      if (nc == 4) dst[3] = src[3];
+      src += nc;
+      dst += nc;
+    }
+  }
+  else {
+    memcpy(dst, src, (size_t) n * nc);
+  }
+  batch->count++;
+
+  if (batch->count == sm->batchsize) save_batch(sm);
+  return !sm->failed;
+}
+
+void
+simage_sequence_movie_close(s_movie * movie)
+{
+  simage_sequence_movie * sm;
+
+  if (!s_params_get(s_movie_params(movie), "sequence movie handle",
+                    S_POINTER_PARAM_TYPE, &sm, NULL)) return;
+
+  if (sm->exporting) {
+    save_batch(sm);
+    finish_saving(sm);
+  }
+  free_movie(sm);
+}
@@ -15,7 +15,7 @@
  */
 
 /*
- * A simple TGA loader
+ * A simple TGA loader and saver
  *
  */
 
@@ -46,6 +46,9 @@
 #define ERR_READ         2
 #define ERR_MEM          3
 #define ERR_UNSUPPORTED  4
+#define ERR_OPEN_WRITE   5
+#define ERR_WRITE        6
+#define ERR_SAVE_FORMAT  7
 
 static int tgaerror = ERR_NO_ERROR;
 int
@@ -61,82 +64,109 @@ simage_tga_error(char * buffer, int buflen)
     case ERR_MEM:
       strncpy(buffer, "TGA loader: Out of memory error", buflen);
       break;
+    case ERR_OPEN_WRITE:
+      strncpy(buffer, "TGA saver: Error opening file for writing", buflen);
+      break;
+    case ERR_WRITE:
+      strncpy(buffer, "TGA saver: Error writing file", buflen);
+      break;
+    case ERR_SAVE_FORMAT:
+      strncpy(buffer, "TGA saver: Unsupported image size or number of components", buflen);
+      break;
   }
   return tgaerror;
 }
 
 /* TODO: */
-/* - bottom-up images */
 /* - huffman, delta encoding */
-static void 
-convert_16_to_24(const unsigned char * const src, unsigned char * const dest)
-{
-  /* RGB for opengl, lo-hi 16 bit for TGA */
-  unsigned int t0 = src[0];
-  unsigned int t1 = src[1];
-  dest[0] = (unsigned char) (t0 & 0x1f) << 2; /* r */
-  dest[1] = (unsigned char) (t1 & 0x7c) >> 2; /* g */
-  dest[2] = (unsigned char) ((t1 & 0x3)<<3) | ((t0&0xe)>>5); /*b */
-}
 
-static void 
-convert_16_to_32(const unsigned char * const src, unsigned char * const dest)
+/* the size of the input buffer for RLE files */
+#define READ_BLOCK_SIZE (64 * 1024)
+
+/* the RLE decoder state at the start of a row */
+typedef struct {
+  long offset;              /* file offset of the next packet byte */
+  int remaining;            /* pixels left in the current packet */
+  int compressed;
+  unsigned char current[4]; /* the pixel of the current run packet */
+} tga_rle_state;
+
+typedef struct {
+  FILE * fp;
+  int type;
+  int width;
+  int height;
+  int depth;             /* bytes per pixel in the file */
+  int format;            /* components per pixel in the image */
+  int topdown;           /* rows are stored from the top */
+  long dataoffset;       /* file offset of the pixel data */
+  int nextrow;           /* next file row to read */
+  /* for RLE files */
+  unsigned char * inbuf;
+  long inoffset;         /* file offset of inbuf[0] */
+  int inpos;
+  int inlen;
+  tga_rle_state state;
+  tga_rle_state * rowstates; /* state at the start of each decoded row */
+} simage_tga_opendata;
+
+/*
+ * The pixel converters. The file stores BGR(A), or 16 bit pixels with
+ * five bits per color and one alpha bit. They are all written so they
+ * can work in place, and are simple enough for the compiler to
+ * vectorize.
+ */
+
+static void
+convert_24_to_24(unsigned char * pixels, size_t n)
 {
-  /* RGBA for opengl, lo-hi 16 bit for TGA */
-  unsigned int t0 = src[0];
-  unsigned int t1 = src[1];
-  dest[0] = (unsigned char) (t0 & 0x1f) << 2; /* r */
-  dest[1] = (unsigned char) (t1 & 0x7c) >> 2; /* g */
-  dest[2] = (unsigned char) ((t1 & 0x3)<<3) | ((t0&0xe)>>5); /*b */
-  dest[3] = (t1&0x70)?255:0; /* a */
+  size_t i;
+  for (i = 0; i < n; i++) {
+    unsigned char b = pixels[i*3];
+    pixels[i*3] = pixels[i*3+2];
+    pixels[i*3+2] = b;
+  }
 }
 
-static void 
-convert_24_to_24(const unsigned char * const src, unsigned char * const dest)
+static void
+convert_32_to_32(unsigned char * pixels, size_t n)
 {
-  /* RGB for opengl */
-  /* BGR for TGA */
-  dest[0] = src[2];
-  dest[1] = src[1];
-  dest[2] = src[0];
+  size_t i;
+  for (i = 0; i < n; i++) {
+    unsigned char b = pixels[i*4];
+    pixels[i*4] = pixels[i*4+2];
+    pixels[i*4+2] = b;
+  }
 }
 
-static void 
-convert_32_to_32(const unsigned char * const src, unsigned char * const dest)
+/* expands 16 bit pixels stored at the end of dest, that is at dest +
+   n * (format - 2). Each pixel is read before it's overwritten */
+static void
+convert_16(unsigned char * dest, size_t n, int format)
 {
-  /* opengl image format is RGBA, not ARGB */
-  /* TGA image format is BGRA for 32 bit */
-  dest[0] = src[2];
-  dest[1] = src[1];
-  dest[2] = src[0];
-  dest[3] = src[3];
+  const unsigned char * src = dest + n * (format - 2);
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    unsigned int t = src[i*2] | (src[i*2+1] << 8);
+    unsigned int r = (t >> 10) & 0x1f;
+    unsigned int g = (t >> 5) & 0x1f;
+    unsigned int b = t & 0x1f;
+    dest[0] = (unsigned char) ((r << 3) | (r >> 2));
+    dest[1] = (unsigned char) ((g << 3) | (g >> 2));
+    dest[2] = (unsigned char) ((b << 3) | (b >> 2));
+    if (format == 4) dest[3] = (t & 0x8000) ? 255 : 0;
+    dest += format;
+  }
 }
 
-static void 
-convert_data(const unsigned char * const src, unsigned char * const dest, 
-             const int x, const int srcformat, 
-             const int destformat)
+/* converts n pixels, read into the end of dest, to RGB(A) */
+static void
+convert_data(unsigned char * dest, size_t n, int depth, int format)
 {
-  if (srcformat == 2) {
-    if (destformat == 3) 
-      convert_16_to_24(src+x*srcformat,
-                       dest+x*destformat);
-    else {
-      assert(destformat == 4);
-      convert_16_to_32(src+x*srcformat,
-                       dest+x*destformat);
-    }
-  }
-  else if (srcformat == 3) {
-    assert(destformat == 3);
-    convert_24_to_24(src+x*srcformat,
-                     dest+x*destformat);
-  }
-  else {
-    assert(srcformat == 4 && destformat == 4);
-    convert_32_to_32(src+x*srcformat,
-                     dest+x*destformat);
-  }
+  if (depth == 2) convert_16(dest, n, format);
+  else if (depth == 3) convert_24_to_24(dest, n);
+  else convert_32_to_32(dest, n);
 }
 
 /* Intel byte order workaround */
@@ -147,99 +177,110 @@ static int getInt16(unsigned char *ptr)
   return res | (tmp<<8);
 }
 
-/* */
-/* decode a new rle packet */
-/* */
-static unsigned char * 
-rle_new_packet(unsigned char * src,
-               int * rleRemaining, 
-               int * rleIsCompressed,
-               unsigned char *rleCurrent,
-               const int rleEntrySize)
+/* reads n bytes of RLE data through the input buffer */
+static int
+rle_read(simage_tga_opendata * od, unsigned char * dest, int n)
 {
-  int i;
-  unsigned char code;
-  
-  code = *src++;
-
-  *rleRemaining = (code & 127) + 1; /* number of bytes left in this packet */
-  if (code & 128) { /* rle */
-    *rleIsCompressed = 1;
-    for (i = 0; i < rleEntrySize; i++)
-      rleCurrent[i] = *src++;
-  }
-  else { /* uncompressed */
-    *rleIsCompressed = 0;
+  int len;
+
+  while (n > 0) {
+    if (od->inpos == od->inlen) {
+      od->inoffset += od->inlen;
+      od->inlen = (int) fread(od->inbuf, 1, READ_BLOCK_SIZE, od->fp);
+      od->inpos = 0;
+      if (od->inlen == 0) return 0;
+    }
+    len = od->inlen - od->inpos;
+    if (len > n) len = n;
+    memcpy(dest, od->inbuf + od->inpos, len);
+    od->inpos += len;
+    dest += len;
+    n -= len;
   }
-  return src;
+  return 1;
 }
 
-/* */
-/* decode the # of specified bytes */
-/* */
-static unsigned char * 
-rle_decode(unsigned char * src, 
-           unsigned char *dest, 
-           const int numbytes,
-           int * rleRemaining,
-           int * rleIsCompressed,
-           unsigned char *rleCurrent,
-           const int rleEntrySize)
+/* decodes a row. Packets may continue on the next row */
+static int
+rle_decode_row(simage_tga_opendata * od, unsigned char * dest)
 {
-  int i;
-  int remain, compress, size;
-  unsigned char *stop = dest + numbytes;
-  
-  size = rleEntrySize;
-  remain = *rleRemaining;
-  compress = *rleIsCompressed;
-  
-  while (dest < stop) {
-    if (remain == 0) {/* start new packet */
-      src = rle_new_packet(src, &remain, &compress,
-                           rleCurrent, rleEntrySize);
+  tga_rle_state * state = &od->state;
+  int depth = od->depth;
+  int n = od->width;
+  int i, len, done;
+  unsigned char code;
+
+  while (n > 0) {
+    if (state->remaining == 0) { /* start new packet */
+      if (!rle_read(od, &code, 1)) return 0;
+      state->remaining = (code & 127) + 1;
+      state->compressed = (code & 128) != 0;
+      if (state->compressed && !rle_read(od, state->current, depth)) return 0;
     }
-    if (compress) {
-      for (i = 0; i < size; i++) {
-        *dest++ = rleCurrent[i];
+    len = state->remaining < n ? state->remaining : n;
+    if (state->compressed) {
+      /* copy the pixel, then keep doubling the copied part */
+      memcpy(dest, state->current, depth);
+      for (i = 1; i < len; i += done) {
+        done = i < len - i ? i : len - i;
+        memcpy(dest + i * depth, dest, done * depth);
       }
+      dest += len * depth;
     }
     else {
-      for (i = 0; i < size; i++) {
-        *dest++ = *src++;
-      }
+      if (!rle_read(od, dest, len * depth)) return 0;
+      dest += len * depth;
     }
-    remain--;
+    state->remaining -= len;
+    n -= len;
   }
-  *rleRemaining = remain;
-  *rleIsCompressed = compress;
-  return src;
+  return 1;
 }
 
-unsigned char *
-simage_tga_load(const char *filename,
-                int *width_ret,
-                int *height_ret,
-                int *numComponents_ret)
+/* reads a row, counting from the start of the file, as stored in the
+   file into dest */
+static int
+read_file_row(simage_tga_opendata * od, int row, unsigned char * dest)
 {
-  FILE * fp;
+  size_t rowbytes = (size_t) od->width * od->depth;
+
+  if (od->type == 2) {
+    if (row != od->nextrow &&
+        fseek(od->fp, od->dataoffset + (long) (row * rowbytes), SEEK_SET) != 0) {
+      return 0;
+    }
+    od->nextrow = row + 1;
+    return fread(dest, 1, rowbytes, od->fp) == rowbytes;
+  }
+
+  /* RLE data can only be decoded from the start of a row we've
+     already been to */
+  if (row < od->nextrow) {
+    od->state = od->rowstates[row];
+    if (fseek(od->fp, od->state.offset, SEEK_SET) != 0) return 0;
+    od->inoffset = od->state.offset;
+    od->inpos = od->inlen = 0;
+    od->nextrow = row;
+  }
+  while (od->nextrow <= row) {
+    od->state.offset = od->inoffset + od->inpos;
+    od->rowstates[od->nextrow] = od->state;
+    if (!rle_decode_row(od, dest)) return 0;
+    od->nextrow++;
+  }
+  return 1;
+}
+
+void *
+simage_tga_open(const char * filename,
+                int * width,
+                int * height,
+                int * numcomponents)
+{
+  simage_tga_opendata * od;
   unsigned char header[18];
-  int type;
-  int width;
-  int height;
-  int depth;
-  int flags;
-  int format;
-  unsigned char *colormap;
-  int indexsize;
-  int rleIsCompressed;
-  int rleRemaining;
-  int rleEntrySize;
-  unsigned char rleCurrent[4];
-  unsigned char *buffer;
-  unsigned char *dest;
-  int bpr;
-  unsigned char *linebuf;
+  long offset;
+  FILE * fp;
 
   tgaerror = ERR_NO_ERROR; /* clear error */
 
@@ -248,131 +289,140 @@ simage_tga_load(const char *filename,
     tgaerror = ERR_OPEN;
     return NULL;
   }
-  
+
   if (fread(header, 1, 18, fp) != 18) {
     tgaerror = ERR_READ;
     fclose(fp);
     return NULL;
   }
 
-  type = header[2];
-  width = getInt16(&header[12]);
-  height = getInt16(&header[14]);
-  depth = header[16] >> 3;
-  flags = header[17];
+  od = (simage_tga_opendata *) malloc(sizeof(simage_tga_opendata));
+  if (od == NULL) {
+    tgaerror = ERR_MEM;
+    fclose(fp);
+    return NULL;
+  }
+  memset(od, 0, sizeof(simage_tga_opendata));
+  od->fp = fp;
+  od->type = header[2];
+  od->width = getInt16(&header[12]);
+  od->height = getInt16(&header[14]);
+  od->depth = header[16] >> 3;
+  od->topdown = (header[17] & 0x20) != 0;
 
   /* check for reasonable values in case this is not a tga file */
-  if ((type != 2 && type != 10) ||
-      (width < 0 || width > 4096) ||
-      (height < 0 || height > 4096) ||
-      (depth < 2 || depth > 4)) {
+  if ((od->type != 2 && od->type != 10) ||
+      od->width == 0 || od->height == 0 ||
+      (od->depth < 2 || od->depth > 4)) {
     tgaerror = ERR_UNSUPPORTED;
-    fclose(fp);
+    simage_tga_close(od);
     return NULL;
   }
 
-  if (header[0]) /* skip identification field */
-    fseek(fp, header[0], SEEK_CUR);
+  /* skip identification field and colormap */
+  offset = 18 + header[0];
+  if (header[1] == 1) {
+    offset += (long) getInt16(&header[5]) * ((header[7] + 7) >> 3);
+  }
+  od->dataoffset = offset;
+  if (fseek(fp, offset, SEEK_SET) != 0) {
+    tgaerror = ERR_READ;
+    simage_tga_close(od);
+    return NULL;
+  }
 
-  colormap = NULL;
-  if (header[1] == 1) { /* there is a colormap */
-    int len = getInt16(&header[5]);
-    indexsize = header[7]>>3;
-    colormap = (unsigned char *)malloc(len*indexsize);
-    fread(colormap, 1, len*indexsize, fp);
+  if (od->depth == 2) { /* 16 bits */
+    if (header[17] & 1) od->format = 4;
+    else od->format = 3;
+  }
+  else od->format = od->depth;
+
+  if (od->type == 10) {
+    od->inbuf = (unsigned char *) malloc(READ_BLOCK_SIZE);
+    od->rowstates = (tga_rle_state *) malloc(od->height * sizeof(tga_rle_state));
+    if (od->inbuf == NULL || od->rowstates == NULL) {
+      tgaerror = ERR_MEM;
+      simage_tga_close(od);
+      return NULL;
+    }
+    od->inoffset = offset;
   }
 
-  if (depth == 2) { /* 16 bits */
-    if (flags & 1) format = 4;
-    else format = 3;
+  *width = od->width;
+  *height = od->height;
+  *numcomponents = od->format;
+  return (void *) od;
+}
+
+void
+simage_tga_close(void * opendata)
+{
+  simage_tga_opendata * od = (simage_tga_opendata *) opendata;
+
+  fclose(od->fp);
+  if (od->inbuf) free(od->inbuf);
+  if (od->rowstates) free(od->rowstates);
+  free(od);
+}
+
+int
+simage_tga_read_line(void * opendata, int y, unsigned char * buf)
+{
+  simage_tga_opendata * od = (simage_tga_opendata *) opendata;
+  int row = od->topdown ? od->height - 1 - y : y;
+  size_t n = od->width;
+
+  /* read the file's pixels into the end of buf, and expand them */
+  if (!read_file_row(od, row, buf + n * (od->format - od->depth))) {
+    tgaerror = ERR_READ;
+    return 0;
   }
-  else format = depth;
+  convert_data(buf, n, od->depth, od->format);
+  return 1;
+}
 
-  /*    SoDebugError::postInfo("simage_tga_load", "TARGA file: %d %d %d %d %d\n",  */
-  /*                     type, width, height, depth, format); */
+unsigned char *
+simage_tga_load(const char *filename,
+                int *width_ret,
+                int *height_ret,
+                int *numComponents_ret)
+{
+  simage_tga_opendata * od;
+  unsigned char * buffer;
+  size_t n, bpr;
+  int width, height, format, row;
+
+  od = (simage_tga_opendata *) simage_tga_open(filename, &width, &height, &format);
+  if (od == NULL) return NULL;
+
+  n = (size_t) width * height;
+  bpr = (size_t) width * format;
+  buffer = (unsigned char*) malloc(n * format);
+  if (buffer == NULL) {
+    tgaerror = ERR_MEM;
+    simage_tga_close(od);
+    return NULL;
+  }
 
-  rleIsCompressed = 0;
-  rleRemaining = 0;
-  rleEntrySize = depth;
-  buffer = (unsigned char*)malloc(width*height*format);
-  dest = buffer;
-  bpr = format * width;
-  linebuf = (unsigned char *)malloc(width*depth);
-  
-  switch(type) {
-    case 1: /* colormap, uncompressed */
-    {
-      /* FIXME: write code */
-      /* should never get here because simage_tga_identify returns 0 */
-      /* for this filetype */
-      /* I need example files in this format to write the code... */
-      tgaerror = ERR_UNSUPPORTED;
-    }
-    break;
-    case 2: /* RGB, uncompressed */
-    {
-      int x, y;
-      for (y = 0; y < height; y++) {
-        if (fread(linebuf, 1, width*depth, fp) != (unsigned int)width*depth) {
-          tgaerror = ERR_READ;
-          break;
-        }
-        for (x = 0; x < width; x++) {
-          convert_data(linebuf, dest, x, depth, format); 
-        }
-        dest += bpr;
-      }
+  if (od->type == 2 && !od->topdown) {
+    /* the rows are stored in the same order as we want them, so the
+       whole image can be read with one call */
+    if (fread(buffer + n * (format - od->depth), 1, n * od->depth, od->fp) !=
+        n * od->depth) {
+      tgaerror = ERR_READ;
     }
-    break;
-    case 9: /* colormap, compressed */
-    {
-      /* FIXME: write code */
-      /* should never get here because simage_tga_identify returns 0 */
-      /* for this filetype */
-      /* I need example files in this format to write the code... */
-      tgaerror = ERR_UNSUPPORTED;
-    }
-    break;
-    case 10: /* RGB, compressed */
-    {
-      int size, x, y;
-      unsigned char *buf;
-      unsigned char *src;
-      int pos = ftell(fp);
-      fseek(fp, 0, SEEK_END);
-      size = ftell(fp) - pos;
-      fseek(fp, pos, SEEK_SET);
-      buf = (unsigned char *)malloc(size);
-      if (buf == NULL) {
-        tgaerror = ERR_MEM;
-        break;
-      }
-      src = buf;
-      if (fread(buf, 1, size, fp) != (unsigned int) size) {
-        tgaerror = ERR_READ;
-        break;
-      }
-      for (y = 0; y < height; y++) {
-        src = rle_decode(src, linebuf, width*depth, &rleRemaining,
-                         &rleIsCompressed, rleCurrent, rleEntrySize);
-        assert(src <= buf + size);
-        for (x = 0; x < width; x++) {
-          convert_data(linebuf, dest, x, depth, format); 
-        }
-        dest += bpr;
-      }
-      if (buf) free(buf);
+    else convert_data(buffer, n, od->depth, format);
+  }
+  else {
+    for (row = 0; row < height; row++) {
+      int y = od->topdown ? height - 1 - row : row;
+      if (!simage_tga_read_line(od, y, buffer + y * bpr)) break;
     }
-    break;
-    default:
-      tgaerror = ERR_UNSUPPORTED;
   }
-  
-  if (linebuf) free(linebuf);
-  fclose(fp);
+  simage_tga_close(od);
 
   if (tgaerror) {
-    if (buffer) free(buffer);
+    free(buffer);
     return NULL;
   }
 
@@ -383,6 +433,199 @@ simage_tga_load(const char *filename,
   return buffer;
 }
 
+/*
+ * The saver. Images are stored bottom-up, which is the TGA default,
+ * as 24 bit BGR or 32 bit BGRA. Grayscale images are expanded to
+ * color, since that is what the loader reads.
+ */
+
+/* the output is collected in blocks of about this size before being
+   written */
+#define WRITE_BLOCK_SIZE (1024 * 1024)
+
+/* converts a row of RGB(A) or grayscale pixels to BGR(A) */
+static void
+pack_row(const unsigned char * src, int width, int nc, unsigned char * dst)
+{
+  int x;
+
+  switch (nc) {
+  case 1:
+    for (x = 0; x < width; x++) {
+      dst[0] = dst[1] = dst[2] = src[x];
+      dst += 3;
+    }
+    break;
+  case 2:
+    for (x = 0; x < width; x++) {
+      dst[0] = dst[1] = dst[2] = src[0];
+      dst[3] = src[1];
+      src += 2;
+      dst += 4;
+    }
+    break;
+  case 3:
+    for (x = 0; x < width; x++) {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+      src += 3;
+      dst += 3;
+    }
+    break;
+  default:
+    for (x = 0; x < width; x++) {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+      dst[3] = src[3];
+      src += 4;
+      dst += 4;
+    }
+    break;
+  }
+}
+
+static int
+same_pixel(const unsigned char * a, const unsigned char * b, int size)
+{
+  if (size == 4) {
+    unsigned int pa, pb;
+    memcpy(&pa, a, 4);
+    memcpy(&pb, b, 4);
+    return pa == pb;
+  }
+  return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+/* run length encodes a row of pixels. Packets never cross rows.
+   Returns the number of bytes written to dst, which needs room for
+   width * (size + 1) bytes */
+static int
+rle_encode_row(const unsigned char * src, int width, int size,
+               unsigned char * dst)
+{
+  unsigned char * start = dst;
+  const unsigned char * p;
+  int x, n;
+
+  x = 0;
+  while (x < width) {
+    p = src + x * size;
+    n = 1;
+    while (x + n < width && n < 128 && same_pixel(p, p + n * size, size)) n++;
+    if (n > 1) {
+      *dst++ = (unsigned char) (0x80 | (n - 1));
+      memcpy(dst, p, size);
+      dst += size;
+    }
+    else {
+      /* raw pixels up to where the next run starts */
+      while (x + n < width && n < 128 &&
+             !(x + n + 1 < width &&
+               same_pixel(p + n * size, p + (n + 1) * size, size))) n++;
+      *dst++ = (unsigned char) (n - 1);
+      memcpy(dst, p, n * size);
+      dst += n * size;
+    }
+    x += n;
+  }
+  return (int) (dst - start);
+}
+
+int
+simage_tga_save(const char * filename,
+                const unsigned char * bytes,
+                int width,
+                int height,
+                int numcomponents,
+                s_params * params)
+{
+  /* TGA 2.0 footer without extension and developer areas */
+  static const char footer[26] = {
+    0, 0, 0, 0, 0, 0, 0, 0,
+    'T', 'R', 'U', 'E', 'V', 'I', 'S', 'I', 'O', 'N', '-',
+    'X', 'F', 'I', 'L', 'E', '.', 0
+  };
+  unsigned char header[18];
+  unsigned char * rowbuf, * outbuf;
+  size_t used, bufsize, maxrow;
+  int rle, depth, y;
+  char * str;
+  FILE * fp;
+
+  if (numcomponents < 1 || numcomponents > 4 ||
+      width <= 0 || height <= 0 || width > 65535 || height > 65535) {
+    tgaerror = ERR_SAVE_FORMAT;
+    return 0;
+  }
+
+  rle = 0;
+  if (params && s_params_get(params, "compression", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+    if (strcmp(str, "rle") == 0) rle = 1;
+    else if (strcmp(str, "none") == 0) rle = 0;
+  }
+  depth = (numcomponents == 2 || numcomponents == 4) ? 4 : 3;
+
+  memset(header, 0, 18);
+  header[2] = rle ? 10 : 2;
+  header[12] = (unsigned char) (width & 0xff);
+  header[13] = (unsigned char) (width >> 8);
+  header[14] = (unsigned char) (height & 0xff);
+  header[15] = (unsigned char) (height >> 8);
+  header[16] = (unsigned char) (depth * 8);
+  header[17] = depth == 4 ? 8 : 0; /* alpha bits, bottom-left origin */
+
+  /* room for a row, including the worst case RLE overhead */
+  maxrow = (size_t) width * (depth + 1);
+  bufsize = maxrow > WRITE_BLOCK_SIZE ? maxrow : WRITE_BLOCK_SIZE;
+  outbuf = (unsigned char *) malloc(bufsize);
+  rowbuf = rle ? (unsigned char *) malloc((size_t) width * depth) : NULL;
+  if (outbuf == NULL || (rle && rowbuf == NULL)) {
+    tgaerror = ERR_MEM;
+    if (outbuf) free(outbuf);
+    if (rowbuf) free(rowbuf);
+    return 0;
+  }
+
+  fp = fopen(filename, "wb");
+  if (!fp) {
+    tgaerror = ERR_OPEN_WRITE;
+    free(outbuf);
+    if (rowbuf) free(rowbuf);
+    return 0;
+  }
+
+  tgaerror = ERR_NO_ERROR;
+  if (fwrite(header, 1, 18, fp) != 18) tgaerror = ERR_WRITE;
+
+  used = 0;
+  for (y = 0; y < height && tgaerror == ERR_NO_ERROR; y++) {
+    const unsigned char * src = bytes + (size_t) y * width * numcomponents;
+    if (used + maxrow > bufsize) {
+      if (fwrite(outbuf, 1, used, fp) != used) tgaerror = ERR_WRITE;
+      used = 0;
+    }
+    if (rle) {
+      pack_row(src, width, numcomponents, rowbuf);
+      used += rle_encode_row(rowbuf, width, depth, outbuf + used);
+    }
+    else {
+      pack_row(src, width, numcomponents, outbuf + used);
+      used += (size_t) width * depth;
+    }
+  }
+  if (tgaerror == ERR_NO_ERROR &&
+      (fwrite(outbuf, 1, used, fp) != used ||
+       fwrite(footer, 1, 26, fp) != 26)) {
+    tgaerror = ERR_WRITE;
+  }
+
+  free(outbuf);
+  if (rowbuf) free(rowbuf);
+  if (fclose(fp) != 0 && tgaerror == ERR_NO_ERROR) tgaerror = ERR_WRITE;
+  return tgaerror == ERR_NO_ERROR;
+}
 
 int 
 simage_tga_identify(const char *filename,
@@ -26,6 +26,7 @@
 #ifdef HAVE_TIFFLIB
 
 #include <simage_tiff.h>
+#include <simage_private.h>
 #include <stdio.h>
 
 #include <tiffio.h>
@@ -42,6 +43,8 @@
 #define ERR_TIFFLIB     5
 #define ERR_OPEN_WRITE  6
 #define ERR_WRITE       7
+#define ERR_UNSUPPORTED_WRITE 8
+#define ERR_RESIZE      9
 
 static int tifferror = ERR_NO_ERROR;
 
@@ -67,6 +70,12 @@ simage_tiff_error(char * buffer, int buflen)
     case ERR_WRITE:
       strncpy(buffer, "TIFF loader: Error writing file", buflen);
       break;
+    case ERR_UNSUPPORTED_WRITE:
+      strncpy(buffer, "TIFF saver: Compression not supported by libtiff", buflen);
+      break;
+    case ERR_RESIZE:
+      strncpy(buffer, "TIFF saver: Unable to create reduced resolution image", buflen);
+      break;
   }
   return tifferror;
 }
@@ -127,8 +136,8 @@ copy_row(unsigned char *ptr, unsigned char *data, int n, int numcomponents)
 static void
 interleave_row(unsigned char *ptr,
                unsigned char *red,
-               unsigned char *blue,
                unsigned char *green,
+               unsigned char *blue,
                unsigned char *alpha,
                int n)
 {
@@ -153,7 +162,7 @@ tiff_try_read_rgba(TIFF *in, int w, int h, int format,
   }
   if (!TIFFReadRGBAImage(in, w, h,
                          (unsigned int*) newbuffer, 1)) {
-    free(newbuffer);
+    if (newbuffer != buffer) free(newbuffer);
     return ERR_READ;
   }
   if (format != 4) {
@@ -194,123 +203,459 @@ simage_tiff_identify(const char *ptr,
 {
   static unsigned char tifcmp[] = {0x4d, 0x4d, 0x0, 0x2a};
   static unsigned char tifcmp2[] = {0x49, 0x49, 0x2a, 0};
+  /* BigTIFF */
+  static unsigned char bigcmp[] = {0x4d, 0x4d, 0x0, 0x2b};
+  static unsigned char bigcmp2[] = {0x49, 0x49, 0x2b, 0};
 
   if (headerlen < 4) return 0;
   if (memcmp((const void*)header, (const void*)tifcmp, 4) == 0) return 1;
   if (memcmp((const void*)header, (const void*)tifcmp2, 4) == 0) return 1;
+  if (memcmp((const void*)header, (const void*)bigcmp, 4) == 0) return 1;
+  if (memcmp((const void*)header, (const void*)bigcmp2, 4) == 0) return 1;
   return 0;
 }
 
-/* useful defines (undef'ed below) */
-#define CVT(x)          (((x) * 255L) / ((1L<<16)-1))
-#define pack(a,b)       ((a)<<8 | (b))
-
-unsigned char *
-simage_tiff_load(const char *filename,
-                 int *width_ret,
-                 int *height_ret,
-                 int *numComponents_ret)
-{
-  TIFF *in;
+typedef struct {
+  TIFF * in;
   uint16 samplesperpixel;
   uint16 bitspersample;
   uint16 photometric;
   uint32 w, h;
   uint16 config;
-  uint16* red;
-  uint16* green;
-  uint16* blue;
-  unsigned char *inbuf = NULL;
-  tsize_t rowsize;
-  uint32 row;
+  uint16 * red;
+  uint16 * green;
+  uint16 * blue;
   int format;
-  unsigned char *buffer;
-  int width;
-  int height;
-  unsigned char *currPtr;
-
+  int rowsize;
+  unsigned char * inbuf;
+  /* for reading tiles, or strips as tiles as wide as the image */
+  int tiled;
+  uint32 tilew, tileh;
+  tsize_t tilesize;
+  unsigned char * tilebuf;  /* one raw tile, one plane per sample if separate */
+  unsigned char * band;     /* a decoded row of tiles, for read_line */
+  int bandrow;              /* the tile row in band, or -1 */
+  /* for strips too large to be decoded whole, read as bands of
+     tileh rows with TIFFReadScanline() */
+  int scanlines;
+  uint32 rowsperstrip;
+  uint32 nextrow;           /* the row TIFFReadScanline() is at */
+  int nextplane;
+} simage_tiff_opendata;
 
-  TIFFSetErrorHandler(tiff_error);
-  TIFFSetWarningHandler(tiff_warn);
+/* the most memory used for decoding a strip or band of rows */
+#define MAX_STRIP_BUFFER (1024 * 1024)
 
-  in = TIFFOpen(filename, "r");
-  if (in == NULL) {
-    tifferror = ERR_OPEN;
-    return NULL;
-  }
-  if (TIFFGetField(in, TIFFTAG_PHOTOMETRIC, &photometric) == 1) {
-    if (photometric != PHOTOMETRIC_RGB && photometric != PHOTOMETRIC_PALETTE &&
-        photometric != PHOTOMETRIC_MINISWHITE &&
-        photometric != PHOTOMETRIC_MINISBLACK) {
-      /*Bad photometric; can only handle Grayscale, RGB and Palette images :-( */
-      TIFFClose(in);
-      tifferror = ERR_UNSUPPORTED;
-      return NULL;
+/* sets up reading of the image a tile or strip at a time, leaving
+   tilebuf NULL if that's not possible. Returns 0 if out of memory */
+static int
+tiff_init_tiles(simage_tiff_opendata * od)
+{
+  int planes;
+
+  od->tiled = 0;
+  od->scanlines = 0;
+  od->tilebuf = NULL;
+  od->band = NULL;
+  od->bandrow = -1;
+  if (TIFFIsTiled(od->in)) {
+    if (TIFFGetField(od->in, TIFFTAG_TILEWIDTH, &od->tilew) != 1 ||
+        TIFFGetField(od->in, TIFFTAG_TILELENGTH, &od->tileh) != 1 ||
+        od->tilew == 0 || od->tileh == 0) {
+      return 1; /* let TIFFReadScanline() fail later */
     }
+    od->tilesize = TIFFTileSize(od->in);
   }
   else {
-    tifferror = ERR_READ;
-    TIFFClose(in);
-    return NULL;
+    /* TIFFReadScanline() can't go back to earlier rows of a
+       compressed strip, so strips are decoded whole */
+    if (TIFFGetFieldDefaulted(od->in, TIFFTAG_ROWSPERSTRIP, &od->tileh) != 1) {
+      return 1;
+    }
+    if (od->tileh == 0 || od->tileh > od->h) od->tileh = od->h;
+    od->rowsperstrip = od->tileh;
+    od->tilew = od->w;
+    od->tilesize = TIFFStripSize(od->in);
+  }
+  if (od->tilesize <= 0) return 1;
+  planes = od->config == PLANARCONFIG_SEPARATE ? od->samplesperpixel : 1;
+  if (!TIFFIsTiled(od->in) && od->tilesize * planes > MAX_STRIP_BUFFER) {
+    /* large strips, like the single strip many writers use for the
+       whole image, are decoded in bands of rows instead, to not hold
+       two copies of the whole strip */
+    tsize_t scanline = TIFFScanlineSize(od->in);
+    if (scanline <= 0) return 1;
+    od->tileh = MAX_STRIP_BUFFER / (scanline * planes);
+    if (od->tileh < 1) od->tileh = 1;
+    od->tilesize = scanline * od->tileh;
+    od->scanlines = 1;
+    od->nextrow = 0;
+    od->nextplane = 0;
   }
+  od->tilebuf = (unsigned char *) malloc(od->tilesize * planes);
+  if (od->tilebuf == NULL) return 0;
+  od->tiled = TIFFIsTiled(od->in);
+  return 1;
+}
 
-  if (TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, &samplesperpixel) == 1) {
-    if (samplesperpixel < 1 || samplesperpixel > 4) {
-      /* Bad samples/pixel */
-      tifferror = ERR_UNSUPPORTED;
-      TIFFClose(in);
-      return NULL;
+static void
+tiff_free_tiles(simage_tiff_opendata * od)
+{
+  if (od->tilebuf) free(od->tilebuf);
+  if (od->band) free(od->band);
+  od->tilebuf = NULL;
+  od->band = NULL;
+}
+
+/* converts n pixels to our pixel format. src holds one pointer per
+   sample for planar images, else just the one */
+static void
+convert_row(simage_tiff_opendata * od, unsigned char ** src, int n,
+            unsigned char * dst)
+{
+  int spp = od->samplesperpixel;
+  int i;
+
+  if (od->config == PLANARCONFIG_SEPARATE) {
+    switch (od->photometric) {
+    case PHOTOMETRIC_MINISWHITE:
+    case PHOTOMETRIC_MINISBLACK:
+      invert_row(dst, src[0], n, od->photometric == PHOTOMETRIC_MINISWHITE);
+      break;
+    case PHOTOMETRIC_PALETTE:
+      remap_row(dst, src[0], n, od->red, od->green, od->blue, NULL);
+      break;
+    default:
+      interleave_row(dst, src[0], src[1], src[2],
+                     od->format == 4 ? src[3] : NULL, n);
+      break;
     }
   }
   else {
-    tifferror = ERR_READ;
-    TIFFClose(in);
-    return NULL;
+    switch (od->photometric) {
+    case PHOTOMETRIC_MINISWHITE:
+      for (i = 0; i < n; i++) dst[i] = 255 - src[0][i*spp];
+      break;
+    case PHOTOMETRIC_MINISBLACK:
+      for (i = 0; i < n; i++) dst[i] = src[0][i*spp];
+      break;
+    case PHOTOMETRIC_PALETTE:
+      remap_row(dst, src[0], n, od->red, od->green, od->blue, NULL);
+      break;
+    default:
+      copy_row(dst, src[0], n, od->format);
+      break;
+    }
   }
+}
 
-  if (TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &bitspersample) == 1) {
-    if (bitspersample != 8) {
-      /* can only handle 8-bit samples. */
-      TIFFClose(in);
-      tifferror = ERR_UNSUPPORTED;
-      return NULL;
+/* converts n pixels from the raw tile data at column x, row y in the
+   tile to our pixel format */
+static void
+convert_tile_row(simage_tiff_opendata * od, int x, int y, int n,
+                 unsigned char * dst)
+{
+  unsigned char * src[4];
+  int i;
+
+  if (od->config == PLANARCONFIG_SEPARATE) {
+    for (i = 0; i < od->samplesperpixel; i++) {
+      src[i] = od->tilebuf + i * od->tilesize + y * od->tilew + x;
     }
   }
   else {
-    tifferror = ERR_READ;
-    TIFFClose(in);
-    return NULL;
+    src[0] = od->tilebuf + (y * od->tilew + x) * od->samplesperpixel;
   }
+  convert_row(od, src, n, dst);
+}
 
-  if (TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &w) != 1 ||
-      TIFFGetField(in, TIFFTAG_IMAGELENGTH, &h) != 1 ||
-      TIFFGetField(in, TIFFTAG_PLANARCONFIG, &config) != 1) {
-    TIFFClose(in);
-    tifferror = ERR_READ;
-    return NULL;
+/* decodes the n rows from row of the given plane into dst with
+   TIFFReadScanline(). As the codecs can't skip rows, the rows are read
+   from the start of the strip, unless the previous call ended in the
+   same strip before row */
+static int
+tiff_read_scanlines(simage_tiff_opendata * od, uint32 row, uint32 n, int s,
+                    unsigned char * dst)
+{
+  tsize_t scanline = od->tilesize / od->tileh;
+  uint32 start = (row / od->rowsperstrip) * od->rowsperstrip;
+  uint32 r;
+
+  if (s == od->nextplane && od->nextrow >= start && od->nextrow <= row) {
+    start = od->nextrow;
+  }
+  /* the rows before row are decoded into the first row of dst */
+  for (r = start; r < row + n; r++) {
+    od->nextrow = od->h; /* start over after errors */
+    if (TIFFReadScanline(od->in, dst + (r < row ? 0 : (r - row) * scanline),
+                         r, (tsample_t) s) < 0) return 0;
   }
+  od->nextrow = row + n;
+  od->nextplane = s;
+  return 1;
+}
 
-  if (photometric == PHOTOMETRIC_MINISWHITE ||
-      photometric == PHOTOMETRIC_MINISBLACK)
-    format = 1;
-  else {
-    if (photometric == PHOTOMETRIC_PALETTE) format = 3;
-    else format = samplesperpixel;
+/*
+ * Decodes the w x h pixels at x, y (counted from the top left corner)
+ * from a tiled or stripped image, reading only the tiles or strips
+ * that overlap. Row r of the region is stored at dst + r * dststride.
+ * Returns 0 on failure.
+ */
+static int
+tiff_read_tiles(simage_tiff_opendata * od, int x, int y, int w, int h,
+                unsigned char * dst, long dststride)
+{
+  uint32 tx, ty;
+  int s, planes = od->config == PLANARCONFIG_SEPARATE ? od->samplesperpixel : 1;
+  int bpp = od->format;
+
+  for (ty = (y / od->tileh) * od->tileh; ty < (uint32) (y + h); ty += od->tileh) {
+    int y0 = (int) ty > y ? (int) ty : y;
+    int y1 = (int) (ty + od->tileh) < y + h ? (int) (ty + od->tileh) : y + h;
+    for (tx = (x / od->tilew) * od->tilew; tx < (uint32) (x + w); tx += od->tilew) {
+      int x0 = (int) tx > x ? (int) tx : x;
+      int x1 = (int) (tx + od->tilew) < x + w ? (int) (tx + od->tilew) : x + w;
+      int row;
+      for (s = 0; s < planes; s++) {
+        unsigned char * raw = od->tilebuf + s * od->tilesize;
+        tsize_t got;
+        if (od->scanlines) {
+          uint32 n = od->h - ty < od->tileh ? od->h - ty : od->tileh;
+          got = tiff_read_scanlines(od, ty, n, s, raw) ? n : -1;
+        }
+        else if (od->tiled) {
+          got = TIFFReadTile(od->in, raw, tx, ty, 0, (tsample_t) s);
+        }
+        else {
+          got = TIFFReadEncodedStrip(od->in, TIFFComputeStrip(od->in, ty, (tsample_t) s),
+                                     raw, od->tilesize);
+        }
+        if (got < 0) return 0;
+      }
+      for (row = y0; row < y1; row++) {
+        convert_tile_row(od, x0 - tx, row - ty, x1 - x0,
+                         dst + (row - y) * dststride + (x0 - x) * bpp);
+      }
+    }
   }
-  buffer = (unsigned char*)malloc(w*h*format);
+  return 1;
+}
 
-  if (!buffer) {
-    tifferror = ERR_MEM;
-    TIFFClose(in);
-    return NULL;
+/* useful defines (undef'ed below) */
+#define CVT(x)          (((x) * 255L) / ((1L<<16)-1))
+#define pack(a,b)       ((a)<<8 | (b))
+
+/* sets up od for decoding an image from the loader. Returns 0 if
+   the colormap of a palette image can't be read */
+static int
+tiff_fill_opendata(simage_tiff_opendata * od, TIFF * in, uint16 photometric,
+                   uint16 config, uint16 samplesperpixel, uint16 bitspersample,
+                   uint32 w, uint32 h, int format)
+{
+  memset(od, 0, sizeof(simage_tiff_opendata));
+  od->in = in;
+  od->photometric = photometric;
+  od->config = config;
+  od->samplesperpixel = samplesperpixel;
+  od->bitspersample = bitspersample;
+  od->w = w;
+  od->h = h;
+  od->format = format;
+  od->bandrow = -1;
+
+  if (photometric == PHOTOMETRIC_PALETTE) {
+    if (TIFFGetField(in, TIFFTAG_COLORMAP, &od->red, &od->green, &od->blue) != 1)
+      return 0;
+    if (checkcmap(1<<bitspersample, od->red, od->green, od->blue) == 16) {
+      int i;
+      for (i = (1<<bitspersample)-1; i >= 0; i--) {
+        od->red[i] = CVT(od->red[i]);
+        od->green[i] = CVT(od->green[i]);
+        od->blue[i] = CVT(od->blue[i]);
+      }
+    }
   }
+  return 1;
+}
 
-  width = w;
-  height = h;
+/* decodes an image tile by tile, or strip by strip. Returns 0 on
+   failure */
+static int
+tiff_load_tiled(simage_tiff_opendata * od, unsigned char * buffer)
+{
+  int ret;
 
-  currPtr = buffer + (h-1)*w*format;
+  if (!tiff_init_tiles(od) || od->tilebuf == NULL) {
+    tiff_free_tiles(od);
+    return 0;
+  }
+  /* flip the image upside down while decoding */
+  ret = tiff_read_tiles(od, 0, 0, od->w, od->h,
+                        buffer + (od->h-1)*od->w*od->format,
+                        -(long) (od->w*od->format));
+  tiff_free_tiles(od);
+  return ret;
+}
 
-  tifferror = ERR_NO_ERROR;
+/*
+ * Parallel decoding of strips and tiles.
+ *
+ * Every strip (or tile) is compressed on its own, so bands of strips
+ * or rows of tiles can be decoded on the worker threads. libtiff's
+ * codecs keep their state in the TIFF handle, so each job opens the
+ * file again and decodes its band through libtiff straight into the
+ * output image.
+ */
+
+/* don't bother with threads for images smaller than this */
+#define PARALLEL_MIN_PIXELS (1024 * 1024)
+
+typedef struct {
+  simage_tiff_opendata * od;
+  const char * filename;
+  tdir_t directory;
+  uint32 bandh;         /* rows decoded by each job, whole strips or tiles */
+  unsigned char * buffer;
+  int failed;
+} tiff_parallel_job;
+
+static void
+decode_band(void * closure, int idx)
+{
+  tiff_parallel_job * job = (tiff_parallel_job *) closure;
+  simage_tiff_opendata od = *job->od;
+  uint32 y = idx * job->bandh;
+  uint32 n = od.h - y < job->bandh ? od.h - y : job->bandh;
+  int ok;
+
+  od.in = TIFFOpen(job->filename, "r");
+  if (od.in == NULL) {
+    job->failed = 1;
+    return;
+  }
+  ok = TIFFSetDirectory(od.in, job->directory) &&
+    tiff_init_tiles(&od) && od.tilebuf != NULL &&
+    tiff_read_tiles(&od, 0, y, od.w, n,
+                    job->buffer + (size_t) (od.h - 1 - y) * od.w * od.format,
+                    -(long) (od.w * od.format));
+  tiff_free_tiles(&od);
+  TIFFClose(od.in);
+  if (!ok) job->failed = 1;
+}
+
+/* decodes the image on the worker threads if possible. Returns 0 if
+   the image must be decoded the normal way */
+static int
+tiff_load_parallel(simage_tiff_opendata * od, unsigned char * buffer)
+{
+  tiff_parallel_job job;
+  uint32 units, tileh;
+  int numjobs, scanlines;
+
+  numjobs = simage_get_num_threads();
+  if (numjobs < 2 || (double) od->w * od->h < PARALLEL_MIN_PIXELS) return 0;
+
+  /* find the size of the strips or tiles */
+  if (!tiff_init_tiles(od)) return 0;
+  tileh = od->tileh;
+  scanlines = od->scanlines;
+  if (od->tilebuf == NULL) scanlines = 1;
+  tiff_free_tiles(od);
+  /* strips too large to be decoded whole must be read from the start */
+  if (scanlines) return 0;
+
+  units = (od->h + tileh - 1) / tileh;
+  if (units < 2) return 0;
+  if ((uint32) numjobs > units) numjobs = (int) units;
+
+  job.od = od;
+  job.filename = TIFFFileName(od->in);
+  job.directory = TIFFCurrentDirectory(od->in);
+  job.bandh = ((units + numjobs - 1) / numjobs) * tileh;
+  job.buffer = buffer;
+  job.failed = 0;
+  numjobs = (int) ((od->h + job.bandh - 1) / job.bandh);
+  s_parallel_for(numjobs, decode_band, &job);
+  return !job.failed;
+}
+
+/* reads the properties of the current directory and checks that we
+   can decode it */
+static int
+tiff_read_info(TIFF * in, uint16 * photometric, uint16 * config,
+               uint16 * samplesperpixel, uint16 * bitspersample,
+               uint32 * w, uint32 * h, int * format)
+{
+  if (TIFFGetField(in, TIFFTAG_PHOTOMETRIC, photometric) == 1) {
+    if (*photometric != PHOTOMETRIC_RGB && *photometric != PHOTOMETRIC_PALETTE &&
+        *photometric != PHOTOMETRIC_MINISWHITE &&
+        *photometric != PHOTOMETRIC_MINISBLACK) {
+      /*Bad photometric; can only handle Grayscale, RGB and Palette images :-( */
+      return ERR_UNSUPPORTED;
+    }
+  }
+  else return ERR_READ;
+
+  if (TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, samplesperpixel) == 1) {
+    if (*samplesperpixel < 1 || *samplesperpixel > 4) {
+      /* Bad samples/pixel */
+      return ERR_UNSUPPORTED;
+    }
+  }
+  else return ERR_READ;
+
+  if (TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, bitspersample) == 1) {
+    if (*bitspersample != 8) {
+      /* can only handle 8-bit samples. */
+      return ERR_UNSUPPORTED;
+    }
+  }
+  else return ERR_READ;
+
+  if (TIFFGetField(in, TIFFTAG_IMAGEWIDTH, w) != 1 ||
+      TIFFGetField(in, TIFFTAG_IMAGELENGTH, h) != 1 ||
+      TIFFGetField(in, TIFFTAG_PLANARCONFIG, config) != 1) {
+    return ERR_READ;
+  }
+
+  if (*photometric == PHOTOMETRIC_MINISWHITE ||
+      *photometric == PHOTOMETRIC_MINISBLACK)
+    *format = 1;
+  else {
+    if (*photometric == PHOTOMETRIC_PALETTE) *format = 3;
+    else *format = *samplesperpixel;
+  }
+  return ERR_NO_ERROR;
+}
+
+/* decodes the current directory into buffer, which must have room
+   for w*h*format bytes */
+static int
+tiff_read_image(TIFF * in, uint16 photometric, uint16 config,
+                uint16 samplesperpixel, uint16 bitspersample,
+                uint32 w, uint32 h, int format, unsigned char * buffer)
+{
+  uint16* red;
+  uint16* green;
+  uint16* blue;
+  unsigned char *inbuf = NULL;
+  tsize_t rowsize;
+  uint32 row;
+  unsigned char *currPtr;
+  simage_tiff_opendata od;
+  int err = ERR_NO_ERROR;
+
+  currPtr = buffer + (size_t) (h-1)*w*format;
+
+  /* large images can be decompressed on several threads, and other
+     images are decoded tile by tile or strip by strip, converting the
+     pixels the same way as s_image_read_line(). If that fails, we try
+     the scanline interface and TIFFReadRGBAImage() below */
+  if (tiff_fill_opendata(&od, in, photometric, config, samplesperpixel,
+                         bitspersample, w, h, format) &&
+      (tiff_load_parallel(&od, buffer) || tiff_load_tiled(&od, buffer))) {
+    return ERR_NO_ERROR;
+  }
 
   switch (pack(photometric, config)) {
     case pack(PHOTOMETRIC_MINISWHITE, PLANARCONFIG_CONTIG):
@@ -321,14 +666,15 @@ simage_tiff_load(const char *filename,
       inbuf = (unsigned char *)malloc(TIFFScanlineSize(in));
       for (row = 0; row < h; row++) {
         if (TIFFReadScanline(in, inbuf, row, 0) < 0) {
-          tifferror = ERR_READ;
+          err = ERR_READ;
           break;
         }
-        invert_row(currPtr, inbuf, w, photometric == PHOTOMETRIC_MINISWHITE);
+        /* skips any extra samples, like alpha */
+        convert_row(&od, &inbuf, w, currPtr);
         currPtr -= format*w;
       }
-      if (tifferror == ERR_READ) {
-        tifferror = tiff_try_read_rgba(in, w, h, format, buffer);
+      if (err == ERR_READ) {
+        err = tiff_try_read_rgba(in, w, h, format, buffer);
       }
 
       break;
@@ -336,12 +682,12 @@ simage_tiff_load(const char *filename,
     case pack(PHOTOMETRIC_PALETTE, PLANARCONFIG_CONTIG):
     case pack(PHOTOMETRIC_PALETTE, PLANARCONFIG_SEPARATE):
       if (TIFFGetField(in, TIFFTAG_COLORMAP, &red, &green, &blue) != 1)
-        tifferror = ERR_READ;
+        err = ERR_READ;
       /* */
       /* Convert 16-bit colormap to 8-bit (unless it looks */
       /* like an old-style 8-bit colormap). */
       /* */
-      if (!tifferror && checkcmap(1<<bitspersample, red, green, blue) == 16) {
+      if (!err && checkcmap(1<<bitspersample, red, green, blue) == 16) {
         int i;
         for (i = (1<<bitspersample)-1; i >= 0; i--) {
           red[i] = CVT(red[i]);
@@ -353,14 +699,14 @@ simage_tiff_load(const char *filename,
       inbuf = (unsigned char *)malloc(TIFFScanlineSize(in));
       for (row = 0; row < h; row++) {
         if (TIFFReadScanline(in, inbuf, row, 0) < 0) {
-          tifferror = ERR_READ;
+          err = ERR_READ;
           break;
         }
         remap_row(currPtr, inbuf, w, red, green, blue, NULL);
         currPtr -= format*w;
       }
-      if (tifferror == ERR_READ) {
-        tifferror = tiff_try_read_rgba(in, w, h, format, buffer);
+      if (err == ERR_READ) {
+        err = tiff_try_read_rgba(in, w, h, format, buffer);
       }
 
       break;
@@ -369,14 +715,14 @@ simage_tiff_load(const char *filename,
       inbuf = (unsigned char *)malloc(TIFFScanlineSize(in));
       for (row = 0; row < h; row++) {
         if (TIFFReadScanline(in, inbuf, row, 0) < 0) {
-          tifferror = ERR_READ;
+          err = ERR_READ;
           break;
         }
         copy_row(currPtr, inbuf, w, format);
         currPtr -= format*w;
       }
-      if (tifferror == ERR_READ) {
-        tifferror = tiff_try_read_rgba(in, w, h, format, buffer);
+      if (err == ERR_READ) {
+        err = tiff_try_read_rgba(in, w, h, format, buffer);
       }
 
       break;
@@ -384,60 +730,164 @@ simage_tiff_load(const char *filename,
     case pack(PHOTOMETRIC_RGB, PLANARCONFIG_SEPARATE):
       rowsize = TIFFScanlineSize(in);
       inbuf = (unsigned char *)malloc(format*rowsize);
-      for (row = 0; !tifferror && row < h; row++) {
+      for (row = 0; !err && row < h; row++) {
         int s;
         for (s = 0; s < format; s++) {
           if (TIFFReadScanline(in, (tdata_t)(inbuf+s*rowsize), (uint32)row, (tsample_t)s) < 0) {
-            tifferror = ERR_READ; break;
+            err = ERR_READ; break;
           }
         }
-        if (tifferror != ERR_READ) {
+        if (err != ERR_READ) {
           interleave_row(currPtr, inbuf, inbuf+rowsize, inbuf+2*rowsize,
                          format == 4 ? inbuf+3*rowsize : NULL, w);
           currPtr -= format*w;
         }
       }
-      if (tifferror == ERR_READ) {
-        tifferror = tiff_try_read_rgba(in, w, h, format, buffer);
+      if (err == ERR_READ) {
+        err = tiff_try_read_rgba(in, w, h, format, buffer);
       }
 
       break;
     default:
-      tifferror = ERR_UNSUPPORTED;
+      err = ERR_UNSUPPORTED;
       break;
   }
 
   if (inbuf) free(inbuf);
+  return err;
+}
+
+unsigned char *
+simage_tiff_load(const char *filename,
+                 int *width_ret,
+                 int *height_ret,
+                 int *numComponents_ret)
+{
+  TIFF *in;
+  uint16 samplesperpixel;
+  uint16 bitspersample;
+  uint16 photometric;
+  uint32 w, h;
+  uint16 config;
+  int format;
+  unsigned char *buffer;
+
+  TIFFSetErrorHandler(tiff_error);
+  TIFFSetWarningHandler(tiff_warn);
+
+  in = TIFFOpen(filename, "r");
+  if (in == NULL) {
+    tifferror = ERR_OPEN;
+    return NULL;
+  }
+  tifferror = tiff_read_info(in, &photometric, &config, &samplesperpixel,
+                             &bitspersample, &w, &h, &format);
+  if (tifferror != ERR_NO_ERROR) {
+    TIFFClose(in);
+    return NULL;
+  }
+
+  buffer = (unsigned char*)malloc((size_t) w*h*format);
+  if (!buffer) {
+    tifferror = ERR_MEM;
+    TIFFClose(in);
+    return NULL;
+  }
+
+  tifferror = tiff_read_image(in, photometric, config, samplesperpixel,
+                              bitspersample, w, h, format, buffer);
   TIFFClose(in);
 
   if (tifferror) {
-    if (buffer) free(buffer);
+    free(buffer);
     return NULL;
   }
-  *width_ret = width;
-  *height_ret = height;
+  *width_ret = w;
+  *height_ret = h;
   *numComponents_ret = format;
   return buffer;
 }
 
-int
-simage_tiff_save(const char *filename,
-                 const unsigned char * bytes,
-                 int width,
-                 int height,
-                 int numcomponents)
+/* the size we aim for when splitting images into strips */
+#define DEFAULT_STRIP_SIZE (256 * 1024)
+
+/* tile size used for pyramids if no tile size is given */
+#define DEFAULT_TILE_SIZE 256
+
+/* writes the image in strips of rowsperstrip rows */
+static int
+tiff_write_strips(TIFF * out, const unsigned char * bytes,
+                  int width, int height, int numcomponents,
+                  uint32 rowsperstrip)
 {
-  uint16 photometric;
-  TIFF * out;
-  int y, bytesperrow;
-  short config = PLANARCONFIG_CONTIG;
-  int16 compression = COMPRESSION_PACKBITS; /* RLE */
+  int bytesperrow = width * numcomponents;
+  unsigned char * buf, * dst;
+  uint32 strip, row, y;
+
+  /* the strips are copied first, since the image is stored
+     bottom-up and libtiff may modify the data when compressing */
+  buf = (unsigned char *) malloc((size_t) bytesperrow * rowsperstrip);
+  if (buf == NULL) return ERR_MEM;
+
+  for (strip = 0, row = 0; row < (uint32) height; strip++, row += rowsperstrip) {
+    uint32 n = height - row < rowsperstrip ? height - row : rowsperstrip;
+    dst = buf;
+    for (y = row; y < row + n; y++) {
+      memcpy(dst, bytes + (size_t) bytesperrow * (height-y-1), bytesperrow);
+      dst += bytesperrow;
+    }
+    if (TIFFWriteEncodedStrip(out, strip, buf, (tsize_t) n * bytesperrow) < 0) {
+      free(buf);
+      return ERR_WRITE;
+    }
+  }
+  free(buf);
+  return ERR_NO_ERROR;
+}
 
-  out = TIFFOpen(filename, "w");
-  if (out == NULL) {
-    tifferror = ERR_OPEN_WRITE;
-    return 0;
+/* writes the image in tilesize x tilesize tiles */
+static int
+tiff_write_tiles(TIFF * out, const unsigned char * bytes,
+                 int width, int height, int numcomponents,
+                 uint32 tilesize)
+{
+  int bytesperrow = width * numcomponents;
+  int tilebpr = tilesize * numcomponents;
+  unsigned char * buf;
+  uint32 tx, ty, y;
+
+  buf = (unsigned char *) malloc((size_t) tilebpr * tilesize);
+  if (buf == NULL) return ERR_MEM;
+
+  for (ty = 0; ty < (uint32) height; ty += tilesize) {
+    uint32 h = height - ty < tilesize ? height - ty : tilesize;
+    for (tx = 0; tx < (uint32) width; tx += tilesize) {
+      uint32 w = width - tx < tilesize ? width - tx : tilesize;
+      /* tiles on the right and bottom edges are padded with zeros */
+      if (w < tilesize || h < tilesize) memset(buf, 0, (size_t) tilebpr * tilesize);
+      for (y = 0; y < h; y++) {
+        memcpy(buf + y * tilebpr,
+               bytes + (size_t) bytesperrow * (height-(ty+y)-1) + tx * numcomponents,
+               w * numcomponents);
+      }
+      if (TIFFWriteEncodedTile(out, TIFFComputeTile(out, tx, ty, 0, 0), buf,
+                               (tsize_t) tilebpr * tilesize) < 0) {
+        free(buf);
+        return ERR_WRITE;
+      }
+    }
   }
+  free(buf);
+  return ERR_NO_ERROR;
+}
+
+/* sets the tags shared by the full resolution image and the
+   reduced resolution levels */
+static void
+tiff_set_fields(TIFF * out, int width, int height, int numcomponents,
+                uint16 compression, int predictor, int level)
+{
+  uint16 photometric;
 
   TIFFSetField(out, TIFFTAG_IMAGEWIDTH, (uint32) width);
   TIFFSetField(out, TIFFTAG_IMAGELENGTH, (uint32) height);
@@ -458,40 +908,180 @@ simage_tiff_save(const char *filename,
   }
   TIFFSetField(out, TIFFTAG_MINSAMPLEVALUE, (uint16) 0);
   TIFFSetField(out, TIFFTAG_MAXSAMPLEVALUE, (uint16) 255);
-  TIFFSetField(out, TIFFTAG_PLANARCONFIG, config);
-  /* force 1 row/strip for library limitation */
-  TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, 1L);
-  TIFFSetField(out, TIFFTAG_IMAGEDESCRIPTION, filename);
+  TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+
+  if (compression == COMPRESSION_LZW ||
+      compression == COMPRESSION_ADOBE_DEFLATE
+#ifdef COMPRESSION_ZSTD
+      || compression == COMPRESSION_ZSTD
+#endif /* COMPRESSION_ZSTD */
+      ) {
+    if (predictor > 0) TIFFSetField(out, TIFFTAG_PREDICTOR, (uint16) predictor);
+    if (level >= 0 && compression == COMPRESSION_ADOBE_DEFLATE)
+      TIFFSetField(out, TIFFTAG_ZIPQUALITY, level);
+#ifdef TIFFTAG_ZSTD_LEVEL
+    if (level >= 0 && compression == COMPRESSION_ZSTD)
+      TIFFSetField(out, TIFFTAG_ZSTD_LEVEL, level);
+#endif /* TIFFTAG_ZSTD_LEVEL */
+  }
+}
 
-  bytesperrow = width * numcomponents;
+/* the largest number of reduced resolution levels we'll write */
+#define MAX_PYRAMID_LEVELS 32
 
-  for (y = 0; y < height; y++) {
-    if (TIFFWriteScanline(out, (tdata_t) (bytes + bytesperrow * (height-y-1)), y, 0) < 0) {
-      TIFFClose(out);
-      tifferror = ERR_WRITE;
-      return 0;
+/* images with more pixel data than this are written as BigTIFF, since
+   the offsets might not fit in 32 bits */
+#define BIGTIFF_THRESHOLD 3.5e9
+
+/* writes the reduced resolution levels as SubIFDs of the full
+   resolution image, which must have been written already. Each level
+   is half the size of the previous one */
+static int
+tiff_write_pyramid(TIFF * out, const unsigned char * bytes,
+                   int width, int height, int numcomponents,
+                   uint32 tilesize, int numlevels, const char * filter,
+                   uint16 compression, int predictor, int level)
+{
+  const unsigned char * prev = bytes;
+  unsigned char * cur;
+  int i, err = ERR_NO_ERROR;
+
+  for (i = 0; i < numlevels && err == ERR_NO_ERROR; i++) {
+    int w = (width + 1) / 2;
+    int h = (height + 1) / 2;
+    cur = s_resize_filtered(prev, width, height, numcomponents, w, h, filter);
+    if (prev != bytes) free((void *) prev);
+    prev = cur;
+    if (cur == NULL) return ERR_RESIZE;
+    width = w;
+    height = h;
+
+    if (!TIFFWriteDirectory(out)) {
+      err = ERR_WRITE;
+      break;
+    }
+    tiff_set_fields(out, width, height, numcomponents,
+                    compression, predictor, level);
+    TIFFSetField(out, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+    TIFFSetField(out, TIFFTAG_TILEWIDTH, tilesize);
+    TIFFSetField(out, TIFFTAG_TILELENGTH, tilesize);
+    err = tiff_write_tiles(out, cur, width, height, numcomponents, tilesize);
+  }
+  if (prev != bytes) free((void *) prev);
+  return err;
+}
+
+int
+simage_tiff_save(const char *filename,
+                 const unsigned char * bytes,
+                 int width,
+                 int height,
+                 int numcomponents,
+                 s_params * params)
+{
+  TIFF * out;
+  int bytesperrow, err;
+  uint16 compression = COMPRESSION_PACKBITS; /* RLE */
+  int predictor = 0;
+  int level = -1;
+  int tilesize = 0;
+  int stripsize = DEFAULT_STRIP_SIZE;
+  int numlevels = 0;
+  int bigtiff = 0;
+  char * filter = NULL;
+  uint32 rowsperstrip;
+  char * str;
+
+  if (params) {
+    if (s_params_get(params, "compression", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+      if (strcmp(str, "none") == 0) compression = COMPRESSION_NONE;
+      else if (strcmp(str, "packbits") == 0) compression = COMPRESSION_PACKBITS;
+      else if (strcmp(str, "lzw") == 0) compression = COMPRESSION_LZW;
+      else if (strcmp(str, "deflate") == 0) compression = COMPRESSION_ADOBE_DEFLATE;
+#ifdef COMPRESSION_ZSTD
+      else if (strcmp(str, "zstd") == 0) compression = COMPRESSION_ZSTD;
+#endif /* COMPRESSION_ZSTD */
+      else {
+        tifferror = ERR_UNSUPPORTED_WRITE;
+        return 0;
+      }
+    }
+    (void) s_params_get(params, "predictor", S_INTEGER_PARAM_TYPE, &predictor, NULL);
+    (void) s_params_get(params, "compression level", S_INTEGER_PARAM_TYPE, &level, NULL);
+    (void) s_params_get(params, "tile size", S_INTEGER_PARAM_TYPE, &tilesize, NULL);
+    (void) s_params_get(params, "strip size", S_INTEGER_PARAM_TYPE, &stripsize, NULL);
+    (void) s_params_get(params, "pyramid levels", S_INTEGER_PARAM_TYPE, &numlevels, NULL);
+    (void) s_params_get(params, "pyramid filter", S_STRING_PARAM_TYPE, &filter, NULL);
+    (void) s_params_get(params, "bigtiff", S_INTEGER_PARAM_TYPE, &bigtiff, NULL);
+  }
+  if (!TIFFIsCODECConfigured(compression)) {
+    tifferror = ERR_UNSUPPORTED_WRITE;
+    return 0;
+  }
+  /* pyramids are always tiled */
+  if (numlevels != 0 && tilesize <= 0) tilesize = DEFAULT_TILE_SIZE;
+  /* tile dimensions must be multiples of 16 */
+  if (tilesize > 0) tilesize = (tilesize + 15) & ~15;
+  if (numlevels != 0) {
+    /* no more levels than needed to fit the image in one tile */
+    int w = width, h = height;
+    int maxlevels = numlevels < 0 || numlevels > MAX_PYRAMID_LEVELS ?
+      MAX_PYRAMID_LEVELS : numlevels;
+    numlevels = 0;
+    while (numlevels < maxlevels && (w > tilesize || h > tilesize)) {
+      w = (w + 1) / 2;
+      h = (h + 1) / 2;
+      numlevels++;
+    }
+    /* and written as BigTIFF */
+    bigtiff = 1;
+  }
+  if ((double) width * height * numcomponents > BIGTIFF_THRESHOLD) bigtiff = 1;
+
+  out = TIFFOpen(filename, bigtiff ? "w8" : "w");
+  if (out == NULL) {
+    tifferror = ERR_OPEN_WRITE;
+    return 0;
+  }
+
+  tiff_set_fields(out, width, height, numcomponents,
+                  compression, predictor, level);
+  TIFFSetField(out, TIFFTAG_IMAGEDESCRIPTION, filename);
+
+  if (tilesize > 0) {
+    TIFFSetField(out, TIFFTAG_TILEWIDTH, (uint32) tilesize);
+    TIFFSetField(out, TIFFTAG_TILELENGTH, (uint32) tilesize);
+    if (numlevels > 0) {
+      /* the offsets are filled in by libtiff as the levels are written */
+      toff_t offsets[MAX_PYRAMID_LEVELS];
+      memset(offsets, 0, sizeof(offsets));
+      TIFFSetField(out, TIFFTAG_SUBIFD, (uint16) numlevels, offsets);
+    }
+    err = tiff_write_tiles(out, bytes, width, height, numcomponents, tilesize);
+    if (err == ERR_NO_ERROR && numlevels > 0) {
+      err = tiff_write_pyramid(out, bytes, width, height, numcomponents,
+                               tilesize, numlevels, filter,
+                               compression, predictor, level);
     }
   }
+  else {
+    /* make strips of about stripsize bytes */
+    bytesperrow = width * numcomponents;
+    rowsperstrip = bytesperrow > 0 ? stripsize / bytesperrow : 1;
+    if (rowsperstrip < 1) rowsperstrip = 1;
+    if (rowsperstrip > (uint32) height) rowsperstrip = height;
+    TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, rowsperstrip);
+    err = tiff_write_strips(out, bytes, width, height, numcomponents, rowsperstrip);
+  }
 
   TIFFClose(out);
+  if (err != ERR_NO_ERROR) {
+    tifferror = err;
+    return 0;
+  }
   return 1;
 }
 
-typedef struct {
-  TIFF * in;
-  uint16 samplesperpixel;
-  uint16 bitspersample;
-  uint16 photometric;
-  uint32 w, h;
-  uint16 config;
-  uint16 * red;
-  uint16 * green;
-  uint16 * blue;
-  int format;
-  int rowsize;
-  unsigned char * inbuf;
-} simage_tiff_opendata;
-
 void *
 simage_tiff_open(const char * filename,
                  int * width,
@@ -604,6 +1194,11 @@ simage_tiff_open(const char * filename,
   }
   od->rowsize = (int) TIFFScanlineSize(in);
   od->inbuf = (unsigned char *) malloc(od->rowsize * 4); /* *4 to support all formats */
+  if (!tiff_init_tiles(od)) {
+    tifferror = ERR_MEM;
+    simage_tiff_close(od);
+    return NULL;
+  }
 
   *width = od->w;
   *height = od->h;
@@ -619,6 +1214,7 @@ simage_tiff_close(void * opendata)
   simage_tiff_opendata * od = (simage_tiff_opendata*) opendata;
   TIFFClose(od->in);
   free(od->inbuf);
+  tiff_free_tiles(od);
   free(od);
 }
 
@@ -632,6 +1228,32 @@ simage_tiff_read_line(void * opendata, int y, unsigned char * buf)
   od = (simage_tiff_opendata*) opendata;
   row = (od->h-1)-y;
 
+  if (od->tilebuf) {
+    /* decode the whole strip or row of tiles, and keep it for the
+       next lines */
+    int bpr = od->w * od->format;
+    int bandrow = row / od->tileh;
+    if (od->bandrow != bandrow) {
+      int first = bandrow * od->tileh;
+      int n = od->h - first < od->tileh ? od->h - first : od->tileh;
+      if (od->band == NULL) {
+        od->band = (unsigned char *) malloc(bpr * od->tileh);
+        if (od->band == NULL) {
+          tifferror = ERR_MEM;
+          return 0;
+        }
+      }
+      od->bandrow = -1;
+      if (!tiff_read_tiles(od, 0, first, od->w, n, od->band, bpr)) {
+        tifferror = ERR_READ;
+        return 0;
+      }
+      od->bandrow = bandrow;
+    }
+    memcpy(buf, od->band + (row - bandrow * od->tileh) * bpr, bpr);
+    return 1;
+  }
+
   switch (pack(od->photometric, od->config)) {
     case pack(PHOTOMETRIC_MINISWHITE, PLANARCONFIG_CONTIG):
     case pack(PHOTOMETRIC_MINISBLACK, PLANARCONFIG_CONTIG):
@@ -641,7 +1263,7 @@ simage_tiff_read_line(void * opendata, int y, unsigned char * buf)
         tifferror = ERR_READ;
         break;
       }
-      invert_row(buf, od->inbuf, od->w, od->photometric == PHOTOMETRIC_MINISWHITE);
+      convert_row(od, &od->inbuf, od->w, buf);
       break;
 
     case pack(PHOTOMETRIC_PALETTE, PLANARCONFIG_CONTIG):
@@ -680,6 +1302,117 @@ simage_tiff_read_line(void * opendata, int y, unsigned char * buf)
   return tifferror == ERR_NO_ERROR;
 }
 
+int
+simage_tiff_read_region(void * opendata, int x, int y, int w, int h,
+                        unsigned char * buf)
+{
+  simage_tiff_opendata * od = (simage_tiff_opendata*) opendata;
+  int bpr = w * od->format;
+
+  /* only the strips or tiles covering the region are decoded */
+  if (od->tilebuf == NULL) return 0;
+
+  tifferror = ERR_NO_ERROR;
+  /* y is the bottom line of the region, and buf is bottom-up too */
+  if (!tiff_read_tiles(od, x, od->h - y - h, w, h,
+                       buf + (h-1) * bpr, -(long) bpr)) {
+    tifferror = ERR_READ;
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Multi-page TIFF files as movies. Each s_movie_get_image() decodes
+ * the next directory in the file.
+ */
+
+typedef struct {
+  TIFF * in;
+  int page; /* the number of pages read so far */
+} simage_tiff_movie;
+
+int
+simage_tiff_movie_open(const char * filename, s_movie * movie)
+{
+  unsigned char header[4];
+  simage_tiff_movie * tm;
+  FILE * fp;
+  TIFF * in;
+  int ok;
+
+  /* check the header first, to avoid libtiff errors for other files */
+  fp = fopen(filename, "rb");
+  if (fp == NULL) return 0;
+  ok = fread(header, 1, 4, fp) == 4 && simage_tiff_identify(filename, header, 4);
+  fclose(fp);
+  if (!ok) return 0;
+
+  TIFFSetErrorHandler(tiff_error);
+  TIFFSetWarningHandler(tiff_warn);
+
+  in = TIFFOpen(filename, "r");
+  if (in == NULL) {
+    tifferror = ERR_OPEN;
+    return 0;
+  }
+  tm = (simage_tiff_movie *) malloc(sizeof(simage_tiff_movie));
+  if (tm == NULL) {
+    tifferror = ERR_MEM;
+    TIFFClose(in);
+    return 0;
+  }
+  tm->in = in;
+  tm->page = 0;
+  s_params_set(s_movie_params(movie), "tiff movie handle",
+               S_POINTER_PARAM_TYPE, tm, NULL);
+  return 1;
+}
+
+s_image *
+simage_tiff_movie_get(s_movie * movie, s_image * prealloc, s_params * params)
+{
+  simage_tiff_movie * tm;
+  uint16 samplesperpixel, bitspersample, photometric, config;
+  uint32 w, h;
+  int format;
+  s_image * image;
+
+  if (!s_params_get(s_movie_params(movie), "tiff movie handle",
+                    S_POINTER_PARAM_TYPE, &tm, NULL)) return NULL;
+
+  if (tm->page > 0 && !TIFFReadDirectory(tm->in)) return NULL; /* no more pages */
+  tm->page++;
+
+  tifferror = tiff_read_info(tm->in, &photometric, &config, &samplesperpixel,
+                             &bitspersample, &w, &h, &format);
+  if (tifferror != ERR_NO_ERROR) return NULL;
+
+  image = s_image_prepare(prealloc, w, h, format);
+  if (image == NULL) {
+    tifferror = ERR_MEM;
+    return NULL;
+  }
+  tifferror = tiff_read_image(tm->in, photometric, config, samplesperpixel,
+                              bitspersample, w, h, format, s_image_data(image));
+  if (tifferror != ERR_NO_ERROR) {
+    if (image != prealloc) s_image_destroy(image);
+    return NULL;
+  }
+  return image;
+}
+
+void
+simage_tiff_movie_close(s_movie * movie)
+{
+  simage_tiff_movie * tm;
+  if (s_params_get(s_movie_params(movie), "tiff movie handle",
+                   S_POINTER_PARAM_TYPE, &tm, NULL)) {
+    TIFFClose(tm->in);
+    free(tm);
+  }
+}
+
 #undef CVT
 #undef pack
 
@@ -23,6 +23,7 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <simage.h>
+#include <simage_private.h>
 #include <string.h>
 #include <ctype.h>
 
@@ -32,6 +33,9 @@ struct _saver_data
                    int width, int height, int numcomponents);
   int (*save_func_ext)(const char * name, const unsigned char * bytes,
                        int width, int height, int numcomponents, const char * ext);
+  int (*save_func_params)(const char * name, const unsigned char * bytes,
+                          int width, int height, int numcomponents,
+                          s_params * params);
   int (*error_func)(char * textbuffer, int bufferlen);
   char * extensions;
   char * fullname;
@@ -70,6 +74,20 @@ static saver_data gif_saver;
 #include <simage_eps.h>
 static saver_data eps_saver;
 #endif /* SIMAGE_EPS_SUPPORT */
+#ifdef SIMAGE_TGA_SUPPORT
+#include <simage_tga.h>
+static saver_data tga_saver;
+#endif /* SIMAGE_TGA_SUPPORT */
+#ifdef SIMAGE_PNM_SUPPORT
+#include <simage_pnm.h>
+static saver_data pnm_saver;
+#endif /* SIMAGE_PNM_SUPPORT */
+#ifdef SIMAGE_QOI_SUPPORT
+#include <simage_qoi.h>
+static saver_data qoi_saver;
+#endif /* SIMAGE_QOI_SUPPORT */
+static saver_data dds_saver;
+static saver_data ktx2_saver;
 #ifdef SIMAGE_QIMAGE_SUPPORT
 #include <simage_qimage.h>
 #endif /* SIMAGE_QIMAGE_SUPPORT */
@@ -179,6 +197,7 @@ add_saver(saver_data * saver,
   assert(saver);
   saver->save_func = save_func;
   saver->save_func_ext = NULL;
+  saver->save_func_params = NULL;
   add_saver_data(saver, error_func, extensions, fullname,
                  description, is_internal, addbefore);
   return saver;
@@ -199,6 +218,28 @@ add_saver_ext(saver_data * saver,
   assert(saver);
   saver->save_func = NULL;
   saver->save_func_ext = save_func;
+  saver->save_func_params = NULL;
+  add_saver_data(saver, error_func, extensions, fullname,
+                 description, is_internal, addbefore);
+  return saver;
+}
+
+static void *
+add_saver_params(saver_data * saver,
+                 int (*save_func)(const char *,
+                                  const unsigned char *,
+                                  int, int, int, s_params *),
+                 int (*error_func)(char *, int),
+                 const char * extensions,
+                 const char * fullname,
+                 const char * description,
+                 int is_internal,
+                 int addbefore)
+{
+  assert(saver);
+  saver->save_func = NULL;
+  saver->save_func_ext = NULL;
+  saver->save_func_params = save_func;
   add_saver_data(saver, error_func, extensions, fullname,
                  description, is_internal, addbefore);
   return saver;
@@ -210,23 +251,32 @@ add_saver_ext(saver_data * saver,
  * internal function which finds the correct saver. Returns
  * NULL if none was found
  */
+static int
+match_extension(const char * ext, size_t len, const char * filenameextension)
+{
+  size_t i;
+  for (i = 0; i < len; i++) {
+    if (filenameextension[i] == 0 ||
+        tolower(ext[i]) != tolower(filenameextension[i])) return 0;
+  }
+  return filenameextension[len] == 0;
+}
+
 static saver_data *
 find_saver(const char * filenameextension)
 {
   saver_data * saver;
+  if (filenameextension == NULL) return NULL;
   saver = first_saver;
   while (saver) {
-    char * str;
-    char * ext = saver->extensions;
+    const char * str;
+    const char * ext = saver->extensions;
     str = strchr(ext, ',');
 
+    /* the list is not modified while comparing, as savers may be
+       looked up from several threads */
     while (str) {
-      int cmp;
-      /* modify string while comparing. string is a copy so it should be safe */
-      *str = 0;
-      cmp = simage_strcasecmp(ext, filenameextension);
-      *str = ',';
-      if (cmp == 0) return saver;
+      if (match_extension(ext, str - ext, filenameextension)) return saver;
       ext = str + 1;
       str = strchr(ext, ',');
     }
@@ -249,6 +299,16 @@ static char gifext[] = "gif";
 static const char giffull[] = "The Graphics Interchange Format";
 static char epsext[] = "eps,ps";
 static const char epsfull[] ="Encapsulated postscript";
+static char tgaext[] = "tga";
+static const char tgafull[] = "The Truevision Targa file format";
+static char pnmext[] = "pnm,ppm,pgm,pam";
+static const char pnmfull[] = "The NetPBM file formats";
+static char qoiext[] = "qoi";
+static const char qoifull[] = "The Quite OK Image format";
+static char ddsext[] = "dds";
+static const char ddsfull[] = "The DirectDraw Surface texture format";
+static char ktx2ext[] = "ktx2";
+static const char ktx2full[] = "The Khronos KTX 2.0 texture format";
 
 static void
 str_tolower(char * str)
@@ -271,60 +331,105 @@ add_internal_savers(void)
     first = 0;
 
 #ifdef HAVE_JPEGLIB
-    add_saver(&jpeg_saver,
-              simage_jpeg_save,
-              simage_jpeg_error,
-              jpegext,
-              jpegfull,
-              NULL,
-              1, 0);
+    add_saver_params(&jpeg_saver,
+                     simage_jpeg_save,
+                     simage_jpeg_error,
+                     jpegext,
+                     jpegfull,
+                     NULL,
+                     1, 0);
 #endif /* HAVE_JPEGLIB */
 #ifdef HAVE_PNGLIB
-    add_saver(&png_saver,
-              simage_png_save,
-              simage_png_error,
-              pngext,
-              pngfull,
-              NULL,
-              1, 0);
+    add_saver_params(&png_saver,
+                     simage_png_save,
+                     simage_png_error,
+                     pngext,
+                     pngfull,
+                     NULL,
+                     1, 0);
 #endif /* HAVE_PNGLIB */
 #ifdef HAVE_TIFFLIB
-    add_saver(&tiff_saver,
-              simage_tiff_save,
-              simage_tiff_error,
-              tiffext,
-              tifffull,
-              NULL,
-              1, 0);
+    add_saver_params(&tiff_saver,
+                     simage_tiff_save,
+                     simage_tiff_error,
+                     tiffext,
+                     tifffull,
+                     NULL,
+                     1, 0);
 #endif /* HAVE_TIFFLIB */
 #ifdef SIMAGE_RGB_SUPPORT
-    add_saver(&rgb_saver,
-              simage_rgb_save,
-              simage_rgb_error,
-              rgbext,
-              rgbfull,
-              NULL,
-              1, 0);
+    add_saver_params(&rgb_saver,
+                     simage_rgb_save,
+                     simage_rgb_error,
+                     rgbext,
+                     rgbfull,
+                     NULL,
+                     1, 0);
 #endif /* SIMAGE_RGB_SUPPORT */
 #ifdef HAVE_GIFLIB
-    add_saver(&gif_saver,
-              simage_gif_save,
-              simage_gif_error,
-              gifext,
-              giffull,
-              NULL,
-              1, 0);
+    add_saver_params(&gif_saver,
+                     simage_gif_save,
+                     simage_gif_error,
+                     gifext,
+                     giffull,
+                     NULL,
+                     1, 0);
 #endif /* HAVE_GIFLIB */
 
 #ifdef SIMAGE_EPS_SUPPORT
-    add_saver(&eps_saver,
-              simage_eps_save,
-              simage_eps_error,
-              epsext,
-              epsfull,
+    add_saver_params(&eps_saver,
+                     simage_eps_save,
+                     simage_eps_error,
+                     epsext,
+                     epsfull,
+                     NULL,
+                     1, 0);
+#endif /* SIMAGE_EPS_SUPPORT */
+
+#ifdef SIMAGE_TGA_SUPPORT
+    add_saver_params(&tga_saver,
+                     simage_tga_save,
+                     simage_tga_error,
+                     tgaext,
+                     tgafull,
+                     NULL,
+                     1, 0);
+#endif /* SIMAGE_TGA_SUPPORT */
+
+#ifdef SIMAGE_PNM_SUPPORT
+    add_saver(&pnm_saver,
+              simage_pnm_save,
+              simage_pnm_error,
+              pnmext,
+              pnmfull,
               NULL,
               1, 0);
-#endif /* SIMAGE_EPS_SUPPORT */
+#endif /* SIMAGE_PNM_SUPPORT */
+
+#ifdef SIMAGE_QOI_SUPPORT
+    add_saver(&qoi_saver,
+              simage_qoi_save,
+              simage_qoi_error,
+              qoiext,
+              qoifull,
+              NULL,
+              1, 0);
+#endif /* SIMAGE_QOI_SUPPORT */
+
+    add_saver_params(&dds_saver,
+                     s_texture_save_dds,
+                     s_texture_error,
+                     ddsext,
+                     ddsfull,
+                     NULL,
+                     1, 0);
+    add_saver_params(&ktx2_saver,
+                     s_texture_save_ktx2,
+                     s_texture_error,
+                     ktx2ext,
+                     ktx2full,
+                     NULL,
+                     1, 0);
 
 #ifdef SIMAGE_GDIPLUS_SUPPORT
     qtext = simage_gdiplus_get_savers();
@@ -434,6 +539,17 @@ simage_save_image(const char * filename,
                   const unsigned char * bytes,
                   int width, int height, int numcomponents,
                   const char * filenameextension)
+{
+  return simage_save_image_ex(filename, bytes, width, height,
+                              numcomponents, filenameextension, NULL);
+}
+
+int
+simage_save_image_ex(const char * filename,
+                     const unsigned char * bytes,
+                     int width, int height, int numcomponents,
+                     const char * filenameextension,
+                     s_params * params)
 {
   saver_data * saver;
 
@@ -445,7 +561,12 @@ simage_save_image(const char * filename,
 
   if (saver) {
     int ret = 0;
-    if (saver->save_func_ext) {
+    if (saver->save_func_params) {
+      ret = saver->save_func_params(filename, bytes, width,
+                                    height, numcomponents,
+                                    params);
+    }
+    else if (saver->save_func_ext) {
       ret = saver->save_func_ext(filename, bytes, width,
                                  height, numcomponents,
                                  filenameextension);
@@ -29,10 +29,15 @@
 
 #include <simage_xwd.h>
 
+#include <sys/types.h>
 #include <sys/stat.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
 #endif /* HAVE_UNISTD_H */
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif /* HAVE_SYS_MMAN_H */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -187,139 +192,472 @@ simage_xwd_identify(
 
 /* ********************************************************************** */
 
-unsigned char *
-simage_xwd_load(
+/*
+  The pixel layouts we know how to convert. The byte layouts are
+  TrueColor visuals with 8 bit masks on byte boundaries, which covers
+  almost all 24 and 32 bit screens.
+*/
+
+#define XWD_LAYOUT_BGRX                0 /* 32 bit, LSBFirst */
+#define XWD_LAYOUT_XRGB                1 /* 32 bit, MSBFirst */
+#define XWD_LAYOUT_BGR                 2 /* 24 bit, LSBFirst */
+#define XWD_LAYOUT_RGB                 3 /* 24 bit, MSBFirst */
+#define XWD_LAYOUT_BYTES               4 /* other byte positions */
+#define XWD_LAYOUT_MASKS               5 /* any TrueColor pixel size */
+#define XWD_LAYOUT_PALETTE             6 /* colormapped visuals */
+
+typedef struct {
+  FILE * file;
+  const unsigned char * map;   /* the mapped file, or NULL */
+  size_t mapsize;
+  unsigned char * row;         /* file row, when the file isn't mapped */
+  unsigned long dataoffset;
+  unsigned int width;
+  unsigned int height;
+  unsigned int bits_per_pixel;
+  unsigned int bytes_per_line;
+  unsigned int byteorder;
+  unsigned int bitorder;
+  int layout;
+  int byteindex[3];            /* XWD_LAYOUT_BYTES */
+  unsigned int mask[3];        /* XWD_LAYOUT_MASKS */
+  unsigned int shift[3];
+  unsigned int max[3];
+  unsigned char * palette;     /* XWD_LAYOUT_PALETTE, RGB for each pixel value */
+} simage_xwd_opendata;
+
+/* ********************************************************************** */
+
+/*
+  The converters for the byte layouts. The byte positions are
+  constants, so the compiler can turn the loops into shuffles.
+*/
+
+static void
+convert_bgrx( const unsigned char * src, unsigned int n, unsigned char * dst )
+{
+  unsigned int i;
+  for ( i = 0; i < n; i++ ) {
+    dst[i*3] = src[i*4+2];
+    dst[i*3+1] = src[i*4+1];
+    dst[i*3+2] = src[i*4];
+  }
+} /* convert_bgrx() */
+
+static void
+convert_xrgb( const unsigned char * src, unsigned int n, unsigned char * dst )
+{
+  unsigned int i;
+  for ( i = 0; i < n; i++ ) {
+    dst[i*3] = src[i*4+1];
+    dst[i*3+1] = src[i*4+2];
+    dst[i*3+2] = src[i*4+3];
+  }
+} /* convert_xrgb() */
+
+static void
+convert_bgr( const unsigned char * src, unsigned int n, unsigned char * dst )
+{
+  unsigned int i;
+  for ( i = 0; i < n; i++ ) {
+    dst[i*3] = src[i*3+2];
+    dst[i*3+1] = src[i*3+1];
+    dst[i*3+2] = src[i*3];
+  }
+} /* convert_bgr() */
+
+static void
+convert_bytes( const unsigned char * src, unsigned int n, unsigned int bpp,
+               const int * index, unsigned char * dst )
+{
+  unsigned int i;
+  for ( i = 0; i < n; i++ ) {
+    dst[i*3] = src[i*bpp+index[0]];
+    dst[i*3+1] = src[i*bpp+index[1]];
+    dst[i*3+2] = src[i*bpp+index[2]];
+  }
+} /* convert_bytes() */
+
+/* reads pixel x of a row of any pixel size */
+static unsigned int
+get_pixel( const simage_xwd_opendata * od, const unsigned char * line,
+           unsigned int x )
+{
+  unsigned int bits = od->bits_per_pixel;
+  const unsigned char * ptr;
+  unsigned int value, pos;
+
+  if ( bits < 8 ) {
+    pos = x * bits;
+    value = line[pos >> 3];
+    if ( od->bitorder == MSBFirst )
+      value >>= 8 - bits - (pos & 7);
+    else
+      value >>= pos & 7;
+    return value & ((1 << bits) - 1);
+  }
+  ptr = line + x * (bits >> 3);
+  switch ( bits ) {
+    case 8:
+      return ptr[0];
+    case 16:
+      return (od->byteorder == LSBFirst) ?
+        (ptr[0] | (ptr[1] << 8)) : INT16BE(ptr);
+    case 24:
+      return (od->byteorder == LSBFirst) ?
+        (ptr[0] | (ptr[1] << 8) | (ptr[2] << 16)) :
+        ((ptr[0] << 16) | (ptr[1] << 8) | ptr[2]);
+    default:
+      return (od->byteorder == LSBFirst) ?
+        (ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((unsigned int) ptr[3] << 24)) :
+        (unsigned int) INT32BE(ptr);
+  }
+} /* get_pixel() */
+
+/* scales the masked bits of a pixel to 8 bits */
+static unsigned char
+get_channel( const simage_xwd_opendata * od, unsigned int pixel, int c )
+{
+  unsigned int value = (pixel & od->mask[c]) >> od->shift[c];
+  if ( od->max[c] == 255 ) return (unsigned char) value;
+  return (unsigned char) ((value * 255 + od->max[c] / 2) / od->max[c]);
+} /* get_channel() */
+
+static void
+convert_row( const simage_xwd_opendata * od, const unsigned char * line,
+             unsigned char * dst )
+{
+  unsigned int x, pixel;
+
+  switch ( od->layout ) {
+    case XWD_LAYOUT_BGRX:
+      convert_bgrx( line, od->width, dst );
+      break;
+    case XWD_LAYOUT_XRGB:
+      convert_xrgb( line, od->width, dst );
+      break;
+    case XWD_LAYOUT_BGR:
+      convert_bgr( line, od->width, dst );
+      break;
+    case XWD_LAYOUT_RGB:
+      memcpy( dst, line, od->width * 3 );
+      break;
+    case XWD_LAYOUT_BYTES:
+      convert_bytes( line, od->width, od->bits_per_pixel >> 3, od->byteindex, dst );
+      break;
+    case XWD_LAYOUT_MASKS:
+      for ( x = 0; x < od->width; x++ ) {
+        pixel = get_pixel( od, line, x );
+        *dst++ = get_channel( od, pixel, 0 );
+        *dst++ = get_channel( od, pixel, 1 );
+        *dst++ = get_channel( od, pixel, 2 );
+      }
+      break;
+    default:
+      for ( x = 0; x < od->width; x++ ) {
+        memcpy( dst, od->palette + get_pixel( od, line, x ) * 3, 3 );
+        dst += 3;
+      }
+      break;
+  }
+} /* convert_row() */
+
+/* ********************************************************************** */
+
+/* finds the position and size of a color mask */
+static void
+setup_mask( simage_xwd_opendata * od, int c, unsigned int mask )
+{
+  unsigned int shift = 0;
+
+  if ( mask == 0 ) mask = 0xffu << (8 * (2 - c));
+  while ( !(mask & (1u << shift)) ) shift++;
+  od->mask[c] = mask;
+  od->shift[c] = shift;
+  od->max[c] = mask >> shift;
+} /* setup_mask() */
+
+/* picks the converter for a TrueColor or DirectColor visual. Returns
+   0 if a mask has bits outside the pixel */
+static int
+setup_truecolor( simage_xwd_opendata * od )
+{
+  unsigned int bytes = od->bits_per_pixel >> 3;
+  int c;
+
+  for ( c = 0; c < 3; c++ ) {
+    if ( od->bits_per_pixel < 32 && (od->mask[c] >> od->bits_per_pixel) != 0 )
+      return 0;
+  }
+
+  od->layout = XWD_LAYOUT_BYTES;
+  if ( od->bits_per_pixel != 24 && od->bits_per_pixel != 32 )
+    od->layout = XWD_LAYOUT_MASKS;
+  for ( c = 0; c < 3; c++ ) {
+    if ( od->max[c] != 255 || (od->shift[c] & 7) ) {
+      od->layout = XWD_LAYOUT_MASKS;
+      break;
+    }
+    od->byteindex[c] = od->byteorder == LSBFirst ?
+      (int) (od->shift[c] >> 3) : (int) (bytes - 1 - (od->shift[c] >> 3));
+  }
+  if ( od->layout != XWD_LAYOUT_BYTES ) return 1;
+
+  if ( od->byteindex[0] == 2 && od->byteindex[1] == 1 && od->byteindex[2] == 0 )
+    od->layout = (bytes == 4) ? XWD_LAYOUT_BGRX : XWD_LAYOUT_BGR;
+  else if ( bytes == 4 && od->byteindex[0] == 1 &&
+            od->byteindex[1] == 2 && od->byteindex[2] == 3 )
+    od->layout = XWD_LAYOUT_XRGB;
+  else if ( bytes == 3 && od->byteindex[0] == 0 &&
+            od->byteindex[1] == 1 && od->byteindex[2] == 2 )
+    od->layout = XWD_LAYOUT_RGB;
+  return 1;
+} /* setup_truecolor() */
+
+/* reads the colormap into a lookup table for all pixel values */
+static int
+setup_palette( simage_xwd_opendata * od, const unsigned char * colors,
+               unsigned int num_colors, int gray )
+{
+  unsigned int i, pixel, entries;
+
+  entries = 1 << od->bits_per_pixel;
+  if ( (od->palette = (unsigned char *) malloc( entries * 3 )) == NULL ) {
+    xwderror = XWD_MALLOC_ERROR;
+    return 0;
+  }
+  if ( num_colors == 0 && gray ) {
+    /* no colormap, use a gray ramp */
+    for ( i = 0; i < entries; i++ ) {
+      pixel = entries > 1 ? (i * 255) / (entries - 1) : 0;
+      od->palette[i*3] = od->palette[i*3+1] = od->palette[i*3+2] =
+        (unsigned char) pixel;
+    }
+    return 1;
+  }
+  memset( od->palette, 0, entries * 3 );
+  for ( i = 0; i < num_colors; i++ ) {
+    pixel = getuint32be( colors + XWD_COFF_PIXEL );
+    if ( pixel < entries ) {
+      od->palette[pixel*3] = colors[XWD_COFF_RED];
+      od->palette[pixel*3+1] = colors[XWD_COFF_GREEN];
+      od->palette[pixel*3+2] = colors[XWD_COFF_BLUE];
+    }
+    colors += XWD_COLOR_SIZE;
+  }
+  return 1;
+} /* setup_palette() */
+
+/* maps the file into memory, if the platform supports it */
+static void
+map_file( simage_xwd_opendata * od, const char * filename )
+{
+#ifdef HAVE_SYS_MMAN_H
+  struct stat statdata;
+  void * map;
+  int fd;
+
+  if ( (fd = open( filename, O_RDONLY )) == -1 ) return;
+  if ( fstat( fd, &statdata ) == 0 && statdata.st_size > 0 ) {
+    map = mmap( NULL, (size_t) statdata.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( map != MAP_FAILED ) {
+      od->map = (const unsigned char *) map;
+      od->mapsize = (size_t) statdata.st_size;
+    }
+  }
+  close( fd );
+#endif /* HAVE_SYS_MMAN_H */
+} /* map_file() */
+
+/* reads size bytes at offset into buf, or returns a pointer into the
+   mapped file */
+static const unsigned char *
+read_data( simage_xwd_opendata * od, unsigned long offset, unsigned long size,
+           unsigned char * buf )
+{
+  if ( od->map != NULL ) {
+    if ( offset > od->mapsize || size > od->mapsize - offset ) return NULL;
+    return od->map + offset;
+  }
+  if ( fseek( od->file, (long) offset, SEEK_SET ) != 0 ||
+       fread( buf, 1, size, od->file ) != size )
+    return NULL;
+  return buf;
+} /* read_data() */
+
+void *
+simage_xwd_open(
   const char * filename,
   int * width,
   int * height,
   int * components )
 {
-  unsigned char * buf, * image, * ptr, * line, * imageptr;
-  unsigned long * palette;
-  unsigned int w, h, c, /* i, */ x, y, num_colors; /* , colormap_entries; */
-  unsigned int /* bits_per_rgb, */ bits_per_pixel, bytes_per_line;
-  unsigned int pixel, /* red, green, blue, */ bits, got_bits, value;
-  unsigned int swap;
-  FILE * xwdfile;
-  struct stat statdata;
-
-  if ( stat( filename, &statdata ) == -1 ) {
-    xwderror = XWD_FILE_STAT_ERROR;
-    /* xwderrno = errno; */
-    return NULL;
-  }
-  if ( (buf = (unsigned char *) malloc( statdata.st_size )) == NULL ) {
+  simage_xwd_opendata * od;
+  unsigned char headerbuf[XWD_HEADER_SIZE];
+  const unsigned char * header, * colors;
+  unsigned char * colorbuf;
+  unsigned int header_size, num_colors, visual_class;
+  unsigned long datasize;
+  int ok, c;
+
+  xwderror = XWD_NO_ERROR;
+  if ( (od = (simage_xwd_opendata *) malloc( sizeof(simage_xwd_opendata) )) == NULL ) {
     xwderror = XWD_MALLOC_ERROR;
-    /* xwderrno = errno; */
     return NULL;
   }
-  xwdfile = fopen( filename, "rb" );
-  if ( (xwdfile = fopen( filename, "rb" )) == NULL ) {
-    free( buf );
+  memset( od, 0, sizeof(simage_xwd_opendata) );
+
+  map_file( od, filename );
+  if ( od->map == NULL && (od->file = fopen( filename, "rb" )) == NULL ) {
+    free( od );
     xwderror = XWD_FILE_OPEN_ERROR;
-    /* xwderrno = errno; */
     return NULL;
   }
-  if ( fread( buf, 1, statdata.st_size, xwdfile ) != statdata.st_size ) {
-    free( buf );
-    fclose( xwdfile );
+  if ( (header = read_data( od, 0, XWD_HEADER_SIZE, headerbuf )) == NULL ) {
+    simage_xwd_close( od );
     xwderror = XWD_FILE_READ_ERROR;
-    /* xwderrno = errno; */
     return NULL;
   }
-  fclose( xwdfile );
 
-  w = getuint32be( buf + XWD_HOFF_WIDTH );
-  h = getuint32be( buf + XWD_HOFF_HEIGHT );
-  c = 3;
-  if ( (image = (unsigned char *) malloc( w * h * c )) == NULL ) {
-    free( buf );
+  header_size = getuint32be( header + XWD_HOFF_HEADER_SIZE );
+  od->width = getuint32be( header + XWD_HOFF_WIDTH );
+  od->height = getuint32be( header + XWD_HOFF_HEIGHT );
+  od->bits_per_pixel = getuint32be( header + XWD_HOFF_BITS_PER_PIXEL );
+  od->bytes_per_line = getuint32be( header + XWD_HOFF_BYTES_PER_LINE );
+  od->byteorder = getuint32be( header + XWD_HOFF_BYTEORDER );
+  od->bitorder = getuint32be( header + XWD_HOFF_BITMAP_BITORDER );
+  visual_class = getuint32be( header + XWD_HOFF_VISUAL_CLASS );
+  num_colors = getuint32be( header + XWD_HOFF_NUM_COLORS );
+  for ( c = 0; c < 3; c++ )
+    setup_mask( od, c, getuint32be( header + XWD_HOFF_RED_MASK + c * 4 ) );
+
+  ok = header_size >= XWD_HEADER_SIZE && od->width > 0 && od->height > 0 &&
+    getuint32be( header + XWD_HOFF_FORMAT ) == ZPixmap &&
+    (od->bits_per_pixel == 1 || od->bits_per_pixel == 2 ||
+     od->bits_per_pixel == 4 || (od->bits_per_pixel & 7) == 0) &&
+    od->bits_per_pixel <= 32 && od->bits_per_pixel > 0 &&
+    num_colors <= 65536 &&
+    od->bytes_per_line >= (od->width * od->bits_per_pixel + 7) / 8 &&
+    od->width <= 0x7fffffff / 3 / od->height;
+  if ( ok ) {
+    switch ( visual_class ) {
+      case TrueColor:
+      case DirectColor:
+        ok = setup_truecolor( od );
+        break;
+      default:
+        if ( od->bits_per_pixel > 16 ) {
+          ok = 0;
+          break;
+        }
+        od->layout = XWD_LAYOUT_PALETTE;
+        colorbuf = NULL;
+        if ( od->map == NULL &&
+             (colorbuf = (unsigned char *) malloc( num_colors * XWD_COLOR_SIZE + 1 )) == NULL ) {
+          simage_xwd_close( od );
+          xwderror = XWD_MALLOC_ERROR;
+          return NULL;
+        }
+        colors = read_data( od, header_size, num_colors * XWD_COLOR_SIZE, colorbuf );
+        ok = colors != NULL &&
+          setup_palette( od, colors, num_colors,
+                         visual_class == StaticGray || visual_class == GrayScale );
+        if ( colorbuf ) free( colorbuf );
+        break;
+    }
+  }
+  if ( !ok ) {
+    simage_xwd_close( od );
+    if ( xwderror == XWD_NO_ERROR ) xwderror = XWD_NO_SUPPORT_ERROR;
+    return NULL;
+  }
+
+  od->dataoffset = header_size + num_colors * XWD_COLOR_SIZE;
+  datasize = (unsigned long) od->height * od->bytes_per_line;
+  if ( od->map != NULL ) {
+    if ( read_data( od, od->dataoffset, datasize, NULL ) == NULL ) {
+      simage_xwd_close( od );
+      xwderror = XWD_FILE_READ_ERROR;
+      return NULL;
+    }
+  }
+  else if ( (od->row = (unsigned char *) malloc( od->bytes_per_line )) == NULL ) {
+    simage_xwd_close( od );
     xwderror = XWD_MALLOC_ERROR;
-    /* xwderrno = errno; */
     return NULL;
   }
-  /* bits_per_rgb = getuint32be( buf + XWD_HOFF_BITS_PER_RGB ); */
-  bytes_per_line = getuint32be( buf + XWD_HOFF_BYTES_PER_LINE );
-  bits_per_pixel = getuint32be( buf + XWD_HOFF_BITS_PER_PIXEL );
-  num_colors = getuint32be( buf + XWD_HOFF_NUM_COLORS );
-  /* colormap_entries = getuint32be( buf + XWD_HOFF_COLORMAP_ENTRIES ); */
-  swap = (getuint32be( buf + XWD_HOFF_BYTEORDER ) == LSBFirst ) ? 1 : 0;
-  palette = NULL;
-
-  /* check that format is supported and set
-     xwderror = XWD_NO_SUPPORT_ERROR;
-     if problem is detected */
-
-  /*
-    fprintf( stdout, "xwd image: %dx%d\n", w, h );
-    fprintf( stdout, "bpp: %d  pbrgb: %d  bpl: %d\n", bits_per_pixel, bits_per_rgb, bytes_per_line );
-    fprintf( stdout, "colors: %d  entries: %d\n", num_colors, colormap_entries );
-    fprintf( stdout, "red: %08x  green: %08x  blue: %08x\n",
-    getuint32be( buf + XWD_HOFF_RED_MASK ),
-    getuint32be( buf + XWD_HOFF_GREEN_MASK ),
-    getuint32be( buf + XWD_HOFF_BLUE_MASK ) );
-  */
-
-  /* check visual class */
-
-  /* FIXME:
-     if visual needs palette (I figure it's visual that decides this), read the palette data.
-     leave it at NULL if else, since palette != NULL will lead to palette lookup
-     if ( (palette = (unsigned long *) malloc( sizeof(long) * getuint32be( buf + XWD_HOFF_COLORMAP_ENTRIES ))) == NULL ) {
-     free( buf );
-     free( image );
-     xwderror = XWD_MALLOC_ERROR;
-     xwderrno = errno;
-     return NULL;
-     }
-     ptr = buf + getuint32be( buf + XWD_HOFF_HEADER_SIZE );
-     for ( i = 0; i < num_colors; i++ ) {
-     pixel = getuint32be( ptr + XWD_COFF_PIXEL );
-     red = (getuint16be( ptr + XWD_COFF_RED ) / 256) & 0xff;
-     green = (getuint16be( ptr + XWD_COFF_GREEN ) / 256) & 0xff;
-     blue = (getuint16be( ptr + XWD_COFF_BLUE ) / 256) & 0xff;
-     palette[i] = ((red << 16) | (green << 8) | blue);
-     fprintf( stdout, "color:  %08x (pixel)  %d (red)  %d (green)  %d (blue)  = %08x\n",
-     pixel, red, green, blue, palette[i] );
-     ptr += XWD_COLOR_SIZE;
-     } */
-
-  ptr = buf + getuint32be( buf + XWD_HOFF_HEADER_SIZE ) + (num_colors * XWD_COLOR_SIZE);
-  imageptr = image;
-  for ( y = 0; y < h; y++ ) {
-    line = ptr + ((h-(y+1)) * bytes_per_line);
-    got_bits = 0;
-    bits = 0;
-    for ( x = 0; x < w; x++ ) {
-      while ( got_bits < bits_per_pixel ) {
-        bits = (bits << 8) | line[0];
-        line++;
-        got_bits += 8;
-      }
-      if ( got_bits > bits_per_pixel ) {
-        got_bits -= bits_per_pixel;
-        value = bits >> got_bits;
-        bits = bits & ((1 << got_bits) - 1);
-      } else {
-        value = bits;
-        bits = 0;
-        got_bits = 0;
-      }
-      if ( palette != NULL )
-        pixel = palette[value];
-      else if ( swap != 0 )
-        pixel = swap32(value);
-      else
-        pixel = value;
-      /* fprintf( stdout, "pixel (%3d, %3d) [%3d]:  %08x\n", x, y, value, pixel ); */
-      /* FIXME - use red/green/blue masks and shift values if it's pixel data */
-      *imageptr++ = (pixel >> 16) & 0xff;
-      *imageptr++ = (pixel >> 8) & 0xff;
-      *imageptr++ = pixel & 0xff;
+
+  *width = od->width;
+  *height = od->height;
+  *components = 3;
+  return od;
+} /* simage_xwd_open() */
+
+void
+simage_xwd_close(
+  void * opendata )
+{
+  simage_xwd_opendata * od = (simage_xwd_opendata *) opendata;
+
+#ifdef HAVE_SYS_MMAN_H
+  if ( od->map != NULL ) munmap( (void *) od->map, od->mapsize );
+#endif /* HAVE_SYS_MMAN_H */
+  if ( od->file != NULL ) fclose( od->file );
+  free( od->row );
+  free( od->palette );
+  free( od );
+} /* simage_xwd_close() */
+
+int
+simage_xwd_read_line(
+  void * opendata,
+  int y,
+  unsigned char * buf )
+{
+  simage_xwd_opendata * od = (simage_xwd_opendata *) opendata;
+  const unsigned char * line;
+
+  /* the rows are stored from the top */
+  line = read_data( od, od->dataoffset +
+                    (unsigned long) (od->height - 1 - y) * od->bytes_per_line,
+                    od->bytes_per_line, od->row );
+  if ( line == NULL ) {
+    xwderror = XWD_FILE_READ_ERROR;
+    return 0;
+  }
+  convert_row( od, line, buf );
+  return 1;
+} /* simage_xwd_read_line() */
+
+/* ********************************************************************** */
+
+unsigned char *
+simage_xwd_load(
+  const char * filename,
+  int * width,
+  int * height,
+  int * components )
+{
+  simage_xwd_opendata * od;
+  unsigned char * image;
+  int w, h, c, y;
+
+  if ( (od = (simage_xwd_opendata *) simage_xwd_open( filename, &w, &h, &c )) == NULL )
+    return NULL;
+  if ( (image = (unsigned char *) malloc( (size_t) w * h * c )) == NULL ) {
+    simage_xwd_close( od );
+    xwderror = XWD_MALLOC_ERROR;
+    return NULL;
+  }
+  /* read the rows in file order */
+  for ( y = h - 1; y >= 0; y-- ) {
+    if ( !simage_xwd_read_line( od, y, image + (size_t) y * w * c ) ) {
+      free( image );
+      simage_xwd_close( od );
+      return NULL;
     }
   }
-  free( palette );
-  free( buf );
+  simage_xwd_close( od );
   *width = w;
   *height = h;
   *components = c;
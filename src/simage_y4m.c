@@ -0,0 +1,602 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * YUV4MPEG2 (.y4m) movies, the raw video format understood by most
+ * video encoders and players.
+ *
+ * A text header line is followed by frames, each a "FRAME" line and
+ * the Y, U and V planes with 8 bits per sample, stored from the top
+ * row. The exporter converts the RGB images to BT.601 YCbCr, and
+ * writes every frame, header line included, with a single fwrite. The
+ * importer reads each frame with a single fread and converts it back
+ * to RGB. Large frames are converted on several threads. The filename
+ * "-" stands for stdout or stdin, to pipe frames to and from other
+ * programs.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#ifdef SIMAGE_Y4M_SUPPORT
+
+#include <simage_y4m.h>
+#include <simage_private.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif /* _WIN32 */
+
+/* don't bother with threads for frames smaller than this */
+#define PARALLEL_MIN_PIXELS (1024 * 1024)
+
+/* the number of row pairs each job converts */
+#define ROWS_PER_JOB 16
+
+#define Y4M_MAGIC "YUV4MPEG2"
+#define Y4M_FRAME "FRAME\n"
+#define Y4M_FRAME_LEN 6
+
+/* the chroma subsampling of the U and V planes */
+#define CHROMA_420 0
+#define CHROMA_422 1
+#define CHROMA_444 2
+#define CHROMA_MONO 3
+
+typedef struct {
+  FILE * fp;
+  int isstdio;
+  int width;
+  int height;
+  int chroma;
+  int fullrange;   /* JPEG range YCbCr instead of 16-235 / 16-240 */
+  int fpsnum, fpsden;
+  int started;     /* the exporter has written the header */
+  size_t framesize;
+  unsigned char * buffer; /* a frame, with room for the frame line */
+} simage_y4m_movie;
+
+static int
+chroma_width(simage_y4m_movie * ym)
+{
+  return ym->chroma == CHROMA_444 ? ym->width : (ym->width + 1) / 2;
+}
+
+static int
+chroma_height(simage_y4m_movie * ym)
+{
+  return ym->chroma == CHROMA_420 ? (ym->height + 1) / 2 : ym->height;
+}
+
+static size_t
+frame_size(simage_y4m_movie * ym)
+{
+  size_t n = (size_t) ym->width * ym->height;
+  if (ym->chroma != CHROMA_MONO) {
+    n += (size_t) chroma_width(ym) * chroma_height(ym) * 2;
+  }
+  return n;
+}
+
+static void
+free_movie(simage_y4m_movie * ym)
+{
+  if (ym->fp) {
+    if (ym->isstdio) fflush(ym->fp);
+    else fclose(ym->fp);
+  }
+  if (ym->buffer) free(ym->buffer);
+  free(ym);
+}
+
+/*
+ * Color conversion, BT.601 with 8 bits of fraction. The limited range
+ * coefficients are the usual ones from the ITU, the full range ones
+ * those of JFIF.
+ */
+
+static unsigned char
+clip8(int val)
+{
+  return val < 0 ? 0 : (val > 0xffff ? 255 : (unsigned char) (val >> 8));
+}
+
+typedef struct {
+  const unsigned char * src;  /* for the exporter */
+  unsigned char * dst;        /* for the importer */
+  int nc;
+  int bgr;
+  simage_y4m_movie * ym;
+  unsigned char * planes[3];
+} y4m_convert_job;
+
+/* converts a row of pixels to luma */
+static void
+rgb_to_luma(const unsigned char * src, int nc, int bgr, int width,
+            int fullrange, unsigned char * dst)
+{
+  int kr = fullrange ? 77 : 66;
+  int kg = fullrange ? 150 : 129;
+  int kb = fullrange ? 29 : 25;
+  int offset = fullrange ? 0 : 16;
+  int ri = bgr ? 2 : 0, bi = 2 - ri;
+  int x;
+
+  if (nc < 3) {
+    for (x = 0; x < width; x++) {
+      int g = src[x * nc];
+      dst[x] = (unsigned char) (fullrange ? g : ((220 * g + 128) >> 8) + 16);
+    }
+  }
+  else if (nc == 3) {
+    for (x = 0; x < width; x++) {
+      const unsigned char * p = src + x * 3;
+      dst[x] = (unsigned char) (((kr * p[ri] + kg * p[1] + kb * p[bi] + 128) >> 8) + offset);
+    }
+  }
+  else {
+    for (x = 0; x < width; x++) {
+      const unsigned char * p = src + x * 4;
+      dst[x] = (unsigned char) (((kr * p[ri] + kg * p[1] + kb * p[bi] + 128) >> 8) + offset);
+    }
+  }
+}
+
+/* converts the average color of two rows (the same row for 4:2:2 and
+   4:4:4) and pairs of pixels (single pixels for 4:4:4) to chroma */
+static void
+rgb_to_chroma(const unsigned char * row0, const unsigned char * row1,
+              int nc, int bgr, int width, int hsub, int fullrange,
+              unsigned char * u, unsigned char * v)
+{
+  int ur = fullrange ? -43 : -38;
+  int ug = fullrange ? -85 : -74;
+  int ub = fullrange ? 128 : 112;
+  int vr = fullrange ? 128 : 112;
+  int vg = fullrange ? -107 : -94;
+  int vb = fullrange ? -21 : -18;
+  int ri = bgr ? 2 : 0, bi = 2 - ri;
+  int cw = (width + hsub - 1) / hsub;
+  int x, n, r, g, b;
+
+  if (hsub == 1) {
+    for (x = 0; x < width; x++) {
+      const unsigned char * p = row0 + x * nc;
+      const unsigned char * q = row1 + x * nc;
+      r = (p[ri] + q[ri] + 1) >> 1;
+      g = (p[1] + q[1] + 1) >> 1;
+      b = (p[bi] + q[bi] + 1) >> 1;
+      u[x] = clip8(ur * r + ug * g + ub * b + 128 + (128 << 8));
+      v[x] = clip8(vr * r + vg * g + vb * b + 128 + (128 << 8));
+    }
+    return;
+  }
+
+  /* the last pixel of odd rows is paired with itself */
+  n = width / 2;
+  for (x = 0; x < cw; x++) {
+    const unsigned char * p = row0 + x * 2 * nc;
+    const unsigned char * q = row1 + x * 2 * nc;
+    int next = x < n ? nc : 0;
+    r = (p[ri] + p[ri + next] + q[ri] + q[ri + next] + 2) >> 2;
+    g = (p[1] + p[1 + next] + q[1] + q[1 + next] + 2) >> 2;
+    b = (p[bi] + p[bi + next] + q[bi] + q[bi + next] + 2) >> 2;
+    u[x] = clip8(ur * r + ug * g + ub * b + 128 + (128 << 8));
+    v[x] = clip8(vr * r + vg * g + vb * b + 128 + (128 << 8));
+  }
+}
+
+static void
+encode_rows(void * closure, int idx)
+{
+  y4m_convert_job * job = (y4m_convert_job *) closure;
+  simage_y4m_movie * ym = job->ym;
+  size_t bpr = (size_t) ym->width * job->nc;
+  int cw = chroma_width(ym);
+  int ch = chroma_height(ym);
+  int vsub = ym->chroma == CHROMA_420 ? 2 : 1;
+  int hsub = ym->chroma == CHROMA_444 ? 1 : 2;
+  const unsigned char * rows[2];
+  int cy, y, j, start, stop;
+
+  /* jobs are made of chroma rows, or luma row pairs for mono */
+  start = idx * ROWS_PER_JOB;
+  stop = start + ROWS_PER_JOB;
+
+  if (ym->chroma == CHROMA_MONO) {
+    start *= 2;
+    stop *= 2;
+    if (stop > ym->height) stop = ym->height;
+    for (y = start; y < stop; y++) {
+      /* the image is stored from the bottom row */
+      rgb_to_luma(job->src + (ym->height - 1 - y) * bpr, job->nc, job->bgr,
+                  ym->width, ym->fullrange,
+                  job->planes[0] + (size_t) y * ym->width);
+    }
+    return;
+  }
+
+  if (stop > ch) stop = ch;
+  for (cy = start; cy < stop; cy++) {
+    for (j = 0; j < 2; j++) {
+      y = cy * vsub + (j < vsub ? j : 0);
+      if (y >= ym->height) y = ym->height - 1;
+      rows[j] = job->src + (ym->height - 1 - y) * bpr;
+      if (j < vsub) {
+        rgb_to_luma(rows[j], job->nc, job->bgr, ym->width, ym->fullrange,
+                    job->planes[0] + (size_t) y * ym->width);
+      }
+    }
+    if (job->nc < 3) {
+      /* gray images have no color */
+      memset(job->planes[1] + (size_t) cy * cw, 128, cw);
+      memset(job->planes[2] + (size_t) cy * cw, 128, cw);
+    }
+    else {
+      rgb_to_chroma(rows[0], rows[1], job->nc, job->bgr, ym->width, hsub,
+                    ym->fullrange, job->planes[1] + (size_t) cy * cw,
+                    job->planes[2] + (size_t) cy * cw);
+    }
+  }
+}
+static void
+decode_rows(void * closure, int idx)
+{
+  y4m_convert_job * job = (y4m_convert_job *) closure;
+  simage_y4m_movie * ym = job->ym;
+  int cw = chroma_width(ym);
+  int vsub = ym->chroma == CHROMA_420 ? 2 : 1;
+  int hshift = ym->chroma == CHROMA_444 ? 0 : 1;
+  const unsigned char * lu, * lv;
+  int x, y, start, stop, c, d, e;
+
+  start = idx * ROWS_PER_JOB * 2;
+  stop = start + ROWS_PER_JOB * 2;
+  if (stop > ym->height) stop = ym->height;
+
+  for (y = start; y < stop; y++) {
+    const unsigned char * ly = job->planes[0] + (size_t) y * ym->width;
+    /* the image is stored from the bottom row */
+    unsigned char * dst = job->dst +
+      (size_t) (ym->height - 1 - y) * ym->width * job->nc;
+
+    if (ym->chroma == CHROMA_MONO) {
+      if (ym->fullrange) memcpy(dst, ly, ym->width);
+      else {
+        for (x = 0; x < ym->width; x++) dst[x] = clip8(298 * (ly[x] - 16) + 128);
+      }
+    }
+    else if (ym->fullrange) {
+      lu = job->planes[1] + (size_t) (y / vsub) * cw;
+      lv = job->planes[2] + (size_t) (y / vsub) * cw;
+      for (x = 0; x < ym->width; x++) {
+        c = ly[x] << 8;
+        d = lu[x >> hshift] - 128;
+        e = lv[x >> hshift] - 128;
+        dst[x*3] = clip8(c + 359 * e + 128);
+        dst[x*3+1] = clip8(c - 88 * d - 183 * e + 128);
+        dst[x*3+2] = clip8(c + 454 * d + 128);
+      }
+    }
+    else {
+      lu = job->planes[1] + (size_t) (y / vsub) * cw;
+      lv = job->planes[2] + (size_t) (y / vsub) * cw;
+      for (x = 0; x < ym->width; x++) {
+        c = 298 * (ly[x] - 16);
+        d = lu[x >> hshift] - 128;
+        e = lv[x >> hshift] - 128;
+        dst[x*3] = clip8(c + 409 * e + 128);
+        dst[x*3+1] = clip8(c - 100 * d - 208 * e + 128);
+        dst[x*3+2] = clip8(c + 516 * d + 128);
+      }
+    }
+  }
+}
+
+/* runs the conversion, on several threads for large frames */
+static void
+convert_frame(y4m_convert_job * job, s_parallel_func * func)
+{
+  simage_y4m_movie * ym = job->ym;
+  int rows, numjobs;
+
+  job->planes[0] = ym->buffer + Y4M_FRAME_LEN;
+  job->planes[1] = job->planes[0] + (size_t) ym->width * ym->height;
+  job->planes[2] = job->planes[1] + (size_t) chroma_width(ym) * chroma_height(ym);
+
+  /* the encoder's jobs cover chroma rows, which are luma row pairs
+     for 4:2:0 and mono, otherwise single luma rows */
+  rows = (ym->height + 1) / 2;
+  if (func == encode_rows && (ym->chroma == CHROMA_422 || ym->chroma == CHROMA_444)) {
+    rows = ym->height;
+  }
+  numjobs = (rows + ROWS_PER_JOB - 1) / ROWS_PER_JOB;
+  if ((double) ym->width * ym->height < PARALLEL_MIN_PIXELS) {
+    int i;
+    for (i = 0; i < numjobs; i++) func(job, i);
+  }
+  else s_parallel_for(numjobs, func, job);
+}
+
+/*
+ * The exporter
+ */
+
+static int
+write_header(simage_y4m_movie * ym)
+{
+  static const char * chromatags[] = { "420jpeg", "422", "444", "mono" };
+  char header[256];
+  int len;
+
+  len = sprintf(header, "%s W%d H%d F%d:%d Ip A1:1 C%s XCOLORRANGE=%s\n",
+                Y4M_MAGIC, ym->width, ym->height, ym->fpsnum, ym->fpsden,
+                chromatags[ym->chroma], ym->fullrange ? "FULL" : "LIMITED");
+  return fwrite(header, 1, len, ym->fp) == (size_t) len;
+}
+
+int
+simage_y4m_movie_create(const char * filename, s_movie * movie,
+                        s_params * params)
+{
+  simage_y4m_movie * ym;
+  const char * mime_type = NULL;
+  char * str;
+  size_t len;
+  int fps, fpsden;
+
+  s_params_get(params, "mime-type", S_STRING_PARAM_TYPE, &mime_type, NULL);
+  if (mime_type) {
+    if (strcmp(mime_type, "video/x-yuv4mpeg") != 0 &&
+        strcmp(mime_type, "video/y4m") != 0) return 0;
+  }
+  else {
+    /* without a mime type, go by the filename */
+    len = strlen(filename);
+    if (strcmp(filename, "-") != 0 &&
+        (len < 4 || strcmp(filename + len - 4, ".y4m") != 0)) return 0;
+  }
+
+  ym = (simage_y4m_movie *) malloc(sizeof(simage_y4m_movie));
+  if (ym == NULL) return 0;
+  memset(ym, 0, sizeof(simage_y4m_movie));
+
+  fps = 25;
+  fpsden = 1;
+  ym->chroma = CHROMA_420;
+  if (params) {
+    s_params_get(params, "width", S_INTEGER_PARAM_TYPE, &ym->width, NULL);
+    s_params_get(params, "height", S_INTEGER_PARAM_TYPE, &ym->height, NULL);
+    s_params_get(params, "fps", S_INTEGER_PARAM_TYPE, &fps, NULL);
+    s_params_get(params, "fps denominator", S_INTEGER_PARAM_TYPE, &fpsden, NULL);
+    if (s_params_get(params, "chroma", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+      if (strcmp(str, "420") == 0) ym->chroma = CHROMA_420;
+      else if (strcmp(str, "422") == 0) ym->chroma = CHROMA_422;
+      else if (strcmp(str, "444") == 0) ym->chroma = CHROMA_444;
+      else if (strcmp(str, "mono") == 0) ym->chroma = CHROMA_MONO;
+    }
+    if (s_params_get(params, "color range", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+      if (strcmp(str, "full") == 0) ym->fullrange = 1;
+      else if (strcmp(str, "limited") == 0) ym->fullrange = 0;
+    }
+  }
+  ym->fpsnum = fps > 0 ? fps : 25;
+  ym->fpsden = fpsden > 0 ? fpsden : 1;
+
+  if (strcmp(filename, "-") == 0) {
+    ym->fp = stdout;
+    ym->isstdio = 1;
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif /* _WIN32 */
+  }
+  else {
+    ym->fp = fopen(filename, "wb");
+    if (ym->fp == NULL) {
+      free(ym);
+      return 0;
+    }
+  }
+
+  s_params_set(s_movie_params(movie), "y4m movie handle",
+               S_POINTER_PARAM_TYPE, ym, NULL);
+  return 1;
+}
+
+int
+simage_y4m_movie_put(s_movie * movie, s_image * image, s_params * params)
+{
+  simage_y4m_movie * ym;
+  y4m_convert_job job;
+
+  if (!s_params_get(s_movie_params(movie), "y4m movie handle",
+                    S_POINTER_PARAM_TYPE, &ym, NULL)) return 0;
+
+  if (!ym->started) {
+    /* the size is taken from the first frame unless it was given */
+    if (ym->width <= 0) ym->width = s_image_width(image);
+    if (ym->height <= 0) ym->height = s_image_height(image);
+    ym->framesize = frame_size(ym);
+    ym->buffer = (unsigned char *) malloc(Y4M_FRAME_LEN + ym->framesize);
+    if (ym->buffer == NULL || !write_header(ym)) return 0;
+    memcpy(ym->buffer, Y4M_FRAME, Y4M_FRAME_LEN);
+    ym->started = 1;
+  }
+  if (s_image_width(image) != ym->width || s_image_height(image) != ym->height ||
+      s_image_data(image) == NULL) {
+    return 0;
+  }
+
+  job.src = s_image_data(image);
+  job.dst = NULL;
+  job.nc = s_image_components(image);
+  job.bgr = s_image_get_component_order(image) == SIMAGE_ORDER_BGR;
+  job.ym = ym;
+  convert_frame(&job, encode_rows);
+
+  return fwrite(ym->buffer, 1, Y4M_FRAME_LEN + ym->framesize, ym->fp) ==
+    Y4M_FRAME_LEN + ym->framesize;
+}
+
+/*
+ * The importer
+ */
+
+/* reads the rest of a header line into line. Returns the length, or -1
+   at the end of the file or for lines that are too long */
+static int
+read_line(FILE * fp, char * line, int maxlen)
+{
+  int c, len = 0;
+
+  while ((c = getc(fp)) != EOF && c != '\n') {
+    if (len == maxlen - 1) return -1;
+    line[len++] = (char) c;
+  }
+  if (c == EOF) return -1;
+  line[len] = 0;
+  return len;
+}
+
+static int
+parse_header(simage_y4m_movie * ym, char * line)
+{
+  char * tok, * next;
+
+  ym->chroma = CHROMA_420;
+  ym->fpsnum = 25;
+  ym->fpsden = 1;
+  for (tok = line; tok && *tok; tok = next) {
+    next = strchr(tok, ' ');
+    if (next) *next++ = 0;
+    switch (tok[0]) {
+    case 'W':
+      ym->width = atoi(tok + 1);
+      break;
+    case 'H':
+      ym->height = atoi(tok + 1);
+      break;
+    case 'F':
+      if (sscanf(tok + 1, "%d:%d", &ym->fpsnum, &ym->fpsden) != 2) return 0;
+      break;
+    case 'I':
+      /* interlaced frames are returned as they are */
+      break;
+    case 'C':
+      if (strncmp(tok + 1, "420", 3) == 0 && (tok[4] == 0 || tok[4] == 'j' ||
+                                              tok[4] == 'm' || tok[4] == 'p')) {
+        ym->chroma = CHROMA_420;
+      }
+      else if (strcmp(tok + 1, "422") == 0) ym->chroma = CHROMA_422;
+      else if (strcmp(tok + 1, "444") == 0) ym->chroma = CHROMA_444;
+      else if (strcmp(tok + 1, "mono") == 0) ym->chroma = CHROMA_MONO;
+      else return 0; /* high bit depths and alpha */
+      break;
+    case 'X':
+      if (strcmp(tok, "XCOLORRANGE=FULL") == 0) ym->fullrange = 1;
+      break;
+    }
+  }
+  return ym->width > 0 && ym->height > 0;
+}
+
+int
+simage_y4m_movie_open(const char * filename, s_movie * movie)
+{
+  simage_y4m_movie * ym;
+  char line[1024];
+  int len = (int) strlen(Y4M_MAGIC);
+
+  ym = (simage_y4m_movie *) malloc(sizeof(simage_y4m_movie));
+  if (ym == NULL) return 0;
+  memset(ym, 0, sizeof(simage_y4m_movie));
+
+  if (strcmp(filename, "-") == 0) {
+    ym->fp = stdin;
+    ym->isstdio = 1;
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif /* _WIN32 */
+  }
+  else ym->fp = fopen(filename, "rb");
+
+  if (ym->fp == NULL ||
+      fread(line, 1, len, ym->fp) != (size_t) len ||
+      memcmp(line, Y4M_MAGIC, len) != 0 ||
+      read_line(ym->fp, line, sizeof(line)) < 0 ||
+      !parse_header(ym, line)) {
+    free_movie(ym);
+    return 0;
+  }
+
+  ym->framesize = frame_size(ym);
+  ym->buffer = (unsigned char *) malloc(Y4M_FRAME_LEN + ym->framesize);
+  if (ym->buffer == NULL) {
+    free_movie(ym);
+    return 0;
+  }
+
+  s_params_set(s_movie_params(movie), "y4m movie handle",
+               S_POINTER_PARAM_TYPE, ym, NULL);
+  return 1;
+}
+
+s_image *
+simage_y4m_movie_get(s_movie * movie, s_image * prealloc, s_params * params)
+{
+  simage_y4m_movie * ym;
+  y4m_convert_job job;
+  s_image * image;
+  char line[256];
+
+  if (!s_params_get(s_movie_params(movie), "y4m movie handle",
+                    S_POINTER_PARAM_TYPE, &ym, NULL)) return NULL;
+
+  /* the frame line may have parameters, which we ignore */
+  if (read_line(ym->fp, line, sizeof(line)) < 5 || strncmp(line, "FRAME", 5) != 0 ||
+      fread(ym->buffer + Y4M_FRAME_LEN, 1, ym->framesize, ym->fp) != ym->framesize) {
+    return NULL;
+  }
+
+  image = s_image_prepare(prealloc, ym->width, ym->height,
+                          ym->chroma == CHROMA_MONO ? 1 : 3);
+  if (image == NULL) return NULL;
+
+  job.src = NULL;
+  job.dst = s_image_data(image);
+  job.nc = ym->chroma == CHROMA_MONO ? 1 : 3;
+  job.bgr = 0;
+  job.ym = ym;
+  convert_frame(&job, decode_rows);
+  return image;
+}
+
+void
+simage_y4m_movie_close(s_movie * movie)
+{
+  simage_y4m_movie * ym;
+  if (s_params_get(s_movie_params(movie), "y4m movie handle",
+                   S_POINTER_PARAM_TYPE, &ym, NULL)) {
+    free_movie(ym);
+  }
+}
+
+#endif /* SIMAGE_Y4M_SUPPORT */
@@ -0,0 +1,831 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * GPU textures in DDS and KTX2 files.
+ *
+ * The savers make a mipmap chain with the resize filters, compress
+ * every level with the block compressor in bcn.c, and write the levels
+ * in one of the two containers. s_texture_load() reads the levels of
+ * such files back as they are stored, ready to be handed to
+ * glCompressedTexImage2D() or similar, without decoding them.
+ *
+ * Texture data is stored from the top row, unlike simage's images.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <simage.h>
+#include <simage_private.h>
+
+#define ERR_NO_ERROR          0
+#define ERR_OPEN              1
+#define ERR_READ              2
+#define ERR_MEM               3
+#define ERR_UNSUPPORTED       4
+#define ERR_OPEN_WRITE        5
+#define ERR_WRITE             6
+#define ERR_RESIZE            7
+
+static int texerror = ERR_NO_ERROR;
+
+int
+s_texture_error(char * buffer, int buflen)
+{
+  switch (texerror) {
+  case ERR_OPEN:
+    strncpy(buffer, "Texture loader: Error opening file", buflen);
+    break;
+  case ERR_READ:
+    strncpy(buffer, "Texture loader: Error reading file", buflen);
+    break;
+  case ERR_MEM:
+    strncpy(buffer, "Texture: Out of memory error", buflen);
+    break;
+  case ERR_UNSUPPORTED:
+    strncpy(buffer, "Texture loader: Unsupported or invalid file", buflen);
+    break;
+  case ERR_OPEN_WRITE:
+    strncpy(buffer, "Texture saver: Error opening file for writing", buflen);
+    break;
+  case ERR_WRITE:
+    strncpy(buffer, "Texture saver: Error writing file", buflen);
+    break;
+  case ERR_RESIZE:
+    strncpy(buffer, "Texture saver: Unknown mipmap filter", buflen);
+    break;
+  }
+  return texerror;
+}
+
+/* a full mipmap chain for 65536 pixels */
+#define MAX_LEVELS 17
+
+typedef struct {
+  int width;
+  int height;
+  size_t size;
+  unsigned char * data;
+} texture_level;
+
+struct simage_texture_s {
+  int format;
+  int srgb;
+  int numlevels;
+  texture_level levels[MAX_LEVELS];
+  unsigned char * buffer; /* holds the data of all the levels */
+};
+
+static int
+block_size(int format)
+{
+  switch (format) {
+  case SIMAGE_TEXTURE_RGBA8:
+    return 4;
+  case SIMAGE_TEXTURE_BC1:
+  case SIMAGE_TEXTURE_BC4:
+    return 8;
+  default:
+    return 16;
+  }
+}
+
+static size_t
+level_size(int format, int width, int height)
+{
+  if (format == SIMAGE_TEXTURE_RGBA8) return (size_t) width * height * 4;
+  return (size_t) ((width + 3) / 4) * ((height + 3) / 4) * block_size(format);
+}
+
+static void
+put_uint32le(unsigned char * ptr, unsigned int val)
+{
+  ptr[0] = (unsigned char) val;
+  ptr[1] = (unsigned char) (val >> 8);
+  ptr[2] = (unsigned char) (val >> 16);
+  ptr[3] = (unsigned char) (val >> 24);
+}
+
+static void
+put_uint64le(unsigned char * ptr, size_t val)
+{
+  put_uint32le(ptr, (unsigned int) (val & 0xffffffff));
+  put_uint32le(ptr + 4, (unsigned int) ((unsigned long long) val >> 32));
+}
+
+static unsigned int
+get_uint32le(const unsigned char * ptr)
+{
+  return (unsigned int) ptr[0] | ((unsigned int) ptr[1] << 8) |
+    ((unsigned int) ptr[2] << 16) | ((unsigned int) ptr[3] << 24);
+}
+
+static unsigned long long
+get_uint64le(const unsigned char * ptr)
+{
+  return get_uint32le(ptr) | ((unsigned long long) get_uint32le(ptr + 4) << 32);
+}
+
+/* sets up the levels of a texture with the given size, and allocates
+   the buffer for their data. Returns 0 if out of memory */
+static int
+setup_levels(s_texture * tex, int width, int height)
+{
+  size_t total = 0;
+  int i;
+
+  for (i = 0; i < tex->numlevels; i++) {
+    tex->levels[i].width = width;
+    tex->levels[i].height = height;
+    tex->levels[i].size = level_size(tex->format, width, height);
+    total += tex->levels[i].size;
+    if (width > 1) width /= 2;
+    if (height > 1) height /= 2;
+  }
+  tex->buffer = (unsigned char *) malloc(total);
+  if (tex->buffer == NULL) return 0;
+  total = 0;
+  for (i = 0; i < tex->numlevels; i++) {
+    tex->levels[i].data = tex->buffer + total;
+    total += tex->levels[i].size;
+  }
+  return 1;
+}
+
+/*
+ * Making textures
+ */
+
+/* copies the image to dst as RGBA from the top row */
+static void
+convert_rgba(const unsigned char * bytes, int width, int height, int nc,
+             unsigned char * dst)
+{
+  int x, y;
+
+  for (y = height - 1; y >= 0; y--) {
+    const unsigned char * src = bytes + (size_t) y * width * nc;
+    switch (nc) {
+    case 1:
+      for (x = 0; x < width; x++) {
+        dst[x*4] = dst[x*4+1] = dst[x*4+2] = src[x];
+        dst[x*4+3] = 255;
+      }
+      break;
+    case 2:
+      for (x = 0; x < width; x++) {
+        dst[x*4] = dst[x*4+1] = dst[x*4+2] = src[x*2];
+        dst[x*4+3] = src[x*2+1];
+      }
+      break;
+    case 3:
+      for (x = 0; x < width; x++) {
+        dst[x*4] = src[x*3];
+        dst[x*4+1] = src[x*3+1];
+        dst[x*4+2] = src[x*3+2];
+        dst[x*4+3] = 255;
+      }
+      break;
+    default:
+      memcpy(dst, src, (size_t) width * 4);
+      break;
+    }
+    dst += (size_t) width * 4;
+  }
+}
+
+static void
+store_level(s_texture * tex, int level, const unsigned char * bytes,
+            int nc)
+{
+  texture_level * l = &tex->levels[level];
+
+  if (tex->format == SIMAGE_TEXTURE_RGBA8) {
+    convert_rgba(bytes, l->width, l->height, nc, l->data);
+  }
+  else {
+    s_bcn_compress(bytes, l->width, l->height, nc, tex->format, l->data);
+  }
+}
+
+static s_texture *
+make_texture(const unsigned char * bytes, int width, int height, int nc,
+             s_params * params)
+{
+  s_texture * tex;
+  const unsigned char * prev;
+  unsigned char * cur;
+  const char * filter = "box";
+  char * str;
+  int i, maxlevels, numlevels, srgb;
+
+  texerror = ERR_NO_ERROR;
+  if (nc < 1 || nc > 4 || width <= 0 || height <= 0) {
+    texerror = ERR_UNSUPPORTED;
+    return NULL;
+  }
+
+  tex = (s_texture *) malloc(sizeof(s_texture));
+  if (tex == NULL) {
+    texerror = ERR_MEM;
+    return NULL;
+  }
+  memset(tex, 0, sizeof(s_texture));
+
+  /* BC1 has only one bit of alpha */
+  tex->format = (nc == 2 || nc == 4) ? SIMAGE_TEXTURE_BC3 : SIMAGE_TEXTURE_BC1;
+  numlevels = 0;
+  srgb = 0;
+  if (params) {
+    if (s_params_get(params, "format", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+      if (strcmp(str, "rgba8") == 0) tex->format = SIMAGE_TEXTURE_RGBA8;
+      else if (strcmp(str, "bc1") == 0) tex->format = SIMAGE_TEXTURE_BC1;
+      else if (strcmp(str, "bc3") == 0) tex->format = SIMAGE_TEXTURE_BC3;
+      else if (strcmp(str, "bc4") == 0) tex->format = SIMAGE_TEXTURE_BC4;
+      else if (strcmp(str, "bc5") == 0) tex->format = SIMAGE_TEXTURE_BC5;
+      else if (strcmp(str, "bc7") == 0) tex->format = SIMAGE_TEXTURE_BC7;
+    }
+    if (s_params_get(params, "mipmap filter", S_STRING_PARAM_TYPE, &str, NULL) && str) {
+      filter = str;
+    }
+    (void) s_params_get(params, "mipmaps", S_INTEGER_PARAM_TYPE, &numlevels, NULL);
+    (void) s_params_get(params, "srgb", S_INTEGER_PARAM_TYPE, &srgb, NULL);
+  }
+  /* there are no sRGB variants of BC4 and BC5 */
+  tex->srgb = srgb && tex->format != SIMAGE_TEXTURE_BC4 &&
+    tex->format != SIMAGE_TEXTURE_BC5;
+
+  maxlevels = 1;
+  for (i = width > height ? width : height; i > 1; i /= 2) maxlevels++;
+  if (maxlevels > MAX_LEVELS) maxlevels = MAX_LEVELS;
+  tex->numlevels = (numlevels <= 0 || numlevels > maxlevels) ? maxlevels : numlevels;
+
+  if (!setup_levels(tex, width, height)) {
+    texerror = ERR_MEM;
+    s_texture_destroy(tex);
+    return NULL;
+  }
+
+  store_level(tex, 0, bytes, nc);
+  prev = bytes;
+  for (i = 1; i < tex->numlevels; i++) {
+    texture_level * l = &tex->levels[i];
+    cur = s_resize_filtered(prev, tex->levels[i-1].width, tex->levels[i-1].height,
+                            nc, l->width, l->height, filter);
+    if (prev != bytes) free((void *) prev);
+    prev = cur;
+    if (cur == NULL) {
+      texerror = ERR_RESIZE;
+      s_texture_destroy(tex);
+      return NULL;
+    }
+    store_level(tex, i, cur, nc);
+  }
+  if (prev != bytes) free((void *) prev);
+  return tex;
+}
+
+/*
+ * DDS
+ */
+
+#define DDS_HEADER_SIZE 128
+#define DDS_DX10_HEADER_SIZE 20
+
+#define DDSD_CAPS        0x1
+#define DDSD_HEIGHT      0x2
+#define DDSD_WIDTH       0x4
+#define DDSD_PITCH       0x8
+#define DDSD_PIXELFORMAT 0x1000
+#define DDSD_MIPMAPCOUNT 0x20000
+#define DDSD_LINEARSIZE  0x80000
+
+#define DDPF_ALPHAPIXELS 0x1
+#define DDPF_FOURCC      0x4
+#define DDPF_RGB         0x40
+
+#define DDSCAPS_COMPLEX  0x8
+#define DDSCAPS_TEXTURE  0x1000
+#define DDSCAPS_MIPMAP   0x400000
+
+#define DDSCAPS2_CUBEMAP 0x200
+#define DDSCAPS2_VOLUME  0x200000
+
+#define DDS_FOURCC(a, b, c, d) \
+  ((unsigned int) (a) | ((unsigned int) (b) << 8) | \
+   ((unsigned int) (c) << 16) | ((unsigned int) (d) << 24))
+
+/* the DXGI formats, and whether they are sRGB */
+static const struct {
+  int format;
+  unsigned int dxgi;
+  unsigned int dxgi_srgb;
+} dxgi_formats[] = {
+  { SIMAGE_TEXTURE_RGBA8, 28, 29 },
+  { SIMAGE_TEXTURE_BC1, 71, 72 },
+  { SIMAGE_TEXTURE_BC3, 77, 78 },
+  { SIMAGE_TEXTURE_BC4, 80, 0 },
+  { SIMAGE_TEXTURE_BC5, 83, 0 },
+  { SIMAGE_TEXTURE_BC7, 98, 99 }
+};
+
+#define NUM_DXGI_FORMATS (int) (sizeof(dxgi_formats) / sizeof(dxgi_formats[0]))
+
+static int
+write_dds(const char * filename, s_texture * tex)
+{
+  unsigned char header[DDS_HEADER_SIZE + DDS_DX10_HEADER_SIZE];
+  unsigned int flags, caps, fourcc;
+  size_t headersize, total;
+  int i, dx10, ok;
+  FILE * fp;
+
+  /* BC7 and the sRGB formats need the DX10 extension header */
+  dx10 = tex->format == SIMAGE_TEXTURE_BC7 || tex->srgb;
+  switch (tex->format) {
+  case SIMAGE_TEXTURE_BC1: fourcc = DDS_FOURCC('D', 'X', 'T', '1'); break;
+  case SIMAGE_TEXTURE_BC3: fourcc = DDS_FOURCC('D', 'X', 'T', '5'); break;
+  case SIMAGE_TEXTURE_BC4: fourcc = DDS_FOURCC('A', 'T', 'I', '1'); break;
+  case SIMAGE_TEXTURE_BC5: fourcc = DDS_FOURCC('A', 'T', 'I', '2'); break;
+  default: fourcc = 0; break;
+  }
+  if (dx10) fourcc = DDS_FOURCC('D', 'X', '1', '0');
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, "DDS ", 4);
+  flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT;
+  flags |= tex->format == SIMAGE_TEXTURE_RGBA8 ? DDSD_PITCH : DDSD_LINEARSIZE;
+  if (tex->numlevels > 1) flags |= DDSD_MIPMAPCOUNT;
+  put_uint32le(header + 4, 124);
+  put_uint32le(header + 8, flags);
+  put_uint32le(header + 12, (unsigned int) tex->levels[0].height);
+  put_uint32le(header + 16, (unsigned int) tex->levels[0].width);
+  put_uint32le(header + 20, tex->format == SIMAGE_TEXTURE_RGBA8 ?
+               (unsigned int) tex->levels[0].width * 4 :
+               (unsigned int) tex->levels[0].size);
+  put_uint32le(header + 28, (unsigned int) tex->numlevels);
+
+  /* the pixel format */
+  put_uint32le(header + 76, 32);
+  if (fourcc) {
+    put_uint32le(header + 80, DDPF_FOURCC);
+    put_uint32le(header + 84, fourcc);
+  }
+  else {
+    put_uint32le(header + 80, DDPF_RGB | DDPF_ALPHAPIXELS);
+    put_uint32le(header + 88, 32);
+    put_uint32le(header + 92, 0x000000ff);
+    put_uint32le(header + 96, 0x0000ff00);
+    put_uint32le(header + 100, 0x00ff0000);
+    put_uint32le(header + 104, 0xff000000);
+  }
+  caps = DDSCAPS_TEXTURE;
+  if (tex->numlevels > 1) caps |= DDSCAPS_COMPLEX | DDSCAPS_MIPMAP;
+  put_uint32le(header + 108, caps);
+
+  headersize = DDS_HEADER_SIZE;
+  if (dx10) {
+    for (i = 0; dxgi_formats[i].format != tex->format; i++);
+    put_uint32le(header + 128, tex->srgb ? dxgi_formats[i].dxgi_srgb :
+                 dxgi_formats[i].dxgi);
+    put_uint32le(header + 132, 3); /* 2D texture */
+    put_uint32le(header + 140, 1); /* array size */
+    headersize += DDS_DX10_HEADER_SIZE;
+  }
+
+  fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    texerror = ERR_OPEN_WRITE;
+    return 0;
+  }
+  /* the levels follow each other in the buffer, starting with the
+     largest one, just as in the file */
+  total = 0;
+  for (i = 0; i < tex->numlevels; i++) total += tex->levels[i].size;
+  ok = fwrite(header, 1, headersize, fp) == headersize &&
+    fwrite(tex->buffer, 1, total, fp) == total;
+  if (fclose(fp) != 0) ok = 0;
+  if (!ok) texerror = ERR_WRITE;
+  return ok;
+}
+
+/* reads a DDS file already in tex->buffer */
+static int
+read_dds(s_texture * tex, size_t filesize)
+{
+  const unsigned char * header = tex->buffer;
+  unsigned int flags, pfflags, fourcc, dxgi, masks[4];
+  size_t offset;
+  int i, width, height, numlevels;
+
+  if (filesize < DDS_HEADER_SIZE || get_uint32le(header + 4) != 124) return 0;
+  flags = get_uint32le(header + 8);
+  height = (int) get_uint32le(header + 12);
+  width = (int) get_uint32le(header + 16);
+  numlevels = (flags & DDSD_MIPMAPCOUNT) ? (int) get_uint32le(header + 28) : 1;
+  pfflags = get_uint32le(header + 80);
+  fourcc = get_uint32le(header + 84);
+  for (i = 0; i < 4; i++) masks[i] = get_uint32le(header + 92 + i * 4);
+
+  /* only plain 2D textures */
+  if (width <= 0 || height <= 0 || width > 65536 || height > 65536 ||
+      (get_uint32le(header + 112) & (DDSCAPS2_CUBEMAP | DDSCAPS2_VOLUME))) {
+    return 0;
+  }
+  if (numlevels < 1) numlevels = 1;
+
+  offset = DDS_HEADER_SIZE;
+  tex->format = -1;
+  if (pfflags & DDPF_FOURCC) {
+    if (fourcc == DDS_FOURCC('D', 'X', 'T', '1')) tex->format = SIMAGE_TEXTURE_BC1;
+    else if (fourcc == DDS_FOURCC('D', 'X', 'T', '5')) tex->format = SIMAGE_TEXTURE_BC3;
+    else if (fourcc == DDS_FOURCC('A', 'T', 'I', '1') ||
+             fourcc == DDS_FOURCC('B', 'C', '4', 'U')) tex->format = SIMAGE_TEXTURE_BC4;
+    else if (fourcc == DDS_FOURCC('A', 'T', 'I', '2') ||
+             fourcc == DDS_FOURCC('B', 'C', '5', 'U')) tex->format = SIMAGE_TEXTURE_BC5;
+    else if (fourcc == DDS_FOURCC('D', 'X', '1', '0')) {
+      if (filesize < DDS_HEADER_SIZE + DDS_DX10_HEADER_SIZE ||
+          get_uint32le(header + 132) != 3) return 0;
+      dxgi = get_uint32le(header + 128);
+      for (i = 0; i < NUM_DXGI_FORMATS; i++) {
+        if (dxgi == dxgi_formats[i].dxgi || dxgi == dxgi_formats[i].dxgi_srgb) {
+          tex->format = dxgi_formats[i].format;
+          tex->srgb = dxgi == dxgi_formats[i].dxgi_srgb;
+          break;
+        }
+      }
+      offset += DDS_DX10_HEADER_SIZE;
+    }
+  }
+  else if ((pfflags & DDPF_RGB) && get_uint32le(header + 88) == 32 &&
+           masks[0] == 0x000000ff && masks[1] == 0x0000ff00 &&
+           masks[2] == 0x00ff0000) {
+    tex->format = SIMAGE_TEXTURE_RGBA8;
+  }
+  if (tex->format < 0) return 0;
+
+  if (numlevels > MAX_LEVELS) numlevels = MAX_LEVELS;
+  tex->numlevels = numlevels;
+  for (i = 0; i < numlevels; i++) {
+    tex->levels[i].width = width;
+    tex->levels[i].height = height;
+    tex->levels[i].size = level_size(tex->format, width, height);
+    if (offset + tex->levels[i].size > filesize) break;
+    tex->levels[i].data = tex->buffer + offset;
+    offset += tex->levels[i].size;
+    if (width > 1) width /= 2;
+    if (height > 1) height /= 2;
+  }
+  /* accept truncated mipmap chains, but not a missing image */
+  tex->numlevels = i;
+  return i > 0;
+}
+
+/*
+ * KTX2
+ */
+
+static const unsigned char ktx2_identifier[12] = {
+  0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n'
+};
+
+#define KTX2_HEADER_SIZE 80
+#define KTX2_LEVEL_INDEX_SIZE 24
+
+/* the Vulkan formats, with the Khronos data format color model and
+   the samples of the data format descriptor as channel id, bit offset
+   and bit length. BC1 is listed with alpha */
+static const struct {
+  int format;
+  unsigned int vkformat;
+  unsigned int vkformat_srgb;
+  int colormodel;
+  int numsamples;
+  int samples[4][3];
+} vk_formats[] = {
+  { SIMAGE_TEXTURE_RGBA8, 37, 43, 1, 4,
+    { { 0, 0, 8 }, { 1, 8, 8 }, { 2, 16, 8 }, { 15, 24, 8 } } },
+  { SIMAGE_TEXTURE_BC1, 133, 134, 128, 1, { { 1, 0, 64 } } },
+  { SIMAGE_TEXTURE_BC3, 137, 138, 130, 2, { { 15, 0, 64 }, { 0, 64, 64 } } },
+  { SIMAGE_TEXTURE_BC4, 139, 0, 131, 1, { { 0, 0, 64 } } },
+  { SIMAGE_TEXTURE_BC5, 141, 0, 132, 2, { { 0, 0, 64 }, { 1, 64, 64 } } },
+  { SIMAGE_TEXTURE_BC7, 145, 146, 134, 1, { { 0, 0, 128 } } }
+};
+
+#define NUM_VK_FORMATS (int) (sizeof(vk_formats) / sizeof(vk_formats[0]))
+
+/* BC1 without alpha */
+#define VK_FORMAT_BC1_RGB_UNORM_BLOCK 131
+#define VK_FORMAT_BC1_RGB_SRGB_BLOCK 132
+
+static int
+write_ktx2(const char * filename, s_texture * tex, int alpha)
+{
+  unsigned char * header;
+  unsigned int vkformat;
+  size_t headersize, dfdsize, offset, align, pad;
+  int i, f, ok;
+  FILE * fp;
+  static const unsigned char zeros[16] = { 0 };
+
+  for (f = 0; vk_formats[f].format != tex->format; f++);
+  vkformat = tex->srgb ? vk_formats[f].vkformat_srgb : vk_formats[f].vkformat;
+  if (tex->format == SIMAGE_TEXTURE_BC1 && !alpha) {
+    vkformat = tex->srgb ? VK_FORMAT_BC1_RGB_SRGB_BLOCK : VK_FORMAT_BC1_RGB_UNORM_BLOCK;
+  }
+
+  dfdsize = 4 + 24 + 16 * vk_formats[f].numsamples;
+  headersize = KTX2_HEADER_SIZE + KTX2_LEVEL_INDEX_SIZE * tex->numlevels + dfdsize;
+  header = (unsigned char *) malloc(headersize);
+  if (header == NULL) {
+    texerror = ERR_MEM;
+    return 0;
+  }
+  memset(header, 0, headersize);
+
+  memcpy(header, ktx2_identifier, 12);
+  put_uint32le(header + 12, vkformat);
+  put_uint32le(header + 16, 1); /* type size */
+  put_uint32le(header + 20, (unsigned int) tex->levels[0].width);
+  put_uint32le(header + 24, (unsigned int) tex->levels[0].height);
+  put_uint32le(header + 36, 1); /* face count */
+  put_uint32le(header + 40, (unsigned int) tex->numlevels);
+  put_uint32le(header + 48, (unsigned int) (headersize - dfdsize));
+  put_uint32le(header + 52, (unsigned int) dfdsize);
+
+  /* the level data is stored from the smallest level, each aligned to
+     the block size (which is a multiple of 4) */
+  align = block_size(tex->format);
+  offset = headersize;
+  for (i = tex->numlevels - 1; i >= 0; i--) {
+    unsigned char * entry = header + KTX2_HEADER_SIZE + KTX2_LEVEL_INDEX_SIZE * i;
+    offset = (offset + align - 1) / align * align;
+    put_uint64le(entry, offset);
+    put_uint64le(entry + 8, tex->levels[i].size);
+    put_uint64le(entry + 16, tex->levels[i].size);
+    offset += tex->levels[i].size;
+  }
+
+  /* the data format descriptor */
+  {
+    unsigned char * dfd = header + headersize - dfdsize;
+    int blockdim = tex->format == SIMAGE_TEXTURE_RGBA8 ? 0 : 3;
+    put_uint32le(dfd, (unsigned int) dfdsize);
+    put_uint32le(dfd + 4, 0); /* Khronos vendor, basic descriptor */
+    put_uint32le(dfd + 8, 2 | ((unsigned int) (dfdsize - 4) << 16));
+    /* color model, BT.709 primaries, transfer function and flags */
+    put_uint32le(dfd + 12, (unsigned int) vk_formats[f].colormodel | (1 << 8) |
+                 ((tex->srgb ? 2u : 1u) << 16));
+    put_uint32le(dfd + 16, (unsigned int) (blockdim | (blockdim << 8)));
+    put_uint32le(dfd + 20, (unsigned int) block_size(tex->format));
+    for (i = 0; i < vk_formats[f].numsamples; i++) {
+      unsigned char * sample = dfd + 28 + 16 * i;
+      unsigned int channel = (unsigned int) vk_formats[f].samples[i][0];
+      /* BC1 without alpha only has color */
+      if (tex->format == SIMAGE_TEXTURE_BC1 && !alpha) channel = 0;
+      /* alpha is linear in sRGB textures */
+      if (tex->srgb && channel == 15) channel |= 0x10;
+      put_uint32le(sample, (unsigned int) vk_formats[f].samples[i][1] |
+                   ((unsigned int) (vk_formats[f].samples[i][2] - 1) << 16) |
+                   (channel << 24));
+      put_uint32le(sample + 12, tex->format == SIMAGE_TEXTURE_RGBA8 ?
+                   255 : 0xffffffff);
+    }
+  }
+
+  fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    free(header);
+    texerror = ERR_OPEN_WRITE;
+    return 0;
+  }
+  ok = fwrite(header, 1, headersize, fp) == headersize;
+  offset = headersize;
+  for (i = tex->numlevels - 1; i >= 0 && ok; i--) {
+    pad = (align - offset % align) % align;
+    ok = fwrite(zeros, 1, pad, fp) == pad &&
+      fwrite(tex->levels[i].data, 1, tex->levels[i].size, fp) == tex->levels[i].size;
+    offset += pad + tex->levels[i].size;
+  }
+  if (fclose(fp) != 0) ok = 0;
+  free(header);
+  if (!ok) texerror = ERR_WRITE;
+  return ok;
+}
+
+/* reads a KTX2 file already in tex->buffer */
+static int
+read_ktx2(s_texture * tex, size_t filesize)
+{
+  const unsigned char * header = tex->buffer;
+  unsigned long long offset, size;
+  unsigned int vkformat;
+  int i, width, height, numlevels;
+
+  if (filesize < KTX2_HEADER_SIZE) return 0;
+  vkformat = get_uint32le(header + 12);
+  width = (int) get_uint32le(header + 20);
+  height = (int) get_uint32le(header + 24);
+  numlevels = (int) get_uint32le(header + 40);
+
+  /* only plain 2D textures that aren't supercompressed */
+  if (width <= 0 || height <= 0 || width > 65536 || height > 65536 ||
+      get_uint32le(header + 28) != 0 || get_uint32le(header + 32) > 1 ||
+      get_uint32le(header + 36) != 1 || get_uint32le(header + 44) != 0) {
+    return 0;
+  }
+
+  tex->format = -1;
+  if (vkformat == VK_FORMAT_BC1_RGB_UNORM_BLOCK ||
+      vkformat == VK_FORMAT_BC1_RGB_SRGB_BLOCK) {
+    tex->format = SIMAGE_TEXTURE_BC1;
+    tex->srgb = vkformat == VK_FORMAT_BC1_RGB_SRGB_BLOCK;
+  }
+  for (i = 0; i < NUM_VK_FORMATS && tex->format < 0; i++) {
+    if (vkformat == vk_formats[i].vkformat || vkformat == vk_formats[i].vkformat_srgb) {
+      tex->format = vk_formats[i].format;
+      tex->srgb = vkformat == vk_formats[i].vkformat_srgb;
+    }
+  }
+  if (tex->format < 0) return 0;
+
+  /* a level count of 0 asks the application to make the mipmaps */
+  if (numlevels < 1) numlevels = 1;
+  if (numlevels > MAX_LEVELS) numlevels = MAX_LEVELS;
+  if (filesize < KTX2_HEADER_SIZE + (size_t) KTX2_LEVEL_INDEX_SIZE * numlevels) return 0;
+
+  for (i = 0; i < numlevels; i++) {
+    const unsigned char * entry = header + KTX2_HEADER_SIZE + KTX2_LEVEL_INDEX_SIZE * i;
+    offset = get_uint64le(entry);
+    size = get_uint64le(entry + 8);
+    tex->levels[i].width = width;
+    tex->levels[i].height = height;
+    tex->levels[i].size = level_size(tex->format, width, height);
+    if (size != tex->levels[i].size || offset > filesize ||
+        size > filesize - offset) return 0;
+    tex->levels[i].data = tex->buffer + offset;
+    if (width > 1) width /= 2;
+    if (height > 1) height /= 2;
+  }
+  tex->numlevels = numlevels;
+  return 1;
+}
+
+/*
+ * The savers
+ */
+
+int
+s_texture_save_dds(const char * filename,
+                   const unsigned char * bytes,
+                   int width,
+                   int height,
+                   int numcomponents,
+                   s_params * params)
+{
+  s_texture * tex;
+  int ok;
+
+  tex = make_texture(bytes, width, height, numcomponents, params);
+  if (tex == NULL) return 0;
+  ok = write_dds(filename, tex);
+  s_texture_destroy(tex);
+  return ok;
+}
+
+int
+s_texture_save_ktx2(const char * filename,
+                    const unsigned char * bytes,
+                    int width,
+                    int height,
+                    int numcomponents,
+                    s_params * params)
+{
+  s_texture * tex;
+  int ok;
+
+  tex = make_texture(bytes, width, height, numcomponents, params);
+  if (tex == NULL) return 0;
+  ok = write_ktx2(filename, tex, numcomponents == 2 || numcomponents == 4);
+  s_texture_destroy(tex);
+  return ok;
+}
+
+/*
+ * The loader
+ */
+
+#define SIMAGE_ERROR_BUFSIZE 512 /* hack warning. Must match define in simage.c */
+extern char simage_error_msg[];
+
+s_texture *
+s_texture_load(const char * filename)
+{
+  s_texture * tex;
+  long filesize = 0;
+  int ok;
+  FILE * fp;
+
+  simage_error_msg[0] = 0; /* clear error msg */
+  texerror = ERR_NO_ERROR;
+
+  fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    texerror = ERR_OPEN;
+    (void) s_texture_error(simage_error_msg, SIMAGE_ERROR_BUFSIZE);
+    return NULL;
+  }
+
+  tex = (s_texture *) malloc(sizeof(s_texture));
+  if (tex) memset(tex, 0, sizeof(s_texture));
+
+  /* the levels are used straight from the file's contents */
+  if (fseek(fp, 0, SEEK_END) != 0 || (filesize = ftell(fp)) < 0 ||
+      fseek(fp, 0, SEEK_SET) != 0) {
+    texerror = ERR_READ;
+  }
+  else if (tex == NULL ||
+           (tex->buffer = (unsigned char *) malloc(filesize > 0 ? filesize : 1)) == NULL) {
+    texerror = ERR_MEM;
+  }
+  else if (fread(tex->buffer, 1, filesize, fp) != (size_t) filesize) {
+    texerror = ERR_READ;
+  }
+  fclose(fp);
+
+  if (texerror == ERR_NO_ERROR) {
+    if (filesize >= 4 && memcmp(tex->buffer, "DDS ", 4) == 0) {
+      ok = read_dds(tex, (size_t) filesize);
+    }
+    else if (filesize >= 12 && memcmp(tex->buffer, ktx2_identifier, 12) == 0) {
+      ok = read_ktx2(tex, (size_t) filesize);
+    }
+    else ok = 0;
+    if (!ok) texerror = ERR_UNSUPPORTED;
+  }
+
+  if (texerror != ERR_NO_ERROR) {
+    if (tex) s_texture_destroy(tex);
+    (void) s_texture_error(simage_error_msg, SIMAGE_ERROR_BUFSIZE);
+    return NULL;
+  }
+  return tex;
+}
+
+void
+s_texture_destroy(s_texture * texture)
+{
+  if (texture->buffer) free(texture->buffer);
+  free(texture);
+}
+
+int
+s_texture_get_format(s_texture * texture)
+{
+  return texture->format;
+}
+
+int
+s_texture_is_srgb(s_texture * texture)
+{
+  return texture->srgb;
+}
+
+int
+s_texture_get_num_levels(s_texture * texture)
+{
+  return texture->numlevels;
+}
+
+const unsigned char *
+s_texture_get_level(s_texture * texture, int level,
+                    int * width, int * height, int * size)
+{
+  texture_level * l;
+
+  if (level < 0 || level >= texture->numlevels) return NULL;
+  l = &texture->levels[level];
+  if (width) *width = l->width;
+  if (height) *height = l->height;
+  if (size) *size = (int) l->size;
+  return l->data;
+}
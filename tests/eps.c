@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Saves EPS files with each encoding and compression, and checks the
+   header comments, the filters, the %%BeginData byte count of binary
+   files, and that the ASCII85 and RunLengthDecode data decodes to the
+   image samples. simage can't load EPS files. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <simage.h>
+
+#define WIDTH 67
+#define HEIGHT 45
+
+/* an image with a row of zeros, for ASCII85 'z' groups, and runs in
+   the left half of every row */
+static unsigned char *
+make_image(int w, int h, int nc)
+{
+  unsigned char * pixels = (unsigned char *) malloc(w * h * nc);
+  int x, y, c;
+  for (y = 0; y < h; y++) {
+    for (x = 0; x < w; x++) {
+      for (c = 0; c < nc; c++) {
+        int i = (y * w + x) * nc + c;
+        pixels[i] = (unsigned char) (y == 0 ? 0 : x < w / 2 ? y + c :
+                                     (i * 7) ^ y);
+      }
+    }
+  }
+  return pixels;
+}
+
+static unsigned char *
+read_file(const char * filename, long * size)
+{
+  unsigned char * data = NULL;
+  FILE * fp = fopen(filename, "rb");
+  if (fp == NULL) return NULL;
+  if (fseek(fp, 0, SEEK_END) == 0 && (*size = ftell(fp)) > 0 &&
+      fseek(fp, 0, SEEK_SET) == 0) {
+    data = (unsigned char *) malloc(*size + 1);
+    if (fread(data, 1, *size, fp) != (size_t) *size) {
+      free(data);
+      data = NULL;
+    }
+    else data[*size] = 0;
+  }
+  (void)fclose(fp);
+  return data;
+}
+
+/* decodes ASCII85 up to the ~> marker. Returns the number of bytes, or
+   -1 for bad data */
+static long
+decode_ascii85(const unsigned char * src, const unsigned char * end,
+               unsigned char * dst, long maxlen)
+{
+  unsigned int value = 0;
+  long len = 0;
+  int n = 0, i;
+
+  for (; src < end && *src != '~'; src++) {
+    if (*src == '\n') continue;
+    if (*src == 'z' && n == 0) {
+      if (len + 4 > maxlen) return -1;
+      memset(dst + len, 0, 4);
+      len += 4;
+      continue;
+    }
+    if (*src < '!' || *src > 'u') return -1;
+    value = value * 85 + (*src - '!');
+    if (++n == 5) {
+      if (len + 4 > maxlen) return -1;
+      for (i = 0; i < 4; i++) dst[len++] = (unsigned char) (value >> (24 - i * 8));
+      value = 0;
+      n = 0;
+    }
+  }
+  if (src + 1 >= end || src[1] != '>' || n == 1) return -1;
+  /* a last group of n digits is padded with 'u' and gives n - 1 bytes */
+  if (n > 0) {
+    for (i = n; i < 5; i++) value = value * 85 + 84;
+    if (len + n - 1 > maxlen) return -1;
+    for (i = 0; i < n - 1; i++) dst[len++] = (unsigned char) (value >> (24 - i * 8));
+  }
+  return len;
+}
+
+/* decodes RunLengthDecode data of exactly len bytes, ending with 128.
+   Returns the number of bytes, or -1 for bad data */
+static long
+decode_runlength(const unsigned char * src, long len, unsigned char * dst,
+                 long maxlen)
+{
+  long i = 0, n = 0;
+  while (i < len && src[i] != 128) {
+    int count = src[i] < 128 ? src[i] + 1 : 257 - src[i];
+    if (n + count > maxlen) return -1;
+    if (src[i] < 128) {
+      if (i + 1 + count > len) return -1;
+      memcpy(dst + n, src + i + 1, count);
+      i += 1 + count;
+    }
+    else {
+      if (i + 2 > len) return -1;
+      memset(dst + n, src[i + 1], count);
+      i += 2;
+    }
+    n += count;
+  }
+  return i == len - 1 ? n : -1;
+}
+
+/* the image samples without alpha */
+static unsigned char *
+make_samples(const unsigned char * pixels, int npixels, int nc, int chan)
+{
+  unsigned char * samples = (unsigned char *) malloc(npixels * chan);
+  int i, c;
+  for (i = 0; i < npixels; i++) {
+    for (c = 0; c < chan; c++) samples[i * chan + c] = pixels[i * nc + c];
+  }
+  return samples;
+}
+
+static int
+check_eps(const char * encoding, const char * compression, int nc)
+{
+  const char * filename = "eps.eps";
+  unsigned char * pixels = make_image(WIDTH, HEIGHT, nc);
+  int chan = nc <= 2 ? 1 : 3;
+  unsigned char * samples = make_samples(pixels, WIDTH * HEIGHT, nc, chan);
+  long numsamples = (long) WIDTH * HEIGHT * chan;
+  unsigned char * text = (unsigned char *) malloc(numsamples * 2 + 16);
+  unsigned char * decoded = (unsigned char *) malloc(numsamples);
+  int binary = strcmp(encoding, "binary") == 0;
+  int rle = strcmp(compression, "rle") == 0;
+  int flate = strcmp(compression, "flate") == 0;
+  s_params * params = s_params_create();
+  unsigned char * file = NULL, * data = NULL, * end, * payload;
+  char * ops;
+  long size, count, len = 0;
+  int ok;
+
+  (void)fprintf(stdout, "``%s'', %s, %s, %d components:\n",
+                filename, encoding, compression, nc);
+  s_params_set(params,
+               "encoding", S_STRING_PARAM_TYPE, encoding,
+               "compression", S_STRING_PARAM_TYPE, compression,
+               NULL);
+  ok = simage_save_image_ex(filename, pixels, WIDTH, HEIGHT, nc, "eps", params);
+  s_params_destroy(params);
+  if (!ok) {
+    (void)fprintf(stdout, "\t** couldn't save file: \"%s\"\n",
+                  simage_get_last_error());
+  }
+  else {
+    file = read_file(filename, &size);
+    ok = file != NULL;
+    if (!ok) (void)fprintf(stdout, "\tcouldn't read the file\n");
+  }
+
+  /* without zlib, flate falls back to rle */
+  if (ok && flate && strstr((char *) file, "/FlateDecode filter\n") == NULL) {
+    flate = 0;
+    rle = 1;
+  }
+  if (ok) {
+    const char * level = rle ? "%%LanguageLevel: 2\n" :
+      flate ? "%%LanguageLevel: 3\n" : NULL;
+    ok = strncmp((char *) file, "%!PS-Adobe-2.0 EPSF-1.2\n", 24) == 0 &&
+      strstr((char *) file, "\n%%BoundingBox: ") != NULL &&
+      strstr((char *) file, "\n%%EndComments\n") != NULL &&
+      (level ? strstr((char *) file, level) != NULL :
+       strstr((char *) file, "%%LanguageLevel") == NULL) &&
+      (strstr((char *) file, "/ASCII85Decode filter\n") != NULL) == !binary &&
+      (strstr((char *) file, "/RunLengthDecode filter\n") != NULL) == rle &&
+      (strstr((char *) file, chan == 3 ? "false 3\ncolorimage\n" :
+              "\nimage\n") != NULL) &&
+      strcmp((char *) file + size - 17, "%%Trailer\n\n%%EOF\n") == 0;
+    if (!ok) (void)fprintf(stdout, "\twrong header or trailer\n");
+  }
+
+  /* the data follows the image or colorimage operator */
+  ops = ok ? strstr((char *) file, "image_wd image_ht 8\n") : NULL;
+  payload = ops ? (unsigned char *) strstr(ops, "image\n") : NULL;
+  if (ok && payload == NULL) {
+    (void)fprintf(stdout, "\tno image operator\n");
+    ok = 0;
+  }
+  if (ok) payload += 6;
+
+  if (ok && binary) {
+    /* the byte count includes the operators */
+    char * begin = strstr((char *) file, "%%BeginData: ");
+    ok = begin != NULL &&
+      sscanf(begin, "%%%%BeginData: %ld Binary Bytes\n", &count) == 1 &&
+      strchr(begin, '\n') + 1 == ops &&
+      ops + count + 12 <= (char *) file + size &&
+      memcmp(ops + count, "\n%%EndData\n", 11) == 0;
+    if (!ok) (void)fprintf(stdout, "\twrong %%%%BeginData byte count\n");
+    data = payload;
+    len = ok ? (long) ((unsigned char *) ops + count - payload) : 0;
+  }
+  else if (ok) {
+    end = (unsigned char *) strstr((char *) payload, "~>\n");
+    len = end ? decode_ascii85(payload, end + 2, text, numsamples * 2 + 16) : -1;
+    ok = len >= 0;
+    if (!ok) (void)fprintf(stdout, "\tbad ASCII85 data\n");
+    data = text;
+  }
+
+  if (ok && !flate) {
+    if (rle) {
+      count = decode_runlength(data, len, decoded, numsamples);
+      ok = count == numsamples;
+    }
+    else {
+      ok = len == numsamples;
+      if (ok) memcpy(decoded, data, len);
+    }
+    ok = ok && memcmp(decoded, samples, numsamples) == 0;
+    if (!ok) (void)fprintf(stdout, "\tdata differs from the image\n");
+  }
+
+  (void)remove(filename);
+  if (file) free(file);
+  free(decoded);
+  free(text);
+  free(samples);
+  free(pixels);
+  return ok;
+}
+
+int
+main(void)
+{
+  const char * encodings[] = { "ascii85", "binary" };
+  const char * compressions[] = { "none", "rle", "flate" };
+  int i, j, nc, failed = 0;
+
+  if (!simage_check_save_supported("eps")) {
+    (void)fprintf(stdout, "EPS saving not supported\n");
+    return 0;
+  }
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < 3; j++) {
+      for (nc = 1; nc <= 4; nc++) {
+        if (!check_eps(encodings[i], compressions[j], nc)) failed++;
+      }
+    }
+  }
+
+  (void)fprintf(stdout, "%d failed\n", failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Opens image files with s_movie_open() and checks that the frames
+   match what simage_read_image() loads. Also writes movies with
+   s_movie_create(), as YUV4MPEG2 files and numbered image files,
+   and checks that they read back the same. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <simage.h>
+
+/* compares the first components of each pixel, allowing a difference
+   of tolerance */
+static int
+same_pixels(const unsigned char * a, int anc, const unsigned char * b,
+            int bnc, int npixels, int tolerance)
+{
+  int nc = anc < bnc ? anc : bnc;
+  int i, c;
+  for (i = 0; i < npixels; i++) {
+    for (c = 0; c < nc; c++) {
+      if (abs(a[i * anc + c] - b[i * bnc + c]) > tolerance) return 0;
+    }
+  }
+  return 1;
+}
+
+/* checks that a single image file opens as a movie of one frame */
+static int
+check_image_file(const char * filename)
+{
+  int w, h, nc, ok;
+  unsigned char * buffer;
+  s_movie * movie;
+  s_image * frame;
+
+  (void)fprintf(stdout, "``%s'':\n", filename);
+  buffer = simage_read_image(filename, &w, &h, &nc);
+  if (buffer == NULL) {
+    (void)fprintf(stdout, "\t** couldn't load file: \"%s\"\n",
+                  simage_get_last_error());
+    return 0;
+  }
+  movie = s_movie_open(filename);
+  if (movie == NULL) {
+    (void)fprintf(stdout, "\t** couldn't open movie\n");
+    simage_free_image(buffer);
+    return 0;
+  }
+
+  frame = s_movie_get_image(movie, NULL, NULL);
+  ok = frame && s_image_width(frame) == w && s_image_height(frame) == h &&
+    same_pixels(s_image_data(frame), s_image_components(frame),
+                buffer, nc, w * h, 0);
+  if (!ok) (void)fprintf(stdout, "\tfirst frame differs\n");
+
+  /* there is only one page or frame */
+  if (ok && s_movie_get_image(movie, frame, NULL) != NULL) {
+    (void)fprintf(stdout, "\tframe after the last one\n");
+    ok = 0;
+  }
+  if (frame) s_image_destroy(frame);
+  s_movie_close(movie);
+  s_movie_destroy(movie);
+  simage_free_image(buffer);
+  return ok;
+}
+
+/* a smooth image, as the chroma is subsampled */
+static unsigned char *
+make_frame(int w, int h, int nc, int frame)
+{
+  unsigned char * pixels = (unsigned char *) malloc(w * h * nc);
+  int x, y, c;
+  for (y = 0; y < h; y++) {
+    for (x = 0; x < w; x++) {
+      for (c = 0; c < nc; c++) {
+        pixels[(y * w + x) * nc + c] = (unsigned char)
+          ((x + y + frame * 16 + c * 32) * 255 / (w + h + 128));
+      }
+    }
+  }
+  return pixels;
+}
+
+#define NUM_FRAMES 3
+
+#ifdef SIMAGE_Y4M_SUPPORT
+
+/* writes a YUV4MPEG2 movie of nc component frames, and checks that
+   the frames read back within tolerance */
+static int
+check_y4m(const char * filename, const char * chroma, const char * range,
+          int w, int h, int nc, int tolerance)
+{
+  unsigned char * frames[NUM_FRAMES];
+  s_params * params;
+  s_movie * movie;
+  s_image * image = NULL;
+  int i, ok = 1;
+
+  (void)fprintf(stdout, "``%s'', %s, %s range, %dx%d, %d components:\n",
+                filename, chroma, range, w, h, nc);
+  params = s_params_create();
+  s_params_set(params,
+               "chroma", S_STRING_PARAM_TYPE, chroma,
+               "color range", S_STRING_PARAM_TYPE, range,
+               NULL);
+  movie = s_movie_create(filename, params);
+  s_params_destroy(params);
+  if (movie == NULL) {
+    (void)fprintf(stdout, "\t** couldn't create movie\n");
+    return 0;
+  }
+  for (i = 0; i < NUM_FRAMES; i++) {
+    frames[i] = make_frame(w, h, nc, i);
+    image = s_image_create(w, h, nc, frames[i]);
+    if (!s_movie_put_image(movie, image, NULL)) ok = 0;
+    s_image_destroy(image);
+  }
+  s_movie_close(movie);
+  s_movie_destroy(movie);
+  if (!ok) (void)fprintf(stdout, "\t** couldn't add frame\n");
+
+  movie = ok ? s_movie_open(filename) : NULL;
+  if (ok && movie == NULL) {
+    (void)fprintf(stdout, "\t** couldn't open movie\n");
+    ok = 0;
+  }
+  image = NULL;
+  for (i = 0; ok && i < NUM_FRAMES; i++) {
+    image = s_movie_get_image(movie, image, NULL);
+    ok = image && s_image_width(image) == w && s_image_height(image) == h &&
+      s_image_components(image) == (strcmp(chroma, "mono") ? 3 : 1) &&
+      same_pixels(s_image_data(image), s_image_components(image),
+                  frames[i], nc, w * h, tolerance);
+    if (!ok) (void)fprintf(stdout, "\tframe %d differs\n", i);
+  }
+  if (ok && s_movie_get_image(movie, image, NULL) != NULL) {
+    (void)fprintf(stdout, "\tframe after the last one\n");
+    ok = 0;
+  }
+  if (image) s_image_destroy(image);
+  if (movie) {
+    s_movie_close(movie);
+    s_movie_destroy(movie);
+  }
+  for (i = 0; i < NUM_FRAMES; i++) free(frames[i]);
+  (void)remove(filename);
+  return ok;
+}
+
+#endif /* SIMAGE_Y4M_SUPPORT */
+
+/* saves numframes frames as numbered files on the given number of
+   threads, reusing one image, and checks that they read back */
+static int
+check_sequence(const char * pattern, const char * filetype, int first,
+               int numframes, int threads)
+{
+  int w = 67, h = 45, nc = 3;
+  s_image * image = s_image_create(w, h, nc, NULL);
+  s_params * params = s_params_create();
+  unsigned char * pixels;
+  s_movie * movie;
+  char name[64];
+  int i, ok = 1;
+
+  (void)fprintf(stdout, "``%s'', %d frames from %d, %d threads:\n",
+                pattern, numframes, first, threads);
+  simage_set_num_threads(threads);
+  s_params_set(params, "first frame", S_INTEGER_PARAM_TYPE, first, NULL);
+  if (filetype) {
+    s_params_set(params, "file type", S_STRING_PARAM_TYPE, filetype, NULL);
+  }
+  movie = s_movie_create(pattern, params);
+  s_params_destroy(params);
+  if (movie == NULL) {
+    (void)fprintf(stdout, "\t** couldn't create movie\n");
+    ok = 0;
+  }
+  for (i = 0; ok && i < numframes; i++) {
+    pixels = make_frame(w, h, nc, i);
+    memcpy(s_image_data(image), pixels, w * h * nc);
+    free(pixels);
+    ok = s_movie_put_image(movie, image, NULL);
+    if (!ok) (void)fprintf(stdout, "\t** couldn't add frame %d\n", i);
+  }
+  if (movie) {
+    s_movie_close(movie);
+    s_movie_destroy(movie);
+  }
+
+  movie = ok ? s_movie_open(pattern) : NULL;
+  if (ok && movie == NULL) {
+    (void)fprintf(stdout, "\t** couldn't open movie\n");
+    ok = 0;
+  }
+  for (i = 0; ok && i < numframes; i++) {
+    /* use both a new and a given image */
+    s_image * frame = s_movie_get_image(movie, i % 2 ? image : NULL, NULL);
+    pixels = make_frame(w, h, nc, i);
+    ok = frame && s_image_width(frame) == w && s_image_height(frame) == h &&
+      s_image_components(frame) == nc &&
+      memcmp(s_image_data(frame), pixels, w * h * nc) == 0;
+    if (!ok) (void)fprintf(stdout, "\tframe %d differs\n", i);
+    if (frame && frame != image) s_image_destroy(frame);
+    free(pixels);
+  }
+  if (ok && s_movie_get_image(movie, image, NULL) != NULL) {
+    (void)fprintf(stdout, "\tframe after the last one\n");
+    ok = 0;
+  }
+  if (movie) {
+    s_movie_close(movie);
+    s_movie_destroy(movie);
+  }
+  simage_set_num_threads(0);
+
+  for (i = 0; i < numframes; i++) {
+    (void)sprintf(name, pattern, first + i);
+    (void)remove(name);
+  }
+  s_image_destroy(image);
+  return ok;
+}
+
+int
+main(int argc, char ** argv)
+{
+  int i, failed = 0;
+
+  for (i = 1; i < argc; i++) {
+    if (simage_check_supported(argv[i]) && !check_image_file(argv[i])) {
+      failed++;
+    }
+  }
+
+#ifdef SIMAGE_Y4M_SUPPORT
+  /* gray is stored without loss in full range */
+  if (!check_y4m("movies.y4m", "mono", "full", 67, 45, 1, 0)) failed++;
+  if (!check_y4m("movies.y4m", "mono", "limited", 67, 45, 2, 1)) failed++;
+  if (!check_y4m("movies.y4m", "444", "full", 67, 45, 3, 2)) failed++;
+  if (!check_y4m("movies.y4m", "422", "limited", 67, 45, 4, 3)) failed++;
+  /* odd sizes, and large enough to be converted on several threads */
+  if (!check_y4m("movies.y4m", "420", "limited", 1281, 1023, 3, 3)) failed++;
+#endif /* SIMAGE_Y4M_SUPPORT */
+
+  if (simage_check_save_supported("pnm")) {
+    if (!check_sequence("movies%03d.pnm", NULL, 0, 10, 1)) failed++;
+    /* ends where a batch of frames ends */
+    if (!check_sequence("movies-%d.frame", "pnm", 1, 8, 4)) failed++;
+    if (!check_sequence("movies-%d.frame", "pnm", 1, 11, 4)) failed++;
+    if (s_movie_open("movies%03d.pnm") != NULL) {
+      (void)fprintf(stdout, "\tmissing sequence opened\n");
+      failed++;
+    }
+  }
+
+  (void)fprintf(stdout, "%d failed\n", failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Saves an image, opens it again with s_image_open() and checks that
+   s_image_read_line() and s_image_read_region() return the saved
+   pixels, reading in any order. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <simage.h>
+
+#define WIDTH 301
+#define HEIGHT 203
+#define COMPONENTS 3
+
+static unsigned char *
+make_image(int w, int h, int nc)
+{
+  unsigned char * pixels = (unsigned char *) malloc(w * h * nc);
+  int i;
+  for (i = 0; i < w * h * nc; i++) {
+    pixels[i] = (unsigned char) ((i * 7) ^ (i / (w * nc)));
+  }
+  return pixels;
+}
+
+static int
+check_region(s_image * image, const unsigned char * pixels,
+             int x, int y, int w, int h)
+{
+  int nc = s_image_components(image);
+  int width = s_image_width(image);
+  unsigned char * buf = (unsigned char *) malloc(w * h * nc);
+  int i, ok = s_image_read_region(image, x, y, w, h, buf);
+
+  for (i = 0; ok && i < h; i++) {
+    ok = memcmp(buf + i * w * nc,
+                pixels + ((y + i) * width + x) * nc, w * nc) == 0;
+  }
+  free(buf);
+  if (!ok) {
+    (void)fprintf(stdout, "\tregion %d,%d %dx%d differs\n", x, y, w, h);
+  }
+  return ok;
+}
+
+static int
+check_image(s_image * image, const unsigned char * pixels)
+{
+  int w = s_image_width(image);
+  int h = s_image_height(image);
+  int nc = s_image_components(image);
+  unsigned char * line = (unsigned char *) malloc(w * nc);
+  unsigned char dummy[4];
+  int i, ok = 1;
+
+  /* bottom-up, top-down, and jumping around */
+  for (i = 0; ok && i < 3 * h; i++) {
+    int y = i < h ? i : (i < 2 * h ? 2 * h - 1 - i : (i * 7919) % h);
+    ok = s_image_read_line(image, y, line) &&
+      memcmp(line, pixels + y * w * nc, w * nc) == 0;
+    if (!ok) (void)fprintf(stdout, "\tline %d differs\n", y);
+  }
+  free(line);
+
+  ok = ok &&
+    check_region(image, pixels, 33, 101, 250, 90) &&
+    check_region(image, pixels, 0, 0, w, h) &&
+    check_region(image, pixels, w - 1, h - 1, 1, 1) &&
+    check_region(image, pixels, 70, 5, 17, 3);
+
+  if (ok && s_image_read_region(image, w - 10, 0, 11, 1, dummy)) {
+    (void)fprintf(stdout, "\tregion outside the image was read\n");
+    ok = 0;
+  }
+  return ok;
+}
+
+/* oktoreadall is needed for formats that can only be read from the
+   top, like PNG */
+static int
+check_file(const char * filename, const char * ext, s_params * params,
+           int oktoreadall, const unsigned char * pixels, int w, int h)
+{
+  s_image * image;
+  int ok;
+
+  (void)fprintf(stdout, "``%s'':\n", filename);
+  if (!simage_save_image_ex(filename, pixels, w, h, COMPONENTS,
+                            ext, params)) {
+    (void)fprintf(stdout, "\t** couldn't save file: \"%s\"\n",
+                  simage_get_last_error());
+    return 0;
+  }
+  image = s_image_open(filename, oktoreadall);
+  if (image == NULL) {
+    (void)fprintf(stdout, "\t** couldn't open file: \"%s\"\n",
+                  simage_get_last_error());
+    ok = 0;
+  }
+  else {
+    ok = check_image(image, pixels);
+    s_image_destroy(image);
+  }
+  (void)remove(filename);
+  return ok;
+}
+
+/* checks that loading the whole file, on one or several threads,
+   gives the same lines as s_image_read_line() */
+static int
+check_load(const char * filename, const unsigned char * pixels,
+           int w, int h, int nc)
+{
+  unsigned char * line, * buffer;
+  s_image * image;
+  int i, threads, lw, lh, lnc, ok = 1;
+
+  (void)fprintf(stdout, "``%s'':\n", filename);
+  if (!simage_save_image(filename, pixels, w, h, nc, "tif")) {
+    (void)fprintf(stdout, "\t** couldn't save file: \"%s\"\n",
+                  simage_get_last_error());
+    return 0;
+  }
+  image = s_image_open(filename, 0);
+  line = (unsigned char *) malloc(w * nc);
+  for (threads = 1; ok && threads <= 4; threads *= 4) {
+    simage_set_num_threads(threads);
+    buffer = simage_read_image(filename, &lw, &lh, &lnc);
+    ok = image && buffer && lw == w && lh == h &&
+      lnc == s_image_components(image);
+    for (i = 0; ok && i < h; i++) {
+      ok = s_image_read_line(image, i, line) &&
+        memcmp(line, buffer + i * w * lnc, w * lnc) == 0;
+    }
+    if (!ok) {
+      (void)fprintf(stdout, "\tloading on %d threads differs\n", threads);
+    }
+    if (buffer) simage_free_image(buffer);
+  }
+  simage_set_num_threads(0);
+  free(line);
+  if (image) s_image_destroy(image);
+  (void)remove(filename);
+  return ok;
+}
+
+int
+main(void)
+{
+  unsigned char * pixels = make_image(WIDTH, HEIGHT, COMPONENTS);
+  unsigned char * large;
+  s_image * image;
+  s_params * params;
+  int failed = 0;
+
+  /* an image in memory */
+  image = s_image_create(WIDTH, HEIGHT, COMPONENTS, pixels);
+  if (!check_image(image, pixels)) failed++;
+  s_image_destroy(image);
+
+  if (simage_check_save_supported("png")) {
+    if (!check_file("regions.png", "png", NULL, 1, pixels, WIDTH, HEIGHT)) failed++;
+  }
+
+  if (simage_check_save_supported("tif")) {
+    /* several compressed rows per strip */
+    params = s_params_create();
+    s_params_set(params,
+                 "compression", S_STRING_PARAM_TYPE, "lzw",
+                 "strip size", S_INTEGER_PARAM_TYPE, 8192,
+                 NULL);
+    if (!check_file("regions-strips.tif", "tif", params, 0, pixels,
+                    WIDTH, HEIGHT)) failed++;
+    s_params_destroy(params);
+
+    /* partial tiles at the right and top edges */
+    params = s_params_create();
+    s_params_set(params,
+                 "compression", S_STRING_PARAM_TYPE, "packbits",
+                 "tile size", S_INTEGER_PARAM_TYPE, 64,
+                 NULL);
+    if (!check_file("regions-tiles.tif", "tif", params, 0, pixels,
+                    WIDTH, HEIGHT)) failed++;
+    s_params_destroy(params);
+
+    /* one strip too large to be decoded whole, read a scanline at a
+       time */
+    large = make_image(650, 560, COMPONENTS);
+    params = s_params_create();
+    s_params_set(params,
+                 "compression", S_STRING_PARAM_TYPE, "packbits",
+                 "strip size", S_INTEGER_PARAM_TYPE, 650 * 560 * COMPONENTS,
+                 NULL);
+    if (!check_file("regions-strip.tif", "tif", params, 0, large,
+                    650, 560)) failed++;
+    s_params_destroy(params);
+    free(large);
+
+    /* gray with alpha, large enough to be decoded on several threads */
+    large = make_image(1100, 1000, 2);
+    if (!check_load("regions-gray.tif", large, 1100, 1000, 2)) failed++;
+    free(large);
+  }
+
+  free(pixels);
+  (void)fprintf(stdout, "%d failed\n", failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,640 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Saves images with the built-in savers and checks that loading them,
+   or streaming them with s_image_open(), gives back the same pixels.
+   Also decodes hand-written files in the variants the savers don't
+   write. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <simage.h>
+
+#define WIDTH 67
+#define HEIGHT 45
+
+static unsigned char *
+make_image(int w, int h, int nc)
+{
+  unsigned char * pixels = (unsigned char *) malloc(w * h * nc);
+  int i;
+  for (i = 0; i < w * h * nc; i++) {
+    pixels[i] = (unsigned char) ((i * 7) ^ (i / (w * nc)));
+  }
+  return pixels;
+}
+
+/* loads filename, and streams it with s_image_open() bottom-up,
+   top-down and in random order, comparing against pixels */
+static int
+check_load(const char * filename, const unsigned char * pixels,
+           int w, int h, int nc)
+{
+  int lw, lh, lnc, i, ok;
+  unsigned char * buffer, * line;
+  s_image * image;
+
+  buffer = simage_read_image(filename, &lw, &lh, &lnc);
+  if (buffer == NULL) {
+    (void)fprintf(stdout, "\t** couldn't load file: \"%s\"\n",
+                  simage_get_last_error());
+    return 0;
+  }
+  ok = lw == w && lh == h && lnc == nc &&
+    memcmp(buffer, pixels, w * h * nc) == 0;
+  simage_free_image(buffer);
+  if (!ok) {
+    (void)fprintf(stdout, "\tloaded image differs\n");
+    return 0;
+  }
+
+  image = s_image_open(filename, 0);
+  if (image == NULL) {
+    (void)fprintf(stdout, "\t** couldn't open file: \"%s\"\n",
+                  simage_get_last_error());
+    return 0;
+  }
+  line = (unsigned char *) malloc(w * nc);
+  for (i = 0; ok && i < 3 * h; i++) {
+    int y = i < h ? i : (i < 2 * h ? 2 * h - 1 - i : (i * 7919) % h);
+    ok = s_image_read_line(image, y, line) &&
+      memcmp(line, pixels + y * w * nc, w * nc) == 0;
+    if (!ok) (void)fprintf(stdout, "\tline %d differs\n", y);
+  }
+  free(line);
+  s_image_destroy(image);
+  return ok;
+}
+
+/* expands gray and gray+alpha pixels to RGB and RGBA */
+static unsigned char *
+expand_gray(const unsigned char * pixels, int npixels, int nc)
+{
+  unsigned char * rgb = (unsigned char *) malloc(npixels * (nc + 2));
+  int i;
+  for (i = 0; i < npixels; i++) {
+    memset(rgb + i * (nc + 2), pixels[i * nc], 3);
+    if (nc == 2) rgb[i * 4 + 3] = pixels[i * 2 + 1];
+  }
+  return rgb;
+}
+
+/* saves pixels of nc components with the saver parameters, and
+   checks that they load as loadnc components */
+static int
+check_saved(const char * filename, const char * ext, s_params * params,
+            const unsigned char * pixels, int w, int h, int nc, int loadnc)
+{
+  const unsigned char * expected = pixels;
+  unsigned char * expanded = NULL;
+  int ok;
+
+  if (loadnc != nc) expected = expanded = expand_gray(pixels, w * h, nc);
+  ok = simage_save_image_ex(filename, pixels, w, h, nc, ext, params);
+  if (!ok) {
+    (void)fprintf(stdout, "\t** couldn't save file: \"%s\"\n",
+                  simage_get_last_error());
+  }
+  else {
+    ok = check_load(filename, expected, w, h, loadnc);
+  }
+  if (expanded) free(expanded);
+  return ok;
+}
+
+/* saves an image of nc components, and checks that it loads as
+   loadnc components */
+static int
+check_roundtrip(const char * filename, const char * ext,
+                int w, int h, int nc, int loadnc)
+{
+  unsigned char * pixels = make_image(w, h, nc);
+  int ok;
+
+  (void)fprintf(stdout, "``%s'', %dx%d, %d components:\n",
+                filename, w, h, nc);
+  ok = check_saved(filename, ext, NULL, pixels, w, h, nc, loadnc);
+  (void)remove(filename);
+  free(pixels);
+  return ok;
+}
+
+/*
+ * NetPBM. The saver only writes binary files with maxval 255, so the
+ * other variants are written here.
+ */
+
+/* writes samples, given top-down, as a NetPBM file of the given
+   format (1-7), and returns the pixels simage should load */
+static unsigned char *
+write_pnm(const char * filename, int format, int w, int h, int nc,
+          unsigned int maxval, const unsigned int * samples)
+{
+  unsigned char * expected = (unsigned char *) malloc(w * h * nc);
+  FILE * fp = fopen(filename, "wb");
+  int x, y, c, n = w * nc;
+
+  if (format == 7) {
+    (void)fprintf(fp, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %u\n"
+                  "# a comment\nTUPLTYPE GRAYSCALE_ALPHA\nENDHDR\n",
+                  w, h, nc, maxval);
+  }
+  else if (format == 1 || format == 4) {
+    (void)fprintf(fp, "P%d\n# a comment\n%d %d\n", format, w, h);
+  }
+  else {
+    (void)fprintf(fp, "P%d\n# a comment\n%d %d\n%u\n", format, w, h, maxval);
+  }
+
+  for (y = 0; y < h; y++) {
+    const unsigned int * row = samples + y * n;
+    unsigned char * dst = expected + (h - 1 - y) * n;
+    if (format == 4) {
+      for (x = 0; x < w; x += 8) {
+        int bits = 0;
+        for (c = 0; c < 8; c++) {
+          if (x + c < w && row[x + c]) bits |= 0x80 >> c;
+        }
+        (void)fputc(bits, fp);
+      }
+    }
+    for (x = 0; x < n; x++) {
+      if (format == 1) (void)fputc(row[x] ? '1' : '0', fp);
+      else if (format == 2 || format == 3) (void)fprintf(fp, "%u\n", row[x]);
+      else if (format != 4) {
+        if (maxval > 255) (void)fputc(row[x] >> 8, fp);
+        (void)fputc(row[x] & 0xff, fp);
+      }
+      if (format == 1 || format == 4) dst[x] = row[x] ? 0 : 255;
+      else dst[x] = (unsigned char) ((row[x] * 255 + maxval / 2) / maxval);
+    }
+  }
+  (void)fclose(fp);
+  return expected;
+}
+
+static int
+check_pnm(int format, int nc, unsigned int maxval)
+{
+  const char * filename = "roundtrip-in.pnm";
+  unsigned int * samples;
+  unsigned char * expected;
+  int i, ok, w = 13, h = 5; /* not a multiple of 8 for P4 */
+
+  (void)fprintf(stdout, "P%d, maxval %u:\n", format, maxval);
+  samples = (unsigned int *) malloc(w * h * nc * sizeof(unsigned int));
+  for (i = 0; i < w * h * nc; i++) samples[i] = (i * 4099u) % (maxval + 1);
+  expected = write_pnm(filename, format, w, h, nc, maxval, samples);
+  ok = check_load(filename, expected, w, h, nc);
+  (void)remove(filename);
+  free(expected);
+  free(samples);
+  return ok;
+}
+
+/*
+ * TGA. The saver writes 24 and 32 bit files, and run length encodes
+ * rows in packets of at most 128 pixels. 16 bit files and packets
+ * crossing rows, as other writers make them, are written here.
+ */
+
+/* an image where each row has a run of 127 to 130 equal pixels, then
+   130 different pixels, and then another run to the end of the row */
+static unsigned char *
+make_runs(int w, int h, int nc)
+{
+  unsigned char * pixels = (unsigned char *) malloc(w * h * nc);
+  int x, y, c;
+  for (y = 0; y < h; y++) {
+    int run = 127 + y % 4;
+    for (x = 0; x < w; x++) {
+      int v = x < run ? y : (x < run + 130 ? x * 7 + y : 255 - y);
+      for (c = 0; c < nc; c++) {
+        pixels[(y * w + x) * nc + c] = (unsigned char) (v + c * 50);
+      }
+    }
+  }
+  return pixels;
+}
+
+/* checks that the file ends with the TGA 2.0 footer */
+static int
+check_tga_footer(const char * filename)
+{
+  char footer[26];
+  FILE * fp = fopen(filename, "rb");
+  int ok = fp && fseek(fp, -26, SEEK_END) == 0 &&
+    fread(footer, 1, 26, fp) == 26 &&
+    memcmp(footer + 8, "TRUEVISION-XFILE.", 18) == 0;
+  if (fp) (void)fclose(fp);
+  if (!ok) (void)fprintf(stdout, "\tno TGA 2.0 footer\n");
+  return ok;
+}
+
+static int
+check_tga(const char * compression, int w, int h, int nc)
+{
+  const char * filename = "roundtrip.tga";
+  unsigned char * pixels = make_runs(w, h, nc);
+  s_params * params = s_params_create();
+  int ok;
+
+  (void)fprintf(stdout, "``%s'', %s, %dx%d, %d components:\n",
+                filename, compression, w, h, nc);
+  s_params_set(params, "compression", S_STRING_PARAM_TYPE, compression, NULL);
+  /* gray is saved as RGB */
+  ok = check_saved(filename, "tga", params, pixels, w, h, nc,
+                   nc < 3 ? nc + 2 : nc) &&
+    check_tga_footer(filename);
+  (void)remove(filename);
+  s_params_destroy(params);
+  free(pixels);
+  return ok;
+}
+
+/* writes a 16 bit TGA file, optionally with an alpha bit, stored from
+   the top and run length encoded in packets that cross rows, and
+   returns the pixels simage should load */
+static unsigned char *
+write_tga16(const char * filename, int w, int h, int rle, int topdown,
+            int alpha)
+{
+  int nc = alpha ? 4 : 3;
+  unsigned char * expected = (unsigned char *) malloc(w * h * nc);
+  unsigned char header[18];
+  FILE * fp = fopen(filename, "wb");
+  int k, c;
+
+  memset(header, 0, 18);
+  header[2] = rle ? 10 : 2;
+  header[12] = (unsigned char) w;
+  header[14] = (unsigned char) h;
+  header[16] = 16;
+  header[17] = (unsigned char) ((alpha ? 1 : 0) | (topdown ? 0x20 : 0));
+  (void)fwrite(header, 1, 18, fp);
+
+  /* groups of 8 pixels: a run of 5, and 3 raw pixels */
+  for (k = 0; k < w * h; k++) {
+    int g = k / 8, i = k % 8;
+    unsigned int t = ((i < 5 ? g : k) * 2731u + g * 977u) & 0xffff;
+    int row = k / w;
+    unsigned char * dst = expected +
+      ((topdown ? h - 1 - row : row) * w + k % w) * nc;
+    if (rle && i == 0) (void)fputc(0x80 | 4, fp);
+    if (rle && i == 5) (void)fputc(2, fp);
+    if (!rle || i == 0 || i >= 5) {
+      (void)fputc(t & 0xff, fp);
+      (void)fputc(t >> 8, fp);
+    }
+    for (c = 0; c < 3; c++) {
+      unsigned int v = (t >> (10 - c * 5)) & 0x1f;
+      dst[c] = (unsigned char) ((v << 3) | (v >> 2));
+    }
+    if (alpha) dst[3] = (t & 0x8000) ? 255 : 0;
+  }
+  (void)fclose(fp);
+  return expected;
+}
+
+static int
+check_tga16(int rle, int topdown, int alpha)
+{
+  const char * filename = "roundtrip-in.tga";
+  unsigned char * expected;
+  int ok, w = 13, h = 8; /* the packets cross rows */
+
+  (void)fprintf(stdout, "16 bit TGA%s%s%s:\n", rle ? ", RLE" : "",
+                topdown ? ", from the top" : "", alpha ? ", alpha" : "");
+  expected = write_tga16(filename, w, h, rle, topdown, alpha);
+  ok = check_load(filename, expected, w, h, alpha ? 4 : 3);
+  (void)remove(filename);
+  free(expected);
+  return ok;
+}
+
+/*
+ * SGI. The RLE saver stores each row of each channel on its own, and
+ * rows without runs compress to more than their size. Large images
+ * are loaded and saved on several threads.
+ */
+
+static long
+file_size(const char * filename)
+{
+  FILE * fp = fopen(filename, "rb");
+  long size = -1;
+  if (fp && fseek(fp, 0, SEEK_END) == 0) size = ftell(fp);
+  if (fp) (void)fclose(fp);
+  return size;
+}
+
+/* saves an image with runs or without, and checks the file size
+   against the uncompressed size and the worst case for RLE rows */
+static int
+check_sgi(const char * compression, int w, int h, int nc, int runs,
+          int numthreads)
+{
+  const char * filename = "roundtrip.rgb";
+  unsigned char * pixels = runs ? make_runs(w, h, nc) : make_image(w, h, nc);
+  s_params * params = s_params_create();
+  long size, raw = 512 + (long) w * h * nc;
+  long worst = 512 + (long) h * nc * (8 + w + (w + 126) / 127 + 1);
+  int ok;
+
+  (void)fprintf(stdout, "``%s'', %s, %dx%d, %d components, %s, "
+                "%d threads:\n", filename, compression, w, h, nc,
+                runs ? "runs" : "no runs", numthreads);
+  simage_set_num_threads(numthreads);
+  s_params_set(params, "compression", S_STRING_PARAM_TYPE, compression, NULL);
+  ok = check_saved(filename, "rgb", params, pixels, w, h, nc, nc);
+  if (ok) {
+    size = file_size(filename);
+    if (strcmp(compression, "none") == 0) ok = size == raw;
+    else if (runs) ok = size < raw;
+    else ok = size > raw && size <= worst;
+    if (!ok) (void)fprintf(stdout, "\tfile size %ld\n", size);
+  }
+  simage_set_num_threads(0);
+  (void)remove(filename);
+  s_params_destroy(params);
+  free(pixels);
+  return ok;
+}
+
+#ifdef SIMAGE_XWD_SUPPORT
+
+/*
+ * XWD. There is no saver, so the files are written here, with the
+ * pixel layouts and visuals the loader handles.
+ */
+
+#define XWD_TRUECOLOR 4
+#define XWD_PSEUDOCOLOR 3
+
+static void
+put_uint32be(unsigned char * ptr, unsigned int val)
+{
+  ptr[0] = (unsigned char) (val >> 24);
+  ptr[1] = (unsigned char) (val >> 16);
+  ptr[2] = (unsigned char) (val >> 8);
+  ptr[3] = (unsigned char) val;
+}
+
+/* writes a ZPixmap XWD file, and returns the RGB pixels simage should
+   load. TrueColor pixels are built from the masks, the others index a
+   colormap of 1 << bpp entries */
+static unsigned char *
+write_xwd(const char * filename, int w, int h, int bpp, int msbfirst,
+          int visual, const unsigned int * masks)
+{
+  unsigned char * expected = (unsigned char *) malloc(w * h * 3);
+  int numcolors = visual == XWD_TRUECOLOR ? 0 : 1 << bpp;
+  int bytesperline = ((w * bpp + 31) / 32) * 4;
+  unsigned char * line = (unsigned char *) malloc(bytesperline);
+  unsigned char header[100], color[12];
+  FILE * fp = fopen(filename, "wb");
+  int x, y, c, i;
+
+  memset(header, 0, 100);
+  put_uint32be(header, 100);                 /* header size */
+  put_uint32be(header + 4, 7);               /* version */
+  put_uint32be(header + 8, 2);               /* ZPixmap */
+  put_uint32be(header + 12, bpp);
+  put_uint32be(header + 16, w);
+  put_uint32be(header + 20, h);
+  put_uint32be(header + 28, msbfirst);       /* byte order */
+  put_uint32be(header + 32, 32);
+  put_uint32be(header + 36, msbfirst);       /* bit order */
+  put_uint32be(header + 40, 32);
+  put_uint32be(header + 44, bpp);
+  put_uint32be(header + 48, bytesperline);
+  put_uint32be(header + 52, visual);
+  for (c = 0; c < 3; c++) put_uint32be(header + 56 + c * 4, masks[c]);
+  put_uint32be(header + 68, 8);
+  put_uint32be(header + 72, numcolors);
+  put_uint32be(header + 76, numcolors);
+  (void)fwrite(header, 1, 100, fp);
+
+  /* the colormap gives 16 bit values, of which simage uses the high
+     byte */
+  for (i = 0; i < numcolors; i++) {
+    memset(color, 0, 12);
+    put_uint32be(color, i);
+    for (c = 0; c < 3; c++) {
+      color[4 + c * 2] = (unsigned char) (i * 37 + c * 80);
+      color[5 + c * 2] = 0x5a;
+    }
+    (void)fwrite(color, 1, 12, fp);
+  }
+
+  /* the rows are stored from the top */
+  for (y = 0; y < h; y++) {
+    unsigned char * dst = expected + (h - 1 - y) * w * 3;
+    memset(line, 0, bytesperline);
+    for (x = 0; x < w; x++) {
+      unsigned int pixel = 0;
+      if (visual == XWD_TRUECOLOR) {
+        for (c = 0; c < 3; c++) {
+          unsigned int shift = 0, max, v;
+          while (!(masks[c] & (1u << shift))) shift++;
+          max = masks[c] >> shift;
+          v = ((x * 19 + y * 41 + c * 90) & 0xff) * max / 255;
+          pixel |= v << shift;
+          dst[x * 3 + c] = (unsigned char) ((v * 255 + max / 2) / max);
+        }
+      }
+      else {
+        pixel = (x + y * 3) & (numcolors - 1);
+        for (c = 0; c < 3; c++) {
+          dst[x * 3 + c] = (unsigned char) (pixel * 37 + c * 80);
+        }
+      }
+      if (bpp < 8) {
+        int pos = x * bpp;
+        line[pos >> 3] |= (unsigned char)
+          (msbfirst ? pixel << (8 - bpp - (pos & 7)) : pixel << (pos & 7));
+      }
+      else {
+        int n = bpp / 8;
+        for (i = 0; i < n; i++) {
+          line[x * n + i] = (unsigned char)
+            (pixel >> (8 * (msbfirst ? n - 1 - i : i)));
+        }
+      }
+    }
+    (void)fwrite(line, 1, bytesperline, fp);
+  }
+  (void)fclose(fp);
+  free(line);
+  return expected;
+}
+
+static int
+check_xwd(int bpp, int msbfirst, int visual, unsigned int r, unsigned int g,
+          unsigned int b)
+{
+  const char * filename = "roundtrip-in.xwd";
+  unsigned int masks[3];
+  unsigned char * expected;
+  int ok, w = 13, h = 7; /* rows are padded */
+
+  (void)fprintf(stdout, "%d bit XWD, %s, %s, masks %x %x %x:\n", bpp,
+                msbfirst ? "MSBFirst" : "LSBFirst",
+                visual == XWD_TRUECOLOR ? "TrueColor" : "PseudoColor",
+                r, g, b);
+  masks[0] = r;
+  masks[1] = g;
+  masks[2] = b;
+  expected = write_xwd(filename, w, h, bpp, msbfirst, visual, masks);
+  ok = check_load(filename, expected, w, h, 3);
+  (void)remove(filename);
+  free(expected);
+  return ok;
+}
+
+/* checks that a file with masks outside the pixel, or pixels larger
+   than 32 bits, is refused */
+static int
+check_bad_xwd(int bpp, unsigned int r, unsigned int g, unsigned int b)
+{
+  const char * filename = "roundtrip-in.xwd";
+  unsigned char header[100];
+  unsigned char * buffer;
+  int lw, lh, lnc, ok;
+  FILE * fp;
+
+  (void)fprintf(stdout, "%d bit XWD, masks %x %x %x, not loaded:\n",
+                bpp, r, g, b);
+  memset(header, 0, 100);
+  put_uint32be(header, 100);
+  put_uint32be(header + 4, 7);
+  put_uint32be(header + 8, 2);
+  put_uint32be(header + 12, bpp);
+  put_uint32be(header + 16, 4);
+  put_uint32be(header + 20, 2);
+  put_uint32be(header + 44, bpp);
+  put_uint32be(header + 48, bpp / 2);
+  put_uint32be(header + 52, XWD_TRUECOLOR);
+  put_uint32be(header + 56, r);
+  put_uint32be(header + 60, g);
+  put_uint32be(header + 64, b);
+  fp = fopen(filename, "wb");
+  (void)fwrite(header, 1, 100, fp);
+  for (ok = 0; ok < bpp; ok++) (void)fputc(0x55, fp);
+  (void)fclose(fp);
+
+  buffer = simage_read_image(filename, &lw, &lh, &lnc);
+  (void)remove(filename);
+  ok = buffer == NULL;
+  if (!ok) {
+    (void)fprintf(stdout, "	loaded\n");
+    simage_free_image(buffer);
+  }
+  return ok;
+}
+
+#endif /* SIMAGE_XWD_SUPPORT */
+
+int
+main(void)
+{
+  int nc, failed = 0;
+
+  if (simage_check_save_supported("pnm")) {
+    for (nc = 1; nc <= 4; nc++) {
+      if (!check_roundtrip("roundtrip.pnm", "pnm", WIDTH, HEIGHT, nc, nc)) {
+        failed++;
+      }
+    }
+    /* written in several blocks, and with rows larger than a block */
+    if (!check_roundtrip("roundtrip.pnm", "pnm", 1031, 517, 4, 4)) failed++;
+    if (!check_roundtrip("roundtrip.pnm", "pnm", 300007, 3, 1, 1)) failed++;
+    if (!check_pnm(1, 1, 1)) failed++;
+    if (!check_pnm(2, 1, 15)) failed++;
+    if (!check_pnm(3, 3, 1000)) failed++;
+    if (!check_pnm(4, 1, 1)) failed++;
+    if (!check_pnm(5, 1, 100)) failed++;
+    if (!check_pnm(5, 1, 65535)) failed++;
+    if (!check_pnm(6, 3, 4000)) failed++;
+    if (!check_pnm(7, 2, 255)) failed++;
+  }
+
+  if (simage_check_save_supported("qoi")) {
+    /* gray is saved as RGB */
+    for (nc = 1; nc <= 4; nc++) {
+      if (!check_roundtrip("roundtrip.qoi", "qoi", WIDTH, HEIGHT, nc,
+                           nc < 3 ? nc + 2 : nc)) {
+        failed++;
+      }
+    }
+    /* large enough to be read through several input buffers */
+    if (!check_roundtrip("roundtrip.qoi", "qoi", 1031, 517, 4, 4)) failed++;
+  }
+
+  if (simage_check_save_supported("tga")) {
+    /* widths around the packet limit, and a long row */
+    static const int widths[] = { 127, 128, 129, 257, 400 };
+    int i;
+    for (i = 0; i < 5; i++) {
+      if (!check_tga("rle", widths[i], 9, 3)) failed++;
+    }
+    for (nc = 1; nc <= 4; nc++) {
+      if (!check_tga("rle", 400, 9, nc)) failed++;
+      if (!check_tga("none", 129, 9, nc)) failed++;
+    }
+    if (!check_tga16(0, 0, 0)) failed++;
+    if (!check_tga16(1, 0, 1)) failed++;
+    if (!check_tga16(1, 1, 0)) failed++;
+    if (!check_tga16(0, 1, 1)) failed++;
+  }
+
+  if (simage_check_save_supported("rgb")) {
+    for (nc = 1; nc <= 4; nc++) {
+      if (!check_sgi("rle", 400, 9, nc, 1, 1)) failed++;
+      if (!check_sgi("rle", 381, 9, nc, 0, 1)) failed++;
+      if (!check_sgi("none", 129, 9, nc, 0, 1)) failed++;
+    }
+    /* more than a million pixels loads and saves on the threads */
+    if (!check_sgi("rle", 1031, 1024, 3, 0, 2)) failed++;
+    if (!check_sgi("rle", 1031, 1024, 4, 1, 2)) failed++;
+    if (!check_sgi("none", 1031, 1024, 3, 0, 2)) failed++;
+  }
+
+#ifdef SIMAGE_XWD_SUPPORT
+  /* the byte layouts */
+  if (!check_xwd(32, 0, XWD_TRUECOLOR, 0xff0000, 0xff00, 0xff)) failed++;
+  if (!check_xwd(32, 1, XWD_TRUECOLOR, 0xff0000, 0xff00, 0xff)) failed++;
+  if (!check_xwd(24, 0, XWD_TRUECOLOR, 0xff0000, 0xff00, 0xff)) failed++;
+  if (!check_xwd(24, 1, XWD_TRUECOLOR, 0xff0000, 0xff00, 0xff)) failed++;
+  if (!check_xwd(32, 0, XWD_TRUECOLOR, 0xff, 0xff00, 0xff000000)) failed++;
+  /* masks that aren't bytes */
+  if (!check_xwd(16, 0, XWD_TRUECOLOR, 0xf800, 0x7e0, 0x1f)) failed++;
+  if (!check_xwd(16, 1, XWD_TRUECOLOR, 0x7c00, 0x3e0, 0x1f)) failed++;
+  if (!check_xwd(32, 1, XWD_TRUECOLOR, 0x3ff00000, 0xffc00, 0x3ff)) failed++;
+  /* colormaps */
+  if (!check_xwd(8, 0, XWD_PSEUDOCOLOR, 0, 0, 0)) failed++;
+  if (!check_xwd(4, 1, XWD_PSEUDOCOLOR, 0, 0, 0)) failed++;
+  if (!check_xwd(2, 0, XWD_PSEUDOCOLOR, 0, 0, 0)) failed++;
+  /* broken headers */
+  if (!check_bad_xwd(16, 0xff0000, 0xff00, 0xff)) failed++;
+  if (!check_bad_xwd(24, 0xff000000, 0xff00, 0xff)) failed++;
+  if (!check_bad_xwd(40, 0xff0000, 0xff00, 0xff)) failed++;
+#endif /* SIMAGE_XWD_SUPPORT */
+
+  (void)fprintf(stdout, "%d failed\n", failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Saves textures with the DDS and KTX2 savers and checks that
+   s_texture_load() gives back the format, the sRGB flag and the mipmap
+   levels that were written. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <simage.h>
+
+#define WIDTH 67
+#define HEIGHT 45
+
+static unsigned char *
+make_image(int w, int h, int nc)
+{
+  unsigned char * pixels = (unsigned char *) malloc(w * h * nc);
+  int i;
+  for (i = 0; i < w * h * nc; i++) {
+    pixels[i] = (unsigned char) ((i * 7) ^ (i / (w * nc)));
+  }
+  return pixels;
+}
+
+/* RGBA8 levels are stored from the top row, with 4 components */
+static int
+same_rgba(const unsigned char * level, const unsigned char * pixels,
+          int w, int h, int nc)
+{
+  int x, y, c;
+  for (y = 0; y < h; y++) {
+    const unsigned char * src = pixels + (h - 1 - y) * w * nc;
+    for (x = 0; x < w; x++) {
+      const unsigned char * dst = level + (y * w + x) * 4;
+      for (c = 0; c < 4; c++) {
+        int expected = c < 3 ? src[x * nc + (nc < 3 ? 0 : c)] : 255;
+        if (c == 3 && (nc == 2 || nc == 4)) expected = src[x * nc + nc - 1];
+        if (dst[c] != expected) return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/* saves an nc component image with the given format and number of
+   mipmaps, and checks the loaded texture */
+static int
+check_texture(const char * filename, const char * ext, int nc,
+              const char * format, int numlevels, int srgb,
+              int expectedformat, int expectedlevels)
+{
+  unsigned char * pixels = make_image(WIDTH, HEIGHT, nc);
+  s_params * params = s_params_create();
+  s_texture * texture = NULL;
+  int i, w, h, size, blocksize, ok;
+  const unsigned char * data;
+
+  (void)fprintf(stdout, "``%s'', %s, %d components, %d levels%s:\n",
+                filename, format ? format : "default", nc, numlevels,
+                srgb ? ", sRGB" : "");
+  if (format) {
+    s_params_set(params, "format", S_STRING_PARAM_TYPE, format, NULL);
+  }
+  s_params_set(params,
+               "mipmaps", S_INTEGER_PARAM_TYPE, numlevels,
+               "srgb", S_INTEGER_PARAM_TYPE, srgb,
+               NULL);
+  ok = simage_save_image_ex(filename, pixels, WIDTH, HEIGHT, nc, ext, params);
+  s_params_destroy(params);
+  if (!ok) {
+    (void)fprintf(stdout, "\t** couldn't save file: \"%s\"\n",
+                  simage_get_last_error());
+  }
+  else {
+    texture = s_texture_load(filename);
+    if (texture == NULL) {
+      (void)fprintf(stdout, "\t** couldn't load file: \"%s\"\n",
+                    simage_get_last_error());
+      ok = 0;
+    }
+  }
+
+  if (ok && s_texture_get_format(texture) != expectedformat) {
+    (void)fprintf(stdout, "\tformat %d, expected %d\n",
+                  s_texture_get_format(texture), expectedformat);
+    ok = 0;
+  }
+  /* there are no sRGB variants of BC4 and BC5 */
+  if (ok && s_texture_is_srgb(texture) !=
+      (srgb && expectedformat != SIMAGE_TEXTURE_BC4 &&
+       expectedformat != SIMAGE_TEXTURE_BC5)) {
+    (void)fprintf(stdout, "\twrong sRGB flag\n");
+    ok = 0;
+  }
+  if (ok && s_texture_get_num_levels(texture) != expectedlevels) {
+    (void)fprintf(stdout, "\t%d levels, expected %d\n",
+                  s_texture_get_num_levels(texture), expectedlevels);
+    ok = 0;
+  }
+
+  blocksize = expectedformat == SIMAGE_TEXTURE_BC1 ||
+    expectedformat == SIMAGE_TEXTURE_BC4 ? 8 : 16;
+  for (i = 0; ok && i < expectedlevels; i++) {
+    int ew = WIDTH >> i, eh = HEIGHT >> i;
+    if (ew < 1) ew = 1;
+    if (eh < 1) eh = 1;
+    data = s_texture_get_level(texture, i, &w, &h, &size);
+    ok = data != NULL && w == ew && h == eh &&
+      size == (expectedformat == SIMAGE_TEXTURE_RGBA8 ? w * h * 4 :
+               ((w + 3) / 4) * ((h + 3) / 4) * blocksize);
+    if (ok && i == 0 && expectedformat == SIMAGE_TEXTURE_RGBA8) {
+      ok = same_rgba(data, pixels, w, h, nc);
+    }
+    if (!ok) (void)fprintf(stdout, "\tlevel %d differs\n", i);
+  }
+  if (ok && s_texture_get_level(texture, expectedlevels, &w, &h, &size)) {
+    (void)fprintf(stdout, "\tlevel after the last one\n");
+    ok = 0;
+  }
+
+  if (texture) s_texture_destroy(texture);
+  (void)remove(filename);
+  free(pixels);
+  return ok;
+}
+
+static unsigned int
+get_uint32le(const unsigned char * ptr)
+{
+  return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((unsigned int) ptr[3] << 24);
+}
+
+/* saves a single level KTX2 file and checks the Vulkan format, the
+   transfer function and the channel byte of each sample in the data
+   format descriptor */
+static int
+check_ktx2_dfd(int nc, const char * format, int srgb, unsigned int vkformat,
+               int numsamples, const unsigned char * channels)
+{
+  const char * filename = "texture-dfd.ktx2";
+  unsigned char * pixels = make_image(WIDTH, HEIGHT, nc);
+  s_params * params = s_params_create();
+  unsigned char header[512];
+  const unsigned char * dfd;
+  unsigned int dfdoffset;
+  size_t len = 0;
+  int i, ok;
+  FILE * fp;
+
+  (void)fprintf(stdout, "``%s'', %s, %d components%s, descriptor:\n",
+                filename, format, nc, srgb ? ", sRGB" : "");
+  s_params_set(params,
+               "format", S_STRING_PARAM_TYPE, format,
+               "mipmaps", S_INTEGER_PARAM_TYPE, 1,
+               "srgb", S_INTEGER_PARAM_TYPE, srgb,
+               NULL);
+  ok = simage_save_image_ex(filename, pixels, WIDTH, HEIGHT, nc, "ktx2", params);
+  s_params_destroy(params);
+  free(pixels);
+  if (!ok) {
+    (void)fprintf(stdout, "\t** couldn't save file: \"%s\"\n",
+                  simage_get_last_error());
+    return 0;
+  }
+  fp = fopen(filename, "rb");
+  if (fp) {
+    len = fread(header, 1, sizeof(header), fp);
+    (void)fclose(fp);
+  }
+  (void)remove(filename);
+
+  dfdoffset = len >= 56 ? get_uint32le(header + 48) : 0;
+  ok = dfdoffset > 0 && dfdoffset + 28 + 16 * numsamples <= len &&
+    get_uint32le(header + 12) == vkformat &&
+    get_uint32le(header + 52) == (unsigned int) (28 + 16 * numsamples);
+  if (!ok) {
+    (void)fprintf(stdout, "\twrong header\n");
+    return 0;
+  }
+  dfd = header + dfdoffset;
+  /* the transfer function is 2 for sRGB and 1 for linear */
+  if (dfd[14] != (srgb ? 2 : 1)) {
+    (void)fprintf(stdout, "\ttransfer function %d\n", dfd[14]);
+    ok = 0;
+  }
+  /* the channel id in the low bits, qualifiers in the high bits */
+  for (i = 0; i < numsamples; i++) {
+    if (dfd[28 + 16 * i + 3] != channels[i]) {
+      (void)fprintf(stdout, "\tsample %d has channel 0x%02x, expected 0x%02x\n",
+                    i, dfd[28 + 16 * i + 3], channels[i]);
+      ok = 0;
+    }
+  }
+  return ok;
+}
+
+/* checks that other files are refused */
+static int
+check_not_texture(const char * filename)
+{
+  unsigned char * pixels = make_image(WIDTH, HEIGHT, 3);
+  s_texture * texture;
+  FILE * fp;
+
+  (void)fprintf(stdout, "``%s'', not a texture:\n", filename);
+  fp = fopen(filename, "wb");
+  (void)fwrite(pixels, 1, WIDTH * HEIGHT * 3, fp);
+  (void)fclose(fp);
+  free(pixels);
+  texture = s_texture_load(filename);
+  (void)remove(filename);
+  if (texture) {
+    (void)fprintf(stdout, "\tloaded\n");
+    s_texture_destroy(texture);
+    return 0;
+  }
+  return 1;
+}
+
+int
+main(void)
+{
+  /* a full chain for 67x45 goes down to 1x1 in 7 levels */
+  const int full = 7;
+  const char * exts[] = { "dds", "ktx2" };
+  const char * files[] = { "texture.dds", "texture.ktx2" };
+  int i, failed = 0;
+
+  for (i = 0; i < 2; i++) {
+    const char * f = files[i];
+    if (!simage_check_save_supported(exts[i])) continue;
+
+    if (!check_texture(f, exts[i], 3, NULL, 0, 0, SIMAGE_TEXTURE_BC1, full)) {
+      failed++;
+    }
+    if (!check_texture(f, exts[i], 4, NULL, 3, 1, SIMAGE_TEXTURE_BC3, 3)) {
+      failed++;
+    }
+    if (!check_texture(f, exts[i], 1, "bc4", 1, 1, SIMAGE_TEXTURE_BC4, 1)) {
+      failed++;
+    }
+    if (!check_texture(f, exts[i], 2, "bc5", 0, 0, SIMAGE_TEXTURE_BC5, full)) {
+      failed++;
+    }
+    if (!check_texture(f, exts[i], 4, "bc7", 2, 1, SIMAGE_TEXTURE_BC7, 2)) {
+      failed++;
+    }
+    if (!check_texture(f, exts[i], 2, "rgba8", 1, 0,
+                       SIMAGE_TEXTURE_RGBA8, 1)) {
+      failed++;
+    }
+    if (!check_texture(f, exts[i], 3, "rgba8", 0, 1,
+                       SIMAGE_TEXTURE_RGBA8, full)) {
+      failed++;
+    }
+    if (!check_not_texture(f)) failed++;
+  }
+
+  if (simage_check_save_supported("ktx2")) {
+    /* R, G, B, and alpha, which is linear in sRGB textures */
+    static const unsigned char rgba8[] = { 0x00, 0x01, 0x02, 0x1f };
+    static const unsigned char rgba8_linear[] = { 0x00, 0x01, 0x02, 0x0f };
+    /* BC1 color, BC1 with alpha */
+    static const unsigned char bc1[] = { 0x00 };
+    static const unsigned char bc1a[] = { 0x01 };
+    /* BC3 alpha and color */
+    static const unsigned char bc3[] = { 0x1f, 0x00 };
+
+    if (!check_ktx2_dfd(4, "rgba8", 1, 43, 4, rgba8)) failed++;
+    if (!check_ktx2_dfd(4, "rgba8", 0, 37, 4, rgba8_linear)) failed++;
+    if (!check_ktx2_dfd(4, "bc1", 0, 133, 1, bc1a)) failed++;
+    if (!check_ktx2_dfd(4, "bc1", 1, 134, 1, bc1a)) failed++;
+    if (!check_ktx2_dfd(3, "bc1", 0, 131, 1, bc1)) failed++;
+    if (!check_ktx2_dfd(4, "bc3", 1, 138, 2, bc3)) failed++;
+  }
+
+  (void)fprintf(stdout, "%d failed\n", failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) Kongsberg Oil & Gas Technologies
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Creates views of images with s_image_create_view() and checks that
+   they share the parent's pixels, and that reading, saving and
+   resizing them gives the same result as a packed copy of the
+   region. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <simage.h>
+
+#define WIDTH 67
+#define HEIGHT 45
+#define COMPONENTS 3
+
+static unsigned char *
+make_image(int w, int h, int nc)
+{
+  unsigned char * pixels = (unsigned char *) malloc(w * h * nc);
+  int i;
+  for (i = 0; i < w * h * nc; i++) {
+    pixels[i] = (unsigned char) ((i * 7) ^ (i / (w * nc)));
+  }
+  return pixels;
+}
+
+/* copies the w x h pixels at x, y to a new packed buffer */
+static unsigned char *
+crop(const unsigned char * pixels, int width, int nc,
+     int x, int y, int w, int h)
+{
+  unsigned char * region = (unsigned char *) malloc(w * h * nc);
+  int i;
+  for (i = 0; i < h; i++) {
+    memcpy(region + i * w * nc, pixels + ((y + i) * width + x) * nc, w * nc);
+  }
+  return region;
+}
+
+/* checks the size, the shared data, read_line and read_region of a
+   view against the packed region */
+static int
+check_view(s_image * view, s_image * parent, const unsigned char * region,
+           int x, int y, int w, int h)
+{
+  int nc = s_image_components(parent);
+  int stride = s_image_stride(parent);
+  unsigned char * buf = (unsigned char *) malloc(w * h * nc);
+  int i, ok;
+
+  ok = view && s_image_width(view) == w && s_image_height(view) == h &&
+    s_image_components(view) == nc && s_image_stride(view) == stride &&
+    s_image_data(view) == s_image_data(parent) + y * stride + x * nc;
+  if (!ok) {
+    (void)fprintf(stdout, "\tview of %d,%d %dx%d has wrong layout\n",
+                  x, y, w, h);
+    free(buf);
+    return 0;
+  }
+  for (i = 0; ok && i < h; i++) {
+    ok = memcmp(s_image_data(view) + i * stride, region + i * w * nc,
+                w * nc) == 0 &&
+      s_image_read_line(view, i, buf) &&
+      memcmp(buf, region + i * w * nc, w * nc) == 0;
+    if (!ok) (void)fprintf(stdout, "\tline %d of the view differs\n", i);
+  }
+  if (ok) {
+    ok = s_image_read_region(view, 0, 0, w, h, buf) &&
+      memcmp(buf, region, w * h * nc) == 0;
+    if (!ok) (void)fprintf(stdout, "\tregion of the view differs\n");
+  }
+  free(buf);
+  return ok;
+}
+
+/* checks that saving and resizing a view gives the same as saving
+   and resizing the packed region */
+static int
+check_save_resize(s_image * view, const unsigned char * region)
+{
+  int w = s_image_width(view), h = s_image_height(view);
+  int nc = s_image_components(view);
+  int lw, lh, lnc, ok = 1;
+  unsigned char * buffer, * resized;
+  s_image * image;
+
+  if (simage_check_save_supported("pnm")) {
+    ok = s_image_save("views.pnm", view, NULL);
+    buffer = ok ? simage_read_image("views.pnm", &lw, &lh, &lnc) : NULL;
+    ok = buffer && lw == w && lh == h && lnc == nc &&
+      memcmp(buffer, region, w * h * nc) == 0;
+    if (buffer) simage_free_image(buffer);
+    (void)remove("views.pnm");
+    if (!ok) (void)fprintf(stdout, "\tsaved view differs\n");
+  }
+
+  /* up in one direction and down in the other */
+  image = ok ? s_image_resize(view, w * 2 + 1, h / 2 + 1) : NULL;
+  resized = simage_resize((unsigned char *) region, w, h, nc,
+                          w * 2 + 1, h / 2 + 1);
+  if (ok) {
+    ok = image && resized &&
+      s_image_width(image) == w * 2 + 1 && s_image_height(image) == h / 2 + 1 &&
+      s_image_components(image) == nc &&
+      s_image_stride(image) == (w * 2 + 1) * nc &&
+      memcmp(s_image_data(image), resized, (w * 2 + 1) * (h / 2 + 1) * nc) == 0;
+    if (!ok) (void)fprintf(stdout, "\tresized view differs\n");
+  }
+  if (image) s_image_destroy(image);
+  if (resized) simage_free_image(resized);
+  return ok;
+}
+
+int
+main(void)
+{
+  unsigned char * pixels = make_image(WIDTH, HEIGHT, COMPONENTS);
+  unsigned char * region, * inner;
+  s_image * parent, * view, * view2;
+  int failed = 0;
+
+  (void)fprintf(stdout, "views of an image in memory:\n");
+  parent = s_image_create(WIDTH, HEIGHT, COMPONENTS, pixels);
+  region = crop(pixels, WIDTH, COMPONENTS, 13, 7, 41, 29);
+  view = s_image_create_view(parent, 13, 7, 41, 29);
+  if (!check_view(view, parent, region, 13, 7, 41, 29)) failed++;
+  else if (!check_save_resize(view, region)) failed++;
+
+  /* a view of a view is a view of the parent */
+  inner = crop(pixels, WIDTH, COMPONENTS, 15, 10, 20, 11);
+  view2 = view ? s_image_create_view(view, 2, 3, 20, 11) : NULL;
+  if (!check_view(view2, parent, inner, 15, 10, 20, 11)) failed++;
+  free(inner);
+
+  /* the whole image, and regions outside it */
+  if (view2) s_image_destroy(view2);
+  view2 = s_image_create_view(parent, 0, 0, WIDTH, HEIGHT);
+  if (!check_view(view2, parent, pixels, 0, 0, WIDTH, HEIGHT)) failed++;
+  if (view2) s_image_destroy(view2);
+  if (s_image_create_view(parent, 60, 0, 8, 1) ||
+      s_image_create_view(parent, 0, -1, 1, 1) ||
+      s_image_create_view(parent, 0, 0, 0, 1)) {
+    (void)fprintf(stdout, "\tview outside the image created\n");
+    failed++;
+  }
+
+  /* the view keeps its parent alive */
+  s_image_destroy(parent);
+  if (view) {
+    unsigned char * line = (unsigned char *) malloc(41 * COMPONENTS);
+    if (!s_image_read_line(view, 28, line) ||
+        memcmp(line, region + 28 * 41 * COMPONENTS, 41 * COMPONENTS) != 0) {
+      (void)fprintf(stdout, "\tview differs after the parent is destroyed\n");
+      failed++;
+    }
+    free(line);
+    s_image_destroy(view);
+  }
+
+  /* an image opened with s_image_open() is loaded by the view */
+  if (simage_check_save_supported("pnm")) {
+    (void)fprintf(stdout, "views of an opened image:\n");
+    if (!simage_save_image("views-open.pnm", pixels, WIDTH, HEIGHT,
+                           COMPONENTS, "pnm")) {
+      (void)fprintf(stdout, "\t** couldn't save file: \"%s\"\n",
+                    simage_get_last_error());
+      failed++;
+    }
+    else {
+      parent = s_image_open("views-open.pnm", 0);
+      view = parent ? s_image_create_view(parent, 13, 7, 41, 29) : NULL;
+      if (!check_view(view, parent, region, 13, 7, 41, 29)) failed++;
+      if (view) s_image_destroy(view);
+      if (parent) s_image_destroy(parent);
+    }
+    (void)remove("views-open.pnm");
+  }
+
+  free(region);
+  free(pixels);
+  (void)fprintf(stdout, "%d failed\n", failed);
+  return failed ? 1 : 0;
+}